@@ -2,10 +2,12 @@
 #ifndef _MATRIX_HPP
 #define _MATRIX_HPP
 
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <cstdint>
-//#include <cstddef>
+#include <cstddef>
+#include <type_traits>
 
 template<class T>
 class Matrix
@@ -49,33 +51,93 @@ public:
 
     size_t block_count(size_t block_size) const  { return (m_cols * m_rows) / (block_size*block_size); }
 
-    IMG_DATA_LINEAR_T get_block(size_t block_index, size_t block_size) const
+    // copy block block_index (row-major order of the whole blocks) into block[block_size * block_size], nothing is
+    // allocated; for walking all blocks of a picture use TiledPlane (tiled_image.hpp), which stores them contiguously
+    void get_block(size_t block_index, size_t block_size, T* block) const
     {
         size_t block_width = m_cols / block_size;
-        size_t block_height = m_rows / block_size;
         size_t block_x = block_index % block_width;
         size_t block_y = block_index / block_width;
 
-        IMG_DATA_LINEAR_T block_data(block_size * block_size );
-        for (size_t y = 0; y < block_size; ++y)
+        const T* src = m_data.data() + (block_y * block_size) * m_cols + block_x * block_size;
+        for (size_t y = 0; y < block_size; ++y, src += m_cols, block += block_size)
+            std::copy(src, src + block_size, block);
+    }
+
+};
+
+
+// width x height samples of someone else's memory, rows stride bytes apart (e.g. AVFrame::data[i] with its
+// linesize, which needn't be a multiple of sizeof(T) for packed RGB), nothing is copied or owned: whoever made the
+// view keeps the memory alive (FrameView in frame_view.hpp holds a reference on the frame)
+template<class T>
+class MatrixView
+{
+public:
+    MatrixView() = default;
+    MatrixView(T* data, size_t cols, size_t rows, ptrdiff_t stride):
+    m_data{data},
+    m_cols{cols},
+    m_rows{rows},
+    m_stride{stride}
+    {}
+
+    // a packed cols x rows image
+    MatrixView(T* data, size_t cols, size_t rows):
+    MatrixView(data, cols, rows, ptrdiff_t(cols * sizeof(T)))
+    {}
+
+    // read-only view of a Matrix, valid as long as the matrix isn't resized
+    template<class U, class = std::enable_if_t<std::is_same_v<const U, T>>>
+    MatrixView(const Matrix<U>& matrix):
+    MatrixView(matrix.data().data(), matrix.width(), matrix.height())
+    {}
+
+    // a view of non-const samples converts to a read-only one
+    template<class U, class = std::enable_if_t<std::is_same_v<const U, T>>>
+    MatrixView(const MatrixView<U>& other):
+    MatrixView(other.data(), other.width(), other.height(), other.stride())
+    {}
+
+    inline T* row(size_t row) const { return reinterpret_cast<T*>(reinterpret_cast<Byte*>(m_data) + ptrdiff_t(row) * m_stride); }
+    inline T& operator()(size_t row, size_t col) const { return this->row(row)[col]; }
+
+    T* data() const { return m_data; }
+    size_t width() const { return m_cols; }
+    size_t height() const { return m_rows; }
+    ptrdiff_t stride() const { return m_stride; } // bytes from one row to the next
+    bool empty() const { return !m_data || !m_cols || !m_rows; }
+
+    // the cols x rows samples starting at (row, col), same memory
+    MatrixView sub_view(size_t row, size_t col, size_t cols, size_t rows) const
+    {
+        return MatrixView(this->row(row) + col, cols, rows, m_stride);
+    }
+
+    size_t block_count(size_t block_size) const { return (m_cols / block_size) * (m_rows / block_size); }
+
+    // same as Matrix::get_block
+    void get_block(size_t block_index, size_t block_size, std::remove_const_t<T>* block) const
+    {
+        size_t block_width = m_cols / block_size;
+        size_t block_x = block_index % block_width;
+        size_t block_y = block_index / block_width;
+
+        for (size_t y = 0; y < block_size; ++y, block += block_size)
         {
-            for (size_t x = 0; x < block_size; ++x)
-            {
-                //for (size_t c = 0; c < m_channels; ++c)
-                {
-                    // size_t src_index = ((block_y * block_size + y) * m_cols + (block_x * block_size + x)) * m_channels + c;
-                    // size_t dst_index = (y * block_size + x) * m_channels + c;
-                    size_t src_index = ((block_y * block_size + y) * m_cols + (block_x * block_size + x)) ;
-                    size_t dst_index = (y * block_size + x) ; 
-                    block_data[dst_index] = m_data[src_index];
-                }
-            }
+            const T* src = row(block_y * block_size + y) + block_x * block_size;
+            std::copy(src, src + block_size, block);
         }
-        return block_data;
     }
 
-};
+private:
+    using Byte = std::conditional_t<std::is_const_v<T>, const uint8_t, uint8_t>;
 
+    T*        m_data   = nullptr;
+    size_t    m_cols   = 0;
+    size_t    m_rows   = 0;
+    ptrdiff_t m_stride = 0;
+};
 
 template<class T, size_t ROWST, size_t COLST>
 class FixedMatrix
@@ -87,6 +149,12 @@ protected:
     const size_t m_rows;
     MATRIX_DATA_LINEAR_T m_data;    
 public:
+    FixedMatrix():
+    m_cols{COLST},
+    m_rows{ROWST},
+    m_data{}
+    {}
+
     FixedMatrix(const T* data):
     m_cols{COLST},
     m_rows{ROWST}
@@ -110,7 +178,7 @@ public:
     inline T& operator()(size_t row, size_t col)  {return m_data[ row*m_cols + col] ;} ;
     inline T& set(size_t row, size_t col, uint8_t val)  {return m_data[ row*m_cols + col]=val;  } ;
     
-    const std::vector<uint8_t>&  data() const  {return m_data;} ;
+    const MATRIX_DATA_LINEAR_T&  data() const  {return m_data;} ;
     size_t width() const { return m_cols; }
     size_t height() const { return m_rows; }
     size_t size() const { return m_data.size(); }
@@ -118,27 +186,16 @@ public:
 
     size_t block_count(int blk_size) const  { return (m_cols * m_rows) / (blk_size*blk_size); }
 
-    MATRIX_DATA_LINEAR_T get_block(size_t block_index, int block_size) const
+    // same as Matrix::get_block
+    void get_block(size_t block_index, size_t block_size, T* block) const
     {
         size_t block_width = m_cols / block_size;
-        size_t block_height = m_rows / block_size;
         size_t block_x = block_index % block_width;
         size_t block_y = block_index / block_width;
 
-        MATRIX_DATA_LINEAR_T block_data(block_size * block_size );
-        for (size_t y = 0; y < block_size; ++y)
-        {
-            for (size_t x = 0; x < block_size; ++x)
-            {
-                //for (size_t c = 0; c < m_channels; ++c)
-                {
-                    size_t src_index = ((block_y * block_size + y) * m_cols + (block_x * block_size + x)) ;
-                    size_t dst_index = (y * block_size + x) ;
-                    block_data[dst_index] = m_data[src_index];
-                }
-            }
-        }
-        return block_data;
+        const T* src = m_data.data() + (block_y * block_size) * m_cols + block_x * block_size;
+        for (size_t y = 0; y < block_size; ++y, src += m_cols, block += block_size)
+            std::copy(src, src + block_size, block);
     }
 
 };
@@ -164,6 +221,10 @@ using  ImageMatY8x8  = FixedMatrix<float, 8, 8>;
 using  ImageMatCb8x8 = FixedMatrix<float, 8, 8>;
 using  ImageMatCr8x8 = FixedMatrix<float, 8, 8>;
 using  DCTMatrix8x8 = FixedMatrix<int16_t, 8, 8>;
+using  DCTMatrixF8x8 = FixedMatrix<float, 8, 8>;  // unquantized coefficients of the naive transforms
+
+using  PlaneView = MatrixView<const uint8_t>;      // one 8 bit plane, e.g. Y of a decoded frame
+using  RGBView   = MatrixView<const RGBChannels>;  // packed RGB24
 
 
 //using Image =  Matrix<Channels>;
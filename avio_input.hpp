@@ -0,0 +1,214 @@
+#ifndef _AVIO_INPUT_HPP
+#define _AVIO_INPUT_HPP
+
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavformat/avio.h>
+    #include <libavutil/mem.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Where the demuxer reads from when it is not ffmpeg's own file protocol: a memory mapped file, a buffer of the
+// caller (e.g. a video received over RPC) or a pipe, each read through a custom AVIOContext.
+// The mapped file and the buffer are shared by any number of readers with read positions of their own (the
+// workers of the GOP-parallel mode), a pipe can be read once and can't seek.
+// A mapped file is advised MADV_SEQUENTIAL and every reader asks for the window ahead of its position with
+// MADV_WILLNEED, the demuxer's reads are then a memcpy out of the page cache instead of a read() each.
+class InputSource
+{
+public:
+    static constexpr int    buffer_size = 64 << 10;         // AVIOContext buffer, bytes per read callback
+    static constexpr size_t readahead_window = 8 << 20;     // mapped files: MADV_WILLNEED this far ahead
+
+    InputSource(const InputSource& other) = delete;
+    InputSource& operator=(const InputSource& other) = delete;
+
+    ~InputSource()
+    {
+        if (m_mapped)
+            munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+
+    // nullptr if the file can't be opened or mapped (or is empty)
+    static std::shared_ptr<InputSource> map_file(const char* filename)
+    {
+        const int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps the file
+        if (data == MAP_FAILED)
+            return nullptr;
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        auto source = std::shared_ptr<InputSource>(new InputSource(static_cast<const uint8_t*>(data), st.st_size, -1));
+        source->m_mapped = true;
+        return source;
+    }
+
+    // not copied, data must outlive the source and every reader
+    static std::shared_ptr<InputSource> memory(const void* data, size_t size)
+    {
+        return std::shared_ptr<InputSource>(new InputSource(static_cast<const uint8_t*>(data), size, -1));
+    }
+
+    // e.g. 0 for stdin, the caller closes fd
+    static std::shared_ptr<InputSource> pipe(int fd)
+    {
+        return std::shared_ptr<InputSource>(new InputSource(NULL, 0, fd));
+    }
+
+    // a pipe has neither, the demuxer has to do without seeking (no mp4 with its index at the end)
+    bool seekable() const { return m_fd < 0; }
+    bool shareable() const { return m_fd < 0; }
+
+    // a new AVIOContext reading from the start, NULL without memory or when the pipe already has its reader
+    AVIOContext* open_reader()
+    {
+        if (!shareable() && m_piped)
+            return NULL;
+        uint8_t* buffer = static_cast<uint8_t*>(av_malloc(buffer_size));
+        if (!buffer)
+            return NULL;
+        auto* reader = new Reader{ this, 0, 0 };
+        AVIOContext* pb = avio_alloc_context(buffer, buffer_size, 0, reader,
+                                             seekable() ? &InputSource::read_memory : &InputSource::read_pipe, NULL,
+                                             seekable() ? &InputSource::seek_memory : NULL);
+        if (!pb)
+        {
+            av_free(buffer);
+            delete reader;
+            return NULL;
+        }
+        pb->seekable = seekable() ? AVIO_SEEKABLE_NORMAL : 0;
+        m_piped = !shareable();
+        return pb;
+    }
+
+    // the AVIOContext of open_reader() and its buffer (avformat_close_input() leaves AVFMT_FLAG_CUSTOM_IO alone)
+    static void close_reader(AVIOContext** pb)
+    {
+        if (!*pb)
+            return;
+        delete static_cast<Reader*>((*pb)->opaque);
+        av_freep(&(*pb)->buffer); // may have been replaced by the demuxer
+        avio_context_free(pb);
+    }
+
+    // open the input through a new reader, filename only names it in messages and helps probing the format;
+    // on failure *fmt_ctx is NULL and the reader closed
+    int open_input(AVFormatContext** fmt_ctx, const char* filename)
+    {
+        AVIOContext* pb = open_reader();
+        *fmt_ctx = pb ? avformat_alloc_context() : NULL;
+        if (!*fmt_ctx)
+        {
+            close_reader(&pb);
+            return AVERROR(ENOMEM);
+        }
+        (*fmt_ctx)->pb     = pb;
+        (*fmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+        const int ret = avformat_open_input(fmt_ctx, filename, NULL, NULL); // frees *fmt_ctx on failure
+        if (ret < 0)
+            close_reader(&pb);
+        return ret;
+    }
+
+    // close an input of open_input() and its reader, or one ffmpeg opened itself
+    static void close_input(AVFormatContext** fmt_ctx)
+    {
+        if (!*fmt_ctx)
+            return;
+        AVIOContext* pb = ((*fmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*fmt_ctx)->pb : NULL;
+        avformat_close_input(fmt_ctx);
+        close_reader(&pb);
+    }
+
+private:
+    struct Reader
+    {
+        InputSource* source;
+        size_t       pos;
+        size_t       advised;   // mapped files: MADV_WILLNEED was given up to here
+    };
+
+    InputSource(const uint8_t* data, size_t size, int fd): m_data{data}, m_size{size}, m_fd{fd} {}
+
+    static int read_memory(void* opaque, uint8_t* buf, int buf_size)
+    {
+        auto* reader = static_cast<Reader*>(opaque);
+        const InputSource& source = *reader->source;
+        if (reader->pos >= source.m_size)
+            return AVERROR_EOF;
+        const size_t size = std::min(size_t(buf_size), source.m_size - reader->pos);
+        if (source.m_mapped && reader->pos + readahead_window / 2 > reader->advised)
+        {
+            // ask for the next window before the copy below faults on it, again when half of it is consumed
+            const size_t page = sysconf(_SC_PAGESIZE);
+            const size_t start = reader->pos / page * page;
+            const size_t end = std::min(start + readahead_window, source.m_size);
+            madvise(const_cast<uint8_t*>(source.m_data) + start, end - start, MADV_WILLNEED);
+            reader->advised = end;
+        }
+        std::copy_n(source.m_data + reader->pos, size, buf);
+        reader->pos += size;
+        return int(size);
+    }
+
+    static int64_t seek_memory(void* opaque, int64_t offset, int whence)
+    {
+        auto* reader = static_cast<Reader*>(opaque);
+        const int64_t size = int64_t(reader->source->m_size);
+        int64_t pos;
+        switch (whence & ~AVSEEK_FORCE)
+        {
+        case AVSEEK_SIZE: return size;
+        case SEEK_SET:    pos = offset; break;
+        case SEEK_CUR:    pos = int64_t(reader->pos) + offset; break;
+        case SEEK_END:    pos = size + offset; break;
+        default:          return AVERROR(EINVAL);
+        }
+        if (pos < 0 || pos > size)
+            return AVERROR(EINVAL);
+        reader->pos = size_t(pos);
+        if (reader->pos < reader->advised - std::min(reader->advised, readahead_window))
+            reader->advised = 0; // jumped back, advise the new position again
+        return pos;
+    }
+
+    static int read_pipe(void* opaque, uint8_t* buf, int buf_size)
+    {
+        auto* reader = static_cast<Reader*>(opaque);
+        for (;;)
+        {
+            const ssize_t got = read(reader->source->m_fd, buf, buf_size);
+            if (got > 0)
+            {
+                reader->pos += got;
+                return int(got);
+            }
+            if (got == 0)
+                return AVERROR_EOF;
+            if (errno != EINTR)
+                return AVERROR(errno);
+        }
+    }
+
+    const uint8_t* m_data;
+    size_t         m_size;
+    int            m_fd;             // >= 0: a pipe
+    bool           m_mapped = false; // m_data is our mapping of a file
+    bool           m_piped = false;  // the pipe has its reader
+};
+
+#endif // _AVIO_INPUT_HPP
@@ -0,0 +1,115 @@
+#ifndef _BIT_WRITER_HPP
+#define _BIT_WRITER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// represent a single Huffman code
+struct BitCode
+{
+  BitCode() = default; // undefined state, must be initialized at a later time
+  BitCode(uint16_t code_, uint8_t numBits_)
+  : code(code_), numBits(numBits_) {}
+  uint16_t code;       // JPEG's Huffman codes are limited to 16 bits
+  uint8_t  numBits;    // number of valid bits
+};
+
+// Entropy coded segment writer: bits are collected in a 64 bit accumulator and stored 8 bytes at a time
+// straight into the output vector, which is grown ahead by the worst case of a whole block (reserve()),
+// so writing a word needs neither a capacity check nor a push_back per byte.
+// 0xFF bytes must be followed by a stuffed 0x00; a word-wide test finds them, only words containing
+// one are written byte by byte.
+class BitWriter
+{
+public:
+    // one block: DC + 63 AC coefficients, each at most a 16 bit Huffman code + 11 extra bits,
+    // plus up to 8 bytes still pending in the accumulator, every byte may need stuffing
+    static constexpr size_t max_block_bytes = 2 * (64 * (16 + 11) / 8 + 8);
+
+    // appends to out, whose size is only valid again after flush()
+    explicit BitWriter(std::vector<uint8_t>& out)
+    : m_out(out), m_data(out.data()), m_pos(out.size()) {}
+
+    BitWriter(const BitWriter& other) = delete;
+    BitWriter& operator=(const BitWriter& other) = delete;
+
+    ~BitWriter() { m_out.resize(m_pos); }
+
+    // make room for at least bytes more output, called once per block with max_block_bytes
+    void reserve(size_t bytes)
+    {
+        if (m_out.size() - m_pos < bytes)
+            grow(bytes);
+    }
+
+    // append the bits of a Huffman code (or of a coefficient's extra bits)
+    BitWriter& operator<<(const BitCode& data)
+    {
+        if (data.numBits < m_free)
+        {
+            m_bits  = (m_bits << data.numBits) | data.code;
+            m_free -= data.numBits;
+            return *this;
+        }
+        // fill the accumulator up and write it, the remaining low bits of data start the next word
+        // (m_bits keeps the already written high bits of data, they are shifted out before they are written again)
+        const int rest = data.numBits - m_free;
+        write_word((m_bits << m_free) | (uint64_t(data.code) >> rest));
+        m_bits = data.code;
+        m_free = 64 - rest;
+        return *this;
+    }
+
+    // pad the last byte with 1-bits as required by the JPEG standard and write it, out has its final size afterwards
+    void flush()
+    {
+        reserve(2 * 16);
+        *this << BitCode(0x7F, 7);
+        for (int pending = 64 - m_free; pending >= 8; pending -= 8)
+            write_byte(uint8_t(m_bits >> (pending - 8)));
+        m_bits = 0;
+        m_free = 64;
+        m_out.resize(m_pos);
+    }
+
+private:
+    void grow(size_t bytes)
+    {
+        m_out.resize(std::max(m_pos + bytes, 2 * m_out.size()));
+        m_data = m_out.data();
+    }
+
+    void write_byte(uint8_t byte)
+    {
+        m_data[m_pos++] = byte;
+        if (byte == 0xFF) // 0xFF has a special meaning for JPEGs (it's a block marker)
+            m_data[m_pos++] = 0; // therefore pad a zero to indicate "nope, this one ain't a marker, it's just a coincidence"
+    }
+
+    void write_word(uint64_t word)
+    {
+        // word has a 0xFF byte <=> ~word has a zero byte: (x - 0x01..01) & ~x & 0x80..80 != 0
+        const uint64_t inverted = ~word;
+        if ((inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull)
+        {
+            for (int shift = 56; shift >= 0; shift -= 8)
+                write_byte(uint8_t(word >> shift));
+            return;
+        }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word); // the first bit is the most significant one
+#endif
+        std::memcpy(m_data + m_pos, &word, sizeof(word));
+        m_pos += sizeof(word);
+    }
+
+    std::vector<uint8_t>& m_out;
+    uint8_t*              m_data;       // m_out.data(), valid up to m_out.size()
+    size_t                m_pos;        // bytes written so far
+    uint64_t              m_bits = 0;   // pending bits are the low 64 - m_free bits, higher bits are garbage
+    int                   m_free = 64;  // unused bits of m_bits
+};
+
+#endif // _BIT_WRITER_HPP
@@ -0,0 +1,144 @@
+// throughput benchmark: 64 bit BitWriter (bit_writer.hpp) vs. the previous 24 bit, push_back per byte writer
+//   usage: bit_writer_bench [num_blocks] [iterations]
+
+#include "write_jpeg.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// what Bytestream::operator<<(BitCode) did before: at most 24 pending bits, one push_back per byte
+struct ReferenceWriter
+{
+    std::vector<uint8_t> bytes;
+    int32_t data    = 0;
+    uint8_t numBits = 0;
+
+    void put(const BitCode& code)
+    {
+        numBits += code.numBits;
+        data   <<= code.numBits;
+        data    |= code.code;
+        while (numBits >= 8)
+        {
+            numBits -= 8;
+            auto oneByte = uint8_t(data >> numBits);
+            bytes.push_back(oneByte);
+            if (oneByte == 0xFF)
+                bytes.push_back(0);
+        }
+    }
+
+    void flush() { put(BitCode(0x7F, 7)); }
+};
+
+template<typename Func>
+static double best_seconds(int iterations, Func&& func)
+{
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(stop - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    size_t num_blocks = argc > 1 ? strtoul(argv[1], nullptr, 10) : 48600; // one 1080p 4:2:0 frame
+    int iterations    = argc > 2 ? atoi(argv[2]) : 20;
+
+    // deterministic pseudo-random quantized blocks, Laplacian-like: large low frequencies, mostly zero high frequencies
+    std::vector<int16_t> blocks(num_blocks * 64);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        const double scale = 40. / (1 + (i % 64));
+        const double u = ((seed >> 8) + 0.5) / double(1 << 24);
+        int16_t magnitude = int16_t(-scale * std::log(u));
+        blocks[i] = (seed & 1) ? magnitude : -magnitude;
+    }
+
+    // Huffman codes and extra bits as the encoder would write them (zero runs simplified away)
+    JpegEncoderContext context(1920, 1080, true, 90, true);
+    const auto& tables = context.tables();
+    std::vector<BitCode> codes;
+    {
+        int16_t lastDC = 0;
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            const int16_t* quantized = &blocks[b * 64];
+            auto diff = quantized[0] - lastDC;
+            lastDC = quantized[0];
+            if (diff == 0)
+                codes.push_back(tables.huffmanLuminanceDC[0]);
+            else
+            {
+                auto dc = tables.codewords()[diff];
+                codes.push_back(tables.huffmanLuminanceDC[dc.numBits]);
+                codes.push_back(dc);
+            }
+            for (int i = 1; i < 64; i++)
+                if (quantized[i] != 0)
+                {
+                    auto ac = tables.codewords()[quantized[i]];
+                    codes.push_back(tables.huffmanLuminanceAC[ac.numBits]);
+                    codes.push_back(ac);
+                }
+            codes.push_back(tables.huffmanLuminanceAC[0x00]);
+        }
+    }
+
+    ReferenceWriter reference;
+    double s_ref = best_seconds(iterations, [&]
+    {
+        reference = ReferenceWriter();
+        for (const auto& code : codes)
+            reference.put(code);
+        reference.flush();
+    });
+
+    std::vector<uint8_t> output;
+    double s_writer = best_seconds(iterations, [&]
+    {
+        output.clear();
+        BitWriter writer(output);
+        for (size_t i = 0; i < codes.size(); i++)
+        {
+            if ((i & 63) == 0)
+                writer.reserve(BitWriter::max_block_bytes); // like the encoder, 64 codes never exceed the worst case of one block
+            writer << codes[i];
+        }
+        writer.flush();
+    });
+
+    // the complete entropy coder: zigzagged block in, Huffman coded bytes out
+    std::vector<uint8_t> encoded;
+    double s_encode = best_seconds(iterations, [&]
+    {
+        encoded.clear();
+        BitWriter writer(encoded);
+        int16_t lastDC = 0;
+        for (size_t b = 0; b < num_blocks; b++)
+            lastDC = JPEGWriter::encodeQuantized(writer, &blocks[b * 64], lastDC, tables.huffmanLuminanceDC,
+                                                 tables.huffmanLuminanceAC, tables.codewords());
+        writer.flush();
+    });
+
+    const double mb = output.size() / 1e6;
+    std::cout << "blocks:              " << num_blocks << "\n"
+              << "bit codes:           " << codes.size() << "\n"
+              << "output:              " << output.size() << " bytes\n"
+              << "reference writer:    " << mb / s_ref    << " MB/s\n"
+              << "BitWriter:           " << mb / s_writer << " MB/s (" << (output == reference.bytes ? "identical" : "DIFFERENT") << ")\n"
+              << "speedup:             " << s_ref / s_writer << "x\n"
+              << "encodeQuantized:     " << encoded.size() / 1e6 / s_encode << " MB/s, "
+              << s_encode * 1e9 / num_blocks << " ns/block" << std::endl;
+
+    return output == reference.bytes ? 0 : 1;
+}
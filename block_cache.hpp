@@ -0,0 +1,155 @@
+#ifndef _BLOCK_CACHE_HPP
+#define _BLOCK_CACHE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Quantized DCT blocks of the previous frame for incremental encoding (JPEGWriter::writeJpegIncremental):
+// MCUs whose pixels did not change since the previous frame are Huffman coded from here, without color
+// conversion, DCT and quantization.
+// Before each frame the caller describes what changed, e.g. from the motion vectors of the video decoder:
+// startFrame(), then markUnchanged()/markChanged() for pixel rectangles. An MCU is reused only if every
+// pixel of it is covered by markUnchanged() and none by markChanged(); everything never marked is encoded.
+// Drift bound: an MCU is encoded again after it was reused maxReuse frames in a row, refresh() forces a
+// full encode of the next frame (e.g. on I-frames).
+class BlockCache
+{
+public:
+    // the motion map has one cell per 4x4 pixels, the smallest motion compensation partition of H.264
+    static constexpr int cell_size = 4;
+
+    explicit BlockCache(int maxReuse = 30) : m_maxReuse(maxReuse) {}
+
+    void setMaxReuse(int maxReuse) { m_maxReuse = maxReuse; }
+
+    // forget the marks of the previous frame, nothing of the next width x height frame is known to be unchanged
+    void startFrame(int width, int height)
+    {
+        m_cellsX = (width  + cell_size - 1) / cell_size;
+        m_cellsY = (height + cell_size - 1) / cell_size;
+        m_cells.assign(size_t(m_cellsX) * m_cellsY, Unknown);
+    }
+
+    // the rectangle shows the same pixels as in the previous frame (e.g. zero motion, no residual)
+    void markUnchanged(int x, int y, int width, int height) { mark(x, y, width, height, Unchanged); }
+
+    // the rectangle changed, overrides markUnchanged() of the same cells in either order
+    void markChanged(int x, int y, int width, int height) { mark(x, y, width, height, Changed); }
+
+    // encode all MCUs of the next frame
+    void refresh() { m_refresh = true; }
+
+    // blocks of the last frame taken over from the previous one / all blocks of the last frame
+    size_t reusedBlocks() const { return m_reusedBlocks; }
+    size_t totalBlocks()  const { return m_totalBlocks; }
+
+    // used by the encoder: called before a frame is encoded with these settings, decides which MCUs are reused
+    // (none if the settings differ from those of the previous frame), settings = anything else that changes
+    // the quantized coefficients (quality, DCT method)
+    void prepare(int width, int height, bool isRGB, bool downsample, int settings)
+    {
+        const int  mcuSize   = downsample ? 16 : 8;
+        const bool sameFrame = m_valid && width == m_width && height == m_height && isRGB == m_isRGB &&
+                               downsample == m_downsample && settings == m_settings;
+        m_width       = width;
+        m_height      = height;
+        m_isRGB       = isRGB;
+        m_downsample  = downsample;
+        m_settings    = settings;
+        m_lumaBlocks  = downsample ? 4 : 1;
+        m_mcuBlocks   = m_lumaBlocks + (isRGB ? 2 : 0);
+        m_mcusPerRow  = (width  + mcuSize - 1) / mcuSize;
+        m_numMcuRows  = (height + mcuSize - 1) / mcuSize;
+        const size_t numMcus = size_t(m_mcusPerRow) * m_numMcuRows;
+        if (!sameFrame)
+        {
+            m_blocks.assign(numMcus * m_mcuBlocks * 64, 0);
+            m_reuseCount.assign(numMcus, 0);
+        }
+        m_reuse.assign(numMcus, 0);
+
+        const bool mapValid = !m_cells.empty() && m_cellsX == (width  + cell_size - 1) / cell_size &&
+                                                  m_cellsY == (height + cell_size - 1) / cell_size;
+        m_reusedBlocks = 0;
+        m_totalBlocks  = numMcus * m_mcuBlocks;
+        if (sameFrame && !m_refresh && mapValid)
+            for (int mcuY = 0; mcuY < m_numMcuRows; mcuY++)
+                for (int mcuX = 0; mcuX < m_mcusPerRow; mcuX++)
+                {
+                    const size_t mcu = size_t(mcuY) * m_mcusPerRow + mcuX;
+                    if (m_reuseCount[mcu] < m_maxReuse && unchanged(mcuX * mcuSize, mcuY * mcuSize, mcuSize))
+                    {
+                        m_reuse[mcu] = 1;
+                        m_reusedBlocks += m_mcuBlocks;
+                    }
+                }
+
+        // the encoder (re)computes every MCU that is not reused, so afterwards the cache is complete
+        for (size_t mcu = 0; mcu < numMcus; mcu++)
+            m_reuseCount[mcu] = m_reuse[mcu] ? m_reuseCount[mcu] + 1 : 0;
+        m_valid   = true;
+        m_refresh = false;
+        m_cells.clear(); // marks are valid for one frame only
+    }
+
+    int     lumaBlocks() const           { return m_lumaBlocks; }
+    int     mcuBlocks()  const           { return m_mcuBlocks; }
+    int     mcusPerRow() const           { return m_mcusPerRow; }
+    bool    reuse(size_t mcu) const      { return m_reuse[mcu]; }
+    // the quantized blocks of an MCU in coding order (1 or 4 Y blocks, Cb, Cr), 64 zigzagged coefficients each
+    int16_t* blocks(size_t mcu)          { return &m_blocks[mcu * m_mcuBlocks * 64]; }
+
+private:
+    enum Cell : uint8_t { Unknown, Unchanged, Changed };
+
+    void mark(int x, int y, int width, int height, Cell state)
+    {
+        // unchanged cells must be covered completely, changed ones are marked as soon as they are touched
+        const int round = state == Unchanged ? cell_size - 1 : 0;
+        const int x0 = std::max(0, (x + round) / cell_size);
+        const int y0 = std::max(0, (y + round) / cell_size);
+        const int x1 = std::min(m_cellsX, (x + width  + cell_size - 1 - round) / cell_size);
+        const int y1 = std::min(m_cellsY, (y + height + cell_size - 1 - round) / cell_size);
+        for (int cellY = y0; cellY < y1; cellY++)
+            for (int cellX = x0; cellX < x1; cellX++)
+            {
+                auto& cell = m_cells[size_t(cellY) * m_cellsX + cellX];
+                if (cell != Changed)
+                    cell = state;
+            }
+    }
+
+    // all cells of the size x size pixels at (x, y) are unchanged, the part outside of the frame is ignored
+    bool unchanged(int x, int y, int size) const
+    {
+        const int x1 = std::min(m_cellsX, (x + size) / cell_size);
+        const int y1 = std::min(m_cellsY, (y + size) / cell_size);
+        for (int cellY = y / cell_size; cellY < y1; cellY++)
+            for (int cellX = x / cell_size; cellX < x1; cellX++)
+                if (m_cells[size_t(cellY) * m_cellsX + cellX] != Unchanged)
+                    return false;
+        return true;
+    }
+
+    int                  m_maxReuse;
+    bool                 m_refresh = false;
+    // motion map of the next frame
+    int                  m_cellsX = 0;
+    int                  m_cellsY = 0;
+    std::vector<uint8_t> m_cells;
+    // settings and blocks of the previous frame
+    bool                 m_valid = false;
+    int                  m_width = 0, m_height = 0;
+    bool                 m_isRGB = false, m_downsample = false;
+    int                  m_settings = 0;
+    int                  m_lumaBlocks = 1, m_mcuBlocks = 1;
+    int                  m_mcusPerRow = 0, m_numMcuRows = 0;
+    std::vector<int16_t> m_blocks;
+    std::vector<int>     m_reuseCount;  // frames in a row each MCU was reused
+    std::vector<uint8_t> m_reuse;       // MCUs of the current frame taken from m_blocks
+    size_t               m_reusedBlocks = 0;
+    size_t               m_totalBlocks  = 0;
+};
+
+#endif // _BLOCK_CACHE_HPP
@@ -0,0 +1,420 @@
+#ifndef _COEF_ARCHIVE_HPP
+#define _COEF_ARCHIVE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "coefficient_plane.hpp"
+
+// Archive of the quantized DCT coefficients of every frame (compressed domain features without decoding pixels),
+// memory-mappable with random access to any frame:
+//   CoefFileHeader (64 bytes), one record per frame appended while decoding, the index when the writer is closed
+//   record = CoefFrameHeader (320 bytes: pts, picture type, both quantization tables, where the planes are),
+//            then the Y, Cb and Cr planes, each starting 64 byte aligned relative to the start of the file
+//   plane, raw:        blocks_x * blocks_y blocks of 64 int16 coefficients (128 bytes each, block-aligned)
+//   plane, zero runs:  the zero coefficients are dropped (zigzag order puts them in long runs at the end):
+//                      uint64 mask per block (bit i: coefficient i is kept), uint32 per block row + 1 (first
+//                      value of the row, so rows can be expanded independently), the kept int16 values in order;
+//                      each array padded with zeros to a multiple of 64 bytes
+//   index    = uint64 file offset of every record, then CoefIndexTrailer (64 bytes) as the last bytes of the file
+// Everything is in the byte order of the writer (CoefFileHeader::byte_order). A file without the index (the writer
+// was killed) is still readable, CoefArchiveReader then walks the records like MvFrameView::next() does.
+
+static constexpr size_t coef_alignment = 64;
+
+inline size_t coef_padded(size_t bytes)
+{
+    return (bytes + coef_alignment - 1) & ~(coef_alignment - 1);
+}
+
+enum class CoefCompression : uint8_t { None = 0, ZeroRuns = 1 };
+
+struct CoefFileHeader
+{
+    char     magic[8]          = { 'D', 'C', 'T', 'C', 'O', 'E', 'F', 0 };
+    uint32_t byte_order        = 0x01020304; // as written by the producer, reads 0x04030201 if the order differs
+    uint32_t version           = 1;
+    uint32_t header_size       = 64;         // sizeof(CoefFileHeader)
+    uint32_t frame_header_size = 320;        // sizeof(CoefFrameHeader)
+    uint32_t alignment         = coef_alignment;
+    uint8_t  reserved[36]      = { 0 };
+};
+static_assert(sizeof(CoefFileHeader) == 64, "CoefFileHeader must stay 64 bytes");
+
+struct CoefPlaneHeader
+{
+    uint64_t offset;           // of the plane's first array, relative to the start of the record
+    uint64_t size;             // bytes of all its arrays, padding included
+    uint32_t width;            // samples
+    uint32_t height;
+    uint32_t blocks_x;
+    uint32_t blocks_y;
+};
+static_assert(sizeof(CoefPlaneHeader) == 32, "CoefPlaneHeader must stay 32 bytes");
+
+struct CoefFrameHeader
+{
+    char     tag[8];           // "COEFFRM", tells a record from the index trailer
+    uint64_t record_size;      // this header plus all planes, a multiple of 64
+    int64_t  index;            // number of the frame in output order, starting at 0
+    int64_t  pts;              // presentation time stamp in the stream's time base, INT64_MIN = unknown
+    char     picture_type;     // 'I', 'P', 'B', ... ('?' = unknown)
+    uint8_t  order;            // CoefficientOrder of the blocks: 0 natural, 1 zigzag
+    uint8_t  compression;      // CoefCompression
+    uint8_t  chroma_shift_x;   // log2 of the chroma subsampling of planes 1 and 2
+    uint8_t  chroma_shift_y;
+    uint8_t  full_range;       // 0: the samples were video range and got stretched before the DCT
+    uint8_t  reserved[58];
+    uint8_t  quant[2][64];     // quantization steps in zigzag order (DQT order): [0] for Y, [1] for Cb and Cr
+    CoefPlaneHeader planes[3];
+};
+static_assert(sizeof(CoefFrameHeader) == 320, "CoefFrameHeader must stay 320 bytes");
+
+struct CoefIndexTrailer
+{
+    char     tag[8];           // "COEFIDX"
+    uint64_t count;            // records in the index
+    uint64_t offset;           // of the index (count uint64 record offsets), from the start of the file
+    uint8_t  reserved[40];
+};
+static_assert(sizeof(CoefIndexTrailer) == 64, "CoefIndexTrailer must stay 64 bytes");
+
+static constexpr char coef_frame_tag[8] = { 'C', 'O', 'E', 'F', 'F', 'R', 'M', 0 };
+static constexpr char coef_index_tag[8] = { 'C', 'O', 'E', 'F', 'I', 'D', 'X', 0 };
+
+// one plane of a record, e.g. of a memory-mapped file
+struct CoefPlaneView
+{
+    const CoefPlaneHeader* header;
+    CoefCompression        compression;
+    CoefficientOrder       order;
+    const int16_t*         blocks;     // raw: all blocks
+    const uint64_t*        masks;      // zero runs: kept coefficients per block
+    const uint32_t*        row_starts; // zero runs: index of the first value of each block row in values
+    const int16_t*         values;     // zero runs: the kept coefficients
+
+    CoefPlaneView(const void* record, const CoefPlaneHeader* plane, CoefCompression compression_, CoefficientOrder order_)
+    : header(plane), compression(compression_), order(order_), blocks(nullptr), masks(nullptr), row_starts(nullptr),
+      values(nullptr)
+    {
+        const uint8_t* data = (const uint8_t*)record + plane->offset;
+        if (compression == CoefCompression::None)
+        {
+            blocks = (const int16_t*)data;
+            return;
+        }
+        const size_t count = block_count();
+        masks      = (const uint64_t*)data;
+        row_starts = (const uint32_t*)(data + coef_padded(count * sizeof(uint64_t)));
+        values     = (const int16_t*)((const uint8_t*)row_starts + coef_padded((header->blocks_y + 1) * sizeof(uint32_t)));
+    }
+
+    int    width()       const { return int(header->width); }
+    int    height()      const { return int(header->height); }
+    int    blocks_x()    const { return int(header->blocks_x); }
+    int    blocks_y()    const { return int(header->blocks_y); }
+    size_t block_count() const { return size_t(header->blocks_x) * header->blocks_y; }
+
+    // the blocks of block row blockY, 64 coefficients each, into out (blocks_x() * 64 values)
+    void expand_row(int blockY, int16_t* out) const
+    {
+        const size_t first = size_t(blockY) * blocks_x();
+        if (compression == CoefCompression::None)
+        {
+            memcpy(out, blocks + first * 64, size_t(blocks_x()) * 64 * sizeof(int16_t));
+            return;
+        }
+        memset(out, 0, size_t(blocks_x()) * 64 * sizeof(int16_t));
+        const int16_t* value = values + row_starts[blockY];
+        for (int blockX = 0; blockX < blocks_x(); blockX++, out += 64)
+            for (uint64_t mask = masks[first + blockX]; mask; mask &= mask - 1)
+                out[__builtin_ctzll(mask)] = *value++;
+    }
+
+    // the whole plane as a CoefficientPlane (e.g. for coefficients_to_plane())
+    void expand(CoefficientPlane& plane) const
+    {
+        plane.resize(width(), height(), order);
+        for (int blockY = 0; blockY < blocks_y(); blockY++)
+            expand_row(blockY, plane.block(0, blockY));
+    }
+};
+
+// one record
+struct CoefFrameView
+{
+    const CoefFrameHeader* header;
+
+    explicit CoefFrameView(const void* record) : header((const CoefFrameHeader*)record) {}
+
+    CoefPlaneView plane(int plane) const
+    {
+        return CoefPlaneView(header, &header->planes[plane], CoefCompression(header->compression),
+                             header->order ? CoefficientOrder::ZigZag : CoefficientOrder::Natural);
+    }
+
+    // quantization steps of a plane in zigzag order, e.g. for DequantTable
+    const uint8_t* quant(int plane) const { return header->quant[plane == 0 ? 0 : 1]; }
+
+    // the record following this one (check against the end of the mapping first)
+    const void* next() const { return (const uint8_t*)header + header->record_size; }
+};
+
+// builds the records and appends them to an archive, each record is written with a single fwrite and flushed;
+// records can be built on any thread (build_record() is static) and appended in order by one of them
+class CoefArchiveWriter
+{
+public:
+    CoefArchiveWriter() = default;
+    CoefArchiveWriter(const CoefArchiveWriter& other) = delete;
+    CoefArchiveWriter& operator=(const CoefArchiveWriter& other) = delete;
+    ~CoefArchiveWriter() { close(); }
+
+    // open filename for appending: a new or empty file gets the file header, an existing one must have been
+    // written by this version on a machine with the same byte order; its index and an incomplete last record
+    // are cut off, the index is written again by close()
+    bool open(const char* filename)
+    {
+        close();
+        m_offsets.clear();
+        m_file = fopen(filename, "a+b");
+        if (!m_file)
+            return false;
+        if (fseek(m_file, 0, SEEK_END) != 0)
+            return fail();
+        const long size = ftell(m_file);
+        if (size == 0)
+        {
+            const CoefFileHeader header;
+            m_end = sizeof(header);
+            return (fwrite(&header, sizeof(header), 1, m_file) == 1 && fflush(m_file) == 0) || fail();
+        }
+
+        CoefFileHeader expected, header;
+        if (size < long(sizeof(header)) || fseek(m_file, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, m_file) != 1 ||
+            memcmp(&header, &expected, offsetof(CoefFileHeader, reserved)) != 0)
+            return fail();
+
+        // walk the records up to the index or the first incomplete one
+        long end = sizeof(header);
+        CoefFrameHeader frame;
+        while (end + long(sizeof(frame)) <= size && fseek(m_file, end, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, m_file) == 1 &&
+               memcmp(frame.tag, coef_frame_tag, sizeof(frame.tag)) == 0 && frame.record_size % coef_alignment == 0 &&
+               frame.record_size >= sizeof(frame) && end + long(frame.record_size) <= size)
+        {
+            m_offsets.push_back(uint64_t(end));
+            end += long(frame.record_size);
+        }
+        if (end < size && ftruncate(fileno(m_file), end) != 0)
+            return fail();
+        m_end = uint64_t(end);
+        return fseek(m_file, 0, SEEK_END) == 0 || fail();
+    }
+
+    bool is_open() const { return m_file != nullptr; }
+
+    // the record of a frame into record (its capacity is reused), index is set by append()
+    static void build_record(std::vector<uint8_t>& record, const CoefficientFrame& frame, const uint8_t quantLuma[64],
+                             const uint8_t quantChroma[64], bool fullRange, int64_t pts, char picture_type,
+                             CoefCompression compression)
+    {
+        CoefFrameHeader header = {};
+        memcpy(header.tag, coef_frame_tag, sizeof(header.tag));
+        header.index          = -1;
+        header.pts            = pts;
+        header.picture_type   = picture_type;
+        header.order          = frame.planes[0].order == CoefficientOrder::ZigZag ? 1 : 0;
+        header.compression    = uint8_t(compression);
+        header.chroma_shift_x = uint8_t(frame.chromaShiftX);
+        header.chroma_shift_y = uint8_t(frame.chromaShiftY);
+        header.full_range     = fullRange;
+        memcpy(header.quant[0], quantLuma,   64);
+        memcpy(header.quant[1], quantChroma, 64);
+
+        // sizes first, the record is allocated once and zero filled (padding)
+        size_t nonzero[3] = { 0, 0, 0 };
+        uint64_t offset = sizeof(header);
+        for (int p = 0; p < 3; p++)
+        {
+            const CoefficientPlane& plane = frame.planes[p];
+            CoefPlaneHeader& info = header.planes[p];
+            info.offset   = offset;
+            info.width    = uint32_t(plane.width);
+            info.height   = uint32_t(plane.height);
+            info.blocks_x = uint32_t(plane.blocks_x());
+            info.blocks_y = uint32_t(plane.blocks_y());
+            if (compression == CoefCompression::None)
+                info.size = coef_padded(plane.coefficients.size() * sizeof(int16_t));
+            else
+            {
+                nonzero[p] = plane.coefficients.size() - std::count(plane.coefficients.begin(), plane.coefficients.end(), 0);
+                info.size  = coef_padded(plane.block_count() * sizeof(uint64_t)) +
+                             coef_padded((plane.blocks_y() + 1) * sizeof(uint32_t)) + coef_padded(nonzero[p] * sizeof(int16_t));
+            }
+            offset += info.size;
+        }
+        header.record_size = offset;
+        record.assign(offset, 0);
+        memcpy(record.data(), &header, sizeof(header));
+
+        for (int p = 0; p < 3; p++)
+        {
+            const CoefficientPlane& plane = frame.planes[p];
+            uint8_t* data = record.data() + header.planes[p].offset;
+            if (compression == CoefCompression::None)
+            {
+                memcpy(data, plane.coefficients.data(), plane.coefficients.size() * sizeof(int16_t));
+                continue;
+            }
+            uint64_t* masks      = (uint64_t*)data;
+            uint32_t* row_starts = (uint32_t*)(data + coef_padded(plane.block_count() * sizeof(uint64_t)));
+            int16_t*  values     = (int16_t*)((uint8_t*)row_starts + coef_padded((plane.blocks_y() + 1) * sizeof(uint32_t)));
+            const int16_t* block = plane.coefficients.data();
+            uint32_t kept = 0;
+            for (int blockY = 0; blockY < plane.blocks_y(); blockY++)
+            {
+                row_starts[blockY] = kept;
+                for (int blockX = 0; blockX < plane.blocks_x(); blockX++, block += 64)
+                {
+                    uint64_t mask = 0;
+                    for (int i = 0; i < 64; i++)
+                        if (block[i] != 0)
+                        {
+                            mask |= uint64_t(1) << i;
+                            values[kept++] = block[i];
+                        }
+                    *masks++ = mask;
+                }
+            }
+            row_starts[plane.blocks_y()] = kept;
+        }
+    }
+
+    // append a record built by build_record() as frame number index
+    bool append(std::vector<uint8_t>& record, int64_t index)
+    {
+        CoefFrameHeader* header = (CoefFrameHeader*)record.data();
+        header->index = index;
+        if (fwrite(record.data(), 1, record.size(), m_file) != record.size() || fflush(m_file) != 0)
+            return false;
+        m_offsets.push_back(m_end);
+        m_end += record.size();
+        return true;
+    }
+
+    // writes the index, the file is complete afterwards
+    bool close()
+    {
+        if (!m_file)
+            return true;
+        CoefIndexTrailer trailer = {};
+        memcpy(trailer.tag, coef_index_tag, sizeof(trailer.tag));
+        trailer.count  = m_offsets.size();
+        trailer.offset = m_end;
+        const bool ok = fwrite(m_offsets.data(), sizeof(uint64_t), m_offsets.size(), m_file) == m_offsets.size() &&
+                        fwrite(&trailer, sizeof(trailer), 1, m_file) == 1;
+        return (fclose(std::exchange(m_file, nullptr)) == 0) && ok;
+    }
+
+    size_t frames() const { return m_offsets.size(); }
+
+private:
+    bool fail()
+    {
+        fclose(std::exchange(m_file, nullptr));
+        return false;
+    }
+
+    FILE*                 m_file = nullptr;
+    uint64_t              m_end  = 0;     // file size, where the next record goes
+    std::vector<uint64_t> m_offsets;      // of the records so far, the index
+};
+
+// read-only mapping of an archive, any frame in O(1) through the index
+class CoefArchiveReader
+{
+public:
+    CoefArchiveReader() = default;
+    CoefArchiveReader(const CoefArchiveReader& other) = delete;
+    CoefArchiveReader& operator=(const CoefArchiveReader& other) = delete;
+    ~CoefArchiveReader() { close(); }
+
+    // false if the file can't be mapped or was not written by this version with our byte order
+    bool open(const char* filename)
+    {
+        close();
+        const int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(CoefFileHeader)))
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        m_data = (const uint8_t*)data;
+        m_size = size_t(st.st_size);
+
+        const CoefFileHeader expected;
+        if (memcmp(m_data, &expected, offsetof(CoefFileHeader, reserved)) != 0)
+        {
+            close();
+            return false;
+        }
+
+        // the index if the writer was closed, otherwise the records are walked once
+        const CoefIndexTrailer* trailer = (const CoefIndexTrailer*)(m_data + m_size - sizeof(CoefIndexTrailer));
+        if (m_size >= sizeof(CoefFileHeader) + sizeof(CoefIndexTrailer) &&
+            memcmp(trailer->tag, coef_index_tag, sizeof(trailer->tag)) == 0 &&
+            trailer->offset + trailer->count * sizeof(uint64_t) + sizeof(CoefIndexTrailer) == m_size)
+        {
+            m_index = (const uint64_t*)(m_data + trailer->offset);
+            m_count = size_t(trailer->count);
+            return true;
+        }
+        for (size_t end = sizeof(CoefFileHeader); end + sizeof(CoefFrameHeader) <= m_size; )
+        {
+            const CoefFrameHeader* frame = (const CoefFrameHeader*)(m_data + end);
+            if (memcmp(frame->tag, coef_frame_tag, sizeof(frame->tag)) != 0 || frame->record_size < sizeof(CoefFrameHeader) ||
+                end + frame->record_size > m_size)
+                break;
+            m_walked.push_back(end);
+            end += frame->record_size;
+        }
+        m_index = m_walked.data();
+        m_count = m_walked.size();
+        return true;
+    }
+
+    void close()
+    {
+        if (m_data)
+            munmap(const_cast<uint8_t*>(m_data), m_size);
+        m_data  = nullptr;
+        m_size  = 0;
+        m_index = nullptr;
+        m_count = 0;
+        m_walked.clear();
+    }
+
+    size_t size() const { return m_count; }
+    CoefFrameView frame(size_t i) const { return CoefFrameView(m_data + m_index[i]); }
+
+private:
+    const uint8_t*        m_data  = nullptr;
+    size_t                m_size  = 0;
+    const uint64_t*       m_index = nullptr;
+    size_t                m_count = 0;
+    std::vector<uint64_t> m_walked;       // record offsets of a file without index
+};
+
+#endif // _COEF_ARCHIVE_HPP
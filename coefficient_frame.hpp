@@ -0,0 +1,54 @@
+#ifndef _COEFFICIENT_FRAME_HPP
+#define _COEFFICIENT_FRAME_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Planes of quantized DCT coefficients: blocks_x * blocks_y blocks of 64 int16 values, the blocks row by row,
+// the 64 values of a block in natural (row-major) or zigzag order (the order of a JPEG scan and of DQT segments).
+// Filled by frame_to_coefficients() (coefficient_plane.hpp) or by the JPEG encoder itself
+// (JPEGWriter::setCoefficientOutput()), read by writeJpegCoefficients(), coefficients_to_plane() and the
+// coefficient archive.
+
+enum class CoefficientOrder { Natural, ZigZag };
+
+// blocks of a plane of size pixels (width or height)
+inline int coefficient_blocks(int size)
+{
+  return (size + 7) / 8;
+}
+
+// the coefficients of one plane, width x height samples, contiguous blocks
+struct CoefficientPlane
+{
+  std::vector<int16_t> coefficients; // blocks_x() * blocks_y() * 64
+  int              width  = 0;
+  int              height = 0;
+  CoefficientOrder order  = CoefficientOrder::ZigZag;
+
+  // storage for a width x height plane, the vector keeps its capacity from frame to frame (content undefined)
+  void resize(int newWidth, int newHeight, CoefficientOrder newOrder)
+  {
+    width  = newWidth;
+    height = newHeight;
+    order  = newOrder;
+    coefficients.resize(block_count() * 64);
+  }
+
+  int    blocks_x()    const { return coefficient_blocks(width); }
+  int    blocks_y()    const { return coefficient_blocks(height); }
+  size_t block_count() const { return size_t(blocks_x()) * blocks_y(); }
+  int16_t*       block(int blockX, int blockY)       { return &coefficients[(size_t(blockY) * blocks_x() + blockX) * 64]; }
+  const int16_t* block(int blockX, int blockY) const { return &coefficients[(size_t(blockY) * blocks_x() + blockX) * 64]; }
+};
+
+// Y, Cb and Cr, chroma at the size of the source's (or the JPEG's) chroma planes
+struct CoefficientFrame
+{
+  CoefficientPlane planes[3];
+  int chromaShiftX = 0;
+  int chromaShiftY = 0;
+};
+
+#endif // _COEFFICIENT_FRAME_HPP
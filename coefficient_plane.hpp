@@ -0,0 +1,228 @@
+#ifndef _COEFFICIENT_PLANE_HPP
+#define _COEFFICIENT_PLANE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "coefficient_frame.hpp"
+#include "dct_batch.hpp"
+#include "thread_pool.hpp"
+#include "write_jpeg.hpp"
+
+// frame_to_coefficients() transforms and quantizes the Y/Cb/Cr planes of a frame (see coefficient_frame.hpp) at the
+// source's chroma size without encoding a JPEG, for consumers of the blocks alone (analytics, ...); the block rows of
+// all planes are spread over a ThreadPool. The JPEG encoder does not read them, it keeps its own blocks with
+// JPEGWriter::setCoefficientOutput() (the coefficient archive of decode -C takes those); for the same planes and
+// sampling both are the same blocks, which dct_bench checks against the float encoder.
+// coefficients_to_plane() is the decoder's half: dequantization, the batched AAN inverse DCT (dct_inverse_blocks())
+// and the conversion back to 8 bit samples, one row of blocks at a time.
+
+// 8 bit sample => (value - offset) * scale - shift, the level shifted input of the DCT; video range is stretched
+// to 0..255 exactly like encodeMcuRowsYCbCr() does
+struct SampleLevels
+{
+  float offset = 0;
+  float scale  = 1;
+  float shift  = 128;
+
+  static SampleLevels luma  (bool fullRange) { return fullRange ? SampleLevels{ 0,   1, 128 } : SampleLevels{ 16,  255.f / 219.f, 128 }; }
+  static SampleLevels chroma(bool fullRange) { return fullRange ? SampleLevels{ 128, 1, 0   } : SampleLevels{ 128, 255.f / 224.f, 0   }; }
+};
+
+// block rows [firstRow, lastRow) of a plane of 8 bit samples (out was resized to the plane already),
+// rows linesize bytes apart; the border blocks replicate the last column / row like the encoder
+inline void plane_rows_to_coefficients(const uint8_t* src, ptrdiff_t linesize, const SampleLevels& levels,
+                                       const QuantizeTable& quant, CoefficientPlane& out, int firstRow, int lastRow)
+{
+  // a few batches of blocks at a time, they stay in the L1 cache from the samples to the quantized values
+  constexpr int chunk = 32;
+  alignas(64) float blocks[chunk * 64];
+  const int blocksX = out.blocks_x();
+  const int maxX = out.width  - 1;
+  const int maxY = out.height - 1;
+  for (int blockY = firstRow; blockY < lastRow; blockY++)
+    for (int firstX = 0; firstX < blocksX; firstX += chunk)
+    {
+      const int count = std::min(chunk, blocksX - firstX);
+      const bool inside = (firstX + count) * 8 <= out.width;
+      for (int y = 0; y < 8; y++)
+      {
+        const uint8_t* line = src + std::min(blockY * 8 + y, maxY) * linesize;
+        for (int b = 0; b < count; b++)
+        {
+          float* row = &blocks[b * 64 + y * 8];
+          const int x0 = (firstX + b) * 8;
+          if (inside)
+            for (int x = 0; x < 8; x++)
+              row[x] = (line[x0 + x] - levels.offset) * levels.scale - levels.shift;
+          else
+            for (int x = 0; x < 8; x++)
+              row[x] = (line[std::min(x0 + x, maxX)] - levels.offset) * levels.scale - levels.shift;
+        }
+      }
+      dct_forward_blocks(blocks, count);
+
+      // quantized and rounded like encodeBlock() (one row per vector), then stored in the plane's order
+      typedef float   floats __attribute__((vector_size(8 * sizeof(float))));
+      typedef int32_t ints   __attribute__((vector_size(8 * sizeof(int32_t))));
+      typedef int16_t shorts __attribute__((vector_size(8 * sizeof(int16_t))));
+      int16_t* block = out.block(firstX, blockY);
+      for (int b = 0; b < count; b++, block += 64)
+      {
+        int16_t quantized[8*8];
+        for (auto i = 0; i < 8*8; i += 8)
+        {
+          floats value, multiplier;
+          std::memcpy(&value,      &blocks[b * 64 + i],   sizeof(value));
+          std::memcpy(&multiplier, &quant.multiplier[i], sizeof(multiplier));
+          value = value * multiplier;
+          value = value + (value >= 0 ? +0.5f : -0.5f);
+          const shorts rounded = __builtin_convertvector(__builtin_convertvector(value, ints), shorts);
+          std::memcpy(&quantized[i], &rounded, sizeof(rounded));
+        }
+        if (out.order == CoefficientOrder::ZigZag)
+          for (auto i = 0; i < 8*8; i++)
+            block[i] = quantized[ZigZagInv[i]];
+        else
+          std::memcpy(block, quantized, sizeof(quantized));
+      }
+    }
+}
+
+// a whole plane, its block rows split over pool (NULL: the calling thread does all of them)
+inline void plane_to_coefficients(const uint8_t* src, ptrdiff_t linesize, int width, int height, const SampleLevels& levels,
+                                  const QuantizeTable& quant, CoefficientOrder order, CoefficientPlane& out,
+                                  ThreadPool* pool = NULL)
+{
+  out.resize(width, height, order);
+  if (!pool)
+    return plane_rows_to_coefficients(src, linesize, levels, quant, out, 0, out.blocks_y());
+  pool->parallel_for(out.blocks_y(), [&](size_t row)
+  {
+    plane_rows_to_coefficients(src, linesize, levels, quant, out, int(row), int(row) + 1);
+  });
+}
+
+// the three planes of a width x height frame (e.g. ycbcr_view() of a decoded AVFrame), Y quantized with luma,
+// Cb and Cr with chroma; one parallel_for over the block rows of all planes
+inline void frame_to_coefficients(const PlanarYCbCr& image, int width, int height, const QuantizeTable& luma,
+                                  const QuantizeTable& chroma, CoefficientOrder order, CoefficientFrame& out,
+                                  ThreadPool* pool = NULL)
+{
+  out.chromaShiftX = image.chromaShiftX;
+  out.chromaShiftY = image.chromaShiftY;
+  out.planes[0].resize(width, height, order);
+  const int chromaWidth  = (width  + (1 << image.chromaShiftX) - 1) >> image.chromaShiftX;
+  const int chromaHeight = (height + (1 << image.chromaShiftY) - 1) >> image.chromaShiftY;
+  out.planes[1].resize(chromaWidth, chromaHeight, order);
+  out.planes[2].resize(chromaWidth, chromaHeight, order);
+
+  const SampleLevels lumaLevels   = SampleLevels::luma  (image.fullRange);
+  const SampleLevels chromaLevels = SampleLevels::chroma(image.fullRange);
+  const int lumaRows   = out.planes[0].blocks_y();
+  const int chromaRows = out.planes[1].blocks_y();
+  auto transform = [&](size_t task)
+  {
+    // task => plane and block row
+    const int row   = int(task);
+    const int plane = row < lumaRows ? 0 : (row - lumaRows < chromaRows ? 1 : 2);
+    const int first = plane == 0 ? row : row - lumaRows - (plane - 1) * chromaRows;
+    plane_rows_to_coefficients(image.planes[plane], image.linesizes[plane], plane == 0 ? lumaLevels : chromaLevels,
+                               plane == 0 ? luma : chroma, out.planes[plane], first, first + 1);
+  };
+  const size_t tasks = size_t(lumaRows) + 2 * chromaRows;
+  if (pool)
+    pool->parallel_for(tasks, transform);
+  else
+    for (size_t task = 0; task < tasks; task++)
+      transform(task);
+}
+
+// quantized coefficient => input of dct_inverse_blocks(): step * 8 * aan(u) * aan(v), see _IDCTImpl
+struct DequantTable
+{
+  float multiplier[8*8]; // natural order
+
+  // quant: the 64 quantization steps in zigzag order as in a DQT segment (all 1 for unquantized coefficients)
+  explicit DequantTable(const uint8_t quant[8*8])
+  {
+    for (auto i = 0; i < 8*8; i++)
+      multiplier[ZigZagInv[i]] = quant[i] * aan_scale(ZigZagInv[i]);
+  }
+};
+
+// the blocks of a plane (coefficient_blocks(width) x coefficient_blocks(height), consecutive) => width x height
+// samples at dst, rows linesize bytes apart; the parts of the border blocks outside the plane are dropped.
+// A horizontal stripe of the plane is decoded by passing the stripe's first block, first row and height.
+inline void coefficients_to_plane(const int16_t* coefficients, CoefficientOrder order, const DequantTable& dequant,
+                                  int width, int height, uint8_t* dst, ptrdiff_t linesize)
+{
+  // a few batches of blocks at a time, they stay in the L1 cache from dequantization to the stores
+  constexpr int chunk = 32;
+  alignas(64) float blocks[chunk * 64];
+  const int blocksX = coefficient_blocks(width);
+  const int blocksY = coefficient_blocks(height);
+  for (int blockY = 0; blockY < blocksY; blockY++)
+  {
+    const int rows = std::min(8, height - blockY * 8);
+    for (int firstX = 0; firstX < blocksX; firstX += chunk)
+    {
+      const int count = std::min(chunk, blocksX - firstX);
+      // dequantized, natural order (zigzag input is gathered as int16 straight into the natural positions)
+      const int16_t* in = coefficients + (size_t(blockY) * blocksX + firstX) * 64;
+      for (int b = 0; b < count; b++, in += 64)
+      {
+        float* block = &blocks[b * 64];
+        if (order == CoefficientOrder::ZigZag)
+          for (auto i = 0; i < 8*8; i++)
+            block[i] = in[ZigZag[i]] * dequant.multiplier[i];
+        else
+          for (auto i = 0; i < 8*8; i++)
+            block[i] = in[i] * dequant.multiplier[i];
+      }
+      dct_inverse_blocks(blocks, count);
+
+      // level shift, round and clamp to 0..255, one row of a block per vector;
+      // the part of a border block outside the plane is dropped
+      typedef float   floats __attribute__((vector_size(8 * sizeof(float))));
+      typedef int32_t ints   __attribute__((vector_size(8 * sizeof(int32_t))));
+      typedef uint8_t bytes  __attribute__((vector_size(8)));
+      const int columns = std::min(count * 8, width - firstX * 8);
+      for (int y = 0; y < rows; y++)
+      {
+        uint8_t* line = dst + (blockY * 8 + y) * linesize + firstX * 8;
+        for (int x = 0; x < columns; x += 8)
+        {
+          floats row;
+          std::memcpy(&row, &blocks[x * 8 + y * 8], sizeof(row));
+          row = row + 128.5f;
+          row = row < 0.f ? 0.f : row;
+          row = row > 255.f ? 255.f : row;
+          const bytes samples = __builtin_convertvector(__builtin_convertvector(row, ints), bytes);
+          if (x + 8 <= columns)
+            std::memcpy(line + x, &samples, 8);
+          else
+            std::memcpy(line + x, &samples, columns - x);
+        }
+      }
+    }
+  }
+}
+
+// a whole CoefficientPlane back to samples, block rows split over pool (NULL: the calling thread does all of them)
+inline void coefficients_to_plane(const CoefficientPlane& plane, const DequantTable& dequant, uint8_t* dst,
+                                  ptrdiff_t linesize, ThreadPool* pool = NULL)
+{
+  if (!pool)
+    return coefficients_to_plane(plane.coefficients.data(), plane.order, dequant, plane.width, plane.height, dst, linesize);
+  pool->parallel_for(plane.blocks_y(), [&](size_t row)
+  {
+    const int blockY = int(row);
+    coefficients_to_plane(plane.block(0, blockY), plane.order, dequant, plane.width,
+                          std::min(8, plane.height - blockY * 8), dst + blockY * 8 * linesize, linesize);
+  });
+}
+
+#endif // _COEFFICIENT_PLANE_HPP
@@ -0,0 +1,455 @@
+#ifndef _COLOR_CONVERT_HPP
+#define _COLOR_CONVERT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// RGB24 => level shifted YCbCr samples of one MCU, the conversion of JPEGWriter::encodeMcuRows.
+// Same constants as rgb2y/rgb2cb/rgb2cr (dct.hpp) in 16 bit fixed point, Q16 like libjpeg's jccolor.c, computed on
+// int32 vectors of one MCU row (8 or 16 pixels), the RGB triplets are split into three vectors first (pshufb if
+// available). 4:2:0 takes two pixel rows per step, converts both to Y and adds up the 2x2 areas of the same
+// registers for Cb/Cr, there is no second pass over the pixels.
+// Interior MCUs are read straight from the image without any border checks, only MCUs crossing the right or
+// bottom border are copied to a 16x16 buffer first, replicating the last column / row as before.
+// int16 samples are rounded, float samples keep the 16 fractional bits. With SSSE3 int16 samples are computed on
+// 16 bit lanes with pmaddwd instead (rgb_to_ycbcr_mcu_int16, two rows per register with AVX2), same results.
+
+template<typename Sample>
+struct YCbCrMcu
+{
+  Sample Y[4][8][8]; // 4:2:0: top left, top right, bottom left, bottom right; 4:4:4: only Y[0]
+  Sample Cb[8][8];
+  Sample Cr[8][8];
+};
+
+// Q16, each row adds up to 65536 (Y) or 0 (Cb, Cr)
+constexpr int32_t ycc_y_r  =  19595, ycc_y_g  =  38470, ycc_y_b  =  7471; // 0.299, 0.587, 0.114
+constexpr int32_t ycc_cb_r = -11059, ycc_cb_g = -21709, ycc_cb_b = 32768; // -0.16874, -0.33126, 0.5
+constexpr int32_t ycc_cr_r =  32768, ycc_cr_g = -27439, ycc_cr_b = -5329; // 0.5, -0.41869, -0.08131
+
+template<int N>
+struct YccLanes
+{
+  // note: must be a typedef, GCC drops a dependent vector_size on alias declarations
+  typedef int32_t vector __attribute__((vector_size(N * sizeof(int32_t))));
+  typedef uint8_t bytes  __attribute__((vector_size(N)));
+};
+
+// zero extension to int32 lanes, GCC doesn't find vpmovzxbd for __builtin_convertvector on its own
+// (out parameter: returning a vector wider than the enabled ISA changes the ABI)
+template<int N>
+inline void ycc_widen(const typename YccLanes<N>::bytes& bytes, typename YccLanes<N>::vector& wide)
+{
+#if defined(__AVX2__)
+  __m128i packed = _mm_setzero_si128();
+  std::memcpy(&packed, &bytes, N);
+  const __m256i low = _mm256_cvtepu8_epi32(packed);
+  std::memcpy(&wide, &low, 32);
+  if constexpr (N == 16)
+  {
+    const __m256i high = _mm256_cvtepu8_epi32(_mm_srli_si128(packed, 8));
+    std::memcpy(reinterpret_cast<char*>(&wide) + 32, &high, 32);
+  }
+#else
+  wide = __builtin_convertvector(bytes, typename YccLanes<N>::vector);
+#endif
+}
+
+#if defined(__SSSE3__)
+// the N pixels (8 or 16) at rgb as bytes in the low N bytes of three registers (the rest is 0)
+template<int N>
+inline void ycc_split_sse(const uint8_t* rgb, __m128i& red, __m128i& green, __m128i& blue)
+{
+  if constexpr (N == 16)
+  {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb));
+    const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 16));
+    const __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 32));
+    // -1: zero, every channel is gathered from the three registers and or'ed together
+    red = _mm_or_si128(_mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(z, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    green = _mm_or_si128(_mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(z, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    blue = _mm_or_si128(_mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+      _mm_shuffle_epi8(z, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+  }
+  else
+  {
+    // 24 bytes, the second load only takes 8 of them
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb));
+    const __m128i m = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rgb + 16));
+    red = _mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1)));
+    green = _mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1)));
+    blue = _mm_or_si128(
+      _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+  }
+}
+#endif
+
+// the N pixels (8 or 16) at rgb as three vectors of bytes
+template<int N>
+inline void ycc_split(const uint8_t* rgb, typename YccLanes<N>::bytes& red, typename YccLanes<N>::bytes& green,
+                      typename YccLanes<N>::bytes& blue)
+{
+#if defined(__SSSE3__)
+  __m128i r, g, b;
+  ycc_split_sse<N>(rgb, r, g, b);
+  std::memcpy(&red,   &r, N);
+  std::memcpy(&green, &g, N);
+  std::memcpy(&blue,  &b, N);
+#else
+  for (int i = 0; i < N; i++)
+  {
+    red  [i] = rgb[3 * i    ];
+    green[i] = rgb[3 * i + 1];
+    blue [i] = rgb[3 * i + 2];
+  }
+#endif
+}
+
+// the N pixels (8 or 16) at rgb as three vectors
+template<int N>
+inline void ycc_deinterleave(const uint8_t* rgb, typename YccLanes<N>::vector& r, typename YccLanes<N>::vector& g,
+                             typename YccLanes<N>::vector& b)
+{
+  typename YccLanes<N>::bytes red, green, blue;
+  ycc_split<N>(rgb, red, green, blue);
+  ycc_widen<N>(red,   r);
+  ycc_widen<N>(green, g);
+  ycc_widen<N>(blue,  b);
+}
+
+// fixed point values with fractionBits fractional bits => count samples minus offset
+template<typename Sample, int N>
+inline void ycc_store(const typename YccLanes<N>::vector& value, int fractionBits, int offset, Sample* out, int count)
+{
+  Sample converted[N];
+  if constexpr (std::is_same_v<Sample, float>)
+  {
+    typedef float floats __attribute__((vector_size(N * sizeof(float))));
+    const floats scaled = __builtin_convertvector(value, floats) * (1.f / float(1 << fractionBits)) - float(offset);
+    std::memcpy(converted, &scaled, sizeof(converted));
+  }
+  else
+  {
+    // rounded to nearest, halves away from zero like toSample(), the encoder's int16 samples are -128..127
+    const typename YccLanes<N>::vector half = value < 0 ? (1 << (fractionBits - 1)) - 1 : 1 << (fractionBits - 1);
+    typename YccLanes<N>::vector rounded = ((value + half) >> fractionBits) - offset;
+    rounded = rounded < -128 ? -128 : rounded;
+    rounded = rounded >  127 ?  127 : rounded;
+    typedef int16_t shorts __attribute__((vector_size(N * sizeof(int16_t))));
+    const shorts narrowed = __builtin_convertvector(rounded, shorts);
+    std::memcpy(converted, &narrowed, sizeof(converted));
+  }
+  std::copy(converted, converted + count, out);
+}
+
+#if defined(__SSSE3__)
+// int16 samples with pmaddwd like libjpeg-turbo's jccolext-sse2: interleaved 16 bit (R,G) and (B,G) pairs times
+// 16 bit coefficients give exactly the Q16 sums above in 32 bit lanes (38470 * G is split into two halves, the
+// 32768 * B of Cb and 32768 * R of Cr are shifts), rounded and narrowed with a saturating pack. One register of
+// pairs holds 4 pixels, with AVX2 the two 128 bit lanes hold 4 pixels each of two rows.
+
+static_assert(ycc_y_g % 2 == 0 && ycc_cb_b == 32768 && ycc_cr_r == 32768, "coefficients of the pmaddwd split");
+
+// the instructions on 16 and 32 bit lanes of a register of BITS bits
+template<int BITS>
+struct YccWords;
+
+template<>
+struct YccWords<128>
+{
+  typedef __m128i V;
+  static __m128i set32(int32_t value)            { return _mm_set1_epi32(value); }
+  static __m128i set16(int16_t value)            { return _mm_set1_epi16(value); }
+  static __m128i madd(__m128i a, __m128i b)      { return _mm_madd_epi16(a, b); }
+  static __m128i add32(__m128i a, __m128i b)     { return _mm_add_epi32(a, b); }
+  static __m128i sub16(__m128i a, __m128i b)     { return _mm_sub_epi16(a, b); }
+  static __m128i srai32(__m128i a, int count)    { return _mm_srai_epi32(a, count); }
+  static __m128i times32768(__m128i a)           { return _mm_srli_epi32(_mm_slli_epi32(a, 16), 1); }
+  static __m128i pack(__m128i a, __m128i b)      { return _mm_packs_epi32(a, b); }
+  static __m128i clamp(__m128i a, __m128i low, __m128i high) { return _mm_min_epi16(_mm_max_epi16(a, low), high); }
+  static void    store(int16_t* out, __m128i a)  { _mm_storeu_si128(reinterpret_cast<__m128i*>(out), a); }
+};
+
+#if defined(__AVX2__)
+template<>
+struct YccWords<256>
+{
+  typedef __m256i V;
+  static __m256i set32(int32_t value)            { return _mm256_set1_epi32(value); }
+  static __m256i set16(int16_t value)            { return _mm256_set1_epi16(value); }
+  static __m256i madd(__m256i a, __m256i b)      { return _mm256_madd_epi16(a, b); }
+  static __m256i add32(__m256i a, __m256i b)     { return _mm256_add_epi32(a, b); }
+  static __m256i sub16(__m256i a, __m256i b)     { return _mm256_sub_epi16(a, b); }
+  static __m256i srai32(__m256i a, int count)    { return _mm256_srai_epi32(a, count); }
+  static __m256i times32768(__m256i a)           { return _mm256_srli_epi32(_mm256_slli_epi32(a, 16), 1); }
+  static __m256i pack(__m256i a, __m256i b)      { return _mm256_packs_epi32(a, b); }
+  static __m256i clamp(__m256i a, __m256i low, __m256i high)
+  {
+    return _mm256_min_epi16(_mm256_max_epi16(a, low), high);
+  }
+  static void    store(int16_t* out, __m256i a)  { _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), a); }
+};
+
+// two 128 bit registers as the low and high lane of one
+inline __m256i ycc_lanes(__m128i low, __m128i high)
+{
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+#endif
+
+// the coefficient pair (first, second) in every 32 bit lane
+template<int BITS>
+inline typename YccWords<BITS>::V ycc_pair(int32_t first, int32_t second)
+{
+  return YccWords<BITS>::set32(int32_t(uint32_t(uint16_t(first)) | uint32_t(uint16_t(second)) << 16));
+}
+
+// fixed point values with FRACTION fractional bits => rounded to nearest, halves away from zero (as ycc_store)
+template<int FRACTION, int BITS>
+inline typename YccWords<BITS>::V ycc_round(typename YccWords<BITS>::V value)
+{
+  using W = YccWords<BITS>;
+  using V = typename W::V;
+  const V half = W::add32(W::set32(1 << (FRACTION - 1)), W::srai32(value, 31));
+  return W::srai32(W::add32(value, half), FRACTION);
+}
+
+// rounded values of the pixels 0..3 and 4..7 => 8 samples minus offset, clamped to -128..127, at out
+// (with AVX2: 8 samples each of two rows, the second row 8 samples after the first)
+template<int BITS>
+inline void ycc_pack(typename YccWords<BITS>::V low, typename YccWords<BITS>::V high, int offset, int16_t* out)
+{
+  using W = YccWords<BITS>;
+  using V = typename W::V;
+  const V samples = W::sub16(W::pack(low, high), W::set16(int16_t(offset)));
+  W::store(out, W::clamp(samples, W::set16(-128), W::set16(127)));
+}
+
+// the (R,G) and (B,G) pairs of the pixels 0..3 and 4..7 => 8 Y samples
+template<int BITS>
+inline void ycc_luma_int16(const typename YccWords<BITS>::V rg[2], const typename YccWords<BITS>::V bg[2],
+                           int16_t* y)
+{
+  using W = YccWords<BITS>;
+  using V = typename W::V;
+  const V rgY = ycc_pair<BITS>(ycc_y_r, ycc_y_g / 2), bgY = ycc_pair<BITS>(ycc_y_b, ycc_y_g / 2);
+  ycc_pack<BITS>(ycc_round<16, BITS>(W::add32(W::madd(rg[0], rgY), W::madd(bg[0], bgY))),
+                 ycc_round<16, BITS>(W::add32(W::madd(rg[1], rgY), W::madd(bg[1], bgY))), 128, y);
+}
+
+// the pairs of 8 pixels (or of 2x2 sums with FRACTION 18) => 8 Cb and 8 Cr samples
+template<int FRACTION, int BITS>
+inline void ycc_chroma_int16(const typename YccWords<BITS>::V rg[2], const typename YccWords<BITS>::V bg[2],
+                             int16_t* cb, int16_t* cr)
+{
+  using W = YccWords<BITS>;
+  using V = typename W::V;
+  const V rgCb = ycc_pair<BITS>(ycc_cb_r, ycc_cb_g), bgCr = ycc_pair<BITS>(ycc_cr_b, ycc_cr_g);
+  // the first value of the other pair times 32768
+  auto sum = [](V pair, V coefficients, V other)
+  {
+    return ycc_round<FRACTION, BITS>(W::add32(W::madd(pair, coefficients), W::times32768(other)));
+  };
+  ycc_pack<BITS>(sum(rg[0], rgCb, bg[0]), sum(rg[1], rgCb, bg[1]), 0, cb);
+  ycc_pack<BITS>(sum(bg[0], bgCr, rg[0]), sum(bg[1], bgCr, rg[1]), 0, cr);
+}
+
+// 8 pixels of 16 bit r, g, b => their (R,G) and (B,G) pairs
+inline void ycc_pairs(__m128i r, __m128i g, __m128i b, __m128i rg[2], __m128i bg[2])
+{
+  rg[0] = _mm_unpacklo_epi16(r, g);
+  rg[1] = _mm_unpackhi_epi16(r, g);
+  bg[0] = _mm_unpacklo_epi16(b, g);
+  bg[1] = _mm_unpackhi_epi16(b, g);
+}
+
+template<bool DOWNSAMPLE>
+void rgb_to_ycbcr_mcu_int16(const uint8_t* rgb, ptrdiff_t linesize, YCbCrMcu<int16_t>& mcu)
+{
+  if constexpr (!DOWNSAMPLE)
+  {
+    // the pairs straight from the 24 bytes of a row: pixels 0..3 from the first 16, pixels 4..7 from the last 16
+    const __m128i rgLow  = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1,  9, -1, 10, -1);
+    const __m128i bgLow  = _mm_setr_epi8(2, -1, 1, -1, 5, -1, 4, -1, 8, -1, 7, -1, 11, -1, 10, -1);
+    const __m128i rgHigh = _mm_setr_epi8(4, -1, 5, -1, 7, -1, 8, -1, 10, -1, 11, -1, 13, -1, 14, -1);
+    const __m128i bgHigh = _mm_setr_epi8(6, -1, 5, -1, 9, -1, 8, -1, 12, -1, 11, -1, 15, -1, 14, -1);
+    auto first = [&](int y) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + y * linesize)); };
+    auto last  = [&](int y) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + y * linesize + 8)); };
+#if defined(__AVX2__)
+    // two rows per step, their samples are next to each other in every block
+    const __m256i rgLow2 = ycc_lanes(rgLow, rgLow), bgLow2 = ycc_lanes(bgLow, bgLow);
+    const __m256i rgHigh2 = ycc_lanes(rgHigh, rgHigh), bgHigh2 = ycc_lanes(bgHigh, bgHigh);
+    for (int y = 0; y < 8; y += 2)
+    {
+      const __m256i firsts = ycc_lanes(first(y), first(y + 1)), lasts = ycc_lanes(last(y), last(y + 1));
+      const __m256i rg[2] = { _mm256_shuffle_epi8(firsts, rgLow2), _mm256_shuffle_epi8(lasts, rgHigh2) };
+      const __m256i bg[2] = { _mm256_shuffle_epi8(firsts, bgLow2), _mm256_shuffle_epi8(lasts, bgHigh2) };
+      ycc_luma_int16<256>(rg, bg, mcu.Y[0][y]);
+      ycc_chroma_int16<16, 256>(rg, bg, mcu.Cb[y], mcu.Cr[y]);
+    }
+#else
+    for (int y = 0; y < 8; y++)
+    {
+      const __m128i rg[2] = { _mm_shuffle_epi8(first(y), rgLow), _mm_shuffle_epi8(last(y), rgHigh) };
+      const __m128i bg[2] = { _mm_shuffle_epi8(first(y), bgLow), _mm_shuffle_epi8(last(y), bgHigh) };
+      ycc_luma_int16<128>(rg, bg, mcu.Y[0][y]);
+      ycc_chroma_int16<16, 128>(rg, bg, mcu.Cb[y], mcu.Cr[y]);
+    }
+#endif
+  }
+  else
+  {
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(1);
+    for (int y = 0; y < 16; y += 2)
+    {
+      __m128i red[2], green[2], blue[2];
+      ycc_split_sse<16>(rgb +  y      * linesize, red[0], green[0], blue[0]);
+      ycc_split_sse<16>(rgb + (y + 1) * linesize, red[1], green[1], blue[1]);
+
+      // left and right half of the rows go to two different Y blocks
+      int16_t (&left)[8][8] = mcu.Y[y < 8 ? 0 : 2], (&right)[8][8] = mcu.Y[y < 8 ? 1 : 3];
+      __m128i rg[2][2][2], bg[2][2][2]; // [row][left, right][pixels 0..3, 4..7]
+      for (int row = 0; row < 2; row++)
+      {
+        ycc_pairs(_mm_unpacklo_epi8(red[row], zero), _mm_unpacklo_epi8(green[row], zero),
+                  _mm_unpacklo_epi8(blue[row], zero), rg[row][0], bg[row][0]);
+        ycc_pairs(_mm_unpackhi_epi8(red[row], zero), _mm_unpackhi_epi8(green[row], zero),
+                  _mm_unpackhi_epi8(blue[row], zero), rg[row][1], bg[row][1]);
+      }
+#if defined(__AVX2__)
+      for (int side = 0; side < 2; side++)
+      {
+        const __m256i rgRows[2] = { ycc_lanes(rg[0][side][0], rg[1][side][0]),
+                                    ycc_lanes(rg[0][side][1], rg[1][side][1]) };
+        const __m256i bgRows[2] = { ycc_lanes(bg[0][side][0], bg[1][side][0]),
+                                    ycc_lanes(bg[0][side][1], bg[1][side][1]) };
+        ycc_luma_int16<256>(rgRows, bgRows, (side ? right : left)[y % 8]);
+      }
+#else
+      for (int row = 0; row < 2; row++)
+      {
+        ycc_luma_int16<128>(rg[row][0], bg[row][0], left[y % 8 + row]);
+        ycc_luma_int16<128>(rg[row][1], bg[row][1], right[y % 8 + row]);
+      }
+#endif
+
+      // sums of the 2x2 areas: pmaddubsw adds neighbouring bytes, then the two rows
+      __m128i rgSum[2], bgSum[2];
+      ycc_pairs(_mm_add_epi16(_mm_maddubs_epi16(red[0],   ones), _mm_maddubs_epi16(red[1],   ones)),
+                _mm_add_epi16(_mm_maddubs_epi16(green[0], ones), _mm_maddubs_epi16(green[1], ones)),
+                _mm_add_epi16(_mm_maddubs_epi16(blue[0],  ones), _mm_maddubs_epi16(blue[1],  ones)), rgSum, bgSum);
+      ycc_chroma_int16<18, 128>(rgSum, bgSum, mcu.Cb[y / 2], mcu.Cr[y / 2]); // 4 pixels: 2 more fractional bits
+    }
+  }
+}
+#endif
+
+// an MCU whose pixels are all inside the image: 8x8 (4:4:4) or 16x16 (4:2:0) pixels at rgb
+template<typename Sample, bool DOWNSAMPLE>
+void rgb_to_ycbcr_mcu_interior(const uint8_t* rgb, ptrdiff_t linesize, YCbCrMcu<Sample>& mcu)
+{
+#if defined(__SSSE3__)
+  if constexpr (std::is_same_v<Sample, int16_t>)
+  {
+    rgb_to_ycbcr_mcu_int16<DOWNSAMPLE>(rgb, linesize, mcu);
+    return;
+  }
+#endif
+  if constexpr (!DOWNSAMPLE)
+  {
+    using V = YccLanes<8>::vector;
+    for (int y = 0; y < 8; y++)
+    {
+      V r, g, b;
+      ycc_deinterleave<8>(rgb + y * linesize, r, g, b);
+      ycc_store<Sample, 8>(ycc_y_r  * r + ycc_y_g  * g + ycc_y_b  * b, 16, 128, mcu.Y[0][y], 8);
+      ycc_store<Sample, 8>(ycc_cb_r * r + ycc_cb_g * g + ycc_cb_b * b, 16, 0,   mcu.Cb[y],   8);
+      ycc_store<Sample, 8>(ycc_cr_r * r + ycc_cr_g * g + ycc_cr_b * b, 16, 0,   mcu.Cr[y],   8);
+    }
+  }
+  else
+  {
+    using V = YccLanes<16>::vector;
+    for (int y = 0; y < 16; y += 2)
+    {
+      V r0, g0, b0, r1, g1, b1;
+      ycc_deinterleave<16>(rgb +  y      * linesize, r0, g0, b0);
+      ycc_deinterleave<16>(rgb + (y + 1) * linesize, r1, g1, b1);
+
+      // left and right half of the rows go to two different Y blocks
+      Sample (&left)[8][8] = mcu.Y[y < 8 ? 0 : 2], (&right)[8][8] = mcu.Y[y < 8 ? 1 : 3];
+      Sample luma[16];
+      ycc_store<Sample, 16>(ycc_y_r * r0 + ycc_y_g * g0 + ycc_y_b * b0, 16, 128, luma, 16);
+      std::copy(luma,     luma + 8,  left [y % 8]);
+      std::copy(luma + 8, luma + 16, right[y % 8]);
+      ycc_store<Sample, 16>(ycc_y_r * r1 + ycc_y_g * g1 + ycc_y_b * b1, 16, 128, luma, 16);
+      std::copy(luma,     luma + 8,  left [y % 8 + 1]);
+      std::copy(luma + 8, luma + 16, right[y % 8 + 1]);
+
+      // the same registers give the sums of the 2x2 areas: vertical pairs first, then neighbouring lanes
+      const V r = r0 + r1, g = g0 + g1, b = b0 + b1;
+      const V cb = ycc_cb_r * r + ycc_cb_g * g + ycc_cb_b * b;
+      const V cr = ycc_cr_r * r + ycc_cr_g * g + ycc_cr_b * b;
+      using V8 = YccLanes<8>::vector;
+      const V8 cbSum = __builtin_shufflevector(cb, cb, 0, 2, 4, 6, 8, 10, 12, 14) +
+                       __builtin_shufflevector(cb, cb, 1, 3, 5, 7, 9, 11, 13, 15);
+      const V8 crSum = __builtin_shufflevector(cr, cr, 0, 2, 4, 6, 8, 10, 12, 14) +
+                       __builtin_shufflevector(cr, cr, 1, 3, 5, 7, 9, 11, 13, 15);
+      ycc_store<Sample, 8>(cbSum, 18, 0, mcu.Cb[y / 2], 8); // 4 pixels: 2 more fractional bits
+      ycc_store<Sample, 8>(crSum, 18, 0, mcu.Cr[y / 2], 8);
+    }
+  }
+}
+
+// the MCU with its top left pixel at (x, y) of a width x height image, rows linesize bytes apart;
+// MCUs crossing the right or bottom border replicate the last column / row
+template<typename Sample>
+void rgb_to_ycbcr_mcu(const uint8_t* pixels, ptrdiff_t linesize, int x, int y, int width, int height, bool downsample,
+                      YCbCrMcu<Sample>& mcu)
+{
+  const int mcuSize = downsample ? 16 : 8;
+  const uint8_t* rgb = pixels + y * linesize + x * 3;
+  if (x + mcuSize <= width && y + mcuSize <= height)
+  {
+    if (downsample)
+      rgb_to_ycbcr_mcu_interior<Sample, true>(rgb, linesize, mcu);
+    else
+      rgb_to_ycbcr_mcu_interior<Sample, false>(rgb, linesize, mcu);
+    return;
+  }
+
+  uint8_t edge[16 * 16 * 3];
+  const int maxX = width - 1, maxY = height - 1;
+  for (int row = 0; row < mcuSize; row++)
+  {
+    const uint8_t* line = pixels + std::min(y + row, maxY) * linesize;
+    for (int column = 0; column < mcuSize; column++)
+      std::memcpy(&edge[(row * mcuSize + column) * 3], line + std::min(x + column, maxX) * 3, 3);
+  }
+  if (downsample)
+    rgb_to_ycbcr_mcu_interior<Sample, true>(edge, 16 * 3, mcu);
+  else
+    rgb_to_ycbcr_mcu_interior<Sample, false>(edge, 8 * 3, mcu);
+}
+
+#endif // _COLOR_CONVERT_HPP
@@ -7,7 +7,120 @@
 #include <stdlib.h>
 #include "Matrix.hpp"
 
-void init_dct8x8(DCTMatrixT& dct_matrix, DCTMatrixT& matrix);
+// naive O(N^4) DCT of one 8x8 block of level shifted samples and its inverse, cos() in the innermost loop:
+// the reference for the fast transforms, nothing else should call them.
+// dct_matrix holds the coefficients as JPEG defines them (F(u,v) = 1/4 C(u) C(v) sum f(x,y) cos cos, C(0) = 1/sqrt(2)),
+// _DCTImpl's output is the same times 8 * aan(u) * aan(v), see _IDCTImpl
+void init_dct8x8(ImageMatY8x8& matrix, DCTMatrixF8x8& dct_matrix);
+void idct(ImageMatY8x8& matrix, DCTMatrixF8x8& dct_matrix);
+
+// convert from RGB to YCbCr, constants are similar to ITU-R, see https://en.wikipedia.org/wiki/YCbCr#JPEG_conversion
+inline float rgb2y (float r, float g, float b) { return +0.299f   * r +0.587f   * g +0.114f   * b; }
+inline float rgb2cb(float r, float g, float b) { return -0.16874f * r -0.33126f * g +0.5f     * b; }
+inline float rgb2cr(float r, float g, float b) { return +0.5f     * r -0.41869f * g -0.08131f * b; }
+
+// scale factors of the AAN transforms: _DCTImpl on rows and columns gives F(u,v) * 8 * aan(u) * aan(v), _IDCTImpl
+// expects its input scaled the same way; aan(0) = 1, aan(k) = cos(k * pi / 16) * sqrt(2)
+inline constexpr float AanScaleFactors[8] = { 1, 1.387039845f, 1.306562965f, 1.175875602f, 1, 0.785694958f, 0.541196100f, 0.275899379f };
+
+// 8 * aan(u) * aan(v) of the coefficient at natural (row-major) index u * 8 + v
+constexpr float aan_scale(int index)
+{
+  return AanScaleFactors[index / 8] * AanScaleFactors[index % 8] * 8;
+}
+
+// forward DCT computation "in one dimension" (fast AAN algorithm by Arai, Agui and Nakajima: "A fast DCT-SQ scheme for images")
+template<typename T>
+void _DCTImpl(T&& block0 ,
+             T&&  block1 ,
+             T&&  block2 ,
+             T&&  block3 ,
+             T&&  block4 ,
+             T&&  block5 ,
+             T&&  block6 ,
+             T&&  block7  ) 
+{ 
+  const auto SqrtHalfSqrt = 1.306562965f; //    sqrt((2 + sqrt(2)) / 2) = cos(pi * 1 / 8) * sqrt(2)
+  const auto InvSqrt      = 0.707106781f; // 1 / sqrt(2)                = cos(pi * 2 / 8)
+  const auto HalfSqrtSqrt = 0.382683432f; //     sqrt(2 - sqrt(2)) / 2  = cos(pi * 3 / 8)
+  const auto InvSqrtSqrt  = 0.541196100f; // 1 / sqrt(2 - sqrt(2))      = cos(pi * 3 / 8) * sqrt(2)
+
+  // based on https://dev.w3.org/Amaya/libjpeg/jfdctflt.c , the original variable names can be found in my comments
+  auto add07 = block0 + block7; auto sub07 = block0 - block7; // tmp0, tmp7
+  auto add16 = block1 + block6; auto sub16 = block1 - block6; // tmp1, tmp6
+  auto add25 = block2 + block5; auto sub25 = block2 - block5; // tmp2, tmp5
+  auto add34 = block3 + block4; auto sub34 = block3 - block4; // tmp3, tmp4
+
+  auto add0347 = add07 + add34; auto sub07_34 = add07 - add34; // tmp10, tmp13 ("even part" / "phase 2")
+  auto add1256 = add16 + add25; auto sub16_25 = add16 - add25; // tmp11, tmp12
+
+  block0 = add0347 + add1256; block4 = add0347 - add1256; // "phase 3"
+
+  auto z1 = (sub16_25 + sub07_34) * InvSqrt; // all temporary z-variables kept their original names
+  block2 = sub07_34 + z1; block6 = sub07_34 - z1; // "phase 5"
+
+  auto sub23_45 = sub25 + sub34; // tmp10 ("odd part" / "phase 2")
+  auto sub12_56 = sub16 + sub25; // tmp11
+  auto sub01_67 = sub16 + sub07; // tmp12
+
+  auto z5 = (sub23_45 - sub01_67) * HalfSqrtSqrt;
+  auto z2 = sub23_45 * InvSqrtSqrt  + z5;
+  auto z3 = sub12_56 * InvSqrt;
+  auto z4 = sub01_67 * SqrtHalfSqrt + z5;
+  auto z6 = sub07 + z3; // z11 ("phase 5")
+  auto z7 = sub07 - z3; // z13
+  block1 = z6 + z4; block7 = z6 - z4; // "phase 6"
+  block5 = z7 + z2; block3 = z7 - z2;
+}
+
+// inverse DCT computation "in one dimension", the AAN butterfly run backwards
+// (based on https://dev.w3.org/Amaya/libjpeg/jidctflt.c , its variable names are in my comments).
+// The input carries the AAN scale factors exactly like the output of _DCTImpl, so rows and columns of
+// _IDCTImpl applied to the rows and columns of _DCTImpl give the original block times 64.
+// To start from coefficients F(u,v) as JPEG defines them (e.g. dequantized ones) they are multiplied by
+// 8 * aan(u) * aan(v) first, aan(0) = 1, aan(k) = cos(k * pi / 16) * sqrt(2).
+template<typename T>
+void _IDCTImpl(T&& block0 ,
+              T&&  block1 ,
+              T&&  block2 ,
+              T&&  block3 ,
+              T&&  block4 ,
+              T&&  block5 ,
+              T&&  block6 ,
+              T&&  block7  )
+{
+  const auto Sqrt2        = 1.414213562f; // 2 * cos(pi * 2 / 8)
+  const auto TwoCos1      = 1.847759065f; // 2 * cos(pi * 1 / 8)
+  const auto TwoCos1Cos3  = 1.082392200f; // 2 * (cos(pi * 1 / 8) - cos(pi * 3 / 8))
+  const auto TwoCos1Cos3N = 2.613125930f; // 2 * (cos(pi * 1 / 8) + cos(pi * 3 / 8))
+
+  // "even part"
+  auto add04 = block0 + block4; auto sub04 = block0 - block4; // tmp10, tmp11
+  auto add26 = block2 + block6;                                // tmp13
+  auto sub26 = (block2 - block6) * Sqrt2 - add26;              // tmp12
+
+  auto even0 = add04 + add26; auto even3 = add04 - add26; // tmp0, tmp3
+  auto even1 = sub04 + sub26; auto even2 = sub04 - sub26; // tmp1, tmp2
+
+  // "odd part", all temporary z-variables kept their original names
+  auto z13 = block5 + block3; auto z10 = block5 - block3;
+  auto z11 = block1 + block7; auto z12 = block1 - block7;
+
+  auto odd7  = z11 + z13;                      // tmp7
+  auto odd11 = (z11 - z13) * Sqrt2;            // tmp11
+  auto z5    = (z10 + z12) * TwoCos1;
+  auto odd10 = z12 * TwoCos1Cos3  - z5;        // tmp10
+  auto odd12 = z5  - z10 * TwoCos1Cos3N;       // tmp12
+
+  auto odd6 = odd12 - odd7;  // tmp6
+  auto odd5 = odd11 - odd6;  // tmp5
+  auto odd4 = odd10 + odd5;  // tmp4
+
+  block0 = even0 + odd7; block7 = even0 - odd7;
+  block1 = even1 + odd6; block6 = even1 - odd6;
+  block2 = even2 + odd5; block5 = even2 - odd5;
+  block4 = even3 + odd4; block3 = even3 - odd4;
+}
 
 
 #endif
@@ -0,0 +1,218 @@
+#ifndef _DCT_BATCH_HPP
+#define _DCT_BATCH_HPP
+
+#include <cstddef>
+#include <cstring>
+#include "dct.hpp"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Batched forward DCT: runs the same AAN butterfly as _DCTImpl, but on LANES blocks at once
+// (and the inverse with _IDCTImpl).
+// The blocks are transposed into "one vector per coefficient" (lane b holds block b), so every
+// +,-,* of _DCTImpl becomes one SIMD instruction covering LANES blocks.
+// LANES == 1 is the scalar fallback; since every lane executes the very same float operations in
+// the very same order, all widths produce identical output (as long as the compiler is not allowed
+// to contract a*b+c into FMAs differently for the scalar and the vector code, see -ffp-contract).
+
+template<size_t LANES>
+struct DctLaneType
+{
+    // note: must be a typedef, GCC drops a dependent vector_size on alias declarations
+    typedef float  vector __attribute__((vector_size(LANES * sizeof(float))));
+    typedef vector type   __attribute__((__may_alias__)); // filled through float* by the SIMD transposes
+};
+
+template<>
+struct DctLaneType<1>
+{
+    using type = float;
+};
+
+template<size_t LANES>
+class DCTBatch
+{
+public:
+    static constexpr size_t lanes = LANES;
+    using lane_t = typename DctLaneType<LANES>::type;
+
+    // transform LANES consecutive 8x8 blocks (row-major float[64] each) in place
+    static void forward(float* blocks)
+    {
+        alignas(64) lane_t coeffs[64];
+        transpose_in(blocks, coeffs);
+
+        // DCT: rows
+        for (auto row = 0; row < 8; row++)
+        {
+            lane_t* r = &coeffs[row * 8];
+            _DCTImpl(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+        }
+        // DCT: columns
+        for (auto col = 0; col < 8; col++)
+        {
+            lane_t* c = &coeffs[col];
+            _DCTImpl(c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56]);
+        }
+
+        transpose_out(coeffs, blocks);
+    }
+
+    // inverse of forward(): LANES blocks of coefficients with the AAN scale factors => samples, in place
+    static void inverse(float* blocks)
+    {
+        alignas(64) lane_t coeffs[64];
+        transpose_in(blocks, coeffs);
+
+        // IDCT: columns
+        for (auto col = 0; col < 8; col++)
+        {
+            lane_t* c = &coeffs[col];
+            _IDCTImpl(c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56]);
+        }
+        // IDCT: rows, both passes together have a gain of 64
+        for (auto row = 0; row < 8; row++)
+        {
+            lane_t* r = &coeffs[row * 8];
+            _IDCTImpl(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+            for (auto col = 0; col < 8; col++)
+                r[col] = r[col] * (1.f / 64);
+        }
+
+        transpose_out(coeffs, blocks);
+    }
+
+private:
+#if defined(__AVX2__) || defined(__AVX512F__)
+    // classic 8x8 float transpose: rows[i] holds 8 values, afterwards rows[j] holds the j-th value of all 8 inputs
+    static inline void transpose8x8(__m256 rows[8])
+    {
+        __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+        __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+        __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+        __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+        __m256 t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+        __m256 t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+        __m256 t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+        __m256 t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+
+        __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+        rows[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+        rows[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+        rows[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+        rows[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+        rows[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+        rows[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+        rows[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+        rows[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+    }
+#endif
+
+    // blocks[b*64 + k] => coeffs[k][b]
+    static inline void transpose_in(const float* blocks, lane_t* coeffs)
+    {
+        if constexpr (LANES == 1)
+        {
+            std::memcpy(coeffs, blocks, 64 * sizeof(float));
+        }
+#if defined(__AVX2__) || defined(__AVX512F__)
+        else if constexpr (LANES % 8 == 0)
+        {
+            float* out = reinterpret_cast<float*>(coeffs);
+            // each group of 8 blocks fills one 256 bit half (or quarter ...) of the lane vectors
+            for (size_t group = 0; group < LANES; group += 8)
+                for (size_t k = 0; k < 64; k += 8)
+                {
+                    __m256 rows[8];
+                    for (size_t b = 0; b < 8; b++)
+                        rows[b] = _mm256_loadu_ps(blocks + (group + b) * 64 + k);
+                    transpose8x8(rows);
+                    for (size_t j = 0; j < 8; j++)
+                        _mm256_store_ps(out + (k + j) * LANES + group, rows[j]);
+                }
+        }
+#endif
+        else
+        {
+            for (size_t k = 0; k < 64; k++)
+                for (size_t b = 0; b < LANES; b++)
+                    coeffs[k][b] = blocks[b * 64 + k];
+        }
+    }
+
+    // coeffs[k][b] => blocks[b*64 + k]
+    static inline void transpose_out(const lane_t* coeffs, float* blocks)
+    {
+        if constexpr (LANES == 1)
+        {
+            std::memcpy(blocks, coeffs, 64 * sizeof(float));
+        }
+#if defined(__AVX2__) || defined(__AVX512F__)
+        else if constexpr (LANES % 8 == 0)
+        {
+            const float* in = reinterpret_cast<const float*>(coeffs);
+            for (size_t group = 0; group < LANES; group += 8)
+                for (size_t k = 0; k < 64; k += 8)
+                {
+                    __m256 rows[8];
+                    for (size_t j = 0; j < 8; j++)
+                        rows[j] = _mm256_load_ps(in + (k + j) * LANES + group);
+                    transpose8x8(rows);
+                    for (size_t b = 0; b < 8; b++)
+                        _mm256_storeu_ps(blocks + (group + b) * 64 + k, rows[b]);
+                }
+        }
+#endif
+        else
+        {
+            for (size_t k = 0; k < 64; k++)
+                for (size_t b = 0; b < LANES; b++)
+                    blocks[b * 64 + k] = coeffs[k][b];
+        }
+    }
+};
+
+// widest batch supported by the instruction set we are compiled for
+#if defined(__AVX512F__)
+using DCTBatchNative = DCTBatch<16>;
+#elif defined(__AVX2__)
+using DCTBatchNative = DCTBatch<8>;
+#else
+using DCTBatchNative = DCTBatch<1>;
+#endif
+using DCTBatchScalar = DCTBatch<1>;
+
+// transform an arbitrary number of consecutive 8x8 blocks in place:
+// full batches go through the SIMD kernel, the remainder through the scalar fallback
+template<typename Batch = DCTBatchNative>
+void dct_forward_blocks(float* blocks, size_t num_blocks)
+{
+    size_t i = 0;
+    for (; i + Batch::lanes <= num_blocks; i += Batch::lanes)
+        Batch::forward(blocks + i * 64);
+    for (; i < num_blocks; i++)
+        DCTBatchScalar::forward(blocks + i * 64);
+}
+
+// inverse transform of consecutive blocks in place, e.g. the output of dct_forward_blocks()
+template<typename Batch = DCTBatchNative>
+void dct_inverse_blocks(float* blocks, size_t num_blocks)
+{
+    size_t i = 0;
+    for (; i + Batch::lanes <= num_blocks; i += Batch::lanes)
+        Batch::inverse(blocks + i * 64);
+    for (; i < num_blocks; i++)
+        DCTBatchScalar::inverse(blocks + i * 64);
+}
+
+#endif // _DCT_BATCH_HPP
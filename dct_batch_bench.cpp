@@ -0,0 +1,140 @@
+// throughput benchmark: batched AAN DCT (dct_batch.hpp) vs. the per-block _DCTImpl template,
+// plus the batched inverse and its round trip error, and the decoder's fast path against the naive idct()
+//   usage: dct_batch_bench [num_blocks] [iterations]
+
+#include "coefficient_plane.hpp"
+#include "dct_batch.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// what run_dct_RGB does for a single block: 8 row passes, then 8 column passes
+static void dct_reference(float* block)
+{
+    for (auto row = 0; row < 8; row++)
+        _DCTImpl(block[row*8 + 0], block[row*8 + 1], block[row*8 + 2], block[row*8 + 3],
+                 block[row*8 + 4], block[row*8 + 5], block[row*8 + 6], block[row*8 + 7]);
+    for (auto col = 0; col < 8; col++)
+        _DCTImpl(block[0*8 + col], block[1*8 + col], block[2*8 + col], block[3*8 + col],
+                 block[4*8 + col], block[5*8 + col], block[6*8 + col], block[7*8 + col]);
+}
+
+// coefficients_to_plane() (dequantization, batched AAN inverse, level shift and rounding) vs. the naive idct()
+// of dct.cpp on the same quantized blocks of a width x height plane: the number of samples that differ
+static size_t idct_oracle_mismatches(int width, int height)
+{
+    // a gradient with pseudo-random noise, quality 75
+    std::vector<uint8_t> samples(size_t(width) * height);
+    uint32_t seed = 4711;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            samples[y * width + x] = uint8_t(std::clamp(x * 5 + y * 3 + int(seed >> 27) - 16, 0, 255));
+        }
+    uint8_t quant[8*8], quant_chroma[8*8];
+    jpegQuantTables(75, quant, quant_chroma);
+    CoefficientPlane plane;
+    plane_to_coefficients(samples.data(), width, width, height, SampleLevels::luma(true), QuantizeTable(quant),
+                          CoefficientOrder::ZigZag, plane);
+
+    std::vector<uint8_t> decoded(samples.size());
+    coefficients_to_plane(plane, DequantTable(quant), decoded.data(), width);
+
+    size_t mismatches = 0;
+    for (int blockY = 0; blockY < plane.blocks_y(); blockY++)
+        for (int blockX = 0; blockX < plane.blocks_x(); blockX++)
+        {
+            // F(u,v) = quantized value * step, as JPEG defines the coefficients
+            DCTMatrixF8x8 coefficients;
+            ImageMatY8x8  block;
+            for (auto i = 0; i < 8*8; i++)
+                coefficients(ZigZagInv[i] / 8, ZigZagInv[i] % 8) = float(plane.block(blockX, blockY)[i]) * quant[i];
+            idct(block, coefficients);
+            for (int y = 0; y < 8 && blockY * 8 + y < height; y++)
+                for (int x = 0; x < 8 && blockX * 8 + x < width; x++)
+                {
+                    const auto expected = uint8_t(std::clamp(block(y, x) + 128.5f, 0.f, 255.f));
+                    mismatches += decoded[(blockY * 8 + y) * width + blockX * 8 + x] != expected;
+                }
+        }
+    return mismatches;
+}
+
+template<typename Func>
+static double time_ns_per_block(const std::vector<float>& input, std::vector<float>& work,
+                                size_t num_blocks, int iterations, Func&& func)
+{
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++)
+    {
+        work = input;
+        auto start = std::chrono::steady_clock::now();
+        func(work.data(), num_blocks);
+        auto stop = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count() / num_blocks;
+        if (ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    size_t num_blocks = argc > 1 ? strtoul(argv[1], nullptr, 10) : 32400; // one 1080p luma plane
+    int iterations    = argc > 2 ? atoi(argv[2]) : 50;
+
+    // deterministic pseudo-random level-shifted pixels
+    std::vector<float> input(num_blocks * 64);
+    uint32_t seed = 12345;
+    for (auto& v : input)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        v = float(seed >> 24) - 128.f;
+    }
+
+    std::vector<float> work, reference, batched;
+
+    double ns_ref = time_ns_per_block(input, work, num_blocks, iterations,
+        [](float* blocks, size_t n) { for (size_t i = 0; i < n; i++) dct_reference(blocks + i*64); });
+    reference = work;
+
+    double ns_scalar = time_ns_per_block(input, work, num_blocks, iterations,
+        [](float* blocks, size_t n) { dct_forward_blocks<DCTBatchScalar>(blocks, n); });
+    double max_diff_scalar = 0;
+    for (size_t i = 0; i < work.size(); i++)
+        max_diff_scalar = std::max<double>(max_diff_scalar, fabs(work[i] - reference[i]));
+
+    double ns_native = time_ns_per_block(input, work, num_blocks, iterations,
+        [](float* blocks, size_t n) { dct_forward_blocks<DCTBatchNative>(blocks, n); });
+    batched = work;
+    double max_diff_native = 0;
+    for (size_t i = 0; i < batched.size(); i++)
+        max_diff_native = std::max<double>(max_diff_native, fabs(batched[i] - reference[i]));
+
+    // inverse of the batched output, should give the input back up to float rounding
+    std::vector<float> roundtrip;
+    double ns_inverse = time_ns_per_block(batched, roundtrip, num_blocks, iterations,
+        [](float* blocks, size_t n) { dct_inverse_blocks<DCTBatchNative>(blocks, n); });
+    double max_diff_inverse = 0;
+    for (size_t i = 0; i < roundtrip.size(); i++)
+        max_diff_inverse = std::max<double>(max_diff_inverse, fabs(roundtrip[i] - input[i]));
+
+    // a plane with partial border blocks on both sides
+    const size_t oracle_mismatches = idct_oracle_mismatches(37, 21);
+
+    std::cout << "blocks:            " << num_blocks << "\n"
+              << "batch lanes:       " << DCTBatchNative::lanes << "\n"
+              << "_DCTImpl:          " << ns_ref    << " ns/block\n"
+              << "DCTBatch<1>:       " << ns_scalar << " ns/block (max diff " << max_diff_scalar << ")\n"
+              << "DCTBatch<" << DCTBatchNative::lanes << ">:       "
+              << ns_native << " ns/block (max diff " << max_diff_native << ")\n"
+              << "speedup:           " << ns_ref / ns_native << "x\n"
+              << "inverse:           " << ns_inverse << " ns/block (max round trip error " << max_diff_inverse << ")\n"
+              << "37x21 plane:       " << oracle_mismatches << " samples differ from the naive idct()"
+              << std::endl;
+
+    return (max_diff_scalar == 0 && max_diff_native == 0 && max_diff_inverse < 0.01 && oracle_mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,741 @@
+// microbenchmarks of the encoder kernels on fixed synthetic input, the results are printed as one JSON object
+// (diff the output of two commits built on the same host)
+//   usage: dct_bench [num_blocks] [iterations]
+// every kernel reports the best of its iterations:
+//   ns_per_block      nanoseconds per 8x8 block (64 pixels) of input
+//   mb_per_s          megabytes per second, bytes_per_block counts the 8 bit input pixels (RGB: 3 bytes per pixel),
+//                     for the bit writer the output bytes
+//   cycles_per_pixel  Tracer::now() ticks per pixel: TSC cycles on x86 (constant rate, not core cycles), else ns
+// generateHuffmanTable does not work on pixels, it is reported per call (ns_per_call) only
+// "checks" lists the accuracy checks, the exit status is 1 if one of them failed
+
+#include "coef_archive.hpp"
+#include "coefficient_plane.hpp"
+#include "dct_batch.hpp"
+#include "dct_scale.hpp"
+#include "tiled_image.hpp"
+#include "write_jpeg.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static volatile double sink; // results are added up here, so the compiler cannot drop the kernels
+
+struct Timing
+{
+    double ns    = 1e30;
+    double ticks = 1e30;
+};
+
+// best wall time and ticks of func() over iterations runs, setup() runs untimed before each one
+template<typename Setup, typename Func>
+static Timing measure(int iterations, Setup&& setup, Func&& func)
+{
+    Timing best;
+    for (int it = 0; it < iterations; it++)
+    {
+        setup();
+        auto     start       = std::chrono::steady_clock::now();
+        uint64_t start_ticks = Tracer::now();
+        func();
+        uint64_t stop_ticks = Tracer::now();
+        auto     stop       = std::chrono::steady_clock::now();
+        best.ns    = std::min(best.ns, std::chrono::duration<double, std::nano>(stop - start).count());
+        best.ticks = std::min(best.ticks, double(stop_ticks - start_ticks));
+    }
+    return best;
+}
+
+static std::string json_results;
+
+static void report(const char* name, const Timing& timing, size_t blocks, size_t bytes_per_block)
+{
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s    {\"name\": \"%s\", \"blocks\": %zu, \"bytes_per_block\": %zu, \"ns_per_block\": %.3f, "
+             "\"mb_per_s\": %.3f, \"cycles_per_pixel\": %.4f}",
+             json_results.empty() ? "" : ",\n", name, blocks, bytes_per_block, timing.ns / blocks,
+             blocks * bytes_per_block / 1e6 / (timing.ns * 1e-9), timing.ticks / (blocks * 64.));
+    json_results += line;
+}
+
+static void report_call(const char* name, const Timing& timing, size_t calls)
+{
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s    {\"name\": \"%s\", \"calls\": %zu, \"ns_per_call\": %.3f, \"ns_per_block\": null, "
+             "\"mb_per_s\": null, \"cycles_per_pixel\": null}",
+             json_results.empty() ? "" : ",\n", name, calls, timing.ns / calls);
+    json_results += line;
+}
+
+// _DCTImpl as encodeBlock uses it: 8 row passes, then 8 column passes
+static void dct_aan(float* block)
+{
+    for (auto row = 0; row < 8; row++)
+        _DCTImpl(block[row*8 + 0], block[row*8 + 1], block[row*8 + 2], block[row*8 + 3],
+                 block[row*8 + 4], block[row*8 + 5], block[row*8 + 6], block[row*8 + 7]);
+    for (auto col = 0; col < 8; col++)
+        _DCTImpl(block[0*8 + col], block[1*8 + col], block[2*8 + col], block[3*8 + col],
+                 block[4*8 + col], block[5*8 + col], block[6*8 + col], block[7*8 + col]);
+}
+
+// test picture of the accuracy checks: full range planar YCbCr 4:4:4 with gradients, waves of several frequencies,
+// sharp edged rectangles and a little noise, so that every quality has detail to quantize away
+struct TestPicture
+{
+    int width  = 256;
+    int height = 256;
+    std::vector<uint8_t> planes[3];
+
+    TestPicture()
+    {
+        uint32_t seed = 4711;
+        for (int plane = 0; plane < 3; plane++)
+        {
+            planes[plane].resize(size_t(width) * height);
+            for (int y = 0; y < height; y++)
+                for (int x = 0; x < width; x++)
+                {
+                    seed = seed * 1664525u + 1013904223u;
+                    double value = plane == 0 ? 40 + 0.6 * x : 128 + (plane == 1 ? 0.2 : -0.2) * (y - 128);
+                    value += (plane == 0 ? 30 : 15) * std::sin(x * 0.05 * (1 + plane)) * std::cos(y * 0.11);
+                    value += 12 * std::sin((x + 2 * y) * 0.9);
+                    if ((x / 48 + y / 40) % 3 == 0)
+                        value += plane == 0 ? 50 : 25;
+                    value += int(seed >> 29) - 4;
+                    planes[plane][size_t(y) * width + x] = uint8_t(std::clamp(value, 0., 255.));
+                }
+        }
+    }
+
+    PlanarYCbCr view() const
+    {
+        return PlanarYCbCr{ { planes[0].data(), planes[1].data(), planes[2].data() }, { width, width, width }, 0, 0, true };
+    }
+};
+
+// PSNR in dB (all three planes) of picture encoded by the encoder's DCT and quantization with Sample
+// (float: DctMethod::Float, int16_t: DctMethod::Int16) at quality, decoded with the float inverse DCT
+template<typename Sample>
+static double encode_decode_psnr(const TestPicture& picture, int quality)
+{
+    const int width  = picture.width;
+    const int height = picture.height;
+    const JpegEncoderContext context(width, height, true, quality, false);
+    JPEGWriter::QuantizedBlocks blocks;
+    JPEGWriter::encodeMcuRowsYCbCr<Sample>(blocks, context.tables(), picture.view(), width, height, false,
+                                           0, coefficient_blocks(height));
+
+    uint8_t quant[2][8*8];
+    jpegQuantTables(quality, quant[0], quant[1]);
+    std::vector<uint8_t> decoded(size_t(width) * height);
+    double squared = 0;
+    for (int plane = 0; plane < 3; plane++)
+    {
+        // 4:4:4 coding order: the Y, Cb and Cr block of each MCU
+        CoefficientPlane coefficients;
+        coefficients.resize(width, height, CoefficientOrder::ZigZag);
+        for (size_t block = 0; block < coefficients.block_count(); block++)
+            std::memcpy(&coefficients.coefficients[block * 64], &blocks.coefficients[(block * 3 + plane) * 64],
+                        64 * sizeof(int16_t));
+        coefficients_to_plane(coefficients, DequantTable(quant[plane ? 1 : 0]), decoded.data(), width);
+        for (size_t i = 0; i < decoded.size(); i++)
+        {
+            const double error = double(decoded[i]) - picture.planes[plane][i];
+            squared += error * error;
+        }
+    }
+    return 10 * std::log10(255. * 255. / std::max(squared / (3. * width * height), 1e-10));
+}
+
+// the record of coefficients as read back by CoefArchiveReader: header fields and every plane
+static bool same_record(const CoefFrameView& view, const CoefficientFrame& coefficients, int64_t index, int64_t pts)
+{
+    bool same = view.header->index == index && view.header->pts == pts &&
+                view.header->chroma_shift_x == coefficients.chromaShiftX &&
+                view.header->chroma_shift_y == coefficients.chromaShiftY;
+    for (int plane = 0; plane < 3; plane++)
+    {
+        CoefficientPlane expanded;
+        view.plane(plane).expand(expanded);
+        const CoefficientPlane& original = coefficients.planes[plane];
+        same = same && expanded.width == original.width && expanded.height == original.height &&
+               expanded.order == original.order && expanded.coefficients == original.coefficients;
+    }
+    return same;
+}
+
+// CoefArchiveWriter => CoefArchiveReader with the blocks of real JPEGs (4:2:0 zigzag, 4:4:4 natural order):
+// the complete file (read through the index), the file of a killed writer (no index, a partial last record,
+// read by walking the records) and the same file reopened for appending
+static bool coef_archive_roundtrip(const TestPicture& picture, CoefCompression compression)
+{
+    CoefficientFrame frames[2];
+    for (int i = 0; i < 2; i++)
+    {
+        const JpegEncoderContext context(picture.width, picture.height, true, 75, i == 0);
+        JPEGWriter encoder(0);
+        encoder.setCoefficientOutput(&frames[i], i == 0 ? CoefficientOrder::ZigZag : CoefficientOrder::Natural);
+        encoder.writeJpegYCbCr(context, picture.view());
+    }
+    uint8_t quant[2][8*8];
+    jpegQuantTables(75, quant[0], quant[1]);
+    std::vector<uint8_t> record;
+    auto append = [&](CoefArchiveWriter& writer, int64_t index)
+    {
+        CoefArchiveWriter::build_record(record, frames[index & 1], quant[0], quant[1], true, 1000 + index, 'P',
+                                        compression);
+        return writer.append(record, index);
+    };
+    auto read = [&](const char* path, size_t count)
+    {
+        CoefArchiveReader reader;
+        bool ok = reader.open(path) && reader.size() == count;
+        for (size_t i = 0; ok && i < count; i++)
+            ok = same_record(reader.frame(i), frames[i & 1], int64_t(i), 1000 + int64_t(i));
+        return ok;
+    };
+
+    char path[] = "/tmp/dct_bench_coef_XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    ::close(fd);
+    CoefArchiveWriter writer;
+    bool ok = writer.open(path) && append(writer, 0) && append(writer, 1) && append(writer, 2) && writer.close() &&
+              read(path, 3);
+
+    // without the index (3 offsets and the trailer) and the last 64 bytes of the third record
+    struct stat st;
+    ok = ok && stat(path, &st) == 0 && truncate(path, st.st_size - 3 * sizeof(uint64_t) - sizeof(CoefIndexTrailer) - 64) == 0 &&
+         read(path, 2);
+    // the partial record is cut off, the index is written again
+    ok = ok && writer.open(path) && writer.frames() == 2 && append(writer, 2) && append(writer, 3) && writer.close() &&
+         read(path, 4);
+    unlink(path);
+    return ok;
+}
+
+// frame_to_coefficients() of a 250 x 138 crop (odd chroma sizes at 4:2:0, no padding blocks) against the blocks
+// the float encoder keeps with setCoefficientOutput(), and writeJpegCoefficients() of its frame against that JPEG
+static void frame_to_coefficients_check(const TestPicture& picture, bool chroma420, bool fullRange, ThreadPool& pool,
+                                        bool& same_blocks, bool& same_jpeg)
+{
+    const int width = 250, height = 138, shift = chroma420 ? 1 : 0;
+    const int chromaWidth = (width + shift) >> shift, chromaHeight = (height + shift) >> shift;
+    std::vector<uint8_t> chroma[2];
+    for (int plane = 0; plane < 2 && chroma420; plane++)
+    {
+        const std::vector<uint8_t>& full = picture.planes[plane + 1];
+        chroma[plane].resize(size_t(chromaWidth) * chromaHeight);
+        for (int y = 0; y < chromaHeight; y++)
+            for (int x = 0; x < chromaWidth; x++)
+            {
+                const size_t i = size_t(2 * y) * picture.width + 2 * x;
+                chroma[plane][size_t(y) * chromaWidth + x] =
+                    uint8_t((full[i] + full[i + 1] + full[i + picture.width] + full[i + picture.width + 1] + 2) / 4);
+            }
+    }
+    PlanarYCbCr image = picture.view();
+    image.fullRange = fullRange;
+    if (chroma420)
+        image = PlanarYCbCr{ { picture.planes[0].data(), chroma[0].data(), chroma[1].data() },
+                             { picture.width, chromaWidth, chromaWidth }, 1, 1, fullRange };
+
+    const JpegEncoderContext context(width, height, true, 75, chroma420);
+    CoefficientFrame encoded, transformed;
+    JPEGWriter encoder(0), recoder(0);
+    encoder.setCoefficientOutput(&encoded);
+    encoder.writeJpegYCbCr(context, image);
+
+    uint8_t quant[2][8*8];
+    jpegQuantTables(75, quant[0], quant[1]);
+    frame_to_coefficients(image, width, height, QuantizeTable(quant[0]), QuantizeTable(quant[1]),
+                          CoefficientOrder::ZigZag, transformed, &pool);
+    same_blocks = transformed.chromaShiftX == encoded.chromaShiftX && transformed.chromaShiftY == encoded.chromaShiftY;
+    for (int plane = 0; plane < 3; plane++)
+        same_blocks = same_blocks && transformed.planes[plane].width == encoded.planes[plane].width &&
+                      transformed.planes[plane].height == encoded.planes[plane].height &&
+                      transformed.planes[plane].coefficients == encoded.planes[plane].coefficients;
+    same_jpeg = recoder.writeJpegCoefficients(context, transformed) && recoder.m_byte_stream == encoder.m_byte_stream;
+}
+
+int main(int argc, char** argv)
+{
+    size_t num_blocks = argc > 1 ? strtoul(argv[1], nullptr, 10) : 32400; // one 1080p luma plane
+    int iterations    = argc > 2 ? atoi(argv[2]) : 20;
+    num_blocks = std::max<size_t>(num_blocks, 1);
+    iterations = std::max(iterations, 1);
+
+    // deterministic pseudo-random input, the same for every run: packed RGB of an 8 pixel high strip
+    // of num_blocks blocks and level shifted float samples
+    const int width  = int(8 * num_blocks);
+    const int height = 8;
+    std::vector<uint8_t> rgb(size_t(width) * height * 3);
+    std::vector<float>   samples(num_blocks * 64);
+    uint32_t seed = 12345;
+    auto next = [&]() { seed = seed * 1664525u + 1013904223u; return seed; };
+    for (auto& v : rgb)
+        v = uint8_t(next() >> 24);
+    for (auto& v : samples)
+        v = float(next() >> 24) - 128.f;
+
+    // the encoder's tables for quality 90, 4:2:0
+    JpegEncoderContext context(1920, 1080, true, 90, true);
+    const auto& tables = context.tables();
+
+    std::vector<float> work;
+    auto copy_samples = [&] { work = samples; };
+
+    // forward DCT, float AAN
+    Timing t = measure(iterations, copy_samples, [&]
+    {
+        for (size_t b = 0; b < num_blocks; b++)
+            dct_aan(&work[b * 64]);
+    });
+    sink = sink + work[1];
+    report("dct_aan_float", t, num_blocks, 64);
+
+    // the naive transforms compute 2 cos() per term, a few blocks are enough
+    const size_t naive_blocks = std::max<size_t>(num_blocks / 256, 1);
+    std::vector<ImageMatY8x8>  pixel_blocks(naive_blocks);
+    std::vector<DCTMatrixF8x8> coefficient_blocks(naive_blocks);
+    for (size_t b = 0; b < naive_blocks; b++)
+        for (int k = 0; k < 64; k++)
+            pixel_blocks[b](k / 8, k % 8) = samples[b * 64 + k];
+    t = measure(std::min(iterations, 3), [] {}, [&]
+    {
+        for (size_t b = 0; b < naive_blocks; b++)
+            init_dct8x8(pixel_blocks[b], coefficient_blocks[b]);
+    });
+    sink = sink + coefficient_blocks[0](0, 1);
+    report("dct_naive", t, naive_blocks, 64);
+
+    t = measure(std::min(iterations, 3), [] {}, [&]
+    {
+        for (size_t b = 0; b < naive_blocks; b++)
+            idct(pixel_blocks[b], coefficient_blocks[b]);
+    });
+    sink = sink + pixel_blocks[0](0, 1);
+    report("idct_naive", t, naive_blocks, 64);
+
+    // inverse DCT of the forward transformed samples: _IDCTImpl per block and batched
+    std::vector<float> transformed = samples;
+    dct_forward_blocks(transformed.data(), num_blocks);
+    auto copy_transformed = [&] { work = transformed; };
+    t = measure(iterations, copy_transformed, [&]
+    {
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            float* block = &work[b * 64];
+            for (auto col = 0; col < 8; col++)
+                _IDCTImpl(block[0*8 + col], block[1*8 + col], block[2*8 + col], block[3*8 + col],
+                          block[4*8 + col], block[5*8 + col], block[6*8 + col], block[7*8 + col]);
+            for (auto row = 0; row < 8; row++)
+                _IDCTImpl(block[row*8 + 0], block[row*8 + 1], block[row*8 + 2], block[row*8 + 3],
+                          block[row*8 + 4], block[row*8 + 5], block[row*8 + 6], block[row*8 + 7]);
+        }
+    });
+    sink = sink + work[1];
+    report("idct_aan_float", t, num_blocks, 64);
+
+    t = measure(iterations, copy_transformed, [&] { dct_inverse_blocks(work.data(), num_blocks); });
+    sink = sink + work[1];
+    report("idct_batch", t, num_blocks, 64);
+
+    // RGB => YCbCr 4:4:4 with the float helpers, one 8x8 block per component
+    std::vector<float> y(num_blocks * 64), cb(num_blocks * 64), cr(num_blocks * 64);
+    t = measure(iterations, [] {}, [&]
+    {
+        for (size_t i = 0; i < num_blocks * 64; i++)
+        {
+            const uint8_t* pixel = &rgb[3 * i];
+            y [i] = rgb2y (pixel[0], pixel[1], pixel[2]) - 128;
+            cb[i] = rgb2cb(pixel[0], pixel[1], pixel[2]);
+            cr[i] = rgb2cr(pixel[0], pixel[1], pixel[2]);
+        }
+    });
+    sink = sink + y[1] + cb[1] + cr[1];
+    report("rgb_to_ycbcr", t, num_blocks, 3 * 64);
+
+    // 4:2:0 chroma: sum of each 2x2 area converted to Cb/Cr, as encodeMcuRows does (border handling left out)
+    t = measure(iterations, [] {}, [&]
+    {
+        size_t out = 0;
+        for (int row = 0; row < height; row += 2)
+            for (int column = 0; column < width; column += 2)
+            {
+                const int pixelPos = (row * width + column) * 3;
+                const int right = pixelPos + 3, down = pixelPos + 3 * width, downRight = down + 3;
+                auto r = short(rgb[pixelPos    ]) + rgb[right    ] + rgb[down    ] + rgb[downRight    ];
+                auto g = short(rgb[pixelPos + 1]) + rgb[right + 1] + rgb[down + 1] + rgb[downRight + 1];
+                auto b = short(rgb[pixelPos + 2]) + rgb[right + 2] + rgb[down + 2] + rgb[downRight + 2];
+                cb[out] = rgb2cb(r, g, b) / 4;
+                cr[out] = rgb2cr(r, g, b) / 4;
+                out++;
+            }
+    });
+    sink = sink + cb[1] + cr[1];
+    report("chroma_420", t, num_blocks, 3 * 64);
+
+    // the encoder's conversion (color_convert.hpp): fixed point, whole MCUs, 4:4:4 on the strip as it is,
+    // 4:2:0 (Y and the fused chroma averaging) on the same bytes seen as a 16 pixel high strip of half the width
+    YCbCrMcu<float>   mcu_float;
+    YCbCrMcu<int16_t> mcu_int16;
+    t = measure(iterations, [] {}, [&]
+    {
+        for (int column = 0; column < width; column += 8)
+        {
+            rgb_to_ycbcr_mcu(rgb.data(), 3 * width, column, 0, width, height, false, mcu_float);
+            sink = sink + mcu_float.Cr[7][7];
+        }
+    });
+    report("rgb_to_ycbcr_mcu_444_float", t, num_blocks, 3 * 64);
+    t = measure(iterations, [] {}, [&]
+    {
+        for (int column = 0; column < width; column += 8)
+        {
+            rgb_to_ycbcr_mcu(rgb.data(), 3 * width, column, 0, width, height, false, mcu_int16);
+            sink = sink + mcu_int16.Cr[7][7];
+        }
+    });
+    report("rgb_to_ycbcr_mcu_444_int16", t, num_blocks, 3 * 64);
+
+    const int width_420 = width / 2;
+    t = measure(iterations, [] {}, [&]
+    {
+        for (int column = 0; column + 16 <= width_420; column += 16)
+        {
+            rgb_to_ycbcr_mcu(rgb.data(), 3 * width_420, column, 0, width_420, 2 * height, true, mcu_float);
+            sink = sink + mcu_float.Cr[7][7];
+        }
+    });
+    report("rgb_to_ycbcr_mcu_420_float", t, num_blocks, 3 * 64);
+
+    t = measure(iterations, [] {}, [&]
+    {
+        for (int column = 0; column + 16 <= width_420; column += 16)
+        {
+            rgb_to_ycbcr_mcu(rgb.data(), 3 * width_420, column, 0, width_420, 2 * height, true, mcu_int16);
+            sink = sink + mcu_int16.Cr[7][7];
+        }
+    });
+    report("rgb_to_ycbcr_mcu_420_int16", t, num_blocks, 3 * 64);
+
+    // quantization of transformed blocks: scale, zigzag and round (float path of encodeBlock)
+    std::vector<float> coefficients = samples;
+    for (size_t b = 0; b < num_blocks; b++)
+        dct_aan(&coefficients[b * 64]);
+    std::vector<int16_t> quantized(num_blocks * 64);
+    t = measure(iterations, [] {}, [&]
+    {
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            const float* block = &coefficients[b * 64];
+            int16_t*     out   = &quantized[b * 64];
+            for (auto i = 0; i < 8*8; i++)
+            {
+                auto value = block[ZigZagInv[i]] * tables.scaledLuminance[ZigZagInv[i]];
+                out[i] = int16_t(value + (value >= 0 ? +0.5f : -0.5f));
+            }
+        }
+    });
+    sink = sink + quantized[1];
+    report("quantize_float", t, num_blocks, 64);
+
+    // DCT and quantization of a block as the encoder does them: DctMethod::Float per block (encodeBlock() without
+    // the Huffman coding), DctMethod::Int16 fused and DCTBatchInt16Native::lanes blocks at a time (BlockRowInt16)
+    t = measure(iterations, copy_samples, [&]
+    {
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            float*   block = &work[b * 64];
+            int16_t* out   = &quantized[b * 64];
+            dct_aan(block);
+            for (auto i = 0; i < 8*8; i++)
+            {
+                auto value = block[ZigZagInv[i]] * tables.scaledLuminance[ZigZagInv[i]];
+                out[i] = int16_t(value + (value >= 0 ? +0.5f : -0.5f));
+            }
+        }
+    });
+    sink = sink + quantized[1];
+    report("dct_quantize_float", t, num_blocks, 64);
+
+    std::vector<int16_t> samples16(num_blocks * 64), work16;
+    for (size_t i = 0; i < samples16.size(); i++)
+        samples16[i] = int16_t(samples[i]);
+    t = measure(iterations, [&] { work16 = samples16; }, [&]
+    {
+        dct_forward_blocks_int16(work16.data(), num_blocks, tables.reciprocalLuminance);
+    });
+    sink = sink + work16[1];
+    report("dct_quantize_int16", t, num_blocks, 64);
+
+    // Huffman codes of the quantized blocks in the order the encoder writes them, then pushed through the BitWriter
+    // (Bytestream::operator<<(BitCode) of the original encoder, the entropy coded data goes through BitWriter now)
+    for (size_t b = 0; b < num_blocks; b++)
+        for (auto i = 0; i < 8*8; i++)
+        {
+            auto value = coefficients[b * 64 + ZigZagInv[i]] * tables.scaledLuminance[ZigZagInv[i]];
+            quantized[b * 64 + i] = int16_t(std::clamp(int(value + (value >= 0 ? +0.5f : -0.5f)),
+                                                       -CodeWordLimit + 1, CodeWordLimit - 1));
+        }
+    std::vector<BitCode> codes;
+    std::vector<size_t>  block_ends; // end of each block in codes
+    {
+        const auto codewords = tables.codewords();
+        int16_t lastDC = 0;
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            const int16_t* block = &quantized[b * 64];
+            auto diff = block[0] - lastDC;
+            lastDC = block[0];
+            if (diff == 0)
+                codes.push_back(tables.huffmanLuminanceDC[0]);
+            else
+            {
+                auto dc = codewords[diff];
+                codes.push_back(tables.huffmanLuminanceDC[dc.numBits]);
+                codes.push_back(dc);
+            }
+            for (int i = 1; i < 64; i++)
+                if (block[i] != 0)
+                {
+                    auto ac = codewords[block[i]];
+                    codes.push_back(tables.huffmanLuminanceAC[ac.numBits]);
+                    codes.push_back(ac);
+                }
+            codes.push_back(tables.huffmanLuminanceAC[0x00]);
+            block_ends.push_back(codes.size());
+        }
+    }
+    std::vector<uint8_t> output;
+    t = measure(iterations, [&] { output.clear(); }, [&]
+    {
+        BitWriter writer(output);
+        size_t i = 0;
+        for (size_t end : block_ends)
+        {
+            writer.reserve(BitWriter::max_block_bytes);
+            for (; i < end; i++)
+                writer << codes[i];
+        }
+        writer.flush();
+    });
+    sink = sink + output.size();
+    report("bit_writer", t, num_blocks, (output.size() + num_blocks - 1) / num_blocks);
+
+    // whole plane DCT: blocks gathered from the row-major plane (the first byte of every RGB pixel as gray plane)
+    // one at a time, or the plane converted to tiles in bulk and transformed front to back
+    std::vector<uint8_t> gray(size_t(width) * height);
+    for (size_t i = 0; i < gray.size(); i++)
+        gray[i] = rgb[3 * i];
+    std::vector<float> gathered(num_blocks * 64);
+    t = measure(iterations, [] {}, [&]
+    {
+        for (size_t b = 0; b < num_blocks; b++)
+            for (int row = 0; row < 8; row++)
+                for (int column = 0; column < 8; column++)
+                    gathered[b * 64 + row * 8 + column] = gray[row * width + b * 8 + column] - 128.f;
+        dct_forward_blocks(gathered.data(), num_blocks);
+    });
+    sink = sink + gathered[1];
+    report("plane_dct_gathered", t, num_blocks, 64);
+
+    TiledPlane<float> tiles;
+    t = measure(iterations, [] {}, [&]
+    {
+        tiles.assign(gray.data(), width, width, height, LevelShift());
+        dct_forward_tiles(tiles);
+    });
+    sink = sink + tiles.data()[1];
+    report("plane_dct_tiled", t, num_blocks, 64);
+
+    // the shared transform pass: level shift, DCT and quantization of the whole plane into zigzag ordered int16 blocks
+    uint8_t quant_zigzag[8*8], quant_chroma_zigzag[8*8];
+    jpegQuantTables(90, quant_zigzag, quant_chroma_zigzag);
+    const QuantizeTable quantize(quant_zigzag);
+    CoefficientPlane coefficient_plane;
+    t = measure(iterations, [] {}, [&]
+    {
+        plane_to_coefficients(gray.data(), width, width, height, SampleLevels::luma(true), quantize,
+                              CoefficientOrder::ZigZag, coefficient_plane);
+    });
+    sink = sink + coefficient_plane.coefficients[1];
+    report("plane_dct_quantize", t, num_blocks, 64);
+
+    // the way back: zigzag ordered coefficients quantized with the luminance table => 8 bit plane
+    const DequantTable dequant(quant_zigzag);
+    t = measure(iterations, [] {}, [&]
+    {
+        coefficients_to_plane(quantized.data(), CoefficientOrder::ZigZag, dequant, width, height, gray.data(), width);
+    });
+    sink = sink + gray[1];
+    report("plane_idct", t, num_blocks, 64);
+
+    // thumbnails (the folded N x 8 filter of dct_scale.hpp) of the 8 pixel high strip, per input block: the gray
+    // plane, and all three channels of the packed RGB bytes in one pass
+    const int strip_width = width * 3;
+    std::vector<uint8_t> thumbnail(size_t(strip_width) * 4);
+    for (int log2_scale = 1; log2_scale <= 3; log2_scale++)
+    {
+        t = measure(iterations, [] {}, [&]
+        {
+            dct_downscale_plane(gray.data(), 1, width, width, height, log2_scale,
+                                thumbnail.data(), dct_scaled_size(width, log2_scale));
+        });
+        sink = sink + thumbnail[1];
+        std::string name = "dct_downscale_1_" + std::to_string(1 << log2_scale);
+        report(name.c_str(), t, num_blocks, 64);
+
+        t = measure(iterations, [] {}, [&]
+        {
+            dct_downscale_plane(rgb.data(), 3, strip_width, width, height, log2_scale,
+                                thumbnail.data(), 3 * dct_scaled_size(width, log2_scale));
+        });
+        sink = sink + thumbnail[1];
+        name = "dct_downscale_rgb_1_" + std::to_string(1 << log2_scale);
+        report(name.c_str(), t, num_blocks, 192);
+    }
+
+    // Huffman code tables of the four Annex K specifications (once per JPEG header)
+    const HuffmanTables standard = standardHuffmanTables();
+    const HuffmanSpec* specs[4] = { &standard.dcLuminance, &standard.acLuminance,
+                                    &standard.dcChrominance, &standard.acChrominance };
+    JPEGWriter writer(0);
+    BitCode    result[256];
+    const size_t calls = 4 * 1000;
+    t = measure(iterations, [] {}, [&]
+    {
+        for (size_t call = 0; call < calls; call++)
+        {
+            writer.generateHuffmanTable(specs[call & 3]->codesPerBitsize, specs[call & 3]->values, result);
+            sink = sink + result[1].code;
+        }
+    });
+    report_call("huffman_table", t, calls);
+
+    // JPEGWriter::writeJpegYCbCr() of a decoded frame, 1920 pixels wide with about num_blocks luma blocks (the test
+    // picture repeated), 4:2:0 and 4:4:4 kept as they are: the MCU rows go through TiledImage strips
+    const TestPicture picture;
+    const int frame_width  = 1920;
+    const int frame_height = std::max(8, int(num_blocks * 64 / frame_width));
+    const size_t frame_blocks = size_t(frame_width / 8) * ((frame_height + 7) / 8);
+    for (int shift : { 1, 0 })
+    {
+        const int chroma_width = (frame_width + shift) >> shift, chroma_height = (frame_height + shift) >> shift;
+        std::vector<uint8_t> frame[3];
+        for (int plane = 0; plane < 3; plane++)
+        {
+            const int plane_width  = plane == 0 ? frame_width  : chroma_width;
+            const int plane_height = plane == 0 ? frame_height : chroma_height;
+            const int step = plane == 0 ? 1 : 1 << shift;
+            frame[plane].resize(size_t(plane_width) * plane_height);
+            for (int y = 0; y < plane_height; y++)
+                for (int x = 0; x < plane_width; x++)
+                    frame[plane][size_t(y) * plane_width + x] =
+                        picture.planes[plane][(y * step % picture.height) * picture.width + x * step % picture.width];
+        }
+        const PlanarYCbCr image{ { frame[0].data(), frame[1].data(), frame[2].data() },
+                                 { frame_width, chroma_width, chroma_width }, shift, shift, false };
+        for (DctMethod dct : { DctMethod::Float, DctMethod::Int16 })
+        {
+            const JpegEncoderContext frame_context(frame_width, frame_height, true, 90, shift == 1, 0, dct);
+            JPEGWriter encoder(0);
+            t = measure(iterations, [] {}, [&] { encoder.writeJpegYCbCr(frame_context, image); });
+            sink = sink + encoder.m_byte_stream.size();
+            const std::string name = std::string("encode_ycbcr_") + (shift ? "420" : "444") +
+                                     (dct == DctMethod::Float ? "_float" : "_int16");
+            report(name.c_str(), t, frame_blocks, shift ? 64 * 3 / 2 : 3 * 64);
+        }
+    }
+
+    // accuracy of DctMethod::Int16: the PSNR loss against the float path must stay within the tolerance
+    // documented at DctMethod (0.1 dB for qualities 30..95, 5 dB at 100)
+    std::string json_checks;
+    bool passed = true;
+    for (int quality : { 30, 50, 75, 90, 95, 100 })
+    {
+        const double psnr_float = encode_decode_psnr<float>(picture, quality);
+        const double psnr_int16 = encode_decode_psnr<int16_t>(picture, quality);
+        const double limit      = quality <= 95 ? 0.1 : 5.0;
+        const bool   ok         = psnr_float - psnr_int16 <= limit;
+        passed = passed && ok;
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%s    {\"name\": \"int16_psnr\", \"quality\": %d, \"float_db\": %.3f, \"int16_db\": %.3f, "
+                 "\"loss_db\": %.3f, \"limit_db\": %.1f, \"ok\": %s}",
+                 json_checks.empty() ? "" : ",\n", quality, psnr_float, psnr_int16, psnr_float - psnr_int16, limit,
+                 ok ? "true" : "false");
+        json_checks += line;
+    }
+
+    // JPEGWriter::setCoefficientOutput(): the single pass and the optimized encoder keep the same blocks, and
+    // writeJpegCoefficients() turns them back into the identical JPEG (256 x 256 has no 4:2:0 padding blocks)
+    for (bool downsample : { false, true })
+    {
+        const JpegEncoderContext context(picture.width, picture.height, true, 75, downsample, 4, DctMethod::Int16);
+        CoefficientFrame single, optimized;
+        JPEGWriter encoder(0), recoder(0);
+        encoder.setRestartInterval(4);
+        encoder.setCoefficientOutput(&single);
+        encoder.writeJpegYCbCr(context, picture.view());
+        const std::vector<uint8_t> jpeg = encoder.m_byte_stream;
+        encoder.setCoefficientOutput(&optimized);
+        encoder.writeJpegYCbCrOptimized(context, picture.view());
+        bool same_blocks = true;
+        for (int plane = 0; plane < 3; plane++)
+            same_blocks = same_blocks && single.planes[plane].coefficients == optimized.planes[plane].coefficients;
+        const bool same_jpeg = recoder.writeJpegCoefficients(context, single) && recoder.m_byte_stream == jpeg;
+        passed = passed && same_blocks && same_jpeg;
+        char line[256];
+        snprintf(line, sizeof(line),
+                 ",\n    {\"name\": \"coefficient_output\", \"sampling\": \"%s\", \"same_blocks\": %s, "
+                 "\"same_jpeg\": %s, \"ok\": %s}",
+                 downsample ? "420" : "444", same_blocks ? "true" : "false", same_jpeg ? "true" : "false",
+                 same_blocks && same_jpeg ? "true" : "false");
+        json_checks += line;
+    }
+    ThreadPool pool(2);
+    for (bool chroma420 : { false, true })
+        for (bool fullRange : { true, false })
+        {
+            bool same_blocks, same_jpeg;
+            frame_to_coefficients_check(picture, chroma420, fullRange, pool, same_blocks, same_jpeg);
+            passed = passed && same_blocks && same_jpeg;
+            char line[256];
+            snprintf(line, sizeof(line),
+                     ",\n    {\"name\": \"frame_to_coefficients\", \"sampling\": \"%s\", \"full_range\": %s, "
+                     "\"same_blocks\": %s, \"same_jpeg\": %s, \"ok\": %s}",
+                     chroma420 ? "420" : "444", fullRange ? "true" : "false", same_blocks ? "true" : "false",
+                     same_jpeg ? "true" : "false", same_blocks && same_jpeg ? "true" : "false");
+            json_checks += line;
+        }
+
+    // the coefficient archive (decode -C) reads back what was written, raw and with zero runs (-z)
+    for (CoefCompression compression : { CoefCompression::None, CoefCompression::ZeroRuns })
+    {
+        const bool ok = coef_archive_roundtrip(picture, compression);
+        passed = passed && ok;
+        char line[256];
+        snprintf(line, sizeof(line), ",\n    {\"name\": \"coef_archive_roundtrip\", \"zero_runs\": %s, \"ok\": %s}",
+                 compression == CoefCompression::ZeroRuns ? "true" : "false", ok ? "true" : "false");
+        json_checks += line;
+    }
+
+    printf("{\n  \"benchmark\": \"dct_bench\",\n  \"blocks\": %zu,\n  \"iterations\": %d,\n"
+           "  \"dct_batch_lanes\": %zu,\n  \"dct_int16_lanes\": %zu,\n  \"cycle_source\": \"%s\",\n"
+           "  \"results\": [\n%s\n  ],\n  \"checks\": [\n%s\n  ]\n}\n",
+           num_blocks, iterations, DCTBatchNative::lanes, DCTBatchInt16Native::lanes,
+#if defined(__x86_64__) || defined(__i386__)
+           "tsc",
+#else
+           "ns",
+#endif
+           json_results.c_str(), json_checks.c_str());
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,406 @@
+#ifndef _DCT_INT_HPP
+#define _DCT_INT_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// 16 bit fixed point forward DCT and reciprocal quantization.
+// The butterfly is the same AAN scheme as _DCTImpl (libjpeg's jfdctfst.c "ifast"), so the output
+// carries the same AAN scale factors and is divided by the same (8 * aan[row] * aan[column] * q) step.
+// Every value stays in int16: with 8 bit samples (level shifted to -128..127) no intermediate
+// exceeds +/-13000 after both passes, the multiplications are Q15 "multiply high with rounding"
+// (pmulhrsw), so one SIMD register holds twice as many lanes as with float.
+// Unlike the float path the result depends on the rounding of every multiplication, see
+// DctMethod in write_jpeg.hpp for the accuracy compared to the float encoder.
+
+// x * c / 2^15 rounded to nearest, c in Q15 (|c| < 1)
+inline int dct_mulhrs(int x, int c) { return (x * c + (1 << 14)) >> 15; }
+
+// x * m / 2^16 for unsigned 16 bit values (truncating)
+inline int dct_mulhi_u16(int x, int m) { return int((unsigned(x) * unsigned(m)) >> 16); }
+
+// same for vectors of int16 lanes, one instruction per register
+template<typename V> requires (!std::is_arithmetic_v<V>)
+inline V dct_mulhrs(V x, V c)
+{
+  V result;
+  constexpr size_t bytes = sizeof(V);
+#if defined(__AVX512BW__)
+  if constexpr (bytes % 64 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 64)
+    {
+      __m512i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 64);
+      std::memcpy(&b, reinterpret_cast<const char*>(&c) + i, 64);
+      a = _mm512_mulhrs_epi16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 64);
+    }
+    return result;
+  }
+#endif
+#if defined(__AVX2__)
+  if constexpr (bytes % 32 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 32)
+    {
+      __m256i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 32);
+      std::memcpy(&b, reinterpret_cast<const char*>(&c) + i, 32);
+      a = _mm256_mulhrs_epi16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 32);
+    }
+    return result;
+  }
+#endif
+#if defined(__SSSE3__)
+  if constexpr (bytes % 16 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 16)
+    {
+      __m128i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 16);
+      std::memcpy(&b, reinterpret_cast<const char*>(&c) + i, 16);
+      a = _mm_mulhrs_epi16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 16);
+    }
+    return result;
+  }
+#endif
+  for (size_t i = 0; i < bytes / sizeof(int16_t); i++)
+    result[i] = int16_t(dct_mulhrs(int(x[i]), int(c[i])));
+  return result;
+}
+
+template<typename V> requires (!std::is_arithmetic_v<V>)
+inline V dct_mulhi_u16(V x, V m)
+{
+  V result;
+  constexpr size_t bytes = sizeof(V);
+#if defined(__AVX512BW__)
+  if constexpr (bytes % 64 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 64)
+    {
+      __m512i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 64);
+      std::memcpy(&b, reinterpret_cast<const char*>(&m) + i, 64);
+      a = _mm512_mulhi_epu16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 64);
+    }
+    return result;
+  }
+#endif
+#if defined(__AVX2__)
+  if constexpr (bytes % 32 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 32)
+    {
+      __m256i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 32);
+      std::memcpy(&b, reinterpret_cast<const char*>(&m) + i, 32);
+      a = _mm256_mulhi_epu16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 32);
+    }
+    return result;
+  }
+#endif
+#if defined(__SSE2__)
+  if constexpr (bytes % 16 == 0)
+  {
+    for (size_t i = 0; i < bytes; i += 16)
+    {
+      __m128i a, b;
+      std::memcpy(&a, reinterpret_cast<const char*>(&x) + i, 16);
+      std::memcpy(&b, reinterpret_cast<const char*>(&m) + i, 16);
+      a = _mm_mulhi_epu16(a, b);
+      std::memcpy(reinterpret_cast<char*>(&result) + i, &a, 16);
+    }
+    return result;
+  }
+#endif
+  for (size_t i = 0; i < bytes / sizeof(int16_t); i++)
+    result[i] = int16_t(dct_mulhi_u16(uint16_t(x[i]), uint16_t(m[i])));
+  return result;
+}
+
+// forward DCT "in one dimension", fixed point version of _DCTImpl (same variable names)
+// T is int16_t (computed in int, results fit into int16) or a vector of int16 lanes
+template<typename T>
+void _DCTImplInt16(T& block0, T& block1, T& block2, T& block3, T& block4, T& block5, T& block6, T& block7)
+{
+  using V = decltype(block0 + block7); // int for scalars, the vector type itself otherwise
+  // Q15 constants, 1.306562965 = 1 + 0.306562965 does not fit and is split up
+  const V InvSqrt          = V{} + 23170; // 0.707106781 * 2^15
+  const V HalfSqrtSqrt     = V{} + 12540; // 0.382683433 * 2^15
+  const V InvSqrtSqrt      = V{} + 17734; // 0.541196100 * 2^15
+  const V SqrtHalfSqrtFrac = V{} + 10045; // 0.306562965 * 2^15
+
+  V add07 = block0 + block7; V sub07 = block0 - block7; // tmp0, tmp7
+  V add16 = block1 + block6; V sub16 = block1 - block6; // tmp1, tmp6
+  V add25 = block2 + block5; V sub25 = block2 - block5; // tmp2, tmp5
+  V add34 = block3 + block4; V sub34 = block3 - block4; // tmp3, tmp4
+
+  V add0347 = add07 + add34; V sub07_34 = add07 - add34; // tmp10, tmp13
+  V add1256 = add16 + add25; V sub16_25 = add16 - add25; // tmp11, tmp12
+
+  block0 = add0347 + add1256; block4 = add0347 - add1256;
+
+  V z1 = dct_mulhrs(sub16_25 + sub07_34, InvSqrt);
+  block2 = sub07_34 + z1; block6 = sub07_34 - z1;
+
+  V sub23_45 = sub25 + sub34; // tmp10
+  V sub12_56 = sub16 + sub25; // tmp11
+  V sub01_67 = sub16 + sub07; // tmp12
+
+  V z5 = dct_mulhrs(sub23_45 - sub01_67, HalfSqrtSqrt);
+  V z2 = dct_mulhrs(sub23_45, InvSqrtSqrt) + z5;
+  V z3 = dct_mulhrs(sub12_56, InvSqrt);
+  V z4 = sub01_67 + dct_mulhrs(sub01_67, SqrtHalfSqrtFrac) + z5;
+  V z6 = sub07 + z3; // z11
+  V z7 = sub07 - z3; // z13
+  block1 = z6 + z4; block7 = z6 - z4;
+  block5 = z7 + z2; block3 = z7 - z2;
+}
+
+// quantization step as reciprocal: |x| / divisor ~ ((|x| + round) * reciprocal) >> 16 >> shift,
+// so quantizing needs two adds, one multiply-high and one shift per lane, no division
+struct QuantReciprocal
+{
+  uint16_t reciprocal = 0; // 2^(16 + shift) / divisor rounded up, in [2^15, 2^16)
+  uint16_t round      = 0; // divisor / 2 => round to nearest
+  int16_t  shift      = 0; // negative for divisors below 1 (quality >= 98), the result is shifted left then
+                           // and loses its lowest bit
+
+  // divisor: the float path's 1 / scaledLuminance[i] resp. 1 / scaledChrominance[i], i.e. 8 * aan[row] * aan[column] * q
+  static QuantReciprocal fromDivisor(float divisor)
+  {
+    QuantReciprocal result;
+    int  shift      = int(std::floor(std::log2(divisor))); // divisor in [2^shift, 2^(shift+1))
+    long reciprocal = long(std::ceil(std::ldexp(1.0, 16 + shift) / divisor));
+    int  round      = int(divisor / 2);
+    // rounding up keeps exact multiples of integer divisors from falling short, the error of
+    // (|x| + round) * reciprocal stays below one step for |x| < 2^15
+    if (reciprocal > 0xFFFF) // divisor is a power of two: ((y + 1) * 0xFFFF) >> 16 == y
+    {
+      reciprocal = 0xFFFF;
+      round++;
+    }
+    result.reciprocal = uint16_t(reciprocal);
+    result.round      = uint16_t(round);
+    result.shift      = int16_t(shift);
+    return result;
+  }
+};
+
+// quantize one coefficient (scalar) or the same coefficient of many blocks (vector)
+inline int dct_quantize(int x, const QuantReciprocal& step)
+{
+  int magnitude = dct_mulhi_u16(std::abs(x) + step.round, step.reciprocal);
+  magnitude = step.shift >= 0 ? magnitude >> step.shift : magnitude << -step.shift;
+  return x < 0 ? -magnitude : magnitude;
+}
+
+template<typename V> requires (!std::is_arithmetic_v<V>)
+inline V dct_quantize(V x, const QuantReciprocal& step)
+{
+  V sign      = x >> 15;                // 0 or -1
+  V magnitude = ((x ^ sign) - sign) + int16_t(step.round);
+  magnitude   = dct_mulhi_u16(magnitude, V{} + int16_t(step.reciprocal));
+  // magnitude < 2^15 here, so the arithmetic shift of the signed lanes is fine
+  magnitude   = step.shift >= 0 ? magnitude >> step.shift : magnitude << -step.shift;
+  return (magnitude ^ sign) - sign;
+}
+
+// int16 lanes, same layout as DctLaneType: lane b of coefficient k holds coefficient k of block b
+template<size_t LANES>
+struct DctInt16LaneType
+{
+  // note: must be a typedef, GCC drops a dependent vector_size on alias declarations
+  typedef int16_t vector __attribute__((vector_size(LANES * sizeof(int16_t))));
+  typedef vector  type   __attribute__((__may_alias__));
+};
+
+template<>
+struct DctInt16LaneType<1>
+{
+  using type = int16_t;
+};
+
+// Batched fixed point DCT, the int16 counterpart of DCTBatch: LANES blocks are transposed into
+// one vector per coefficient, then every operation of _DCTImplInt16 covers LANES blocks.
+// Integer arithmetic is exact, so all widths produce identical output.
+template<size_t LANES>
+class DCTBatchInt16
+{
+public:
+  static constexpr size_t lanes = LANES;
+  using lane_t = typename DctInt16LaneType<LANES>::type;
+
+  // transform LANES consecutive 8x8 blocks (row-major int16[64] each, samples -128..127) in place
+  static void forward(int16_t* blocks)
+  {
+    alignas(64) lane_t coeffs[64];
+    transpose_in(blocks, coeffs);
+    transform(coeffs);
+    transpose_out(coeffs, blocks);
+  }
+
+  // transform and quantize, divisors[k] belongs to coefficient k (natural order)
+  static void forward_quantize(int16_t* blocks, const QuantReciprocal divisors[64])
+  {
+    alignas(64) lane_t coeffs[64];
+    transpose_in(blocks, coeffs);
+    transform(coeffs);
+    for (size_t k = 0; k < 64; k++)
+      coeffs[k] = lane_t(dct_quantize(coeffs[k], divisors[k]));
+    transpose_out(coeffs, blocks);
+  }
+
+private:
+  static inline void transform(lane_t* coeffs)
+  {
+    // DCT: rows
+    for (auto row = 0; row < 8; row++)
+    {
+      lane_t* r = &coeffs[row * 8];
+      _DCTImplInt16(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+    }
+    // DCT: columns
+    for (auto col = 0; col < 8; col++)
+    {
+      lane_t* c = &coeffs[col];
+      _DCTImplInt16(c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56]);
+    }
+  }
+
+#if defined(__SSE2__)
+  // 8x8 transpose of 16 bit values: rows[i] holds 8 values, afterwards rows[j] holds the j-th value of all 8 inputs
+  static inline void transpose8x8(__m128i rows[8])
+  {
+    __m128i a0 = _mm_unpacklo_epi16(rows[0], rows[1]);
+    __m128i a1 = _mm_unpackhi_epi16(rows[0], rows[1]);
+    __m128i a2 = _mm_unpacklo_epi16(rows[2], rows[3]);
+    __m128i a3 = _mm_unpackhi_epi16(rows[2], rows[3]);
+    __m128i a4 = _mm_unpacklo_epi16(rows[4], rows[5]);
+    __m128i a5 = _mm_unpackhi_epi16(rows[4], rows[5]);
+    __m128i a6 = _mm_unpacklo_epi16(rows[6], rows[7]);
+    __m128i a7 = _mm_unpackhi_epi16(rows[6], rows[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    rows[0] = _mm_unpacklo_epi64(b0, b4);
+    rows[1] = _mm_unpackhi_epi64(b0, b4);
+    rows[2] = _mm_unpacklo_epi64(b1, b5);
+    rows[3] = _mm_unpackhi_epi64(b1, b5);
+    rows[4] = _mm_unpacklo_epi64(b2, b6);
+    rows[5] = _mm_unpackhi_epi64(b2, b6);
+    rows[6] = _mm_unpacklo_epi64(b3, b7);
+    rows[7] = _mm_unpackhi_epi64(b3, b7);
+  }
+#endif
+
+  // blocks[b*64 + k] => coeffs[k][b]
+  static inline void transpose_in(const int16_t* blocks, lane_t* coeffs)
+  {
+    if constexpr (LANES == 1)
+    {
+      std::memcpy(coeffs, blocks, 64 * sizeof(int16_t));
+    }
+#if defined(__SSE2__)
+    else if constexpr (LANES % 8 == 0)
+    {
+      int16_t* out = reinterpret_cast<int16_t*>(coeffs);
+      // each group of 8 blocks fills one 128 bit part of the lane vectors
+      for (size_t group = 0; group < LANES; group += 8)
+        for (size_t k = 0; k < 64; k += 8)
+        {
+          __m128i rows[8];
+          for (size_t b = 0; b < 8; b++)
+            rows[b] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + (group + b) * 64 + k));
+          transpose8x8(rows);
+          for (size_t j = 0; j < 8; j++)
+            _mm_store_si128(reinterpret_cast<__m128i*>(out + (k + j) * LANES + group), rows[j]);
+        }
+    }
+#endif
+    else
+    {
+      for (size_t k = 0; k < 64; k++)
+        for (size_t b = 0; b < LANES; b++)
+          coeffs[k][b] = blocks[b * 64 + k];
+    }
+  }
+
+  // coeffs[k][b] => blocks[b*64 + k]
+  static inline void transpose_out(const lane_t* coeffs, int16_t* blocks)
+  {
+    if constexpr (LANES == 1)
+    {
+      std::memcpy(blocks, coeffs, 64 * sizeof(int16_t));
+    }
+#if defined(__SSE2__)
+    else if constexpr (LANES % 8 == 0)
+    {
+      const int16_t* in = reinterpret_cast<const int16_t*>(coeffs);
+      for (size_t group = 0; group < LANES; group += 8)
+        for (size_t k = 0; k < 64; k += 8)
+        {
+          __m128i rows[8];
+          for (size_t j = 0; j < 8; j++)
+            rows[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(in + (k + j) * LANES + group));
+          transpose8x8(rows);
+          for (size_t b = 0; b < 8; b++)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(blocks + (group + b) * 64 + k), rows[b]);
+        }
+    }
+#endif
+    else
+    {
+      for (size_t k = 0; k < 64; k++)
+        for (size_t b = 0; b < LANES; b++)
+          blocks[b * 64 + k] = coeffs[k][b];
+    }
+  }
+};
+
+// widest batch supported by the instruction set we are compiled for, twice the lanes of DCTBatchNative
+#if defined(__AVX512BW__)
+using DCTBatchInt16Native = DCTBatchInt16<32>;
+#elif defined(__AVX2__)
+using DCTBatchInt16Native = DCTBatchInt16<16>;
+#elif defined(__SSSE3__)
+using DCTBatchInt16Native = DCTBatchInt16<8>;
+#else
+using DCTBatchInt16Native = DCTBatchInt16<1>;
+#endif
+using DCTBatchInt16Scalar = DCTBatchInt16<1>;
+
+// transform (and quantize, if divisors are given) an arbitrary number of consecutive 8x8 blocks in place
+template<typename Batch = DCTBatchInt16Native>
+void dct_forward_blocks_int16(int16_t* blocks, size_t num_blocks, const QuantReciprocal* divisors = nullptr)
+{
+  size_t i = 0;
+  for (; i + Batch::lanes <= num_blocks; i += Batch::lanes)
+    divisors ? Batch::forward_quantize(blocks + i * 64, divisors) : Batch::forward(blocks + i * 64);
+  for (; i < num_blocks; i++)
+    divisors ? DCTBatchInt16Scalar::forward_quantize(blocks + i * 64, divisors)
+             : DCTBatchInt16Scalar::forward(blocks + i * 64);
+}
+
+#endif // _DCT_INT_HPP
@@ -0,0 +1,176 @@
+#ifndef _DCT_SCALE_HPP
+#define _DCT_SCALE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "color_convert.hpp"
+
+// Downscaling by 2, 4 or 8 in the DCT domain (thumbnails): the lowest N x N frequencies (N = 8 >> log2Scale)
+// of the 8x8 DCT of every block, transformed back with an N-point inverse DCT, give the N x N block of the
+// smaller picture (the scaled IDCT of libjpeg's jidctred.c). Both steps are linear and separable, so they are
+// folded into one N x 8 matrix per dimension that is applied to the samples directly: first down each column
+// of a block row (SIMD over the samples of the row), then along the N resulting rows per block (SIMD over the N
+// outputs), both on chunks of 32 blocks that stay in L1.
+// Scale 1/8 keeps the DC only, i.e. the mean of the block.
+// Blocks at the right and bottom border replicate the last column / row like the encoder does.
+
+// width or height of a plane of size pixels after downscaling by 2^log2Scale
+inline int dct_scaled_size(int size, int log2Scale)
+{
+  return (size + (1 << log2Scale) - 1) >> log2Scale;
+}
+
+// m[n][k]: weight of the k-th of 8 samples in the n-th of N downscaled samples, i.e. the orthonormal 8-point DCT
+// followed by the N-point inverse DCT of its lowest N coefficients, with the gain of sqrt(N / 8) that keeps the
+// DC level (every row sums up to 1)
+template<int N>
+struct ScaledDctMatrix
+{
+  static_assert(N <= 4, "downscaling by 2 at least");
+  typedef float column __attribute__((vector_size(4 * sizeof(float)))); // N <= 4, the rest is 0
+  float  m[N][8];
+  column columns[8] = {}; // columns[k][n] = m[n][k]
+
+  ScaledDctMatrix()
+  {
+    const double pi = 3.14159265358979323846;
+    for (int n = 0; n < N; n++)
+      for (int k = 0; k < 8; k++)
+      {
+        double sum = 0;
+        for (int u = 0; u < N; u++)
+        {
+          const double scale = u == 0 ? std::sqrt(1. / 8) * std::sqrt(1. / N) : std::sqrt(2. / 8) * std::sqrt(2. / N);
+          sum += scale * std::cos((2 * k + 1) * u * pi / 16) * std::cos((2 * n + 1) * u * pi / (2 * N));
+        }
+        m[n][k] = float(std::sqrt(N / 8.) * sum);
+        columns[k][n] = m[n][k];
+      }
+  }
+};
+
+// see dct_downscale_plane()
+template<int LOG2_SCALE, int CHANNELS>
+void dct_downscale_plane_n(const uint8_t* src, int srcLinesize, int width, int height, uint8_t* dst, int dstLinesize)
+{
+  constexpr int N      = 8 >> LOG2_SCALE; // output samples per block and dimension
+  constexpr int LANES  = 8;               // samples per SIMD step of the vertical pass (one widening load each)
+  constexpr int CHUNK  = 32;              // blocks per vertical + horizontal pass, the rows stay in L1
+  constexpr int STRIDE = CHUNK * 8 * CHANNELS;
+  typedef float   floats __attribute__((vector_size(LANES * sizeof(float))));
+  typedef typename ScaledDctMatrix<N>::column column;
+  static const ScaledDctMatrix<N> matrix;
+
+  const int blocksX   = (width  + 7) / 8;
+  const int fullX     = width / 8;        // blocks without the right border
+  const int dstWidth  = dct_scaled_size(width,  LOG2_SCALE);
+  const int dstHeight = dct_scaled_size(height, LOG2_SCALE);
+  // horizontal: the 8 samples at in (CHANNELS apart) => N samples clamped to 0..255, one vector of the N outputs
+  auto horizontal = [](const float* in)
+  {
+    const column* m = matrix.columns;
+    column sum = (m[0] * in[0] + m[1] * in[CHANNELS]) + (m[2] * in[2 * CHANNELS] + m[3] * in[3 * CHANNELS]);
+    sum += (m[4] * in[4 * CHANNELS] + m[5] * in[5 * CHANNELS]) + (m[6] * in[6 * CHANNELS] + m[7] * in[7 * CHANNELS]);
+    sum = sum < 0 ? 0 : sum;
+    return sum > 255 ? 255 : sum;
+  };
+
+  alignas(64) float rows[N][STRIDE]; // the N rows of a chunk after the vertical pass
+  for (int blockY = 0; blockY * 8 < height; blockY++)
+  {
+    const uint8_t* lines[8];
+    for (int y = 0; y < 8; y++)
+      lines[y] = src + std::min(blockY * 8 + y, height - 1) * ptrdiff_t(srcLinesize);
+    const int dstRows = std::min(N, dstHeight - blockY * N);
+
+    for (int chunk = 0; chunk < blocksX; chunk += CHUNK)
+    {
+      // vertical: 8 lines => N rows, the samples of the chunk that are inside the picture
+      const int first = chunk * 8 * CHANNELS;
+      const int size  = std::min(CHUNK * 8, width - chunk * 8) * CHANNELS;
+      int i = 0;
+      for (; i + LANES <= size; i += LANES)
+      {
+        floats samples[8];
+        for (int y = 0; y < 8; y++)
+        {
+          typename YccLanes<LANES>::bytes b;
+          typename YccLanes<LANES>::vector wide;
+          std::memcpy(&b, lines[y] + first + i, sizeof(b));
+          ycc_widen<LANES>(b, wide);
+          samples[y] = __builtin_convertvector(wide, floats);
+        }
+        for (int n = 0; n < N; n++)
+        {
+          floats sum = matrix.m[n][0] * samples[0];
+          for (int y = 1; y < 8; y++)
+            sum += matrix.m[n][y] * samples[y];
+          std::memcpy(&rows[n][i], &sum, sizeof(sum));
+        }
+      }
+      for (; i < size; i++)
+        for (int n = 0; n < N; n++)
+        {
+          float sum = 0;
+          for (int y = 0; y < 8; y++)
+            sum += matrix.m[n][y] * lines[y][first + i];
+          rows[n][i] = sum;
+        }
+
+      // horizontal: 8 samples => N per block and channel
+      const int chunkEnd = std::min(chunk + CHUNK, blocksX);
+      for (int n = 0; n < dstRows; n++)
+      {
+        uint8_t* out = dst + (blockY * N + n) * ptrdiff_t(dstLinesize);
+        for (int blockX = chunk; blockX < std::min(chunkEnd, fullX); blockX++)
+        {
+          const float* in = &rows[n][(blockX - chunk) * 8 * CHANNELS];
+          uint8_t* pixel = out + blockX * N * CHANNELS;
+          for (int c = 0; c < CHANNELS; c++)
+          {
+            const column samples = horizontal(in + c);
+            for (int x = 0; x < N; x++)
+              pixel[x * CHANNELS + c] = uint8_t(samples[x] + 0.5f);
+          }
+        }
+        // the partial block at the right border replicates the last column
+        for (int blockX = std::max(chunk, fullX); blockX < chunkEnd; blockX++)
+        {
+          float in[8 * CHANNELS];
+          for (int k = 0; k < 8; k++)
+            for (int c = 0; c < CHANNELS; c++)
+              in[k * CHANNELS + c] = rows[n][(std::min(blockX * 8 + k, width - 1) - chunk * 8) * CHANNELS + c];
+          for (int c = 0; c < CHANNELS; c++)
+          {
+            const column samples = horizontal(in + c);
+            for (int x = 0; x < N && blockX * N + x < dstWidth; x++)
+              out[(blockX * N + x) * CHANNELS + c] = uint8_t(samples[x] + 0.5f);
+          }
+        }
+      }
+    }
+  }
+}
+
+// downscale a width x height picture of 8 bit samples by 2^log2Scale (1, 2 or 3) into
+// dct_scaled_size(width, log2Scale) x dct_scaled_size(height, log2Scale) pixels of the same layout, all channels
+// of interleaved pixels in one pass (channels = 1 for a plane or 3 for packed RGB, false otherwise)
+inline bool dct_downscale_plane(const uint8_t* src, int channels, int srcLinesize, int width, int height, int log2Scale,
+                                uint8_t* dst, int dstLinesize)
+{
+  if (channels != 1 && channels != 3)
+    return false;
+  const bool rgb = channels == 3;
+  switch (log2Scale)
+  {
+  case 1: (rgb ? dct_downscale_plane_n<1, 3> : dct_downscale_plane_n<1, 1>)(src, srcLinesize, width, height, dst, dstLinesize); return true;
+  case 2: (rgb ? dct_downscale_plane_n<2, 3> : dct_downscale_plane_n<2, 1>)(src, srcLinesize, width, height, dst, dstLinesize); return true;
+  case 3: (rgb ? dct_downscale_plane_n<3, 3> : dct_downscale_plane_n<3, 1>)(src, srcLinesize, width, height, dst, dstLinesize); return true;
+  default: return false;
+  }
+}
+
+#endif // _DCT_SCALE_HPP
@@ -7,6 +7,7 @@
  extern "C" {
     #include <libavutil/imgutils.h>
     #include <libavutil/motion_vector.h>
+    #include <libavutil/pixdesc.h>
     #include <libavutil/samplefmt.h>
     #include <libavutil/timestamp.h>
     #include <libavcodec/avcodec.h>
@@ -16,43 +17,325 @@
 }
 
 #include "ffmpeg_decode.hpp"
+#include <algorithm>
 #include <cassert>
+#include <boost/thread/condition_variable.hpp>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <unistd.h>
 
  int VideoDecoder_ffmpegImpl::output_video_frame(AVFrame *frame)
  {
      if (frame->width != m_width || frame->height != m_height ||
        frame->format != m_pix_fmt) {
-         /* To handle this change, one could call av_image_alloc again and
-          * decode the following frames into another rawvideo file. */
-         fprintf(stderr, "Error: Width, height and pixel format have to be "
-                 "constant in a rawvideo file, but the width, height or "
-                 "pixel format of the input video changed:\n"
+         /* the copies are leased from the frame pool, which opens a new
+          * bucket for the new geometry, so just carry on with it */
+         fprintf(stderr, "Warning: the width, height or pixel format "
+                 "of the input video changed:\n"
                  "old: width = %d, height = %d, format = %s\n"
                  "new: width = %d, height = %d, format = %s\n",
                  m_width, m_height, av_get_pix_fmt_name(m_pix_fmt),
                  frame->width, frame->height,
                  av_get_pix_fmt_name((AVPixelFormat)frame->format));
-         return -1;
+         m_width   = frame->width;
+         m_height  = frame->height;
+         m_pix_fmt = (AVPixelFormat)frame->format;
      }
  
-     printf("video_frame n:%d\n", m_video_frame_count++);
- 
+     m_video_frame_count++;
+     if (m_verbosity >= 1)
+     {
+         printf("video_frame n:%d\n", m_video_frame_count - 1);
+         std::cout << "frame->width:" << frame->width   << std::endl;
+         std::cout << "frame->height:" << frame->height << std::endl;
+         std::cout << "frame->format:" << frame->format << std::endl;
+     }
+
      /* copy decoded frame to destination buffer:
       * this is required since rawvideo expects non aligned data */
-     std::cout << "frame->width:" << frame->width   << std::endl;
-     std::cout << "frame->height:" << frame->height << std::endl;
-     std::cout << "frame->format:" << frame->format << std::endl;
 
-     av_image_copy2(m_video_dst_data, m_video_dst_linesize,
-        frame->data, frame->linesize,
-                    m_pix_fmt, m_width, m_height);
- 
-     /* write to rawvideo file */
-     fwrite(m_video_dst_data[0], 1, m_video_dst_bufsize, m_video_dst_file);
-     return 0;
+     AVFrame *raw = av_frame_alloc();
+     if (!raw)
+         return AVERROR(ENOMEM);
+     raw->format = m_pix_fmt;
+     raw->width  = m_width;
+     raw->height = m_height;
+     /* packed rows and contiguous planes (align = 1) */
+     int ret = m_frame_pool.get_buffer(raw, 1);
+     if (ret >= 0) {
+         av_image_copy2(raw->data, raw->linesize,
+            frame->data, frame->linesize,
+                        m_pix_fmt, m_width, m_height);
+
+         /* write to rawvideo file */
+         TRACE_SPAN("file_write");
+         fwrite(raw->data[0], 1, av_image_get_buffer_size(m_pix_fmt, m_width, m_height, 1), m_video_dst_file);
+     }
+     av_frame_free(&raw);
+     return ret;
  }
+
+// convert src to packed RGB24 in rgb, whose buffer is leased from the frame pool
+// (av_frame_unref(rgb) hands it back), sws_ctx follows changes of the source geometry;
+// a source that is RGB24 already is only referenced, not copied
+int VideoDecoder_ffmpegImpl::convert_to_rgb(const AVFrame *src, SwsContext *&sws_ctx, AVFrame *rgb)
+{
+    av_frame_unref(rgb);
+    if (src->format == AV_PIX_FMT_RGB24)
+        return av_frame_ref(rgb, src);
+
+    sws_ctx = sws_getCachedContext(sws_ctx,
+                                   src->width, src->height, (AVPixelFormat)src->format,
+                                   src->width, src->height, AV_PIX_FMT_RGB24,
+                                   SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws_ctx)
+        return AVERROR(EINVAL);
+
+    rgb->format = AV_PIX_FMT_RGB24;
+    rgb->width  = src->width;
+    rgb->height = src->height;
+    int ret = m_frame_pool.get_buffer(rgb);
+    if (ret < 0)
+        return ret;
+
+    TRACE_SPAN("sws_scale");
+    if (sws_scale(sws_ctx, src->data, src->linesize, 0, src->height,
+                  rgb->data, rgb->linesize) != src->height)
+    {
+        av_frame_unref(rgb);
+        return -1;
+    }
+    return 0;
+}
  
+// 8 bit planar YCbCr with at most 2x2 chroma subsampling (yuv420p, yuvj420p, yuv422p, yuv444p, ...),
+// these can be handed to JPEGWriter::writeJpegYCbCr without converting to RGB first
+static bool is_planar_yuv8(enum AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    return desc && desc->nb_components == 3 &&
+           (desc->flags & AV_PIX_FMT_FLAG_PLANAR) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) &&
+           desc->comp[0].depth == 8 && desc->comp[0].plane == 0 &&
+           desc->comp[1].plane == 1 && desc->comp[2].plane == 2 &&
+           desc->log2_chroma_w <= 1 && desc->log2_chroma_h <= 1;
+}
+
+// the encoder context of the current settings, only rebuilt when the frame size changes
+std::shared_ptr<const JpegEncoderContext> VideoDecoder_ffmpegImpl::jpeg_context(int width, int height)
+{
+    boost::lock_guard<boost::mutex> lock(m_jpeg_context_mutex);
+    if (!m_jpeg_context ||
+        !m_jpeg_context->matches(width, height, true, m_jpeg_quality, m_jpeg_downsample, m_restart_mcu_rows, m_jpeg_dct))
+        m_jpeg_context = std::make_shared<const JpegEncoderContext>(width, height, true, m_jpeg_quality,
+                                                                    m_jpeg_downsample, m_restart_mcu_rows, m_jpeg_dct);
+    return m_jpeg_context;
+}
+
+// the thumbnail of frame (see set_thumbnail_scale) in a frame leased from the pool, in the same pixel format,
+// NULL without memory
+AVFrame* VideoDecoder_ffmpegImpl::downscale_frame(const AVFrame *frame, bool planar_yuv)
+{
+    TRACE_SPAN("thumbnail");
+    AVFrame *thumb = av_frame_alloc();
+    if (!thumb)
+        return NULL;
+    thumb->format      = frame->format;
+    thumb->width       = dct_scaled_size(frame->width,  m_thumbnail_scale);
+    thumb->height      = dct_scaled_size(frame->height, m_thumbnail_scale);
+    thumb->color_range = frame->color_range;
+    if (m_frame_pool.get_buffer(thumb) < 0)
+    {
+        av_frame_free(&thumb);
+        return NULL;
+    }
+    if (planar_yuv)
+    {
+        // the chroma planes shrink by the same factor, which gives exactly the chroma size of the thumbnail
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+        for (int plane = 0; plane < 3; plane++)
+        {
+            const int shiftX = plane ? desc->log2_chroma_w : 0;
+            const int shiftY = plane ? desc->log2_chroma_h : 0;
+            dct_downscale_plane(frame->data[plane], 1, frame->linesize[plane],
+                                dct_scaled_size(frame->width, shiftX), dct_scaled_size(frame->height, shiftY),
+                                m_thumbnail_scale, thumb->data[plane], thumb->linesize[plane]);
+        }
+    }
+    else
+    {
+        // the three channels of packed RGB in one pass
+        dct_downscale_plane(frame->data[0], 3, frame->linesize[0], frame->width, frame->height,
+                            m_thumbnail_scale, thumb->data[0], thumb->linesize[0]);
+    }
+    return thumb;
+}
+
+// jpeg is replaced by the encoded frame, its capacity is reused
+// gop: HuffmanMode::Gop only, the key frame (gop_start) optimizes the tables and publishes them for the rest of the GOP
+// cache: incremental encoding, frames encoded with optimized tables don't update it and force a full next frame
+// coefficients: receives the quantized blocks of the JPEG (for the coefficient archive)
+int VideoDecoder_ffmpegImpl::encode_jpeg_frame(const AVFrame *frame, bool planar_yuv, std::vector<uint8_t>& jpeg,
+                                               GopHuffman* gop, bool gop_start, BlockCache* cache,
+                                               CoefficientFrame* coefficients)
+{
+    TRACE_SPAN("jpeg_encode");
+    // thumbnails: the full size picture only goes through the separable N x 8 filter of dct_scale.hpp (the scaled
+    // IDCT of the lowest frequencies folded into one matrix, no DCT of the full frame), the encoder sees the small one
+    AVFrame *thumb = NULL;
+    if (m_thumbnail_scale > 0)
+    {
+        thumb = downscale_frame(frame, planar_yuv);
+        if (!thumb)
+        {
+            if (gop_start)
+                gop->publish(nullptr);
+            return AVERROR(ENOMEM);
+        }
+        frame = thumb;
+        cache = nullptr;
+    }
+    std::shared_ptr<const JpegEncoderContext> context = jpeg_context(frame->width, frame->height);
+    const bool optimize = m_huffman_mode == HuffmanMode::Frame || gop_start;
+    if (gop && !gop_start)
+    {
+        // standard tables if the key frame failed or the frame size changed within the GOP
+        std::shared_ptr<const JpegEncoderContext> shared = gop->context.get();
+        if (shared && shared->matches(frame->width, frame->height, true, m_jpeg_quality, m_jpeg_downsample,
+                                      m_restart_mcu_rows, m_jpeg_dct))
+            context = shared;
+    }
+    HuffmanTables gop_tables;
+    HuffmanTables* reusable = gop_start ? &gop_tables : nullptr;
+    ArenaPool::Lease arena = m_arenas.acquire(); // the writer's scratch, recycled when this frame is done
+    JPEGWriter writer(0);
+    writer.setMemoryResource(arena.get());
+    writer.m_byte_stream.swap(jpeg);
+    writer.m_byte_stream.reserve(size_t(frame->width) * frame->height / 2);
+    writer.setRestartInterval(m_restart_mcu_rows, m_jpeg_pool.get());
+    writer.setCoefficientOutput(coefficients);
+    bool ok;
+    if (planar_yuv)
+    {
+        const PlanarYCbCr image = ycbcr_view(frame);
+        ok = optimize ? writer.writeJpegYCbCrOptimized(*context, image, reusable)
+           : cache    ? writer.writeJpegYCbCrIncremental(*context, image, *cache)
+                      : writer.writeJpegYCbCr(*context, image);
+    }
+    else
+    {
+        // packed RGB24, read in place with the frame's linesize
+        const RGBView pixels = rgb_view(frame);
+        ok = optimize ? writer.writeJpegOptimized(*context, pixels, reusable)
+           : cache    ? writer.writeJpegIncremental(*context, pixels, *cache)
+                      : writer.writeJpeg(*context, pixels);
+    }
+    if (cache && (optimize || !ok))
+        cache->refresh();
+    if (gop_start)
+        gop->publish(ok ? std::make_shared<const JpegEncoderContext>(*context, gop_tables) : nullptr);
+    jpeg.swap(writer.m_byte_stream);
+    av_frame_free(&thumb);
+    return ok ? 0 : -1;
+}
+
+int VideoDecoder_ffmpegImpl::write_jpeg_frame(AVFrame *frame, bool planar_yuv, GopHuffman* gop, bool gop_start)
+{
+    std::vector<uint8_t>& jpeg = m_jpeg_output;
+    if (encode_jpeg_frame(frame, planar_yuv, jpeg, gop, gop_start, m_incremental ? &m_block_cache : NULL,
+                          m_coef_writer.is_open() ? &m_coef_frame : NULL) < 0)
+    {
+        fprintf(stderr, "Could not encode frame %zu\n", m_frame_count);
+        return -1;
+    }
+
+    /* the output file is a plain sequence of JPEGs (MJPEG) */
+    TRACE_SPAN("file_write");
+    if (fwrite(jpeg.data(), 1, jpeg.size(), m_video_dst_file) != jpeg.size())
+    {
+        fprintf(stderr, "Could not write frame %zu\n", m_frame_count);
+        return -1;
+    }
+    return 0;
+}
+
+// the blocks encode_jpeg_frame() kept of the JPEG of frame (as passed to it) as a record of the coefficient archive
+void VideoDecoder_ffmpegImpl::build_coefficient_record(const AVFrame *frame, bool planar_yuv, int64_t pts, char type,
+                                                       const CoefficientFrame& coefficients, std::vector<uint8_t>& record)
+{
+    TRACE_SPAN("coefficients");
+    uint8_t quantLuma[64], quantChroma[64];
+    jpegQuantTables(m_jpeg_quality, quantLuma, quantChroma);
+    // RGB is converted to full range YCbCr by the encoder
+    const bool fullRange = !planar_yuv || ycbcr_view(frame).fullRange;
+    CoefArchiveWriter::build_record(record, coefficients, quantLuma, quantChroma, fullRange, pts, type,
+                                    m_coef_compression);
+}
+
+// a decoded frame on its way through the EncodePipeline
+struct FrameJob : PipelineJob
+{
+    FrameView frame;             // new reference to the decoder's frame, no pixel copy
+    int64_t  pts = AV_NOPTS_VALUE;
+    char     type = '?';         // I, P, B, ...
+    std::vector<uint8_t> coefficients; // coefficient archive record, built by the encode worker
+    bool     planar_yuv = false; // encode directly from YCbCr, otherwise convert to RGB first
+    std::shared_ptr<GopHuffman> gop; // HuffmanMode::Gop: tables shared with the other frames of the GOP
+    bool     gop_start = false;  // key frame, builds the tables of gop
+    std::chrono::steady_clock::time_point received; // when the decoder returned the frame
+    ~FrameJob()
+    {
+        if (gop_start)
+            gop->publish(nullptr); // never encoded (pipeline failed), don't leave the rest of the GOP waiting
+    }
+};
+
+int VideoDecoder_ffmpegImpl::encode_pipeline_job(PipelineJob& job_, size_t worker)
+{
+    auto& job = static_cast<FrameJob&>(job_);
+    const AVFrame* src = job.frame.get();
+    EncodeScratch& scratch = m_encode_scratch[worker];
+    if (!job.planar_yuv)
+    {
+        int ret = convert_to_rgb(src, scratch.sws, scratch.rgb);
+        if (ret < 0)
+            return ret;
+        src = scratch.rgb;
+    }
+
+    CoefficientFrame* coefficients = m_coef_writer.is_open() ? &scratch.coefficients : NULL;
+    int ret = encode_jpeg_frame(src, job.planar_yuv, job.output, job.gop.get(), job.gop_start, NULL, coefficients);
+    if (ret < 0)
+        fprintf(stderr, "Could not encode frame %zu\n", job.seq);
+    else if (coefficients)
+        build_coefficient_record(src, job.planar_yuv, job.pts, job.type, *coefficients, job.coefficients);
+    // the pictures are not needed any more, hand their buffers back to the pool
+    av_frame_unref(scratch.rgb);
+    job.frame.reset();
+    return ret;
+}
+
+int VideoDecoder_ffmpegImpl::write_pipeline_job(PipelineJob& job)
+{
+    /* the output file is a plain sequence of JPEGs (MJPEG) */
+    TRACE_SPAN("file_write");
+    if (fwrite(job.output.data(), 1, job.output.size(), m_video_dst_file) != job.output.size())
+    {
+        fprintf(stderr, "Could not write frame %zu\n", job.seq);
+        return -1;
+    }
+    if (m_coef_writer.is_open() && !m_coef_writer.append(static_cast<FrameJob&>(job).coefficients, int64_t(job.seq)))
+    {
+        fprintf(stderr, "Could not write the coefficients of frame %zu\n", job.seq);
+        return -1;
+    }
+    m_frame_latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - static_cast<FrameJob&>(job).received).count());
+    return 0;
+}
+
 //  int VideoDecoder_ffmpegImpl::output_audio_frame()
 //  {
 //      size_t unpadded_linesize = m_frame->nb_samples * av_get_bytes_per_sample((AVSampleFormat)frame->format);
@@ -76,56 +359,22 @@ int VideoDecoder_ffmpegImpl::decode_img(
     int ret = -1;
     int sts;
 
-    ret = avcodec_send_packet(m_video_dec_ctx, m_pkt);
+    {
+        TRACE_SPAN("send_packet");
+        ret = avcodec_send_packet(m_video_dec_ctx, m_pkt);
+    }
     if (ret < 0)
     {
         fprintf(stderr, "Error sending a packet for decoding\n");
         return ret;
     }
 
-    //Create SWS Context for converting from decode pixel format (like YUV420) to RGB
-    ////////////////////////////////////////////////////////////////////////////
-    m_sws_ctx = sws_getCachedContext(
-                    m_sws_ctx,
-                    m_video_dec_ctx->width,
-                    m_video_dec_ctx->height,
-                    m_video_dec_ctx->pix_fmt,
-                    m_video_dec_ctx->width,
-                    m_video_dec_ctx->height,
-                    AV_PIX_FMT_RGB24,
-                    SWS_BICUBIC,
-                    NULL,
-                    NULL,
-                    NULL);
-
-
-    if (m_sws_ctx == nullptr)
-    {
-        // return;  //Error!
-        return ret;
-    }
-    ////////////////////////////////////////////////////////////////////////////
-
-
-    //Allocate frame for storing image converted to RGB.
-    ////////////////////////////////////////////////////////////////////////////
-    //AVFrame* pRGBFrame = av_frame_alloc();
-
-    m_RGBFrame->format = AV_PIX_FMT_RGB24;
-    m_RGBFrame->width =  m_video_dec_ctx->width;
-    m_RGBFrame->height = m_video_dec_ctx->height;
-
-    sts = av_frame_get_buffer(m_RGBFrame, 0);
-    if (sts < 0)
-    {
-        return sts;
-        // return;  //Error!
-    }
-    ////////////////////////////////////////////////////////////////////////////
-
     while (ret >= 0) 
     {
-        ret = avcodec_receive_frame(m_video_dec_ctx, m_frame);
+        {
+            TRACE_SPAN("receive_frame");
+            ret = avcodec_receive_frame(m_video_dec_ctx, m_frame);
+        }
         if (ret < 0) {
             // those two return values are special and mean there is no output
             // frame available, but there were no errors during decoding
@@ -137,9 +386,16 @@ int VideoDecoder_ffmpegImpl::decode_img(
             fprintf(stderr, "Error during decoding (%s)\n", av_err2str_cpp(ret));
             return ret;
         }
+        const auto received = std::chrono::steady_clock::now();
 
-        printf("saving frame %ld \n", m_video_dec_ctx->frame_num);
-        fflush(stdout);
+        if (!sample_frame())
+        {
+            av_frame_unref(m_frame);
+            continue;
+        }
+
+        if (m_verbosity >= 1)
+            printf("saving frame %ld \n", m_video_dec_ctx->frame_num);
 
         /* the picture is allocated by the decoder. no need to
            free it */
@@ -147,66 +403,486 @@ int VideoDecoder_ffmpegImpl::decode_img(
         //pgm_save(frame->data[0], frame->linesize[0],
         //    frame->width, frame->height, buf);
          
-        //Convert from input format (e.g YUV420) to RGB and save to PPM:
-        ////////////////////////////////////////////////////////////////////////////
-        sts = sws_scale(m_sws_ctx,                //struct SwsContext* c,
-                        m_frame->data,            //const uint8_t* const srcSlice[],
-                        m_frame->linesize,        //const int srcStride[],
-                        0,                      //int srcSliceY, 
-                        m_frame->height,          //int srcSliceH,
-                        m_RGBFrame->data,        //uint8_t* const dst[], 
-                        m_RGBFrame->linesize);   //const int dstStride[]);
+        // planar YCbCr is encoded directly, everything else goes through RGB
+        // (in pipelined mode the encode workers convert to RGB themselves),
+        // decided per frame since the stream may change its format or size
+        const bool direct_yuv = m_direct_yuv && is_planar_yuv8((AVPixelFormat)m_frame->format);
+        const bool convert_rgb = !direct_yuv && !m_pipeline;
 
-        if (sts != m_frame->height)
+        //Convert from input format (e.g YUV420) to RGB:
+        ////////////////////////////////////////////////////////////////////////////
+        if (convert_rgb)
         {
-            std::cerr <<  "sts != frame->height\n";
-            return -1;
-            //return;  //Error!
+            sts = convert_to_rgb(m_frame, m_sws_ctx, m_RGBFrame);
+            if (sts < 0)
+            {
+                std::cerr <<  "Could not convert frame to RGB\n";
+                return sts;
+            }
         }
         ++m_frame_count;
-        std::cout << "Frame->width:"  << m_frame->width << std::endl;
-        std::cout << "Frame->height:" << m_frame->height << std::endl;
-        std::cout << "pRGBFrame->width:" << m_RGBFrame->width << std::endl;
-        std::cout << "pRGBFrame->height:" << m_RGBFrame->height << std::endl;
+        if (m_verbosity >= 1)
+        {
+            std::cout << "Frame->width:"  << m_frame->width << std::endl;
+            std::cout << "Frame->height:" << m_frame->height << std::endl;
+            std::cout << "pRGBFrame->width:" << m_RGBFrame->width << std::endl;
+            std::cout << "pRGBFrame->height:" << m_RGBFrame->height << std::endl;
+        }
         char frame_type[2] = {'?'};
-        std::vector<AVMotionVector> motion_vectors;
+        std::vector<AVMotionVector>& motion_vectors = m_motion_vectors;
         retrieve_motion( frame_type, motion_vectors ); 
-        std::cout << "motion_vectors:" << motion_vectors.size() << std::endl;
-        std::cout << "frame_type:" << frame_type << std::endl;
+        if (m_verbosity >= 1)
+        {
+            std::cout << "motion_vectors:" << motion_vectors.size() << std::endl;
+            std::cout << "frame_type:" << frame_type << std::endl;
+        }
+        if (m_mv_writer.is_open() &&
+            !m_mv_writer.append(int64_t(m_frame_count - 1), m_frame->pts, frame_type[0], motion_vectors.data(), motion_vectors.size()))
+        {
+            fprintf(stderr, "Could not write the motion vectors of frame %zu\n", m_frame_count);
+            return -1;
+        }
+        if (m_incremental && !m_pipeline)
+            mark_motion(motion_vectors);
+
+        // HuffmanMode::Gop: each key frame starts a new set of tables
+        bool gop_start = false;
+        if (m_huffman_mode == HuffmanMode::Gop && (!m_gop_huffman || (m_frame->flags & AV_FRAME_FLAG_KEY)))
+        {
+            m_gop_huffman = std::make_shared<GopHuffman>();
+            gop_start = true;
+        }
+
+        if (m_pipeline)
+        {
+            auto job = std::make_unique<FrameJob>();
+            job->frame.reset(m_frame);
+            job->pts = m_frame->pts;
+            job->type = frame_type[0];
+            job->planar_yuv = direct_yuv;
+            job->gop = m_gop_huffman;
+            job->gop_start = gop_start;
+            job->received = received;
+            if (!job->frame)
+                return AVERROR(ENOMEM);
+            if (!m_pipeline->push(job.release()))
+                return -1;
+        }
+        else
+        {
+            AVFrame *src = direct_yuv ? m_frame : m_RGBFrame;
+            sts = write_jpeg_frame(src, direct_yuv, m_gop_huffman.get(), gop_start);
+            if (sts < 0)
+                return sts;
+            if (m_coef_writer.is_open())
+            {
+                build_coefficient_record(src, direct_yuv, m_frame->pts, frame_type[0], m_coef_frame, m_coef_record);
+                if (!m_coef_writer.append(m_coef_record, int64_t(m_frame_count - 1)))
+                {
+                    fprintf(stderr, "Could not write the coefficients of frame %zu\n", m_frame_count);
+                    return -1;
+                }
+            }
+            m_frame_latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - received).count());
+            if (m_incremental && m_verbosity >= 1)
+                std::cout << "reused_blocks:" << m_block_cache.reusedBlocks() << "/" << m_block_cache.totalBlocks() << std::endl;
+        }
           
         
         //snprintf(buf, sizeof(buf), "%s_%03d.ppm", filename, dec_ctx->frame_num);
         //ppm_save(pRGBFrame->data[0], pRGBFrame->linesize[0], pRGBFrame->width, pRGBFrame->height, buf);
         ////////////////////////////////////////////////////////////////////////////
+        // both buffers go back to the frame pool
+        av_frame_unref(m_RGBFrame);
         av_frame_unref(m_frame);
     }
 
-    //Free
-    av_frame_unref(m_RGBFrame);
-    sws_freeContext(m_sws_ctx);
-    av_frame_free(&m_RGBFrame);
     return 0;
 }
 
+// counts the decoded frame and decides whether it is emitted (fps sampler), plans a jump to a later key frame
+// if that saves decoding frames nobody asked for
+bool VideoDecoder_ffmpegImpl::sample_frame()
+{
+    m_decoded_frames++;
+    if (m_sample_fps <= 0)
+        return true;
+
+    const double interval = 1. / m_sample_fps;
+    const int64_t pts = m_frame->best_effort_timestamp;
+    double time = pts * av_q2d(m_video_stream->time_base);
+    if (pts == AV_NOPTS_VALUE)
+    {
+        // without timestamps the frames are counted at the guessed frame rate (25 fps if that is unknown)
+        AVRational rate = av_guess_frame_rate(m_fmt_ctx, m_video_stream, NULL);
+        if (rate.num <= 0 || rate.den <= 0)
+            rate = AVRational{ 25, 1 };
+        time = (m_decoded_frames - 1) / av_q2d(rate);
+    }
+    if (m_next_sample_time >= 0 && time < m_next_sample_time - 1e-6)
+        return false;
+
+    // the next sample time; after a gap in the timestamps (the stream skipped a whole interval) one interval
+    // after this frame, so the frames after the gap are not emitted in a burst to catch up
+    const double next = m_next_sample_time + interval;
+    m_next_sample_time = m_next_sample_time < 0 || next <= time + 1e-6 ? time + interval : next;
+
+    // the last key frame before the next sample, if the demuxer has not read it yet, everything up to it can be skipped
+    const int64_t target = av_rescale_q(int64_t(m_next_sample_time * AV_TIME_BASE), AV_TIME_BASE_Q, m_video_stream->time_base);
+    const AVIndexEntry *key = avformat_index_get_entry_from_timestamp(m_video_stream, target, AVSEEK_FLAG_BACKWARD);
+    if (key && m_last_dts != AV_NOPTS_VALUE && key->timestamp > m_last_dts)
+        m_seek_target = key->timestamp;
+    return true;
+}
+
+// GOP-parallel mode: where the file can be cut, key frames at least half a second apart (an intra only stream
+// would otherwise give one range, i.e. one seek, per frame), false if it can't be cut
+bool VideoDecoder_ffmpegImpl::scan_key_frames(int stream_idx, std::vector<GopKey>& keys)
+{
+    const int64_t min_distance = av_rescale_q(AV_TIME_BASE / 2, AV_TIME_BASE_Q, m_video_stream->time_base);
+    auto add = [&](int64_t timestamp, int64_t pos)
+    {
+        if (timestamp != AV_NOPTS_VALUE && (keys.empty() || timestamp - keys.back().timestamp >= min_distance))
+            keys.push_back({ timestamp, pos });
+    };
+
+    // the container index (mp4 sample table, mkv cues) has them without reading the file
+    const int entries = avformat_index_get_entries_count(m_video_stream);
+    for (int i = 0; i < entries; i++)
+    {
+        const AVIndexEntry *entry = avformat_index_get_entry(m_video_stream, i);
+        if (entry->flags & AVINDEX_KEYFRAME)
+            add(entry->timestamp, entry->pos);
+    }
+
+    // no index (e.g. MPEG-TS): one pass over the packets, nothing is decoded
+    if (keys.size() < 2)
+    {
+        keys.clear();
+        while (av_read_frame(m_fmt_ctx, m_pkt) >= 0)
+        {
+            if (m_pkt->stream_index == stream_idx && (m_pkt->flags & AV_PKT_FLAG_KEY))
+                add(m_pkt->dts != AV_NOPTS_VALUE ? m_pkt->dts : m_pkt->pts, m_pkt->pos);
+            av_packet_unref(m_pkt);
+        }
+        // back to the start for the serial fallback
+        if (avformat_seek_file(m_fmt_ctx, -1, INT64_MIN, INT64_MIN, INT64_MAX, 0) < 0)
+            av_seek_frame(m_fmt_ctx, -1, 0, AVSEEK_FLAG_BYTE);
+    }
+
+    // the workers recognize the key packets by their byte position
+    return keys.size() >= 2 &&
+           std::all_of(keys.begin(), keys.end(), [](const GopKey& key) { return key.pos >= 0; });
+}
+
+// a demuxer and decoder of its own, the stream parameters come from the already probed main context
+int VideoDecoder_ffmpegImpl::open_gop_worker(GopWorker& worker)
+{
+    int ret = m_input ? m_input->open_input(&worker.fmt, m_src_filename)
+                      : avformat_open_input(&worker.fmt, m_src_filename, NULL, NULL);
+    if (ret < 0)
+        return ret;
+    const AVCodec *dec = avcodec_find_decoder(m_video_stream->codecpar->codec_id);
+    if (!dec)
+        return AVERROR_DECODER_NOT_FOUND;
+    worker.dec         = avcodec_alloc_context3(dec);
+    worker.pkt         = av_packet_alloc();
+    worker.frame       = av_frame_alloc();
+    worker.scratch.rgb = av_frame_alloc();
+    if (!worker.dec || !worker.pkt || !worker.frame || !worker.scratch.rgb)
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_to_context(worker.dec, m_video_stream->codecpar)) < 0)
+        return ret;
+    worker.dec->pkt_timebase = m_video_stream->time_base;
+    worker.dec->thread_count = 1; // the workers are the parallelism
+    m_frame_pool.attach(worker.dec);
+
+    AVDictionary *opts = NULL;
+    av_dict_set(&opts, "flags2", "+export_mvs", 0);
+    ret = avcodec_open2(worker.dec, dec, &opts);
+    av_dict_free(&opts);
+    return ret;
+}
+
+void VideoDecoder_ffmpegImpl::close_gop_worker(GopWorker& worker)
+{
+    sws_freeContext(worker.scratch.sws);
+    av_frame_free(&worker.scratch.rgb);
+    av_frame_free(&worker.frame);
+    av_packet_free(&worker.pkt);
+    avcodec_free_context(&worker.dec);
+    InputSource::close_input(&worker.fmt);
+}
+
+// decode and encode the frames of [key, next): presentation times from the pts of the key packet up to the pts
+// of the next key packet. Open GOPs: the leading frames of the next key frame (decoded after it, shown before it)
+// belong to this range, so it reads on past the next key frame until the first packet shown after it; the worker
+// of the next range decodes them without their references and throws them away
+int VideoDecoder_ffmpegImpl::decode_gop(GopWorker& worker, int stream_idx, const GopKey& key, const GopKey* next,
+                                        bool first, GopRange& range)
+{
+    TRACE_SPAN("decode_gop");
+    range.arena = m_arenas.acquire();
+    avcodec_flush_buffers(worker.dec);
+    int ret = av_seek_frame(worker.fmt, stream_idx, key.timestamp, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+        return ret;
+
+    int64_t start_pts = INT64_MIN;    // the pts of the key packet, except for the first range, which also keeps
+                                      // whatever the decoder shows before the first key frame
+    int64_t end_pts   = INT64_MAX;    // known once the next key packet is read
+    bool started = false, passed_next = false;
+    while ((ret = av_read_frame(worker.fmt, worker.pkt)) >= 0)
+    {
+        AVPacket *pkt = worker.pkt;
+        const bool is_key = pkt->flags & AV_PKT_FLAG_KEY;
+        if (pkt->stream_index != stream_idx || (!started && !(is_key && pkt->pos >= key.pos)))
+        {
+            // other streams, or packets before our key frame the seek landed on
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (!started)
+        {
+            started = true;
+            if (pkt->pts == AV_NOPTS_VALUE || (next && pkt->pos >= next->pos))
+                ret = AVERROR_INVALIDDATA; // no pts to place the frames by, or the seek overshot
+            else if (!first)
+                start_pts = pkt->pts;
+        }
+        else if (next && !passed_next && is_key && pkt->pos >= next->pos)
+        {
+            passed_next = true;
+            end_pts = pkt->pts;
+            if (end_pts == AV_NOPTS_VALUE)
+                ret = AVERROR_INVALIDDATA;
+        }
+        else if (passed_next && (pkt->pts == AV_NOPTS_VALUE || pkt->pts >= end_pts))
+        {
+            // shown after the next key frame: every frame of the range has been sent
+            av_packet_unref(pkt);
+            break;
+        }
+        if (ret >= 0)
+        {
+            TRACE_SPAN("send_packet");
+            ret = avcodec_send_packet(worker.dec, pkt);
+        }
+        av_packet_unref(pkt);
+        if (ret >= 0)
+            ret = receive_gop_frames(worker, range, start_pts, end_pts);
+        if (ret < 0)
+            return ret;
+    }
+    if (!started)
+        return AVERROR_INVALIDDATA;
+
+    // drain the decoder, avcodec_flush_buffers() at the next range resets it
+    ret = avcodec_send_packet(worker.dec, NULL);
+    if (ret >= 0)
+        ret = receive_gop_frames(worker, range, start_pts, end_pts);
+    return ret;
+}
+
+// encode the decoded frames within [start_pts, end_pts), drop the others
+int VideoDecoder_ffmpegImpl::receive_gop_frames(GopWorker& worker, GopRange& range, int64_t start_pts, int64_t end_pts)
+{
+    for (;;)
+    {
+        int ret;
+        {
+            TRACE_SPAN("receive_frame");
+            ret = avcodec_receive_frame(worker.dec, worker.frame);
+        }
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret < 0)
+            return ret;
+        const auto received = std::chrono::steady_clock::now();
+        AVFrame *frame = worker.frame;
+        range.decoded++;
+
+        const int64_t pts = frame->best_effort_timestamp;
+        if (pts != AV_NOPTS_VALUE && (pts < start_pts || pts >= end_pts))
+        {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        const bool direct_yuv = m_direct_yuv && is_planar_yuv8((AVPixelFormat)frame->format);
+        AVFrame *src = frame;
+        if (!direct_yuv)
+        {
+            ret = convert_to_rgb(frame, worker.scratch.sws, worker.scratch.rgb);
+            if (ret < 0)
+            {
+                av_frame_unref(frame);
+                return ret;
+            }
+            src = worker.scratch.rgb;
+        }
+
+        // HuffmanMode::Gop: each key frame starts a new set of tables
+        bool gop_start = false;
+        if (m_huffman_mode == HuffmanMode::Gop && (!range.gop || (frame->flags & AV_FRAME_FLAG_KEY)))
+        {
+            range.gop = std::make_shared<GopHuffman>();
+            gop_start = true;
+        }
+
+        GopFrame out{ pts, av_get_picture_type_char(frame->pict_type),
+                      std::pmr::vector<AVMotionVector>(range.arena.get()), {}, {}, received };
+        if (const AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS))
+        {
+            const AVMotionVector *mvs = (const AVMotionVector *)sd->data;
+            out.motion_vectors.assign(mvs, mvs + sd->size / sizeof(*mvs));
+        }
+        CoefficientFrame* coefficients = m_coef_writer.is_open() ? &worker.scratch.coefficients : NULL;
+        ret = encode_jpeg_frame(src, direct_yuv, out.jpeg, range.gop.get(), gop_start, NULL, coefficients);
+        if (ret >= 0 && coefficients)
+            build_coefficient_record(src, direct_yuv, pts, out.type, *coefficients, out.coefficients);
+        // both buffers go back to the frame pool
+        av_frame_unref(worker.scratch.rgb);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+        range.frames.push_back(std::move(out));
+    }
+}
+
+// append a finished range to the outputs, called in range order
+int VideoDecoder_ffmpegImpl::write_gop(size_t index, GopRange& range)
+{
+    TRACE_SPAN("file_write");
+    if (m_verbosity >= 1)
+        printf("gop %zu: %zu frames decoded, %zu emitted\n", index, range.decoded, range.frames.size());
+    m_decoded_frames += range.decoded;
+    for (GopFrame& frame : range.frames)
+    {
+        if (m_mv_writer.is_open() &&
+            !m_mv_writer.append(int64_t(m_frame_count), frame.pts, frame.type,
+                                frame.motion_vectors.data(), frame.motion_vectors.size()))
+        {
+            fprintf(stderr, "Could not write the motion vectors of frame %zu\n", m_frame_count);
+            return -1;
+        }
+        if (m_coef_writer.is_open() && !m_coef_writer.append(frame.coefficients, int64_t(m_frame_count)))
+        {
+            fprintf(stderr, "Could not write the coefficients of frame %zu\n", m_frame_count);
+            return -1;
+        }
+        if (fwrite(frame.jpeg.data(), 1, frame.jpeg.size(), m_video_dst_file) != frame.jpeg.size())
+        {
+            fprintf(stderr, "Could not write frame %zu\n", m_frame_count);
+            return -1;
+        }
+        m_frame_count++;
+        m_frame_latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - frame.received).count());
+    }
+    range.frames = {};
+    range.arena.reset();
+    return 0;
+}
+
+// every worker takes the next range, whoever finishes the oldest outstanding range writes everything that is
+// complete; at most 2 ranges per worker are decoded ahead of the writer, which bounds the buffered JPEGs
+int VideoDecoder_ffmpegImpl::decode_gops(int stream_idx, const std::vector<GopKey>& keys)
+{
+    std::vector<GopRange> ranges(keys.size());
+    const size_t window = 2 * m_gop_workers;
+    std::atomic<size_t> next_range{0};
+    size_t next_write = 0;
+    int error = 0;
+    boost::mutex mutex;
+    boost::condition_variable written;
+
+    ThreadPool pool(m_gop_workers);
+    pool.parallel_for(m_gop_workers, [&](size_t)
+    {
+        char err[AV_ERROR_MAX_STRING_SIZE]; // av_err2str_cpp() has a single buffer
+        GopWorker worker;
+        int ret = open_gop_worker(worker);
+        if (ret < 0)
+            fprintf(stderr, "Could not open a GOP decoder (%s)\n", av_make_error_string(err, sizeof(err), ret));
+        for (size_t r = next_range++; ret >= 0 && r < ranges.size(); r = next_range++)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                written.wait(lock, [&] { return error < 0 || r < next_write + window; });
+                if (error < 0)
+                    break;
+            }
+            ret = decode_gop(worker, stream_idx, keys[r], r + 1 < keys.size() ? &keys[r + 1] : nullptr, r == 0, ranges[r]);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Could not decode GOP %zu (%s)\n", r, av_make_error_string(err, sizeof(err), ret));
+                break;
+            }
+            boost::lock_guard<boost::mutex> lock(mutex);
+            ranges[r].done = true;
+            for (; ret >= 0 && next_write < ranges.size() && ranges[next_write].done; next_write++)
+                ret = write_gop(next_write, ranges[next_write]);
+            if (ret < 0)
+                error = ret;
+            written.notify_all();
+        }
+        close_gop_worker(worker);
+        if (ret < 0)
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (error == 0)
+                error = ret;
+            written.notify_all();
+        }
+    });
+    return error;
+}
+
+// tell the block cache which parts of the current frame are unchanged since the previous one: blocks predicted
+// with zero motion (AVMotionVector has no skip/residual flag, zero motion counts as a skip, the drift bound of
+// the cache limits the error of a residual); blocks with motion change, intra blocks have no vector and are
+// never reused, I-frames are encoded completely.
+// The cache holds the last emitted frame, so only a P-frame that directly follows its anchor (the previous
+// decoded frame was an emitted I- or P-frame) may reuse blocks, and only those predicted from the past
+// (source < 0). B-frames and the first P-frame after B-frames (it predicts from the older anchor) are encoded
+// completely. The vectors do not tell which past frame a block refers to
+// (H.264 multiple references), the drift bound covers that as well.
+void VideoDecoder_ffmpegImpl::mark_motion(const std::vector<AVMotionVector>& motion_vectors)
+{
+    const bool follows_anchor = m_cache_anchor != 0 && m_cache_anchor + 1 == m_decoded_frames;
+    const bool anchor = m_frame->pict_type == AV_PICTURE_TYPE_I || m_frame->pict_type == AV_PICTURE_TYPE_P;
+    m_cache_anchor = anchor ? m_decoded_frames : 0;
+
+    m_block_cache.startFrame(m_frame->width, m_frame->height);
+    if (m_frame->pict_type != AV_PICTURE_TYPE_P || !follows_anchor)
+    {
+        m_block_cache.refresh();
+        return;
+    }
+    for (const AVMotionVector& mv : motion_vectors)
+    {
+        // dst_x/dst_y is the center of the predicted block
+        const int x = mv.dst_x - mv.w / 2;
+        const int y = mv.dst_y - mv.h / 2;
+        if (mv.source < 0 && mv.motion_x == 0 && mv.motion_y == 0)
+            m_block_cache.markUnchanged(x, y, mv.w, mv.h);
+        else
+            m_block_cache.markChanged(x, y, mv.w, mv.h);
+    }
+}
+
 bool VideoDecoder_ffmpegImpl::retrieve_motion(
     char *frame_type,
     std::vector<AVMotionVector>& motion_vectors
     ) 
     {
 
+    motion_vectors.clear();
     if (!m_video_stream || !(this->m_frame->data[0]))
         return false;
 
-    // change color space of frame
-    sws_scale(
-        m_sws_ctx,
-        m_frame->data,
-        m_frame->linesize,
-        0, m_video_dec_ctx->coded_height,
-        m_RGBFrame->data,
-        m_RGBFrame->linesize
-        );
-
     //*frame = this->picture.data;
     //*width = this->picture.width;
     //*height = this->picture.height;
@@ -214,20 +890,23 @@ bool VideoDecoder_ffmpegImpl::retrieve_motion(
     //*cn = this->picture.cn;
 
     // get motion vectors
+    TRACE_SPAN("motion_vectors");
     AVFrameSideData *sd = av_frame_get_side_data(m_frame, AV_FRAME_DATA_MOTION_VECTORS);
-    std::cout << "sd:" << sd << std::endl;
+    if (m_verbosity >= 2)
+        std::cout << "sd:" << sd << std::endl;
     if (sd) {
         AVMotionVector *mvs = (AVMotionVector *)sd->data;
 
         int num_mvs = sd->size / sizeof(*mvs);
-        std::cout << "num_mvs:" << num_mvs << std::endl;
+        if (m_verbosity >= 2)
+            std::cout << "num_mvs:" << num_mvs << std::endl;
 
-        if (num_mvs > 0) {
+        // store the motion vectors, printed only if they don't go to the binary file
+        motion_vectors.assign(mvs, mvs + num_mvs);
+        if (num_mvs > 0 && m_verbosity >= 2 && !m_mv_writer.is_open()) {
 
-            // store the motion vectors 
             for (MVS_DTYPE i = 0; i < num_mvs; ++i) 
             {
-                motion_vectors.push_back(mvs[i]);
                 printf( "fc: %ld, src %2d, w %2d, h %2d, sx %4d, sy %4d, dx %4d, dy %4d, flags: 0x%" PRIx64 ", motionx %4d, motiony %4d, scale %4d\n ",
                     m_frame_count, mvs[i].source,
                     mvs[i].w, mvs[i].h, mvs[i].src_x, mvs[i].src_y,
@@ -290,6 +969,14 @@ int VideoDecoder_ffmpegImpl::open_codec_context(int *stream_idx,
          /* Init the decoders */
          AVDictionary *opts = NULL;
          av_dict_set(&opts, "flags2", "+export_mvs", 0);
+         if (type == AVMEDIA_TYPE_VIDEO)
+         {
+             m_frame_pool.attach(*dec_ctx);
+             if (m_frame_selection == FrameSelection::KeyFrames)
+                 (*dec_ctx)->skip_frame = AVDISCARD_NONKEY;
+             else if (m_frame_selection == FrameSelection::References)
+                 (*dec_ctx)->skip_frame = AVDISCARD_NONREF;
+         }
          if ((ret = avcodec_open2(*dec_ctx, dec, &opts)) < 0) {
              fprintf(stderr, "Failed to open %s codec\n",
                      av_get_media_type_string(type));
@@ -331,18 +1018,20 @@ int VideoDecoder_ffmpegImpl::get_format_from_sample_fmt(const char **fmt,
      return -1;
  }
 
- void VideoDecoder_ffmpegImpl::decode_encode(
+ int VideoDecoder_ffmpegImpl::decode_encode(
     const char* src_filename,
     const char* video_dst_filename
 )
  {    
     m_src_filename = src_filename;
     int ret = 0;
+    int status = 0; // first error after the outputs were opened, they are still closed properly
     int video_stream_idx = -1; 
     int audio_stream_idx = -1;
     //AVCodecContext * video_dec_ctx;
      /* open input file, and allocate format context */
-     if (avformat_open_input(&m_fmt_ctx, src_filename, NULL, NULL) < 0) {
+     if ((m_input ? m_input->open_input(&m_fmt_ctx, src_filename)
+                  : avformat_open_input(&m_fmt_ctx, src_filename, NULL, NULL)) < 0) {
         fprintf(stderr, "Could not open source file %s\n", src_filename);
         exit(1);
     }
@@ -363,6 +1052,18 @@ int VideoDecoder_ffmpegImpl::get_format_from_sample_fmt(const char **fmt,
             clean_up_exit();
         }
 
+        if (m_mv_filename && !m_mv_writer.open(m_mv_filename)) {
+            fprintf(stderr, "Could not open motion vector file %s (or it is not one)\n", m_mv_filename);
+            ret = 1;
+            clean_up_exit();
+        }
+
+        if (m_coef_filename && !m_coef_writer.open(m_coef_filename)) {
+            fprintf(stderr, "Could not open coefficient archive %s (or it is not one)\n", m_coef_filename);
+            ret = 1;
+            clean_up_exit();
+        }
+
         /* allocate image where the decoded image will be put */
         m_width   =  m_video_dec_ctx->width;
         m_height  =  m_video_dec_ctx->height;
@@ -371,14 +1072,6 @@ int VideoDecoder_ffmpegImpl::get_format_from_sample_fmt(const char **fmt,
         std::cout << "m_width:" << m_width << std::endl;
         std::cout << "m_height:" << m_height << std::endl;
         std::cout << "m_pix_fmt:" << m_pix_fmt << std::endl;
-
-        ret = av_image_alloc(m_video_dst_data, m_video_dst_linesize,
-            m_width, m_height, m_pix_fmt, 1);
-        if (ret < 0) {
-            fprintf(stderr, "Could not allocate raw video buffer\n");
-            clean_up_exit();
-        }
-        m_video_dst_bufsize = ret;
     }
 
     /*   
@@ -429,46 +1122,143 @@ int VideoDecoder_ffmpegImpl::get_format_from_sample_fmt(const char **fmt,
     // if (audio_stream)
     //     printf("Demuxing audio from file '%s' into '%s'\n", src_filename, audio_dst_filename);
 
+    if (m_video_stream && m_pipeline_workers > 0)
+    {
+        m_encode_scratch.resize(m_pipeline_workers);
+        for (auto& scratch : m_encode_scratch)
+        {
+            scratch.rgb = av_frame_alloc();
+            if (!scratch.rgb) {
+                fprintf(stderr, "Could not allocate RGB frame\n");
+                clean_up_exit();
+            }
+        }
+        m_pipeline = std::make_unique<EncodePipeline>(m_pipeline_workers, m_pipeline_depth,
+            [this](PipelineJob& job, size_t worker) { return encode_pipeline_job(job, worker); },
+            [this](PipelineJob& job) { return write_pipeline_job(job); });
+    }
+    auto decode_start = std::chrono::steady_clock::now();
+
+    // GOP-parallel mode replaces the read loop below, a file that can't be cut is decoded serially
+    bool gop_parallel = false;
+    if (m_video_stream && m_gop_workers > 0 && m_input && !m_input->shareable())
+        fprintf(stderr, "The workers can't share a piped input, decoding serially\n");
+    else if (m_video_stream && m_gop_workers > 0)
+    {
+        std::vector<GopKey> keys;
+        gop_parallel = scan_key_frames(video_stream_idx, keys);
+        if (gop_parallel)
+        {
+            printf("Decoding %zu GOP ranges on %zu workers\n", keys.size(), m_gop_workers);
+            status = decode_gops(video_stream_idx, keys);
+            if (status < 0)
+                fprintf(stderr, "GOP-parallel decoding failed\n");
+        }
+        else
+            fprintf(stderr, "No key frame positions to cut the input at, decoding serially\n");
+    }
+
     /* read frames from the file */
-    while (av_read_frame(m_fmt_ctx, m_pkt) >= 0) {
+    while (!gop_parallel && av_read_frame(m_fmt_ctx, m_pkt) >= 0) {
         // check if the packet belongs to a stream we are interested in, otherwise
         // skip it
         if (m_pkt->stream_index == video_stream_idx)
         {
+            // key frames only: the other packets never reach the decoder
+            if (m_frame_selection == FrameSelection::KeyFrames && !(m_pkt->flags & AV_PKT_FLAG_KEY))
+            {
+                m_skipped_packets++;
+                av_packet_unref(m_pkt);
+                continue;
+            }
+            m_last_dts = m_pkt->dts;
             char frame_type[2] = "?"; 
             int32_t *motion_vectors=nullptr; 
             int32_t num_mvs;
             ret = decode_img(frame_type, &motion_vectors, &num_mvs);
-            
+
+            // fps sampler: the next wanted frame is behind a key frame further on, jump there
+            if (ret >= 0 && m_seek_target != AV_NOPTS_VALUE)
+            {
+                if (av_seek_frame(m_fmt_ctx, video_stream_idx, m_seek_target, AVSEEK_FLAG_BACKWARD) >= 0)
+                {
+                    avcodec_flush_buffers(m_video_dec_ctx);
+                    m_sample_seeks++;
+                }
+                m_seek_target = AV_NOPTS_VALUE;
+            }
         }
         else if (m_pkt->stream_index == audio_stream_idx)
             assert(false && "audio decodeing NOT implemented");
             //ret = decode_packet(audio_dec_ctx, pkt);
         av_packet_unref(m_pkt);
         if (ret < 0)
+        {
+            status = ret;
             break;
+        }
     }
 
     /* flush the decoders */
-    if (m_video_dec_ctx)
+    if (m_video_dec_ctx && !gop_parallel)
     {
         char frame_type[2] = "?"; 
         int32_t *motion_vectors=nullptr; 
         int32_t num_mvs;         
         ret = decode_img( frame_type, &motion_vectors, &num_mvs);
+        if (status == 0)
+            status = ret;
     }
     //if (m_audio_dec_ctx)
     //    decode_packet(m_audio_dec_ctx, NULL);
 
+    if (m_pipeline)
+    {
+        m_pipeline->add_decode_time(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - decode_start).count());
+        ret = m_pipeline->finish();
+        if (ret < 0)
+        {
+            fprintf(stderr, "Encoding pipeline failed\n");
+            if (status == 0)
+                status = ret;
+        }
+        m_pipeline->report(stderr);
+        m_pipeline.reset();
+        for (auto& scratch : m_encode_scratch)
+        {
+            sws_freeContext(scratch.sws);
+            av_frame_free(&scratch.rgb);
+        }
+        m_encode_scratch.clear();
+    }
+    av_frame_free(&m_RGBFrame);
+    sws_freeContext(m_sws_ctx);
+    m_sws_ctx = NULL;
+    m_frame_pool.report(stderr);
+    m_arenas.report(stderr);
+    if (!m_coef_writer.close())
+    {
+        fprintf(stderr, "Could not write the index of coefficient archive %s\n", m_coef_filename);
+        if (status == 0)
+            status = AVERROR(EIO);
+    }
+    fprintf(stderr, "frames: %zu decoded, %zu emitted, %zu packets skipped, %zu seeks\n",
+            m_decoded_frames, m_frame_count, m_skipped_packets, m_sample_seeks);
+
+    if (status < 0)
+    {
+        fprintf(stderr, "Decoding failed, the output ends after %zu frames\n", m_frame_count);
+        return status;
+    }
     printf("Demuxing succeeded.\n");
 
     if (m_video_stream) {
         printf("Play the output video file with the command:\n"
-               "ffplay -f rawvideo -pix_fmt %s -video_size %dx%d %s\n",
-               av_get_pix_fmt_name(m_pix_fmt), m_width, m_height,
+               "ffplay -f mjpeg %s\n",
                video_dst_filename);
     }
-
+    return 0;
  }
 
  void VideoDecoder_ffmpegImpl::clean_up_exit()
@@ -477,39 +1267,175 @@ int VideoDecoder_ffmpegImpl::get_format_from_sample_fmt(const char **fmt,
         fclose(m_video_dst_file);
     //if (audio_dst_file)
     //    fclose(m_audio_dst_file);
-    av_free(m_video_dst_data[0]);
     av_frame_free(&m_frame);
     av_packet_free(&m_pkt);
     av_frame_unref(m_RGBFrame);
     sws_freeContext(m_sws_ctx);
     av_frame_free(&m_RGBFrame);
 
-    avformat_close_input(&m_fmt_ctx);
+    InputSource::close_input(&m_fmt_ctx);
     avcodec_free_context(&m_video_dec_ctx);
     avcodec_free_context(&m_audio_dec_ctx);
     exit(1);
 }
 
+#ifndef DCTENCODER_NO_MAIN // e2e_bench links the decoder with its own main()
  int main (int argc, char **argv)
  {
      int ret = 0;
- 
-     if (argc != 3) {
-         fprintf(stderr, "usage: %s  input_file video_output_file audio_output_file\n"
-                 "API example program to show how to read frames from an input file.\n"
-                 "This program reads frames from a file, decodes them, and writes decoded\n"
-                 "video frames to a rawvideo file named video_output_file, and decoded\n"
-                 "audio frames to a rawaudio file named audio_output_file.\n",
+     int opt;
+     int quality = 90;
+     bool downsample = true;
+     bool direct_yuv = true;
+     int jpeg_threads = -1;
+     int restart_mcu_rows = 1;
+     int pipeline_workers = 0;
+     int pipeline_depth = 8;
+     bool huge_pages = false;
+     DctMethod dct = DctMethod::Float;
+     HuffmanMode huffman = HuffmanMode::Standard;
+     int max_reuse = -1;
+     const char* mv_filename = NULL;
+     const char* coef_filename = NULL;
+     bool coef_zero_runs = false;
+     const char* trace_filename = NULL;
+     int verbosity = 0;
+     FrameSelection selection = FrameSelection::All;
+     double sample_fps = 0;
+     int gop_workers = 0;
+     const char* input_method = "file";
+     int thumbnail = 1;
+
+     while ((opt = getopt(argc, argv, "q:s:j:r:Rp:d:HD:O:I:m:C:zT:v:x:F:g:i:t:")) != -1) {
+         switch (opt) {
+         case 'q': quality = atoi(optarg); break;
+         case 's': downsample = atoi(optarg) != 444; break;
+         case 'j': jpeg_threads = atoi(optarg); break;
+         case 'r': restart_mcu_rows = atoi(optarg); break;
+         case 'R': direct_yuv = false; break;
+         case 'p': pipeline_workers = atoi(optarg); break;
+         case 'd': pipeline_depth = atoi(optarg); break;
+         case 'H': huge_pages = true; break;
+         case 'D': dct = strcmp(optarg, "int") == 0 ? DctMethod::Int16 : DctMethod::Float; break;
+         case 'O': huffman = strcmp(optarg, "gop") == 0 ? HuffmanMode::Gop : HuffmanMode::Frame; break;
+         case 'I': max_reuse = atoi(optarg); break;
+         case 'm': mv_filename = optarg; break;
+         case 'C': coef_filename = optarg; break;
+         case 'z': coef_zero_runs = true; break;
+         case 'T': trace_filename = optarg; break;
+         case 'v': verbosity = atoi(optarg); break;
+         case 'x': selection = strcmp(optarg, "key") == 0 ? FrameSelection::KeyFrames
+                             : strcmp(optarg, "ref") == 0 ? FrameSelection::References : FrameSelection::All; break;
+         case 'F': sample_fps = atof(optarg); break;
+         case 'g': gop_workers = atoi(optarg); break;
+         case 'i': input_method = optarg; break;
+         case 't': thumbnail = atoi(optarg); break;
+         default: argc = 0; break;
+         }
+     }
+
+     if (argc - optind != 2) {
+         fprintf(stderr, "usage: %s [options] input_file video_output_file\n"
+                 "Reads frames from an input file (- = stdin), decodes them, and writes every decoded\n"
+                 "video frame as JPEG to video_output_file (a MJPEG stream).\n"
+                 "  -q quality   JPEG quality 1..100 (default 90)\n"
+                 "  -s 420|444   chroma subsampling of the JPEGs (default 420)\n"
+                 "  -j threads   encode each JPEG on this many threads (0 = one per core), off by default\n"
+                 "  -r rows      MCU rows per restart interval when encoding on threads (default 1)\n"
+                 "  -R           always convert to RGB before encoding (no direct YCbCr path)\n"
+                 "  -p workers   decode on one thread and encode frames on this many threads (default 0 = serial)\n"
+                 "  -d frames    capacity of the queues between decode, encode and write (default 8)\n"
+                 "  -H           back the frame buffers by huge pages\n"
+                 "  -D float|int DCT and quantization in float (default) or 16 bit fixed point\n"
+                 "  -O frame|gop optimized Huffman tables for every frame, or per GOP from its key frame\n"
+                 "  -I frames    incremental encoding: keep the blocks of P-frame macroblocks without motion for at\n"
+                 "               most this many frames in a row (serial mode only, I- and B-frames and the first\n"
+                 "               P-frame after B-frames are encoded completely)\n"
+                 "  -m file      append the motion vectors to a binary file (columnar, see mv_stream.hpp) instead of printing them\n"
+                 "  -C file      append the quantized DCT coefficients of every JPEG to a memory-mappable archive\n"
+                 "               (see coef_archive.hpp), the very blocks of the JPEG (-q, -s, -D and -t apply)\n"
+                 "  -z           drop the zero coefficients in the -C archive (a bit mask per block)\n"
+                 "  -T file      write the tracing spans as Chrome trace JSON (needs a build with DCT_TRACE)\n"
+                 "  -v level     per frame console output: 0 none (default), 1 frame info, 2 also every motion vector\n"
+                 "  -x key|ref   decode key frames only, or only frames used as references (skips non-reference B-frames)\n"
+                 "  -F fps       emit at most this many frames per second of video, decoding only what is needed for them\n"
+                 "  -g workers   cut the input at key frames and decode the pieces on this many threads, each with\n"
+                 "               its own decoder (every frame, replaces -p, -I, -x and -F)\n"
+                 "  -i file|map|mem  read the input through ffmpeg's file protocol (default), memory map it, or\n"
+                 "               load it into memory first\n"
+                 "  -t 2|4|8     thumbnails: JPEGs at 1/2, 1/4 or 1/8 of the size, downscaled like a scaled IDCT\n"
+                 "               (one N x 8 matrix per dimension applied to the pixels, see dct_scale.hpp)\n",
                  argv[0]);
          exit(1);
      }
     char* src_filename;
     char* video_dst_filename;
-    src_filename = argv[1];
-    video_dst_filename = argv[2];
+    src_filename = argv[optind];
+    video_dst_filename = argv[optind + 1];
     VideoDecoder_ffmpegImpl codec ;
-    codec.decode_encode(src_filename, video_dst_filename);
+    std::vector<uint8_t> input_data; // -i mem
+    if (strcmp(src_filename, "-") == 0)
+        codec.set_input(InputSource::pipe(STDIN_FILENO));
+    else if (strcmp(input_method, "map") == 0)
+    {
+        std::shared_ptr<InputSource> source = InputSource::map_file(src_filename);
+        if (!source)
+        {
+            fprintf(stderr, "Could not map %s\n", src_filename);
+            exit(1);
+        }
+        codec.set_input(source);
+    }
+    else if (strcmp(input_method, "mem") == 0)
+    {
+        std::ifstream file(src_filename, std::ios::binary);
+        input_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof())
+        {
+            fprintf(stderr, "Could not read %s\n", src_filename);
+            exit(1);
+        }
+        codec.set_input(InputSource::memory(input_data.data(), input_data.size()));
+    }
+    codec.set_jpeg_options((unsigned char)std::clamp(quality, 1, 100), downsample, direct_yuv);
+    if (jpeg_threads >= 0)
+        codec.set_jpeg_threads(jpeg_threads, restart_mcu_rows);
+    if (gop_workers > 0)
+    {
+        if (pipeline_workers > 0 || max_reuse >= 0 || selection != FrameSelection::All || sample_fps > 0)
+            fprintf(stderr, "-p, -I, -x and -F are ignored with -g\n");
+        pipeline_workers = 0;
+        max_reuse = -1;
+        selection = FrameSelection::All;
+        sample_fps = 0;
+        codec.set_gop_parallel(gop_workers);
+    }
+    codec.set_pipeline(std::max(pipeline_workers, 0), std::max(pipeline_depth, 1));
+    codec.set_huge_pages(huge_pages);
+    codec.set_dct_method(dct);
+    codec.set_huffman_mode(huffman);
+    codec.set_motion_output(mv_filename);
+    codec.set_coefficient_output(coef_filename, coef_zero_runs);
+    codec.set_verbosity(verbosity);
+    codec.set_frame_selection(selection, sample_fps);
+    codec.set_thumbnail_scale(thumbnail >= 8 ? 3 : thumbnail >= 4 ? 2 : thumbnail >= 2 ? 1 : 0);
+    if (trace_filename && !Tracer::enabled)
+        fprintf(stderr, "tracing is not compiled in (DCT_TRACE), -T ignored\n");
+    if (max_reuse >= 0)
+    {
+        if (pipeline_workers > 0)
+            fprintf(stderr, "-I needs the frames in order, ignored with -p\n");
+        else if (thumbnail >= 2)
+            fprintf(stderr, "-I encodes the full size, ignored with -t\n");
+        else if (selection != FrameSelection::All || sample_fps > 0)
+            fprintf(stderr, "-I needs every frame, ignored with -x and -F\n");
+        else
+            codec.set_incremental(true, max_reuse);
+    }
+    ret = codec.decode_encode(src_filename, video_dst_filename);
+    if (trace_filename && Tracer::enabled && !Tracer::dump(trace_filename))
+        fprintf(stderr, "Could not write trace file %s\n", trace_filename);
  
      return ret < 0;
  }
- 
\ No newline at end of file
+#endif // DCTENCODER_NO_MAIN
@@ -0,0 +1,473 @@
+// end-to-end throughput of DCTEncoder's decode_encode on a synthetic video corpus, results as one JSON object
+//   usage: e2e_bench [-c corpus_dir] [-n frames] [-S max_height] [-p workers] [-j threads] [-D float|int] [-q quality]
+// The clips are generated with the linked libavcodec/libavformat (no network, no external files) the first time
+// they are needed and kept in corpus_dir: every combination of
+//   codec      H.264 (only if the build has an H.264 encoder, e.g. libx264), MPEG-4 Part 2, MJPEG
+//   size       320x240, 640x360, 1280x720, 1920x1080 (up to max_height)
+//   GOP        intra only, 12 frames with 2 B-frames, 250 frames with 2 B-frames (MJPEG: intra only)
+//   content    static (the same picture every frame) or motion (fast pan plus noise)
+// Every clip is decoded and encoded in a child process, so peak RSS is measured per clip and an exit() of the
+// decoder does not end the benchmark. Reported per clip: frames/s of the whole run, p50/p99 of the per frame
+// latency (decoder output to JPEG written), peak RSS and the size of the MJPEG output.
+// Check of incremental encoding (-I): 320x240 H.264 and MPEG-4 clips with 2 B-frames of a static background and
+// a moving square are encoded completely and incrementally, both outputs are decoded again; "checks" lists the
+// lowest luma PSNR of incremental vs. full per clip, the exit status is 1 if it is below 30 dB.
+
+extern "C" {
+    #include <libavutil/motion_vector.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/timestamp.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "ffmpeg_decode.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// static: the same picture every frame, motion: fast pan plus noise, object: static background with a moving square
+enum class Content { Static, Motion, Object };
+
+static const char* content_name(Content content)
+{
+    return content == Content::Static ? "static" : content == Content::Motion ? "motion" : "object";
+}
+
+struct ClipSpec
+{
+    const char* codec;      // short name for the file and the report
+    AVCodecID   codec_id;
+    int         width;
+    int         height;
+    int         gop;        // 1 = intra only
+    int         b_frames;
+    Content     content;
+
+    std::string name() const
+    {
+        return std::string(codec) + "_" + std::to_string(width) + "x" + std::to_string(height) + "_gop" +
+               std::to_string(gop) + "_" + content_name(content);
+    }
+};
+
+// measured in the child, sent to the parent through a pipe
+struct ClipResult
+{
+    int      frames;
+    double   seconds;
+    double   latency_p50_ms;
+    double   latency_p99_ms;
+    long     peak_rss_kb;
+};
+
+struct BenchOptions
+{
+    int       frames = 60;
+    int       workers = 0;
+    int       jpeg_threads = -1;
+    int       quality = 90;
+    DctMethod dct = DctMethod::Float;
+    int       incremental = 0;    // > 0: serial incremental encoding with this many reuses at most (set_incremental)
+};
+
+// deterministic test picture: a gradient with a checkerboard, panned by 7/5 pixels per frame and overlaid
+// with noise for Content::Motion; Content::Object adds a flat 64x64 square to the static picture that moves
+// 32 pixels to the right per frame, aligned to the 16x16 macroblocks
+static void fill_frame(AVFrame* frame, int index, Content content)
+{
+    const bool motion = content == Content::Motion;
+    const int dx = motion ? 7 * index : 0;
+    const int dy = motion ? 5 * index : 0;
+    uint32_t seed = 12345u + uint32_t(index) * 7919u;
+    for (int y = 0; y < frame->height; y++)
+    {
+        uint8_t* line = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++)
+        {
+            const int u = x + dx, v = y + dy;
+            int value = ((u * 3 + v * 2) & 0xFF) ^ ((((u >> 4) + (v >> 4)) & 1) ? 0x40 : 0);
+            if (motion)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                value = std::clamp(value + int(seed >> 28) - 8, 0, 255);
+            }
+            line[x] = uint8_t(value);
+        }
+    }
+    // 4:2:0 chroma
+    for (int y = 0; y < (frame->height + 1) / 2; y++)
+        for (int x = 0; x < (frame->width + 1) / 2; x++)
+        {
+            frame->data[1][y * frame->linesize[1] + x] = uint8_t(64 + ((x + dx / 2) & 0x7F));
+            frame->data[2][y * frame->linesize[2] + x] = uint8_t(64 + ((y + dy / 2) & 0x7F));
+        }
+    if (content != Content::Object)
+        return;
+    const int size = 64;
+    const int left = (32 * index) % std::max(frame->width / 16 * 16 - size + 16, 16);
+    const int top  = std::min(64, std::max(frame->height - size, 0)) / 16 * 16;
+    for (int y = top; y < std::min(top + size, frame->height); y++)
+        for (int x = left; x < std::min(left + size, frame->width); x++)
+        {
+            frame->data[0][y * frame->linesize[0] + x] = 235;
+            frame->data[1][y / 2 * frame->linesize[1] + x / 2] = 128;
+            frame->data[2][y / 2 * frame->linesize[2] + x / 2] = 128;
+        }
+}
+
+// send frame (NULL = flush) to the encoder and mux all packets it returns
+static int encode_and_mux(AVFormatContext* oc, AVStream* st, AVCodecContext* enc, const AVFrame* frame, AVPacket* pkt)
+{
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0)
+        return ret;
+    while ((ret = avcodec_receive_packet(enc, pkt)) >= 0)
+    {
+        av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+        pkt->stream_index = st->index;
+        ret = av_interleaved_write_frame(oc, pkt);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// write the clip as Matroska (takes all three codecs), returns < 0 on failure
+static int generate_clip(const ClipSpec& spec, int frames, const std::string& filename)
+{
+    const AVCodec* codec = avcodec_find_encoder(spec.codec_id);
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    AVFormatContext* oc = NULL;
+    int ret = avformat_alloc_output_context2(&oc, NULL, "matroska", filename.c_str());
+    if (ret < 0)
+        return ret;
+    AVCodecContext* enc = avcodec_alloc_context3(codec);
+    AVStream* st = avformat_new_stream(oc, NULL);
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    if (!enc || !st || !frame || !pkt)
+        ret = AVERROR(ENOMEM);
+
+    if (ret >= 0)
+    {
+        enc->width        = spec.width;
+        enc->height       = spec.height;
+        enc->time_base    = AVRational{1, 25};
+        enc->framerate    = AVRational{25, 1};
+        enc->gop_size     = spec.gop;
+        enc->max_b_frames = spec.gop > 1 ? spec.b_frames : 0;
+        enc->pix_fmt      = spec.codec_id == AV_CODEC_ID_MJPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+        enc->bit_rate     = int64_t(spec.width) * spec.height * 4; // ~ 4 bits per pixel and second
+        enc->thread_count = 1; // the same bitstream on every run
+        if (spec.codec_id == AV_CODEC_ID_H264)
+            av_opt_set(enc->priv_data, "preset", "veryfast", 0); // ignored by encoders without presets
+        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+            enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        ret = avcodec_open2(enc, codec, NULL);
+    }
+    if (ret >= 0)
+        ret = avcodec_parameters_from_context(st->codecpar, enc);
+    if (ret >= 0)
+    {
+        st->time_base = enc->time_base;
+        ret = avio_open(&oc->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    }
+    if (ret >= 0)
+        ret = avformat_write_header(oc, NULL);
+    if (ret >= 0)
+    {
+        frame->format = enc->pix_fmt;
+        frame->width  = enc->width;
+        frame->height = enc->height;
+        ret = av_frame_get_buffer(frame, 0);
+    }
+    for (int i = 0; ret >= 0 && i < frames; i++)
+    {
+        ret = av_frame_make_writable(frame);
+        if (ret < 0)
+            break;
+        fill_frame(frame, i, spec.content);
+        frame->pts = i;
+        ret = encode_and_mux(oc, st, enc, frame, pkt);
+    }
+    if (ret >= 0)
+        ret = encode_and_mux(oc, st, enc, NULL, pkt);
+    if (ret >= 0)
+        ret = av_write_trailer(oc);
+
+    if (oc && oc->pb)
+        avio_closep(&oc->pb);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    avformat_free_context(oc);
+    if (ret < 0)
+        unlink(filename.c_str()); // no half written clips in the corpus
+    return ret;
+}
+
+// child process: run decode_encode and write a ClipResult to fd
+static void run_clip(const std::string& clip, const std::string& output, const BenchOptions& options, int fd)
+{
+    // decode_encode talks on stdout, the parent's stdout is the JSON report
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0)
+    {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    VideoDecoder_ffmpegImpl codec;
+    codec.set_jpeg_options((unsigned char)std::clamp(options.quality, 1, 100), true, true);
+    if (options.jpeg_threads >= 0)
+        codec.set_jpeg_threads(options.jpeg_threads, 1);
+    codec.set_pipeline(options.incremental > 0 ? 0 : options.workers, 8);
+    codec.set_dct_method(options.dct);
+    if (options.incremental > 0)
+        codec.set_incremental(true, options.incremental);
+
+    const auto start = std::chrono::steady_clock::now();
+    if (codec.decode_encode(clip.c_str(), output.c_str()) < 0)
+        _exit(1);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> latencies = codec.frame_latencies();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p)
+    {
+        if (latencies.empty())
+            return 0.;
+        const size_t rank = std::min(latencies.size() - 1, size_t(p * latencies.size()));
+        return latencies[rank] / 1e6;
+    };
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    ClipResult result = { int(latencies.size()), seconds, percentile(0.5), percentile(0.99), usage.ru_maxrss };
+    _exit(write(fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+}
+
+// run_clip() in a child process, false if it failed
+static bool run_child(const std::string& clip, const std::string& output, const BenchOptions& options, ClipResult& result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(fds[0]);
+        run_clip(clip, output, options, fds[1]);
+    }
+    close(fds[1]);
+    const bool received = child > 0 && read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    int status = 0;
+    if (child > 0)
+        waitpid(child, &status, 0);
+    return received && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// the luma planes (width x height each) of all frames of an MJPEG file written by decode_encode, false on failure
+static bool decode_luma(const std::string& filename, std::vector<std::vector<uint8_t>>& frames, int& width, int& height)
+{
+    AVFormatContext* ic = NULL;
+    if (avformat_open_input(&ic, filename.c_str(), av_find_input_format("mjpeg"), NULL) < 0)
+        return false;
+    const AVCodec* decoder = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext* dec = decoder ? avcodec_alloc_context3(decoder) : NULL;
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    int ret = dec && pkt && frame && ic->nb_streams > 0 ? 0 : AVERROR(ENOMEM);
+    if (ret >= 0)
+        ret = avcodec_parameters_to_context(dec, ic->streams[0]->codecpar);
+    if (ret >= 0)
+        ret = avcodec_open2(dec, decoder, NULL);
+
+    auto receive = [&]()
+    {
+        int sts;
+        while ((sts = avcodec_receive_frame(dec, frame)) >= 0)
+        {
+            width  = frame->width;
+            height = frame->height;
+            std::vector<uint8_t>& luma = frames.emplace_back(size_t(width) * height);
+            for (int y = 0; y < height; y++)
+                std::memcpy(&luma[size_t(y) * width], frame->data[0] + y * frame->linesize[0], width);
+            av_frame_unref(frame);
+        }
+        return sts == AVERROR(EAGAIN) || sts == AVERROR_EOF ? 0 : sts;
+    };
+    while (ret >= 0 && av_read_frame(ic, pkt) >= 0)
+    {
+        ret = avcodec_send_packet(dec, pkt);
+        av_packet_unref(pkt);
+        if (ret >= 0)
+            ret = receive();
+    }
+    if (ret >= 0)
+        ret = avcodec_send_packet(dec, NULL);
+    if (ret >= 0)
+        ret = receive();
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ic);
+    return ret >= 0 && !frames.empty();
+}
+
+// lowest luma PSNR in dB over the frames of b against a, < 0 if the files cannot be decoded or differ in
+// size or number of frames; identical frames count as 99 dB
+static double min_luma_psnr(const std::string& a, const std::string& b)
+{
+    std::vector<std::vector<uint8_t>> frames_a, frames_b;
+    int width_a = 0, height_a = 0, width_b = 0, height_b = 0;
+    if (!decode_luma(a, frames_a, width_a, height_a) || !decode_luma(b, frames_b, width_b, height_b) ||
+        frames_a.size() != frames_b.size() || width_a != width_b || height_a != height_b)
+        return -1;
+    double psnr = 99;
+    for (size_t i = 0; i < frames_a.size(); i++)
+    {
+        double squared = 0;
+        for (size_t j = 0; j < frames_a[i].size(); j++)
+        {
+            const double error = double(frames_a[i][j]) - frames_b[i][j];
+            squared += error * error;
+        }
+        if (squared > 0)
+            psnr = std::min(psnr, 10 * std::log10(255. * 255. * frames_a[i].size() / squared));
+    }
+    return psnr;
+}
+
+int main(int argc, char** argv)
+{
+    std::string corpus = "e2e_corpus";
+    int max_height = 1080;
+    BenchOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:S:p:j:D:q:")) != -1) {
+        switch (opt) {
+        case 'c': corpus = optarg; break;
+        case 'n': options.frames = std::max(atoi(optarg), 1); break;
+        case 'S': max_height = atoi(optarg); break;
+        case 'p': options.workers = std::max(atoi(optarg), 0); break;
+        case 'j': options.jpeg_threads = atoi(optarg); break;
+        case 'D': options.dct = strcmp(optarg, "int") == 0 ? DctMethod::Int16 : DctMethod::Float; break;
+        case 'q': options.quality = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c corpus_dir] [-n frames] [-S max_height] [-p workers] [-j threads] "
+                            "[-D float|int] [-q quality]\n", argv[0]);
+            return 1;
+        }
+    }
+    mkdir(corpus.c_str(), 0755);
+
+    struct Codec { const char* name; AVCodecID id; };
+    const Codec codecs[] = { { "h264", AV_CODEC_ID_H264 }, { "mpeg4", AV_CODEC_ID_MPEG4 }, { "mjpeg", AV_CODEC_ID_MJPEG } };
+    const int sizes[][2] = { { 320, 240 }, { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+    const int gops[] = { 1, 12, 250 };
+
+    std::string results;
+    auto add_result = [&](const std::string& entry) { results += (results.empty() ? "    " : ",\n    ") + entry; };
+    char line[512];
+
+    // the clip of spec in the corpus, generated if it is not there yet; reported as skipped if that fails
+    auto prepare_clip = [&](const ClipSpec& spec, std::string& clip)
+    {
+        clip = corpus + "/" + spec.name() + "_" + std::to_string(options.frames) + ".mkv";
+        struct stat info;
+        if (stat(clip.c_str(), &info) == 0)
+            return true;
+        int ret = generate_clip(spec, options.frames, clip);
+        if (ret >= 0)
+            return true;
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_make_error_string(error, sizeof(error), ret);
+        snprintf(line, sizeof(line), "{\"clip\": \"%s\", \"skipped\": \"%s\"}", spec.name().c_str(), error);
+        add_result(line);
+        return false;
+    };
+    for (const Codec& codec : codecs)
+        for (const auto& size : sizes)
+            for (int gop : gops)
+                for (Content content : { Content::Static, Content::Motion })
+                {
+                    if (size[1] > max_height || (codec.id == AV_CODEC_ID_MJPEG && gop > 1))
+                        continue;
+                    const ClipSpec spec = { codec.name, codec.id, size[0], size[1], gop, 2, content };
+                    std::string clip;
+                    if (!prepare_clip(spec, clip))
+                        continue;
+
+                    const std::string output = corpus + "/output.mjpeg";
+                    ClipResult result;
+                    if (!run_child(clip, output, options, result))
+                    {
+                        snprintf(line, sizeof(line), "{\"clip\": \"%s\", \"failed\": true}", spec.name().c_str());
+                        add_result(line);
+                        continue;
+                    }
+                    struct stat info;
+                    if (stat(output.c_str(), &info) != 0)
+                        info.st_size = 0;
+
+                    snprintf(line, sizeof(line),
+                             "{\"clip\": \"%s\", \"codec\": \"%s\", \"width\": %d, \"height\": %d, \"gop\": %d, "
+                             "\"content\": \"%s\", \"frames\": %d, \"fps\": %.2f, \"latency_p50_ms\": %.3f, "
+                             "\"latency_p99_ms\": %.3f, \"peak_rss_mb\": %.1f, \"output_bytes\": %lld}",
+                             spec.name().c_str(), spec.codec, spec.width, spec.height, spec.gop,
+                             content_name(content), result.frames,
+                             result.seconds > 0 ? result.frames / result.seconds : 0., result.latency_p50_ms,
+                             result.latency_p99_ms, result.peak_rss_kb / 1024., (long long)info.st_size);
+                    add_result(line);
+                }
+
+    // incremental encoding must not take blocks from a frame the current one is not predicted from (B-frames,
+    // the first P-frame after B-frames): compared with the complete encode of the same clip
+    std::string checks;
+    bool passed = true;
+    for (const Codec& codec : codecs)
+    {
+        if (codec.id == AV_CODEC_ID_MJPEG)
+            continue;
+        const ClipSpec spec = { codec.name, codec.id, 320, 240, 12, 2, Content::Object };
+        std::string clip;
+        if (!prepare_clip(spec, clip))
+            continue;
+        BenchOptions incremental = options;
+        incremental.incremental = 30;
+        ClipResult result;
+        const std::string full_output = corpus + "/full.mjpeg", incremental_output = corpus + "/incremental.mjpeg";
+        const double psnr = run_child(clip, full_output, options, result) &&
+                            run_child(clip, incremental_output, incremental, result)
+                          ? min_luma_psnr(full_output, incremental_output) : -1;
+        const bool ok = psnr >= 30;
+        passed = passed && ok;
+        snprintf(line, sizeof(line), "%s    {\"name\": \"incremental_psnr\", \"clip\": \"%s\", \"min_luma_psnr_db\": %.2f, "
+                 "\"limit_db\": 30, \"ok\": %s}", checks.empty() ? "" : ",\n", spec.name().c_str(), psnr,
+                 ok ? "true" : "false");
+        checks += line;
+    }
+
+    printf("{\n  \"benchmark\": \"e2e_bench\",\n  \"frames_per_clip\": %d,\n  \"pipeline_workers\": %d,\n"
+           "  \"jpeg_threads\": %d,\n  \"dct\": \"%s\",\n  \"quality\": %d,\n  \"results\": [\n%s\n  ],\n"
+           "  \"checks\": [\n%s\n  ]\n}\n",
+           options.frames, options.workers, options.jpeg_threads, options.dct == DctMethod::Int16 ? "int" : "float",
+           options.quality, results.c_str(), checks.c_str());
+    return passed ? 0 : 1;
+}
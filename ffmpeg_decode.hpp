@@ -4,7 +4,47 @@
 
 #define MVS_DTYPE int32_t
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
 #include <vector>
+#include <boost/thread/mutex.hpp>
+#include "write_jpeg.hpp"
+#include "dct_scale.hpp"
+#include "avio_input.hpp"
+#include "pipeline.hpp"
+#include "frame_arena.hpp"
+#include "frame_pool.hpp"
+#include "frame_view.hpp"
+#include "mv_stream.hpp"
+#include "coef_archive.hpp"
+
+// Huffman tables of the JPEGs: Annex K (default), optimized for every frame (two pass encoding),
+// or optimized for the key frame of each GOP and reused by the other frames of that GOP
+enum class HuffmanMode { Standard, Frame, Gop };
+
+// the tables of one GOP: the encoder of the key frame publishes its optimized context, the encoders of
+// the following frames wait for it (in pipelined mode they may run at the same time)
+struct GopHuffman
+{
+    std::promise<std::shared_ptr<const JpegEncoderContext>>       promise;
+    std::shared_future<std::shared_ptr<const JpegEncoderContext>> context = promise.get_future().share();
+    std::atomic<bool>  published{false};
+
+    // nullptr = the key frame was not encoded, the rest of the GOP uses the standard tables
+    void publish(std::shared_ptr<const JpegEncoderContext> optimized)
+    {
+        if (!published.exchange(true))
+            promise.set_value(std::move(optimized));
+    }
+};
+
+// which decoded frames are wanted (thumbnails, indexing): the decoder is told to drop the others
+// - All:        every frame
+// - KeyFrames:  key frames only, the other packets are not even sent to the decoder (AVDISCARD_NONKEY)
+// - References: frames other frames are predicted from, e.g. no non-reference B-frames (AVDISCARD_NONREF)
+enum class FrameSelection { All, KeyFrames, References };
 
 class VideoDecoder_ffmpegImpl
 {
@@ -18,13 +58,11 @@ class VideoDecoder_ffmpegImpl
     int                m_height;
     enum AVPixelFormat m_pix_fmt;
     const char *       m_src_filename = NULL;
+    std::shared_ptr<InputSource> m_input;         // NULL: ffmpeg opens m_src_filename itself
 //    const char *       m_video_dst_filename = NULL;
 //    const char *       m_audio_dst_filename = NULL;
     FILE *             m_video_dst_file = NULL;
     FILE *             m_audio_dst_file = NULL;
-    uint8_t*           m_video_dst_data[4] = {NULL};
-    int                m_video_dst_linesize[4];
-    int                m_video_dst_bufsize;    
     AVFrame*           m_frame = NULL;
     AVFrame*           m_RGBFrame = NULL;
     AVPacket*          m_pkt = NULL;
@@ -33,7 +71,89 @@ class VideoDecoder_ffmpegImpl
     char               m_ts_str[AV_TS_MAX_STRING_SIZE] = {0};
     char               m_err_str[AV_TS_MAX_STRING_SIZE] = {0};
     SwsContext*        m_sws_ctx = NULL;    
+    FramePool          m_frame_pool;              // decoder output, RGB conversions and raw copies, declared before
+                                                  // everything that may still hold frames when we are destroyed
+    ArenaPool          m_arenas;                  // per frame scratch memory (encoder) and per GOP range (-g)
     size_t             m_frame_count=0;
+    int                m_verbosity = 0;           // per frame console output: 0 none, 1 frame info, 2 motion vectors
+    bool               m_direct_yuv = true;       // encode straight from the decoder's YCbCr planes, no RGB round trip
+    bool               m_jpeg_downsample = true;  // YCbCr 4:2:0 (true) or 4:4:4 (false) JPEGs
+    unsigned char      m_jpeg_quality = 90;
+    int                m_restart_mcu_rows = 0;    // > 0: DRI/RSTn segments of this many MCU rows, encoded in parallel
+    DctMethod          m_jpeg_dct = DctMethod::Float;
+    std::unique_ptr<ThreadPool> m_jpeg_pool;
+    std::shared_ptr<const JpegEncoderContext> m_jpeg_context; // tables and headers for the current frame size
+    boost::mutex       m_jpeg_context_mutex;      // the encode workers of the pipeline share m_jpeg_context
+    std::vector<uint8_t> m_jpeg_output;           // serial mode: the same output buffer for every frame
+    int                m_thumbnail_scale = 0;     // > 0: JPEGs downscaled by 2^m_thumbnail_scale (dct_scale.hpp)
+    HuffmanMode        m_huffman_mode = HuffmanMode::Standard;
+    std::shared_ptr<GopHuffman> m_gop_huffman;    // HuffmanMode::Gop: tables of the GOP being decoded
+    bool               m_incremental = false;     // serial mode: reuse the blocks of zero motion macroblocks
+    BlockCache         m_block_cache;             // quantized blocks of the previous frame
+    size_t             m_cache_anchor = 0;        // m_decoded_frames of the last emitted I-/P-frame, 0: none
+    std::vector<AVMotionVector> m_motion_vectors; // of the current frame, the capacity is reused
+    const char *       m_mv_filename = NULL;      // binary motion vector output (mv_stream.hpp), replaces the printout
+    MvStreamWriter     m_mv_writer;
+    const char *       m_coef_filename = NULL;    // quantized DCT coefficient archive (coef_archive.hpp)
+    CoefCompression    m_coef_compression = CoefCompression::None;
+    CoefArchiveWriter  m_coef_writer;
+    CoefficientFrame   m_coef_frame;              // serial mode: blocks and record of the current JPEG
+    std::vector<uint8_t> m_coef_record;
+    std::vector<uint64_t> m_frame_latency_ns;     // per frame: received from the decoder until written
+    FrameSelection     m_frame_selection = FrameSelection::All;
+    double             m_sample_fps = 0;          // > 0: emit at most this many frames per second of video
+    double             m_next_sample_time = -1;   // presentation time (s) of the next frame to emit, < 0: first one
+    int64_t            m_seek_target = AV_NOPTS_VALUE; // sampler: jump to this key frame (stream time base)
+    int64_t            m_last_dts = AV_NOPTS_VALUE;    // of the last video packet read
+    size_t             m_decoded_frames = 0;      // returned by the decoder, m_frame_count of them were emitted
+    size_t             m_skipped_packets = 0;     // never sent to the decoder
+    size_t             m_sample_seeks = 0;
+
+    // pipelined mode: frames are handed from the decoding thread to m_pipeline_workers encoders
+    struct EncodeScratch
+    {
+        SwsContext* sws = NULL;   // per worker, a SwsContext must not be shared between threads
+        AVFrame*    rgb = NULL;
+        CoefficientFrame coefficients;
+    };
+    size_t             m_pipeline_workers = 0;    // 0 = decode, encode and write serially on the calling thread
+    size_t             m_pipeline_depth = 8;      // frames per queue between two stages
+    std::unique_ptr<EncodePipeline> m_pipeline;
+    std::vector<EncodeScratch> m_encode_scratch;
+
+    // GOP-parallel mode: the file is cut at key frames, every range is decoded and encoded by a worker with its
+    // own demuxer and decoder, the ranges are written back in presentation order
+    struct GopKey
+    {
+        int64_t timestamp;  // seek target (stream time base)
+        int64_t pos;        // byte position, the range starts at the first key packet at or after it
+    };
+    struct GopFrame
+    {
+        int64_t pts;
+        char    type;       // I, P, B, ...
+        std::pmr::vector<AVMotionVector> motion_vectors; // from the arena of the range
+        std::vector<uint8_t> jpeg;
+        std::vector<uint8_t> coefficients; // archive record, empty without coefficient output
+        std::chrono::steady_clock::time_point received; // when the decoder returned the frame
+    };
+    struct GopRange
+    {
+        ArenaPool::Lease arena;            // while the range is decoded and buffered, before frames
+        std::vector<GopFrame> frames;      // presentation order
+        size_t decoded = 0;                // including the discarded leading frames
+        std::shared_ptr<GopHuffman> gop;   // HuffmanMode::Gop: tables of the GOP being encoded
+        bool done = false;
+    };
+    struct GopWorker
+    {
+        AVFormatContext* fmt = NULL;
+        AVCodecContext*  dec = NULL;
+        AVPacket*        pkt = NULL;
+        AVFrame*         frame = NULL;
+        EncodeScratch    scratch;
+    };
+    size_t             m_gop_workers = 0;         // 0 = one decoder for the whole file
 
     
     char* av_ts2timestr_cpp(int64_t ts, AVRational *tb) 
@@ -54,6 +174,27 @@ class VideoDecoder_ffmpegImpl
     }
 
     int output_video_frame(AVFrame *frame);
+    int convert_to_rgb(const AVFrame *src, SwsContext *&sws_ctx, AVFrame *rgb);
+    std::shared_ptr<const JpegEncoderContext> jpeg_context(int width, int height);
+    AVFrame* downscale_frame(const AVFrame *frame, bool planar_yuv);
+    int encode_jpeg_frame(const AVFrame *frame, bool planar_yuv, std::vector<uint8_t>& jpeg,
+                          GopHuffman* gop = nullptr, bool gop_start = false, BlockCache* cache = nullptr,
+                          CoefficientFrame* coefficients = nullptr);
+    int write_jpeg_frame(AVFrame *frame, bool planar_yuv, GopHuffman* gop, bool gop_start);
+    void build_coefficient_record(const AVFrame *frame, bool planar_yuv, int64_t pts, char type,
+                                  const CoefficientFrame& coefficients, std::vector<uint8_t>& record);
+    int encode_pipeline_job(PipelineJob& job, size_t worker);
+    int write_pipeline_job(PipelineJob& job);
+    void mark_motion(const std::vector<AVMotionVector>& motion_vectors);
+    bool sample_frame();
+    bool scan_key_frames(int stream_idx, std::vector<GopKey>& keys);
+    int open_gop_worker(GopWorker& worker);
+    void close_gop_worker(GopWorker& worker);
+    int decode_gop(GopWorker& worker, int stream_idx, const GopKey& key, const GopKey* next, bool first,
+                   GopRange& range);
+    int receive_gop_frames(GopWorker& worker, GopRange& range, int64_t start_pts, int64_t end_pts);
+    int write_gop(size_t index, GopRange& range);
+    int decode_gops(int stream_idx, const std::vector<GopKey>& keys);
     // int output_audio_frame();
     // int decode_packet(AVCodecContext* dec, const AVPacket* pkt, AVFrame* frame);
     int open_codec_context(int *stream_idx,
@@ -68,7 +209,116 @@ class VideoDecoder_ffmpegImpl
         ); 
 
     public:
-    void decode_encode(
+    void set_jpeg_options(unsigned char quality, bool downsample, bool direct_yuv)
+    {
+        m_jpeg_quality    = quality;
+        m_jpeg_downsample = downsample;
+        m_direct_yuv      = direct_yuv;
+    }
+
+    // float or 16 bit fixed point DCT and quantization, see DctMethod
+    void set_dct_method(DctMethod method)
+    {
+        m_jpeg_dct = method;
+    }
+
+    // standard, per frame or per GOP optimized Huffman tables, see HuffmanMode
+    void set_huffman_mode(HuffmanMode mode)
+    {
+        m_huffman_mode = mode;
+    }
+
+    // thumbnails: every frame is downscaled by 2^log2_scale (1..3 = 1/2, 1/4, 1/8) before it is encoded, with the
+    // DCT + scaled IDCT folded into a separable N x 8 pixel filter (dct_scale.hpp); 0 encodes the full size;
+    // not with incremental encoding
+    void set_thumbnail_scale(int log2_scale)
+    {
+        m_thumbnail_scale = std::clamp(log2_scale, 0, 3);
+    }
+
+    // incremental encoding (serial mode only): P-frame macroblocks without motion keep the quantized blocks of
+    // the previous frame, each block is encoded again after max_reuse frames, on I- and B-frames and on the
+    // first P-frame after B-frames
+    void set_incremental(bool enable, int max_reuse)
+    {
+        m_incremental = enable;
+        m_block_cache.setMaxReuse(std::max(max_reuse, 0));
+    }
+
+    // decode only the selected frames, fps > 0 additionally samples them down to that rate: the frame at or after
+    // every 1/fps seconds is emitted, where the index has a key frame closer to the next sample the decoder
+    // jumps there instead of decoding everything in between (set before decode_encode)
+    void set_frame_selection(FrameSelection selection, double fps)
+    {
+        m_frame_selection = selection;
+        m_sample_fps      = std::max(fps, 0.);
+    }
+
+    // 0: no per frame console output, 1: frame info, 2: also every motion vector
+    void set_verbosity(int verbosity)
+    {
+        m_verbosity = verbosity;
+    }
+
+    // append the motion vectors of every frame to a binary file (see mv_stream.hpp) instead of printing them
+    void set_motion_output(const char* filename)
+    {
+        m_mv_filename = filename;
+    }
+
+    // append the quantized DCT coefficients of every JPEG to a memory-mappable archive (see coef_archive.hpp),
+    // the very blocks the encoder Huffman coded (sampling, DCT method and thumbnail size included);
+    // zero_runs drops the zero coefficients
+    void set_coefficient_output(const char* filename, bool zero_runs)
+    {
+        m_coef_filename    = filename;
+        m_coef_compression = zero_runs ? CoefCompression::ZeroRuns : CoefCompression::None;
+    }
+
+    // encode each JPEG as restart intervals of restart_mcu_rows MCU rows on num_threads workers
+    // (0 threads = one per core), restart_mcu_rows = 0 goes back to a single serial scan
+    void set_jpeg_threads(size_t num_threads, int restart_mcu_rows)
+    {
+        m_restart_mcu_rows = restart_mcu_rows;
+        m_jpeg_pool = restart_mcu_rows > 0 ? std::make_unique<ThreadPool>(num_threads) : nullptr;
+    }
+
+    // decode on the calling thread, encode on num_workers threads (0 = serial), at most queue_depth frames per queue
+    void set_pipeline(size_t num_workers, size_t queue_depth)
+    {
+        m_pipeline_workers = num_workers;
+        m_pipeline_depth   = std::max<size_t>(queue_depth, 1);
+    }
+
+    // decode one file on num_workers threads: it is cut at key frames into ranges of at least half a second, each
+    // worker seeks to its range with its own demuxer and decoder, frames, motion vectors and JPEGs are merged back
+    // in presentation order (0 = off; replaces the pipeline, every frame is emitted, no incremental encoding)
+    void set_gop_parallel(size_t num_workers)
+    {
+        m_gop_workers = num_workers;
+    }
+
+    // read the input through source (mapped file, memory, pipe) instead of opening the file name given to
+    // decode_encode, which then only names it (set before decode_encode, NULL goes back to the file)
+    void set_input(std::shared_ptr<InputSource> source)
+    {
+        m_input = std::move(source);
+    }
+
+    // back the frame pool by huge pages (set before decode_encode)
+    void set_huge_pages(bool huge_pages)
+    {
+        m_frame_pool.set_huge_pages(huge_pages);
+    }
+
+    // nanoseconds from avcodec_receive_frame() to the JPEG being written, one entry per frame in output order
+    const std::vector<uint64_t>& frame_latencies() const
+    {
+        return m_frame_latency_ns;
+    }
+
+    // 0, or the error that stopped decoding or encoding partway (the outputs end with the last frame written)
+    int decode_encode(
         const char* src_filename, 
         const char* video_dst_filename        
     );
@@ -0,0 +1,184 @@
+#ifndef _FRAME_ARENA_HPP
+#define _FRAME_ARENA_HPP
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+// Scratch memory of one frame: a monotonic arena, allocation is a pointer bump, deallocation does nothing and
+// reset() frees everything at once when the frame is done. Its chunks are kept, if a frame needed more than one
+// chunk they are merged into a single one of the frame's size, so from the second frame of a given size on the
+// arena never goes back to malloc. Containers opt in through std::pmr (std::pmr::vector<T> v(&arena)).
+// ArenaPool recycles arenas through a free list, every frame in flight (pipeline job, GOP range) leases one.
+class FrameArena : public std::pmr::memory_resource
+{
+public:
+    static constexpr size_t min_chunk_size = 64 << 10;
+
+    // allocations since the last reset(): served by the arena / chunks that had to be malloc'ed for them
+    struct Counters
+    {
+        uint64_t calls = 0;
+        uint64_t bytes = 0;
+        uint64_t malloc_calls = 0;
+        uint64_t malloc_bytes = 0;
+    };
+
+    FrameArena() = default;
+    FrameArena(const FrameArena& other) = delete;
+    FrameArena& operator=(const FrameArena& other) = delete;
+
+    // everything allocated from the arena is gone, the chunks stay for the next frame
+    void reset()
+    {
+        if (m_current > 0)
+        {
+            // the frame needed several chunks, the next one gets all of that memory in one piece
+            size_t size = 0;
+            for (const Chunk& chunk : m_chunks)
+                size += chunk.size;
+            m_chunks.clear();
+            add_chunk(size);
+        }
+        m_current  = 0;
+        m_used     = 0;
+        m_counters = Counters();
+    }
+
+    const Counters& counters() const { return m_counters; }
+    size_t capacity() const
+    {
+        size_t size = 0;
+        for (const Chunk& chunk : m_chunks)
+            size += chunk.size;
+        return size;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        m_counters.calls++;
+        m_counters.bytes += bytes;
+        for (;;)
+        {
+            if (m_current < m_chunks.size())
+            {
+                Chunk& chunk = m_chunks[m_current];
+                const size_t start = (reinterpret_cast<uintptr_t>(chunk.data.get()) + m_used + alignment - 1) /
+                                     alignment * alignment - reinterpret_cast<uintptr_t>(chunk.data.get());
+                if (start + bytes <= chunk.size)
+                {
+                    m_used = start + bytes;
+                    return chunk.data.get() + start;
+                }
+                if (m_current + 1 < m_chunks.size())
+                {
+                    m_current++;
+                    m_used = 0;
+                    continue;
+                }
+            }
+            // out of chunks: a new one, at least as large as everything so far (the frame's size is found quickly)
+            add_chunk(std::max({ bytes + alignment, capacity(), min_chunk_size }));
+            m_current = m_chunks.size() - 1;
+            m_used    = 0;
+            m_counters.malloc_calls++;
+            m_counters.malloc_bytes += m_chunks.back().size;
+        }
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    void add_chunk(size_t size)
+    {
+        m_chunks.push_back(Chunk{ std::unique_ptr<std::byte[]>(new std::byte[size]), size });
+    }
+
+    std::vector<Chunk> m_chunks;
+    size_t   m_current = 0;      // chunk allocations come from
+    size_t   m_used    = 0;      // bytes of m_chunks[m_current]
+    Counters m_counters;
+};
+
+// free list of FrameArenas, thread-safe; a lease resets its arena and returns it to the pool when it is dropped,
+// the arena's counters are added to the pool's statistics (a lease usually covers one frame)
+class ArenaPool
+{
+public:
+    struct Release
+    {
+        ArenaPool* pool;
+        void operator()(FrameArena* arena) const { pool->release(arena); }
+    };
+    using Lease = std::unique_ptr<FrameArena, Release>;
+
+    ArenaPool() = default;
+    ArenaPool(const ArenaPool& other) = delete;
+    ArenaPool& operator=(const ArenaPool& other) = delete;
+
+    // the pool must outlive its leases
+    Lease acquire()
+    {
+        FrameArena* arena = NULL;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            if (!m_free.empty())
+            {
+                arena = m_free.back().release();
+                m_free.pop_back();
+            }
+            else
+                m_arenas++;
+        }
+        return Lease(arena ? arena : new FrameArena(), Release{ this });
+    }
+
+    void report(FILE* out) const
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        const double leases = std::max<uint64_t>(m_leases, 1);
+        fprintf(out, "frame arenas: %zu arenas, %" PRIu64 " leases, %.1f allocations (%.1f KiB) per lease, "
+                "%" PRIu64 " mallocs (%.1f MiB) in %" PRIu64 " leases\n",
+                m_arenas, m_leases, m_total.calls / leases, m_total.bytes / leases / 1024,
+                m_total.malloc_calls, m_total.malloc_bytes / double(1 << 20), m_leases_with_malloc);
+    }
+
+private:
+    void release(FrameArena* arena)
+    {
+        const FrameArena::Counters counters = arena->counters();
+        arena->reset();
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_leases++;
+        m_leases_with_malloc += counters.malloc_calls > 0;
+        m_total.calls        += counters.calls;
+        m_total.bytes        += counters.bytes;
+        m_total.malloc_calls += counters.malloc_calls;
+        m_total.malloc_bytes += counters.malloc_bytes;
+        m_free.emplace_back(arena);
+    }
+
+    mutable boost::mutex m_mutex;
+    std::vector<std::unique_ptr<FrameArena>> m_free;
+    size_t             m_arenas = 0;             // ever created
+    uint64_t           m_leases = 0;             // returned
+    uint64_t           m_leases_with_malloc = 0; // of them, leases whose arena had to grow
+    FrameArena::Counters m_total;
+};
+
+#endif // _FRAME_ARENA_HPP
@@ -0,0 +1,223 @@
+#ifndef _FRAME_POOL_HPP
+#define _FRAME_POOL_HPP
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/frame.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <tuple>
+#include <sys/mman.h>
+#include <boost/thread/mutex.hpp>
+
+// Ref-counted picture buffers, recycled instead of malloc/free per frame.
+// There is one AVBufferPool per (width, height, pixel format, row alignment) bucket, every buffer
+// holds all planes of one picture. A leased frame keeps its buffer through the usual AVFrame
+// references (av_frame_ref/clone), the buffer returns to its bucket when the last reference is
+// dropped. A new geometry simply opens a new bucket, the old one stays around until the pool is
+// destroyed (buffers still referenced by then are freed when released).
+class FramePool
+{
+public:
+    static constexpr int    plane_align = 64;       // start of every plane, >= any SIMD load we do
+    static constexpr size_t huge_page_size = 2 << 20;
+
+    FramePool() = default;
+    FramePool(const FramePool& other) = delete;
+    FramePool& operator=(const FramePool& other) = delete;
+
+    ~FramePool()
+    {
+        for (auto& bucket : m_buckets)
+            av_buffer_pool_uninit(&bucket.second.pool);
+    }
+
+    // back new buffers by 2 MiB pages: hugetlbfs if pages are reserved, transparent huge pages otherwise,
+    // a 4K frame's luma plane then spans 4 TLB entries instead of ~2000
+    void set_huge_pages(bool huge_pages) { m_huge_pages = huge_pages; }
+
+    // like av_frame_get_buffer(): frame->width, height and format must be set, the rows of all planes are
+    // padded to a multiple of align bytes, keeping their ratio (1 = packed rows and contiguous planes)
+    int get_buffer(AVFrame* frame, int align = plane_align)
+    {
+        return lease(frame, frame->width, frame->height, align);
+    }
+
+    // decoder output from the pool: ctx->get_buffer2 = FramePool::get_buffer2, ctx->opaque = the pool
+    // (set both before avcodec_open2, frame threads copy them from the user context)
+    void attach(AVCodecContext* ctx)
+    {
+        ctx->opaque      = this;
+        ctx->get_buffer2 = &FramePool::get_buffer2;
+    }
+
+    static int get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags)
+    {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+        // decoders without direct rendering, hardware frames and palettes go the default way
+        if (!(ctx->codec->capabilities & AV_CODEC_CAP_DR1) || !desc ||
+            (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+            return avcodec_default_get_buffer2(ctx, frame, flags);
+
+        // the codec may write up to its aligned dimensions (macroblocks, edge emulation)
+        int width = frame->width, height = frame->height;
+        int linesize_align[AV_NUM_DATA_POINTERS];
+        avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+        int align = plane_align;
+        for (int i = 0; i < 4; i++)
+            align = std::max(align, linesize_align[i]);
+        return static_cast<FramePool*>(ctx->opaque)->lease(frame, width, height, align);
+    }
+
+    size_t buckets() const
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return m_buckets.size();
+    }
+
+    // leases vs. buffers actually allocated, close to 1:1 means the pool is not recycling
+    void report(FILE* out) const
+    {
+        fprintf(out, "frame pool: %zu buckets, %" PRIu64 " leases, %" PRIu64 " buffers allocated (%.1f MiB%s)\n",
+                buckets(), m_leases.load(), m_allocations.load(), m_allocated_bytes / double(1 << 20),
+                m_huge_pages ? ", huge pages" : "");
+    }
+
+private:
+    using Key = std::tuple<int, int, int, int>; // width, height, format, align
+
+    struct Bucket
+    {
+        AVBufferPool* pool = NULL;
+        int           linesize[4] = {0};
+        size_t        offset[4] = {0};     // of each plane, relative to the aligned start of the buffer
+    };
+
+    int lease(AVFrame* frame, int width, int height, int align)
+    {
+        const Bucket* bucket = find_bucket(width, height, (AVPixelFormat)frame->format, align);
+        if (!bucket)
+            return AVERROR(EINVAL);
+
+        AVBufferRef* buf = av_buffer_pool_get(bucket->pool);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        m_leases++;
+
+        uint8_t* base = reinterpret_cast<uint8_t*>(FFALIGN(reinterpret_cast<uintptr_t>(buf->data), plane_align));
+        for (int i = 0; i < 4; i++)
+        {
+            frame->data[i]     = bucket->linesize[i] ? base + bucket->offset[i] : NULL;
+            frame->linesize[i] = bucket->linesize[i];
+        }
+        frame->buf[0]        = buf;
+        frame->extended_data = frame->data;
+        return 0;
+    }
+
+    const Bucket* find_bucket(int width, int height, AVPixelFormat format, int align)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        const Key key(width, height, format, align);
+        auto it = m_buckets.find(key);
+        if (it != m_buckets.end())
+            return &it->second;
+
+        // same row layout as avcodec_default_get_buffer2() (update_frame_pool() in libavcodec/get_buffer.c):
+        // the width grows by its lowest set bit until the rows of every plane are a multiple of align; aligning
+        // each linesize on its own would break the ratio between the planes (align 64, width 1344: Y 1344 but
+        // chroma 704, while decoders rely on linesize[0] == 2 * linesize[1] for 4:2:x)
+        Bucket bucket;
+        int  w = width;
+        bool unaligned;
+        do
+        {
+            if (av_image_fill_linesizes(bucket.linesize, format, w) < 0)
+                return NULL;
+            w += w & ~(w - 1);
+            unaligned = false;
+            for (int i = 0; i < 4; i++)
+                unaligned |= bucket.linesize[i] % align != 0;
+        } while (unaligned);
+        ptrdiff_t linesizes[4];
+        for (int i = 0; i < 4; i++)
+            linesizes[i] = bucket.linesize[i];
+        size_t sizes[4];
+        if (av_image_fill_plane_sizes(sizes, format, height, linesizes) < 0)
+            return NULL;
+
+        // planes start on plane_align boundaries, except for packed layouts (align 1),
+        // those stay contiguous like av_image_alloc(..., 1) so the whole picture can be written at once
+        size_t size = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (align > 1)
+                size = FFALIGN(size, plane_align);
+            bucket.offset[i] = size;
+            size += sizes[i];
+        }
+        // alignment of the start + the padding FFmpeg's own pools keep for SIMD overreads
+        size += plane_align + AV_INPUT_BUFFER_PADDING_SIZE;
+
+        bucket.pool = av_buffer_pool_init2(size, this, &FramePool::alloc_buffer, NULL);
+        if (!bucket.pool)
+            return NULL;
+        return &m_buckets.emplace(key, bucket).first->second;
+    }
+
+    static AVBufferRef* alloc_buffer(void* opaque, size_t size)
+    {
+        auto* self = static_cast<FramePool*>(opaque);
+        AVBufferRef* buf = NULL;
+        if (self->m_huge_pages)
+        {
+            const size_t mapped = FFALIGN(size, huge_page_size);
+            void* data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data == MAP_FAILED)
+            {
+                // no reserved hugetlbfs pages, ask for transparent huge pages instead
+                data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (data != MAP_FAILED)
+                    madvise(data, mapped, MADV_HUGEPAGE);
+            }
+            if (data != MAP_FAILED)
+            {
+                // the mapping size travels in the opaque pointer, the buffer does not outlive its mapping
+                buf = av_buffer_create(static_cast<uint8_t*>(data), size, &FramePool::unmap_buffer,
+                                       reinterpret_cast<void*>(mapped), 0);
+                if (!buf)
+                    munmap(data, mapped);
+            }
+        }
+        if (!buf)
+            buf = av_buffer_alloc(size);
+        if (buf)
+        {
+            self->m_allocations++;
+            self->m_allocated_bytes += size;
+        }
+        return buf;
+    }
+
+    static void unmap_buffer(void* opaque, uint8_t* data)
+    {
+        munmap(data, reinterpret_cast<size_t>(opaque));
+    }
+
+    mutable boost::mutex  m_mutex;
+    std::map<Key, Bucket> m_buckets;
+    bool                  m_huge_pages = false;
+    std::atomic<uint64_t> m_leases{0};
+    std::atomic<uint64_t> m_allocations{0};
+    std::atomic<uint64_t> m_allocated_bytes{0};
+};
+
+#endif // _FRAME_POOL_HPP
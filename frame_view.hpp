@@ -0,0 +1,106 @@
+#ifndef _FRAME_VIEW_HPP
+#define _FRAME_VIEW_HPP
+
+extern "C" {
+    #include <libavutil/frame.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include <utility>
+#include "Matrix.hpp"
+#include "write_jpeg.hpp"
+
+// Views of the planes of a decoded AVFrame for the kernels (writeJpeg, run_dct_RGB, ...), with the frame's own
+// linesize as stride: the pixels are read where the decoder (or sws_scale) put them, nothing is copied.
+// The free functions don't hold on to the frame, the caller keeps it alive while the view is used; a FrameView
+// takes its own reference (av_frame_ref) and can be handed to another thread or kept past the next
+// avcodec_receive_frame(), which reuses the decoder's frame.
+
+// plane i, width in bytes (bytes of the pixels of one row: width * 3 for RGB24, the chroma width for yuv420p, ...)
+inline PlaneView plane_view(const AVFrame* frame, int plane)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    const int bytes = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, plane);
+    if (!desc || bytes <= 0 || !frame->data[plane])
+        return PlaneView();
+    const int shiftY = (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+    const int height = (frame->height + (1 << shiftY) - 1) >> shiftY;
+    return PlaneView(frame->data[plane], size_t(bytes), size_t(height), frame->linesize[plane]);
+}
+
+// packed RGB24 pixels, empty for any other format
+inline RGBView rgb_view(const AVFrame* frame)
+{
+    if (frame->format != AV_PIX_FMT_RGB24 || !frame->data[0])
+        return RGBView();
+    return RGBView(reinterpret_cast<const RGBChannels*>(frame->data[0]), frame->width, frame->height, frame->linesize[0]);
+}
+
+// the three planes of 8 bit planar YCbCr for JPEGWriter::writeJpegYCbCr (the caller checked the format)
+inline PlanarYCbCr ycbcr_view(const AVFrame* frame)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    const enum AVPixelFormat fmt = (AVPixelFormat)frame->format;
+    return PlanarYCbCr{
+        { frame->data[0], frame->data[1], frame->data[2] },
+        { frame->linesize[0], frame->linesize[1], frame->linesize[2] },
+        desc->log2_chroma_w,
+        desc->log2_chroma_h,
+        frame->color_range == AVCOL_RANGE_JPEG ||
+            fmt == AV_PIX_FMT_YUVJ420P || fmt == AV_PIX_FMT_YUVJ422P || fmt == AV_PIX_FMT_YUVJ444P
+    };
+}
+
+// a reference to a decoded picture, the views stay valid as long as the FrameView lives
+class FrameView
+{
+public:
+    FrameView() = default;
+
+    // new reference to frame's buffers, empty if that fails (out of memory)
+    explicit FrameView(const AVFrame* frame)
+    {
+        reset(frame);
+    }
+
+    FrameView(const FrameView& other) = delete;
+    FrameView& operator=(const FrameView& other) = delete;
+    FrameView(FrameView&& other) noexcept : m_frame{other.m_frame} { other.m_frame = NULL; }
+    FrameView& operator=(FrameView&& other) noexcept
+    {
+        std::swap(m_frame, other.m_frame);
+        return *this;
+    }
+
+    ~FrameView()
+    {
+        av_frame_free(&m_frame);
+    }
+
+    // drop the current picture, reference frame instead (if given); false without memory
+    bool reset(const AVFrame* frame = NULL)
+    {
+        av_frame_free(&m_frame);
+        if (!frame)
+            return true;
+        m_frame = av_frame_alloc();
+        if (m_frame && av_frame_ref(m_frame, frame) < 0)
+            av_frame_free(&m_frame);
+        return m_frame != NULL;
+    }
+
+    explicit operator bool() const { return m_frame != NULL; }
+    const AVFrame* get() const { return m_frame; }
+    int width() const { return m_frame->width; }
+    int height() const { return m_frame->height; }
+
+    PlaneView   plane(int plane) const { return plane_view(m_frame, plane); }
+    RGBView     rgb()            const { return rgb_view(m_frame); }
+    PlanarYCbCr ycbcr()          const { return ycbcr_view(m_frame); }
+
+private:
+    AVFrame* m_frame = NULL;
+};
+
+#endif // _FRAME_VIEW_HPP
@@ -0,0 +1,178 @@
+#ifndef _HUFFMAN_TABLE_HPP
+#define _HUFFMAN_TABLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// how often each Huffman symbol occurs in the entropy coded data of one or more images
+// DC symbols are the bit sizes of the DC differences (0..11), AC symbols are (zero run << 4) | bit size,
+// 0x00 = end of block and 0xF0 = 16 zeros
+struct HuffmanStatistics
+{
+    uint32_t dcLuminance  [256] = {0};
+    uint32_t acLuminance  [256] = {0};
+    uint32_t dcChrominance[256] = {0};
+    uint32_t acChrominance[256] = {0};
+
+    void add(const HuffmanStatistics& other)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            dcLuminance  [i] += other.dcLuminance  [i];
+            acLuminance  [i] += other.acLuminance  [i];
+            dcChrominance[i] += other.dcChrominance[i];
+            acChrominance[i] += other.acChrominance[i];
+        }
+    }
+
+    // count every symbol of the baseline alphabet at least once, tables built from the result can encode any
+    // image, not only the ones that were counted (e.g. all frames of a GOP with the tables of its key frame)
+    void coverAllSymbols()
+    {
+        for (int size = 0; size <= 11; size++)
+        {
+            dcLuminance  [size] = std::max<uint32_t>(dcLuminance  [size], 1);
+            dcChrominance[size] = std::max<uint32_t>(dcChrominance[size], 1);
+        }
+        for (int run = 0; run < 16; run++)
+            for (int size = 0; size <= 10; size++)
+            {
+                const int symbol = (run << 4) | size;
+                if (size == 0 && symbol != 0x00 && symbol != 0xF0)
+                    continue; // only end of block and 16 zeros have no bits
+                acLuminance  [symbol] = std::max<uint32_t>(acLuminance  [symbol], 1);
+                acChrominance[symbol] = std::max<uint32_t>(acChrominance[symbol], 1);
+            }
+    }
+};
+
+// a Huffman table as stored in the DHT marker: number of codes of each length 1..16
+// and the symbols in order of increasing code length (same layout as DcLuminanceCodesPerBitsize/DcLuminanceValues)
+struct HuffmanSpec
+{
+    uint8_t codesPerBitsize[16] = {0};
+    uint8_t values[256]         = {0};
+
+    int numValues() const
+    {
+        int sum = 0;
+        for (auto count : codesPerBitsize)
+            sum += count;
+        return sum;
+    }
+
+    // optimal code lengths limited to 16 bits, JPEG standard Annex K.2 (same procedure as libjpeg's
+    // jpeg_gen_optimal_table), symbols with a count of 0 get no code
+    static HuffmanSpec fromCounts(const uint32_t counts[256])
+    {
+        long freq[257];
+        int  codesize[257] = {0};
+        int  others[257];
+        for (int i = 0; i < 256; i++)
+            freq[i] = counts[i];
+        freq[256] = 1; // reserved symbol, makes sure that no code consists of 1-bits only
+        std::memset(others, -1, sizeof(others));
+
+        // Huffman's algorithm: merge the two least frequent trees until one is left
+        for (;;)
+        {
+            // least frequent symbol, ties go to the larger value
+            int  c1 = -1;
+            long v  = std::numeric_limits<long>::max();
+            for (int i = 0; i <= 256; i++)
+                if (freq[i] && freq[i] <= v)
+                {
+                    v  = freq[i];
+                    c1 = i;
+                }
+            // the next least frequent one
+            int c2 = -1;
+            v = std::numeric_limits<long>::max();
+            for (int i = 0; i <= 256; i++)
+                if (freq[i] && freq[i] <= v && i != c1)
+                {
+                    v  = freq[i];
+                    c2 = i;
+                }
+            if (c2 < 0)
+                break; // a single tree is left
+
+            freq[c1] += freq[c2];
+            freq[c2]  = 0;
+            // one more bit for every symbol of both trees, then chain c2's list to c1's
+            codesize[c1]++;
+            while (others[c1] >= 0)
+            {
+                c1 = others[c1];
+                codesize[c1]++;
+            }
+            others[c1] = c2;
+            codesize[c2]++;
+            while (others[c2] >= 0)
+            {
+                c2 = others[c2];
+                codesize[c2]++;
+            }
+        }
+
+        // number of symbols of each code length
+        int bits[257] = {0};
+        for (int i = 0; i <= 256; i++)
+            bits[codesize[i]]++;
+        bits[0] = 0;
+
+        // limit to 16 bits: a pair of symbols at the deepest level is replaced by one symbol one level up,
+        // the freed prefix takes the other symbol plus one from the next shorter non-empty level
+        for (int i = 256; i > 16; i--)
+            while (bits[i] > 0)
+            {
+                int j = i - 2;
+                while (bits[j] == 0)
+                    j--;
+                bits[i]     -= 2;
+                bits[i - 1] += 1;
+                bits[j + 1] += 2;
+                bits[j]     -= 1;
+            }
+        // drop the reserved symbol, it has the longest code (nothing to drop if no symbol was counted at all)
+        int longest = 16;
+        while (longest > 0 && bits[longest] == 0)
+            longest--;
+        if (longest > 0)
+            bits[longest]--;
+
+        HuffmanSpec spec;
+        for (int length = 1; length <= 16; length++)
+            spec.codesPerBitsize[length - 1] = uint8_t(bits[length]);
+        // symbols sorted by their unlimited code length, the limited lengths keep that order
+        int p = 0;
+        for (int length = 1; length <= 256; length++)
+            for (int symbol = 0; symbol < 256; symbol++)
+                if (codesize[symbol] == length)
+                    spec.values[p++] = uint8_t(symbol);
+        return spec;
+    }
+};
+
+// the four tables of a color JPEG (grayscale only uses the luminance ones)
+struct HuffmanTables
+{
+    HuffmanSpec dcLuminance;
+    HuffmanSpec acLuminance;
+    HuffmanSpec dcChrominance;
+    HuffmanSpec acChrominance;
+
+    static HuffmanTables fromStatistics(const HuffmanStatistics& statistics)
+    {
+        HuffmanTables tables;
+        tables.dcLuminance   = HuffmanSpec::fromCounts(statistics.dcLuminance);
+        tables.acLuminance   = HuffmanSpec::fromCounts(statistics.acLuminance);
+        tables.dcChrominance = HuffmanSpec::fromCounts(statistics.dcChrominance);
+        tables.acChrominance = HuffmanSpec::fromCounts(statistics.acChrominance);
+        return tables;
+    }
+};
+
+#endif // _HUFFMAN_TABLE_HPP
@@ -0,0 +1,209 @@
+#ifndef _MV_STREAM_HPP
+#define _MV_STREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+// Binary motion vector file, columnar and memory-mappable:
+//   MvFileHeader (64 bytes), then one record per frame, appended while decoding
+//   record = MvFrameHeader (64 bytes) + one array per field of AVMotionVector (structure of arrays),
+//   in the order of MvFrameView, each array padded with zeros to a multiple of 64 bytes
+// Everything is in the byte order of the writer (MvFileHeader::byte_order), every array starts 64 byte aligned
+// relative to the start of the file, so a reader maps the file, steps from record to record by
+// MvFrameHeader::record_size and points MvFrameView at the arrays without parsing or copying anything.
+
+static constexpr size_t mv_alignment = 64;
+
+inline size_t mv_padded(size_t bytes)
+{
+    return (bytes + mv_alignment - 1) & ~(mv_alignment - 1);
+}
+
+struct MvFileHeader
+{
+    char     magic[8]          = { 'M', 'V', 'S', 'O', 'A', 0, 0, 0 };
+    uint32_t byte_order        = 0x01020304; // as written by the producer, reads 0x04030201 if the order differs
+    uint32_t version           = 1;
+    uint32_t header_size       = 64;         // sizeof(MvFileHeader)
+    uint32_t frame_header_size = 64;         // sizeof(MvFrameHeader)
+    uint32_t alignment         = mv_alignment;
+    uint32_t num_fields        = 11;         // arrays per record
+    uint8_t  reserved[32]      = { 0 };
+};
+static_assert(sizeof(MvFileHeader) == 64, "MvFileHeader must stay 64 bytes");
+
+struct MvFrameHeader
+{
+    uint64_t record_size;      // this header plus all arrays, a multiple of 64
+    int64_t  index;            // number of the frame in decoding output order, starting at 0
+    int64_t  pts;              // presentation time stamp in the stream's time base, INT64_MIN = unknown
+    uint32_t count;            // motion vectors of the frame, elements per array
+    char     picture_type;     // 'I', 'P', 'B', ... ('?' = unknown)
+    uint8_t  reserved[35];
+};
+static_assert(sizeof(MvFrameHeader) == 64, "MvFrameHeader must stay 64 bytes");
+
+// the arrays of one record, e.g. of a memory-mapped file (same field meanings and types as AVMotionVector)
+struct MvFrameView
+{
+    const MvFrameHeader* header;
+    const int16_t*       src_x;
+    const int16_t*       src_y;
+    const int16_t*       dst_x;         // center of the predicted block
+    const int16_t*       dst_y;
+    const int32_t*       motion_x;      // dst - src in units of 1 / motion_scale pixels
+    const int32_t*       motion_y;
+    const uint16_t*      motion_scale;
+    const uint8_t*       w;             // block size
+    const uint8_t*       h;
+    const int32_t*       source;        // < 0: past reference, > 0: future reference
+    const uint64_t*      flags;
+
+    explicit MvFrameView(const void* record)
+    : header((const MvFrameHeader*)record)
+    {
+        auto next = (const uint8_t*)record + sizeof(MvFrameHeader);
+        column(next, src_x);
+        column(next, src_y);
+        column(next, dst_x);
+        column(next, dst_y);
+        column(next, motion_x);
+        column(next, motion_y);
+        column(next, motion_scale);
+        column(next, w);
+        column(next, h);
+        column(next, source);
+        column(next, flags);
+    }
+
+    size_t size() const { return header->count; }
+
+    // the record following this one (check against the end of the mapping first)
+    const void* next() const { return (const uint8_t*)header + header->record_size; }
+
+    // size of a record with count motion vectors
+    static size_t record_size(size_t count)
+    {
+        return sizeof(MvFrameHeader) + 4 * mv_padded(count * sizeof(int16_t)) + 2 * mv_padded(count * sizeof(int32_t)) +
+               mv_padded(count * sizeof(uint16_t)) + 2 * mv_padded(count) + mv_padded(count * sizeof(int32_t)) +
+               mv_padded(count * sizeof(uint64_t));
+    }
+
+private:
+    template<typename T>
+    void column(const uint8_t*& next, const T*& array)
+    {
+        array = (const T*)next;
+        next += mv_padded(header->count * sizeof(T));
+    }
+};
+
+// appends one record per frame to a motion vector file, each record is written with a single fwrite and
+// flushed, so a reader following the file never sees a partial record unless the writer was killed mid-write
+class MvStreamWriter
+{
+public:
+    MvStreamWriter() = default;
+    MvStreamWriter(const MvStreamWriter& other) = delete;
+    MvStreamWriter& operator=(const MvStreamWriter& other) = delete;
+    ~MvStreamWriter() { close(); }
+
+    // open filename for appending: a new or empty file gets the file header, an existing one must have been
+    // written by this version on a machine with the same byte order; an incomplete last record is cut off
+    bool open(const char* filename)
+    {
+        close();
+        m_file = fopen(filename, "a+b");
+        if (!m_file)
+            return false;
+        if (fseek(m_file, 0, SEEK_END) != 0)
+            return fail();
+        const long size = ftell(m_file);
+        if (size == 0)
+        {
+            const MvFileHeader header;
+            return (fwrite(&header, sizeof(header), 1, m_file) == 1 && fflush(m_file) == 0) || fail();
+        }
+
+        MvFileHeader expected, header;
+        if (size < long(sizeof(header)) || fseek(m_file, 0, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, m_file) != 1 ||
+            memcmp(&header, &expected, offsetof(MvFileHeader, reserved)) != 0)
+            return fail();
+
+        // walk the records up to the first incomplete one
+        long end = sizeof(header);
+        MvFrameHeader frame;
+        while (end + long(sizeof(frame)) <= size && fseek(m_file, end, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, m_file) == 1 &&
+               frame.record_size == MvFrameView::record_size(frame.count) && end + long(frame.record_size) <= size)
+            end += long(frame.record_size);
+        if (end < size && ftruncate(fileno(m_file), end) != 0)
+            return fail();
+        return fseek(m_file, 0, SEEK_END) == 0 || fail();
+    }
+
+    bool is_open() const { return m_file != nullptr; }
+
+    // append the vectors of a frame, MotionVector has the fields of AVMotionVector
+    template<typename MotionVector>
+    bool append(int64_t index, int64_t pts, char picture_type, const MotionVector* mvs, size_t count)
+    {
+        const size_t size = MvFrameView::record_size(count);
+        m_record.assign(size, 0); // keeps the capacity, the padding must be zero
+
+        MvFrameHeader header = {};
+        header.record_size  = size;
+        header.index        = index;
+        header.pts          = pts;
+        header.count        = uint32_t(count);
+        header.picture_type = picture_type;
+        memcpy(m_record.data(), &header, sizeof(header));
+
+        // one pass per field: the stores of each array are sequential
+        uint8_t* next = m_record.data() + sizeof(header);
+        next = put_column<int16_t >(next, mvs, count, &MotionVector::src_x);
+        next = put_column<int16_t >(next, mvs, count, &MotionVector::src_y);
+        next = put_column<int16_t >(next, mvs, count, &MotionVector::dst_x);
+        next = put_column<int16_t >(next, mvs, count, &MotionVector::dst_y);
+        next = put_column<int32_t >(next, mvs, count, &MotionVector::motion_x);
+        next = put_column<int32_t >(next, mvs, count, &MotionVector::motion_y);
+        next = put_column<uint16_t>(next, mvs, count, &MotionVector::motion_scale);
+        next = put_column<uint8_t >(next, mvs, count, &MotionVector::w);
+        next = put_column<uint8_t >(next, mvs, count, &MotionVector::h);
+        next = put_column<int32_t >(next, mvs, count, &MotionVector::source);
+        next = put_column<uint64_t>(next, mvs, count, &MotionVector::flags);
+
+        return fwrite(m_record.data(), 1, size, m_file) == size && fflush(m_file) == 0;
+    }
+
+    void close()
+    {
+        if (m_file)
+            fclose(m_file);
+        m_file = nullptr;
+    }
+
+private:
+    bool fail()
+    {
+        close();
+        return false;
+    }
+
+    template<typename T, typename MotionVector, typename Member>
+    static uint8_t* put_column(uint8_t* next, const MotionVector* mvs, size_t count, Member member)
+    {
+        T* array = (T*)next; // 64 byte aligned offset in m_record
+        for (size_t i = 0; i < count; i++)
+            array[i] = T(mvs[i].*member);
+        return next + mv_padded(count * sizeof(T));
+    }
+
+    FILE*                m_file = nullptr;
+    std::vector<uint8_t> m_record;   // reused for every frame
+};
+
+#endif // _MV_STREAM_HPP
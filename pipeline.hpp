@@ -0,0 +1,251 @@
+#ifndef _PIPELINE_HPP
+#define _PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include <boost/lockfree/queue.hpp>
+#include <boost/thread/thread.hpp>
+
+// one unit of work travelling through the pipeline, derive from it to attach the payload (e.g. a decoded frame)
+struct PipelineJob
+{
+    virtual ~PipelineJob() = default;
+    size_t               seq = 0;  // position in the output, assigned by EncodePipeline::push()
+    std::vector<uint8_t> output;   // filled by the encode stage, consumed by the writer
+};
+
+// time spent by the threads of one stage: working, waiting for input, waiting for room in the next queue
+struct StageStats
+{
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> busy_ns{0};
+    std::atomic<uint64_t> starved_ns{0};
+    std::atomic<uint64_t> blocked_ns{0};
+};
+
+// bounded multi-producer/multi-consumer queue of job pointers on top of boost::lockfree::queue,
+// push/pop spin (yield, then short sleeps) instead of blocking on a mutex
+class JobQueue
+{
+public:
+    explicit JobQueue(size_t capacity) : m_queue(capacity), m_capacity(capacity) {}
+
+    size_t capacity() const { return m_capacity; }
+
+    // returns the nanoseconds spent waiting for a free slot
+    uint64_t push(PipelineJob* job)
+    {
+        uint64_t waited = 0;
+        // m_depth is reserved first, the lock-free queue itself has no notion of "full" beyond its node pool
+        for (unsigned spins = 0; ; spins++)
+        {
+            size_t depth = m_depth.load(std::memory_order_relaxed);
+            if (depth < m_capacity && m_depth.compare_exchange_weak(depth, depth + 1))
+                break;
+            waited += backoff(spins);
+        }
+        while (!m_queue.bounded_push(job))
+            boost::this_thread::yield();
+        m_depth_sum += m_depth.load(std::memory_order_relaxed);
+        m_pushes++;
+        return waited;
+    }
+
+    // returns the nanoseconds spent waiting for a job
+    uint64_t pop(PipelineJob*& job)
+    {
+        uint64_t waited = 0;
+        for (unsigned spins = 0; !m_queue.pop(job); spins++)
+            waited += backoff(spins);
+        m_depth--;
+        return waited;
+    }
+
+    // average number of queued jobs seen by the producers, close to capacity => the consumers are the bottleneck
+    double average_depth() const { return m_pushes ? double(m_depth_sum) / m_pushes : 0.; }
+
+private:
+    static uint64_t backoff(unsigned spins)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (spins < 64)
+            boost::this_thread::yield();
+        else
+            boost::this_thread::sleep_for(boost::chrono::microseconds(50));
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    boost::lockfree::queue<PipelineJob*, boost::lockfree::fixed_sized<false>> m_queue;
+    const size_t          m_capacity;
+    std::atomic<size_t>   m_depth{0};
+    std::atomic<uint64_t> m_depth_sum{0};
+    std::atomic<uint64_t> m_pushes{0};
+};
+
+// decode (caller's thread) -> encode (pool of workers) -> write (single thread, original order)
+// the stages are connected by bounded queues, so the decoder runs at most queue_depth frames ahead
+class EncodePipeline
+{
+public:
+    // worker is the index of the encode thread, lets the callback keep per-thread scratch state
+    using EncodeFunc = std::function<int (PipelineJob& job, size_t worker)>;
+    using WriteFunc  = std::function<int (PipelineJob& job)>;
+
+    EncodePipeline(size_t num_workers, size_t queue_depth, EncodeFunc encode, WriteFunc write)
+    : m_encode(std::move(encode)),
+      m_write(std::move(write)),
+      m_encode_queue(queue_depth),
+      m_write_queue(queue_depth),
+      m_num_workers(std::max<size_t>(num_workers, 1)),
+      m_start(std::chrono::steady_clock::now())
+    {
+        for (size_t worker = 0; worker < m_num_workers; worker++)
+            m_threads.create_thread([this, worker] { encode_loop(worker); });
+        m_threads.create_thread([this] { write_loop(); });
+    }
+
+    EncodePipeline(const EncodePipeline& other) = delete;
+    EncodePipeline& operator=(const EncodePipeline& other) = delete;
+
+    ~EncodePipeline() { finish(); }
+
+    // decode stage: hand over a job (the pipeline owns it from now on), blocks while the encode queue is full
+    // returns false once any stage has failed
+    bool push(PipelineJob* job)
+    {
+        job->seq = m_next_seq++;
+        m_decode.items++;
+        m_decode.blocked_ns += m_encode_queue.push(job);
+        return m_error == 0;
+    }
+
+    // account the time the caller spent in its demux/decode loop, including the time blocked in push()
+    void add_decode_time(uint64_t ns) { m_decode.busy_ns += ns; }
+
+    // drain all stages and join the threads, returns the first error of any stage (0 = ok)
+    int finish()
+    {
+        if (m_finished)
+            return m_error;
+        m_finished = true;
+        for (size_t worker = 0; worker < m_num_workers; worker++)
+            m_encode_queue.push(nullptr); // one end marker per encoder
+        m_threads.join_all();
+        m_wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+        return m_error;
+    }
+
+    // per stage occupancy: share of the wall time the stage's threads were busy / starved / blocked
+    void report(FILE* out) const
+    {
+        const double wall = m_wall_ns ? double(m_wall_ns)
+                                      : double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                   std::chrono::steady_clock::now() - m_start).count());
+        auto line = [&](const char* name, const StageStats& stats, size_t threads, uint64_t busy_ns)
+        {
+            const double total = wall * threads / 100.;
+            fprintf(out, "%-8s %7zu %8" PRIu64 " %7.1f%% %7.1f%% %7.1f%%\n", name, threads, stats.items.load(),
+                    busy_ns / total, stats.starved_ns / total, stats.blocked_ns / total);
+        };
+        fprintf(out, "pipeline: %.1f ms wall\n", wall / 1e6);
+        fprintf(out, "%-8s %7s %8s %8s %8s %8s\n", "stage", "threads", "items", "busy", "starved", "blocked");
+        // the decode loop time includes push(), which is accounted as blocked
+        const uint64_t decode_busy = m_decode.busy_ns > m_decode.blocked_ns ? m_decode.busy_ns - m_decode.blocked_ns : 0;
+        line("decode", m_decode, 1, decode_busy);
+        line("encode", m_encode_stats, m_num_workers, m_encode_stats.busy_ns);
+        line("write",  m_write_stats, 1, m_write_stats.busy_ns);
+        fprintf(out, "queue decode->encode: avg depth %.1f of %zu\n", m_encode_queue.average_depth(), m_encode_queue.capacity());
+        fprintf(out, "queue encode->write:  avg depth %.1f of %zu\n", m_write_queue.average_depth(), m_write_queue.capacity());
+    }
+
+private:
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    void fail(int error)
+    {
+        int expected = 0;
+        m_error.compare_exchange_strong(expected, error);
+    }
+
+    void encode_loop(size_t worker)
+    {
+        for (;;)
+        {
+            PipelineJob* job;
+            m_encode_stats.starved_ns += m_encode_queue.pop(job);
+            if (!job)
+                break;
+
+            auto start = std::chrono::steady_clock::now();
+            if (m_error == 0)
+            {
+                int ret = m_encode(*job, worker);
+                if (ret < 0)
+                    fail(ret);
+            }
+            m_encode_stats.busy_ns += elapsed_ns(start);
+            m_encode_stats.items++;
+            m_encode_stats.blocked_ns += m_write_queue.push(job);
+        }
+        // the last encoder to finish tells the writer
+        if (++m_workers_done == m_num_workers)
+            m_encode_stats.blocked_ns += m_write_queue.push(nullptr);
+    }
+
+    void write_loop()
+    {
+        // jobs arrive in completion order, keep them until all previous ones are written
+        std::map<size_t, std::unique_ptr<PipelineJob>> pending;
+        size_t next = 0;
+        for (;;)
+        {
+            PipelineJob* job;
+            m_write_stats.starved_ns += m_write_queue.pop(job);
+            if (!job)
+                break;
+            pending.emplace(job->seq, std::unique_ptr<PipelineJob>(job));
+
+            auto start = std::chrono::steady_clock::now();
+            for (auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it), next++)
+            {
+                if (m_error == 0)
+                {
+                    int ret = m_write(*it->second);
+                    if (ret < 0)
+                        fail(ret);
+                }
+                m_write_stats.items++;
+            }
+            m_write_stats.busy_ns += elapsed_ns(start);
+        }
+    }
+
+    EncodeFunc          m_encode;
+    WriteFunc           m_write;
+    JobQueue            m_encode_queue;
+    JobQueue            m_write_queue;
+    const size_t        m_num_workers;
+    boost::thread_group m_threads;
+
+    size_t              m_next_seq = 0;
+    std::atomic<size_t> m_workers_done{0};
+    std::atomic<int>    m_error{0};
+    bool                m_finished = false;
+
+    StageStats          m_decode;
+    StageStats          m_encode_stats;
+    StageStats          m_write_stats;
+    std::chrono::steady_clock::time_point m_start;
+    uint64_t            m_wall_ns = 0;
+};
+
+#endif // _PIPELINE_HPP
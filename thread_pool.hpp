@@ -0,0 +1,112 @@
+#ifndef _THREAD_POOL_HPP
+#define _THREAD_POOL_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// fixed number of worker threads fed from a single task queue
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    // num_threads == 0 => one worker per hardware thread
+    explicit ThreadPool(size_t num_threads = 0)
+    {
+        if (num_threads == 0)
+            num_threads = std::max(1u, boost::thread::hardware_concurrency());
+        for (size_t i = 0; i < num_threads; i++)
+            m_workers.create_thread([this] { worker_loop(); });
+    }
+
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_task_ready.notify_all();
+        m_workers.join_all();
+    }
+
+    size_t size() const { return m_workers.size(); }
+
+    void submit(Task task)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_task_ready.notify_one();
+    }
+
+    // calls func(i) for every i in [0, count) and returns when all calls are done,
+    // the calling thread works on the range, too
+    template<typename Func>
+    void parallel_for(size_t count, Func&& func)
+    {
+        if (count == 0)
+            return;
+
+        std::atomic<size_t> next{0};
+        size_t              running = 0;
+        boost::mutex        done_mutex;
+        boost::condition_variable done;
+
+        auto drain = [&]()
+        {
+            for (size_t i = next++; i < count; i = next++)
+                func(i);
+        };
+
+        const size_t helpers = std::min(size(), count - 1);
+        running = helpers;
+        for (size_t h = 0; h < helpers; h++)
+            submit([&]()
+            {
+                drain();
+                boost::lock_guard<boost::mutex> lock(done_mutex);
+                if (--running == 0)
+                    done.notify_one();
+            });
+
+        drain();
+
+        boost::unique_lock<boost::mutex> lock(done_mutex);
+        done.wait(lock, [&] { return running == 0; });
+    }
+
+private:
+    void worker_loop()
+    {
+        for (;;)
+        {
+            Task task;
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                m_task_ready.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_tasks.empty())
+                    return; // m_stop and nothing left to do
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    boost::thread_group       m_workers;
+    boost::mutex              m_mutex;
+    boost::condition_variable m_task_ready;
+    std::deque<Task>          m_tasks;
+    bool                      m_stop = false;
+};
+
+#endif // _THREAD_POOL_HPP
@@ -0,0 +1,153 @@
+#ifndef _TILED_IMAGE_HPP
+#define _TILED_IMAGE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include "dct_batch.hpp"
+
+// Planes stored block-major: the TILE x TILE samples of a tile (8x8 block or 16x16 MCU) are contiguous, tiles follow
+// each other left to right, top to bottom. Every tile starts on a 64 byte boundary, the plane is padded to whole
+// tiles by replicating its last column / row (what the encoder does at the borders anyway), so a kernel walks the
+// tiles front to back without index math or border checks, and a whole plane of 8x8 float tiles is exactly the
+// input of dct_forward_blocks().
+// Matrix / FixedMatrix (Matrix.hpp) stay row-major and are meant for single blocks and the reference transforms.
+
+// level shifted float samples as the DCT expects them
+struct LevelShift
+{
+  float operator()(uint8_t value) const { return value - 128.f; }
+};
+
+struct KeepSample
+{
+  uint8_t operator()(uint8_t value) const { return value; }
+};
+
+// one tile of a TiledPlane, does not own or copy anything
+template<typename T, int TILE>
+class BlockView
+{
+public:
+  explicit BlockView(T* samples): m_samples{samples} {}
+
+  T& operator()(int row, int col) const { return m_samples[row * TILE + col]; }
+  T* data() const { return m_samples; }
+  T* row(int row) const { return m_samples + row * TILE; }
+  static constexpr int size() { return TILE * TILE; }
+
+private:
+  T* m_samples;
+};
+
+template<typename T, int TILE = 8>
+class TiledPlane
+{
+public:
+  static constexpr int    tile      = TILE;
+  static constexpr size_t tile_size = size_t(TILE) * TILE; // samples per tile
+  static constexpr size_t alignment = 64;
+  static_assert(tile_size * sizeof(T) % alignment == 0, "tiles must keep the 64 byte alignment of the plane");
+
+  TiledPlane() = default;
+  TiledPlane(int width, int height) { resize(width, height); }
+
+  // storage for a width x height plane, kept when it is large enough already (content undefined); the tiles per
+  // row and per column are rounded up to a multiple of multiple (e.g. 2: the 8x8 luma tiles of 16x16 MCUs)
+  void resize(int width, int height, int multiple = 1)
+  {
+    m_width   = width;
+    m_height  = height;
+    m_blocksX = (width  + TILE * multiple - 1) / (TILE * multiple) * multiple;
+    m_blocksY = (height + TILE * multiple - 1) / (TILE * multiple) * multiple;
+    const size_t samples = block_count() * tile_size;
+    if (samples > m_capacity)
+    {
+      m_samples.reset(static_cast<T*>(std::aligned_alloc(alignment, samples * sizeof(T))));
+      m_capacity = m_samples ? samples : 0;
+    }
+  }
+
+  // bulk conversion of a row-major 8 bit plane (e.g. an AVFrame plane: data[i], linesize[i]), convert(sample)
+  // gives the stored value, multiple as for resize(); the source is read row by row, each row is spread over the
+  // tiles it crosses
+  template<typename Convert = KeepSample>
+  void assign(const uint8_t* src, int linesize, int width, int height, Convert&& convert = Convert(),
+              int multiple = 1)
+  {
+    resize(width, height, multiple);
+    const int fullBlocks = width / TILE;
+    const int maxX = width  - 1;
+    const int maxY = height - 1;
+    for (int blockY = 0; blockY < m_blocksY; blockY++)
+      for (int y = 0; y < TILE; y++)
+      {
+        const uint8_t* line = src + std::min(blockY * TILE + y, maxY) * linesize;
+        T* out = block(0, blockY) + y * TILE;
+        int blockX = 0;
+        for (; blockX < fullBlocks; blockX++, out += tile_size)
+          for (int x = 0; x < TILE; x++)
+            out[x] = convert(line[blockX * TILE + x]);
+        // partial tile and padding tiles at the right border
+        for (; blockX < m_blocksX; blockX++, out += tile_size)
+          for (int x = 0; x < TILE; x++)
+            out[x] = convert(line[std::min(blockX * TILE + x, maxX)]);
+      }
+  }
+
+  T*       block(int blockX, int blockY)       { return block(size_t(blockY) * m_blocksX + blockX); }
+  const T* block(int blockX, int blockY) const { return block(size_t(blockY) * m_blocksX + blockX); }
+  T*       block(size_t index)                 { return m_samples.get() + index * tile_size; }
+  const T* block(size_t index)           const { return m_samples.get() + index * tile_size; }
+  BlockView<T, TILE>       view(int blockX, int blockY)       { return BlockView<T, TILE>(block(blockX, blockY)); }
+  BlockView<const T, TILE> view(int blockX, int blockY) const { return BlockView<const T, TILE>(block(blockX, blockY)); }
+
+  T*       data()       { return m_samples.get(); }
+  const T* data() const { return m_samples.get(); }
+  int    width()       const { return m_width; }
+  int    height()      const { return m_height; }
+  int    blocks_x()    const { return m_blocksX; }
+  int    blocks_y()    const { return m_blocksY; }
+  size_t block_count() const { return size_t(m_blocksX) * m_blocksY; }
+
+private:
+  struct Free
+  {
+    void operator()(T* samples) const { std::free(samples); }
+  };
+
+  std::unique_ptr<T[], Free> m_samples;
+  size_t m_capacity = 0;
+  int    m_width    = 0;
+  int    m_height   = 0;
+  int    m_blocksX  = 0;
+  int    m_blocksY  = 0;
+};
+
+// the three planes of a YCbCr picture, chroma at its own (subsampled) size
+template<typename T, int TILE = 8>
+struct TiledImage
+{
+  TiledPlane<T, TILE> planes[3];
+
+  // planes / linesizes as in AVFrame::data / AVFrame::linesize, chroma subsampled by 2^chromaShiftX x 2^chromaShiftY
+  template<typename Convert = KeepSample>
+  void assign(const uint8_t* const src[3], const int linesizes[3], int width, int height,
+              int chromaShiftX, int chromaShiftY, Convert&& convert = Convert())
+  {
+    planes[0].assign(src[0], linesizes[0], width, height, convert);
+    const int chromaWidth  = (width  + (1 << chromaShiftX) - 1) >> chromaShiftX;
+    const int chromaHeight = (height + (1 << chromaShiftY) - 1) >> chromaShiftY;
+    planes[1].assign(src[1], linesizes[1], chromaWidth, chromaHeight, convert);
+    planes[2].assign(src[2], linesizes[2], chromaWidth, chromaHeight, convert);
+  }
+};
+
+// forward DCT of every 8x8 tile of a level shifted plane, in place, the tiles are the batches' input as they are
+inline void dct_forward_tiles(TiledPlane<float, 8>& plane)
+{
+  dct_forward_blocks(plane.data(), plane.block_count());
+}
+
+#endif // _TILED_IMAGE_HPP
@@ -0,0 +1,145 @@
+#ifndef _TRACE_HPP
+#define _TRACE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Tracing spans, compiled in with -DDCT_TRACE (CMake option DCT_TRACE), otherwise TRACE_SPAN is an empty statement:
+//   TRACE_SPAN("dct_quantize"); // from here to the end of the enclosing scope
+// Every thread records into its own fixed size ring buffer, allocated on the thread's first span, the oldest
+// spans are overwritten; recording a span neither allocates nor locks. Timestamps are TSC ticks on x86 (rdtsc),
+// steady_clock nanoseconds elsewhere, Tracer::dump() converts them to microseconds and writes the Chrome
+// trace-event JSON format (chrome://tracing, ui.perfetto.dev).
+class Tracer
+{
+public:
+#ifdef DCT_TRACE
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    static constexpr size_t ring_size = 1 << 16; // spans per thread, a power of 2
+
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static void record(const char* name, uint64_t start, uint64_t end)
+    {
+        Ring& ring = thread_ring();
+        ring.spans[ring.count & (ring_size - 1)] = Span{ name, start, end };
+        ring.count++;
+    }
+
+    // write the spans of all threads, call it when the traced threads are done (or joined)
+    static bool dump(const char* filename)
+    {
+        Registry& registry = Tracer::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        FILE* file = fopen(filename, "w");
+        if (!file)
+            return false;
+
+        // ticks per microsecond, measured over the whole run
+        const double elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - registry.start_time).count();
+        const double ticks_per_us = elapsed_us > 0 ? double(now() - registry.start_ticks) / elapsed_us : 1.;
+
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for (size_t thread = 0; thread < registry.rings.size(); thread++)
+        {
+            const Ring& ring = *registry.rings[thread];
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}}",
+                    first ? "" : ",\n", thread, thread);
+            first = false;
+            const uint64_t begin = ring.count > ring_size ? ring.count - ring_size : 0;
+            for (uint64_t i = begin; i < ring.count; i++)
+            {
+                const Span& span = ring.spans[i & (ring_size - 1)];
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                        span.name, thread, double(span.start - registry.start_ticks) / ticks_per_us,
+                        double(span.end - span.start) / ticks_per_us);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    struct Span
+    {
+        const char* name; // string literal
+        uint64_t    start;
+        uint64_t    end;
+    };
+
+    struct Ring
+    {
+        uint64_t count = 0; // spans recorded so far, the last ring_size of them are kept
+        Span     spans[ring_size];
+    };
+
+    struct Registry
+    {
+        std::mutex                         mutex;
+        std::vector<std::unique_ptr<Ring>> rings;      // kept after their threads ended
+        uint64_t                           start_ticks = now();
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    };
+
+    static Registry& registry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    static Ring& thread_ring()
+    {
+        thread_local Ring* ring = add_ring();
+        return *ring;
+    }
+
+    static Ring* add_ring()
+    {
+        Registry& registry = Tracer::registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.rings.push_back(std::make_unique<Ring>());
+        return registry.rings.back().get();
+    }
+};
+
+// records the time from its construction to its destruction as a span
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char* name) : m_name(name), m_start(Tracer::now()) {}
+    TraceSpan(const TraceSpan& other) = delete;
+    TraceSpan& operator=(const TraceSpan& other) = delete;
+    ~TraceSpan() { Tracer::record(m_name, m_start, Tracer::now()); }
+
+private:
+    const char* m_name;
+    uint64_t    m_start;
+};
+
+#ifdef DCT_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name)    TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+#else
+#define TRACE_SPAN(name)    do {} while (0)
+#endif
+
+#endif // _TRACE_HPP
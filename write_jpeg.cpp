@@ -1,6 +1,13 @@
 #include "write_jpeg.hpp"
 #include <boost/dynamic_bitset.hpp>
 
+Bitstream::Bitstream(size_t size)
+{
+    m_bit_stream = std::make_unique<boost::dynamic_bitset<uint8_t>>(size);
+}
+
+Bitstream::~Bitstream() = default;
+
 void Bitstream::append( bool val)
 {
     m_bit_stream->push_back(val);
@@ -2,31 +2,33 @@
 #define _WRITE_JPEG_HPP
 
 #include <boost/dynamic_bitset_fwd.hpp>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <type_traits>
 #include <vector>
-
-// represent a single Huffman code
-struct BitCode
-{
-  BitCode() = default; // undefined state, must be initialized at a later time
-  BitCode(uint16_t code_, uint8_t numBits_)
-  : code(code_), numBits(numBits_) {}
-  uint16_t code;       // JPEG's Huffman codes are limited to 16 bits
-  uint8_t  numBits;    // number of valid bits
-};
+#include "bit_writer.hpp"
+#include "block_cache.hpp"
+#include "coefficient_frame.hpp"
+#include "color_convert.hpp"
+#include "dct.hpp"
+#include "dct_int.hpp"
+#include "huffman_table.hpp"
+#include "thread_pool.hpp"
+#include "tiled_image.hpp"
+#include "trace.hpp"
 
 class Bitstream
 {
     public:
     std::unique_ptr< boost::dynamic_bitset<uint8_t>> m_bit_stream;    
-    Bitstream(size_t size)
-    {
-        m_bit_stream = std::make_unique<boost::dynamic_bitset<uint8_t>>(size);
-    }
+    Bitstream(size_t size); // defined in write_jpeg.cpp, dynamic_bitset is only forward declared here
     Bitstream(const Bitstream& other) = default;
     Bitstream& operator=(const Bitstream& other) = default;
     Bitstream(Bitstream&& other) = default;
     Bitstream& operator=(Bitstream&& other) = default;
-    ~Bitstream()= default;
+    ~Bitstream();
     void append(bool val);
     void append(uint8_t val);
 };
@@ -36,7 +38,7 @@ class Bytestream
 {
     public:
     std::vector< uint8_t> m_byte_stream;    
-    Bytestream(size_t size):m_byte_stream(size) { }
+    Bytestream(size_t size) { m_byte_stream.reserve(size); } // size is only a capacity hint, the stream starts empty
     Bytestream(const Bytestream& other) = default;
     Bytestream& operator=(const Bytestream& other) = default;
     Bytestream(Bytestream&& other) = default;
@@ -52,15 +54,6 @@ class Bytestream
         m_byte_stream.push_back(uint8_t(length & 0xFF));
     }
 
-
-  // store the most recently encoded bits that are not written yet
-  struct BitBuffer
-  {
-    int32_t data    = 0; // actually only at most 24 bits are used
-    uint8_t numBits = 0; // number of valid bits (the right-most bits)
-  } buffer;
-
-
   // write an array of bytes
   template <typename T, int Size>
   Bytestream& operator<<(T (&manyBytes)[Size])
@@ -76,31 +69,6 @@ class Bytestream
       return *this;
     }
   
-  // write Huffman bits stored in BitCode, keep excess bits in BitBuffer
-  Bytestream& operator<<(const BitCode& data)
-  {
-    // append the new bits to those bits leftover from previous call(s)
-    buffer.numBits += data.numBits;
-    buffer.data   <<= data.numBits;
-    buffer.data    |= data.code;
-
-    // write all "full" bytes
-    while (buffer.numBits >= 8)
-    {
-      // extract highest 8 bits
-      buffer.numBits -= 8;
-      auto oneByte = uint8_t(buffer.data >> buffer.numBits);
-      m_byte_stream.push_back(oneByte);
-
-      if (oneByte == 0xFF) // 0xFF has a special meaning for JPEGs (it's a block marker)
-        m_byte_stream.push_back(0);   // therefore pad a zero to indicate "nope, this one ain't a marker, it's just a coincidence"
-
-      // note: I don't clear those written bits, therefore buffer.bits may contain garbage in the high bits
-      //       if you really want to "clean up" (e.g. for debugging purposes) then uncomment the following line
-      //buffer.bits &= (1 << buffer.numBits) - 1;
-    }
-    return *this;
-  }
 };
 
 #include <algorithm>
@@ -133,6 +101,16 @@ const uint8_t ZigZagInv[8*8] =
         29,22,15,23,30,37,44,51,   //            20,22,33,38,46,51,55,60,
         58,59,52,45,38,31,39,46,   //            21,34,37,47,50,56,59,61,
         53,60,61,54,47,55,62,63 }; //            35,36,48,49,57,58,62,63      
+// the inverse: ZigZag[ZigZagInv[i]] = i, position of a natural (row-major) index in zigzag order
+const uint8_t ZigZag[8*8] =
+      {  0, 1, 5, 6,14,15,27,28,
+         2, 4, 7,13,16,26,29,42,
+         3, 8,12,17,25,30,41,43,
+         9,11,18,24,31,40,44,53,
+        10,19,23,32,39,45,52,54,
+        20,22,33,38,46,51,55,60,
+        21,34,37,47,50,56,59,61,
+        35,36,48,49,57,58,62,63 };
 const int16_t CodeWordLimit = 2048; // +/-2^11, maximum value after DCT
 
 // static Huffman code tables from JPEG standard Annex K
@@ -165,8 +143,78 @@ const uint8_t AcChrominanceValues        [162] =
       0x88,0x89,0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,
       0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,0xC4,0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,
       0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,0xF9,0xFA };
-const int16_t CodeWordLimit = 2048; // +/-2^11, maximum value after DCT
 
+// the quantization steps of the tables above for a quality of 1..100, zigzag order (as written to the DQT segment)
+inline void jpegQuantTables(unsigned char quality_, uint8_t quantLuminance[8*8], uint8_t quantChrominance[8*8])
+{
+  // quality level must be in 1 ... 100
+  auto quality = std::clamp<uint16_t>(quality_, 1, 100);
+  // convert to an internal JPEG quality factor, formula taken from libjpeg
+  quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  for (auto i = 0; i < 8*8; i++)
+  {
+    int luminance   = (DefaultQuantLuminance  [ZigZagInv[i]] * quality + 50) / 100;
+    int chrominance = (DefaultQuantChrominance[ZigZagInv[i]] * quality + 50) / 100;
+
+    // clamp to 1..255
+    quantLuminance  [i] = std::clamp(luminance,   1, 255);
+    quantChrominance[i] = std::clamp(chrominance, 1, 255);
+  }
+}
+
+// output of the forward AAN DCT => quantized coefficient: * 1 / (step * aan_scale()), natural order; the float
+// encoder (EncoderTables::scaledLuminance / scaledChrominance) and frame_to_coefficients() quantize with it
+struct QuantizeTable
+{
+  float multiplier[8*8]; // natural order
+
+  // quant: the 64 quantization steps in zigzag order as in a DQT segment (all 1: unquantized coefficients as JPEG
+  // defines them, rounded)
+  explicit QuantizeTable(const uint8_t quant[8*8])
+  {
+    for (auto i = 0; i < 8*8; i++)
+      multiplier[ZigZagInv[i]] = 1 / aan_scale(ZigZagInv[i]) / quant[i];
+  }
+};
+
+// the Annex K tables above in the layout of optimized tables
+inline HuffmanTables standardHuffmanTables()
+{
+  HuffmanTables tables;
+  auto copy = [](HuffmanSpec& spec, const uint8_t (&codesPerBitsize)[16], const uint8_t* values, size_t numValues)
+  {
+    std::memcpy(spec.codesPerBitsize, codesPerBitsize, 16);
+    std::memcpy(spec.values, values, numValues);
+  };
+  copy(tables.dcLuminance,   DcLuminanceCodesPerBitsize,   DcLuminanceValues,   sizeof(DcLuminanceValues));
+  copy(tables.acLuminance,   AcLuminanceCodesPerBitsize,   AcLuminanceValues,   sizeof(AcLuminanceValues));
+  copy(tables.dcChrominance, DcChrominanceCodesPerBitsize, DcChrominanceValues, sizeof(DcChrominanceValues));
+  copy(tables.acChrominance, AcChrominanceCodesPerBitsize, AcChrominanceValues, sizeof(AcChrominanceValues));
+  return tables;
+}
+
+// planar 8 bit YCbCr image as delivered by the decoder, e.g. AVFrame::data[0..2] and AVFrame::linesize[0..2]
+struct PlanarYCbCr
+{
+  const uint8_t* planes[3];      // Y, Cb, Cr
+  int            linesizes[3];   // bytes per row of each plane (may be larger than the width)
+  int            chromaShiftX;   // log2 of the horizontal chroma subsampling, 1 for 4:2:0 and 4:2:2, 0 for 4:4:4
+  int            chromaShiftY;   // log2 of the vertical   chroma subsampling, 1 for 4:2:0, 0 for 4:2:2 and 4:4:4
+  bool           fullRange;      // true: 0..255 like JFIF ("yuvj"), false: video range Y 16..235, CbCr 16..240
+};
+
+// arithmetic used for DCT and quantization
+// - Float: AAN DCT in float, quantization by multiplying with the scaled reciprocal tables
+// - Int16: the same AAN butterfly in 16 bit fixed point (dct_int.hpp), quantization by reciprocal
+//   multiply-high, samples stay int16 from the color conversion to the Huffman coder, blocks are
+//   transformed DCTBatchInt16Native::lanes at a time
+//   tolerance: the decoded images are at most 0.1 dB PSNR (vs. the source image) below those of the
+//   Float path for qualities 30..95; at quality 100, where divisors below 1 lose their lowest bit,
+//   up to 5 dB below; dct_bench checks both limits and fails when they are exceeded
+enum class DctMethod { Float, Int16 };
+
+class JpegEncoderContext;
 
 class JPEGWriter : public Bytestream
 {
@@ -183,14 +231,513 @@ class JPEGWriter : public Bytestream
         // void writeDHTHeader(Bitstream& bitWriter);
         // void writeSOSHeader(Bitstream& bitWriter);
 
-      // write the JPEG header
-      // this is the first part of the JPEG file, it contains the JFIF header
-      
+      // quality and channel dependent tables, filled by writeHeaders() and used while encoding the MCUs
+      struct EncoderTables
+      {
+        float   scaledLuminance  [8*8];
+        float   scaledChrominance[8*8];
+        QuantReciprocal reciprocalLuminance  [8*8]; // the same quantization steps for DctMethod::Int16
+        QuantReciprocal reciprocalChrominance[8*8];
+        DctMethod dct = DctMethod::Float;
+        BitCode huffmanLuminanceDC  [256];
+        BitCode huffmanLuminanceAC  [256];
+        BitCode huffmanChrominanceDC[256];
+        BitCode huffmanChrominanceAC[256];
+        BitCode codewordsArray[2 * CodeWordLimit];  // note: quantized[i] is found at codewordsArray[quantized[i] + CodeWordLimit]
+        const BitCode* codewords() const { return &codewordsArray[CodeWordLimit]; } // allow negative indices
+        int     restartMcuRows = 0; // MCU rows per restart interval as written to the DRI marker, 0 = no restart markers
+      };
+
+      // first pass of writeJpegOptimized(): the quantized blocks (zigzag order) of one restart interval in coding order
+      struct QuantizedBlocks
+      {
+        // allocator-aware, the blocks of a std::pmr::vector<QuantizedBlocks> use the memory of the vector
+        using allocator_type = std::pmr::polymorphic_allocator<int16_t>;
+        QuantizedBlocks() = default;
+        QuantizedBlocks(const QuantizedBlocks& other) = default;
+        QuantizedBlocks(QuantizedBlocks&& other) = default;
+        explicit QuantizedBlocks(const allocator_type& allocator) : coefficients(allocator) {}
+        QuantizedBlocks(const QuantizedBlocks& other, const allocator_type& allocator)
+        : coefficients(other.coefficients, allocator) {}
+        QuantizedBlocks(QuantizedBlocks&& other, const allocator_type& allocator)
+        : coefficients(std::move(other.coefficients), allocator) {}
+
+        std::pmr::vector<int16_t> coefficients; // 64 per block
+      };
+
+      // split the scan into independent restart intervals of mcuRows MCU rows each (DRI/RSTn markers),
+      // the intervals are encoded in parallel if a pool is given; mcuRows = 0 disables restart markers
+      void setRestartInterval(int mcuRows, ThreadPool* pool = nullptr)
+      {
+        m_restartMcuRows = std::max(mcuRows, 0);
+        m_pool           = pool;
+      }
+
+      void setDctMethod(DctMethod method) { m_dct = method; }
+
+      // scratch memory of writeJpegOptimized() (the quantized blocks of the whole image) comes from memory instead
+      // of the heap, e.g. the FrameArena of the frame (frame_arena.hpp); memory must outlive the writer
+      void setMemoryResource(std::pmr::memory_resource* memory)
+      {
+        // assignment would keep the old resource, polymorphic allocators don't propagate
+        std::destroy_at(&m_quantized);
+        std::construct_at(&m_quantized, memory);
+      }
+
+      // the quantized blocks of every following image also go to frame (nullptr: stop), exactly the blocks of the
+      // JPEG, so that other consumers (e.g. the coefficient archive) need no second transform: Y at the image size,
+      // Cb and Cr at the size of the JPEG's chroma (shift 1 for 4:2:0, 0 for 4:4:4, whatever the source's
+      // subsampling), empty for grayscale; the planes are resized per image, frame must outlive the writer
+      void setCoefficientOutput(CoefficientFrame* frame, CoefficientOrder order = CoefficientOrder::ZigZag)
+      {
+        m_coefficients     = frame;
+        m_coefficientOrder = order;
+      }
+
       //void writeJPEG(bool isRGB)
       bool writeJpeg(const void* pixels_, unsigned short width, unsigned short height,
         bool isRGB, unsigned char quality_, bool downsample, const char* comment)      
       {
+      EncoderTables tables;
+      writeHeaders(tables, width, height, isRGB, quality_, downsample, comment);
+
+      // just convert image data from void*
+      encodeImage(tables, (const uint8_t*)pixels_, width * (isRGB ? 3 : 1), width, height, isRGB, downsample);
+      return true;
+  } // WriteJPEG
+
+      // same with the tables and headers of a JpegEncoderContext (size, quality and sampling are taken from there),
+      // replaces the content of the stream but keeps its capacity => only the entropy coded data is computed per frame
+      // pixels: packed rows; the RGBView / PlaneView overloads read rows of any stride (e.g. an AVFrame's linesize)
+      // in place, they need at least the context's width x height pixels
+      bool writeJpeg(const JpegEncoderContext& context, const void* pixels);
+      bool writeJpeg(const JpegEncoderContext& context, const RGBView& pixels);
+      bool writeJpeg(const JpegEncoderContext& context, const PlaneView& gray);
+      bool writeJpegYCbCr(const JpegEncoderContext& context, const PlanarYCbCr& image);
+
+      // two passes with optimal Huffman tables for this image instead of the Annex K ones (context only provides
+      // size, quality, sampling, ...): all blocks are transformed and quantized once and kept in memory, their
+      // symbol statistics give the tables, then the stored blocks are Huffman coded
+      // reusable != nullptr: every symbol gets a code and the tables are returned, a JpegEncoderContext built with
+      // them encodes the following frames (e.g. of the same GOP) in a single pass
+      bool writeJpegOptimized(const JpegEncoderContext& context, const void* pixels, HuffmanTables* reusable = nullptr);
+      bool writeJpegOptimized(const JpegEncoderContext& context, const RGBView& pixels, HuffmanTables* reusable = nullptr);
+      bool writeJpegYCbCrOptimized(const JpegEncoderContext& context, const PlanarYCbCr& image, HuffmanTables* reusable = nullptr);
+
+      // incremental encoding of a sequence of frames: MCUs that the cache marks as unchanged since the previous
+      // frame are Huffman coded from its stored quantized blocks, all others are encoded and stored for the next
+      // frame; the output is a complete JPEG as with writeJpeg(), cache.reusedBlocks() tells how many were reused
+      bool writeJpegIncremental(const JpegEncoderContext& context, const void* pixels, BlockCache& cache);
+      bool writeJpegIncremental(const JpegEncoderContext& context, const RGBView& pixels, BlockCache& cache);
+      bool writeJpegYCbCrIncremental(const JpegEncoderContext& context, const PlanarYCbCr& image, BlockCache& cache);
+
+      // Huffman coding of already quantized blocks, e.g. from setCoefficientOutput() or a coefficient archive:
+      // the planes must have the sizes setCoefficientOutput() gives for the context (false otherwise) and the
+      // quantization of the context's quality. The blocks of a 4:2:0 MCU beyond an odd number of Y block rows or
+      // columns aren't part of the frame, they are coded with the DC of the nearest block and no AC (like libjpeg's
+      // jpeg_write_coefficients()); without them the output is the JPEG the blocks were taken from.
+      bool writeJpegCoefficients(const JpegEncoderContext& context, const CoefficientFrame& coefficients);
+
+      // entropy coded data of an RGB or grayscale image and the EOI marker, the headers are already written
+      // linesize: bytes from one row of pixels to the next
+      void encodeImage(const EncoderTables& tables, const uint8_t* pixels, int linesize,
+        unsigned short width, unsigned short height, bool isRGB, bool downsample)
+      {
+      encodeScanBlocks(tables, width, height, isRGB, downsample, [&](auto& writer, int firstMcuRow, int lastMcuRow)
+      {
+        if (tables.dct == DctMethod::Int16)
+          encodeMcuRows<int16_t>(writer, tables, pixels, linesize, width, height, isRGB, downsample, firstMcuRow, lastMcuRow);
+        else
+          encodeMcuRows<float>(writer, tables, pixels, linesize, width, height, isRGB, downsample, firstMcuRow, lastMcuRow);
+      });
+
+      // EOI marker (end of image)
+      *this << 0xFF << 0xD9;
+      }
+
+      // level shifted sample as stored in the blocks: float as is, int16 rounded and clamped to -128..127
+      template<typename Sample>
+      static Sample toSample(float value)
+      {
+        if constexpr (std::is_same_v<Sample, float>)
+          return value;
+        else
+          return Sample(std::clamp(int(value + (value >= 0 ? +0.5f : -0.5f)), -128, 127));
+      }
+
+      // color conversion, DCT, quantization and Huffman coding of the MCU rows [firstMcuRow, lastMcuRow)
+      // of an RGB or grayscale image, DC prediction starts from zero, rows of pixels are linesize bytes apart
+      // Sample is float (DctMethod::Float) or int16_t (DctMethod::Int16)
+      // Writer is a BitWriter, QuantizedBlocks (first pass of writeJpegOptimized), CachedBlocks (writeJpegIncremental)
+      // or CoefficientBlocks (setCoefficientOutput)
+      template<typename Sample, typename Writer>
+      static void encodeMcuRows(Writer& writer, const EncoderTables& tables, const uint8_t* pixels, int linesize,
+        unsigned short width, unsigned short height, bool isRGB, bool downsample, int firstMcuRow, int lastMcuRow)
+      {
+      const auto& scaledLuminance      = tables.scaledLuminance;
+      const auto& scaledChrominance    = tables.scaledChrominance;
+      const auto& huffmanLuminanceDC   = tables.huffmanLuminanceDC;
+      const auto& huffmanLuminanceAC   = tables.huffmanLuminanceAC;
+      const auto& huffmanChrominanceDC = tables.huffmanChrominanceDC;
+      const auto& huffmanChrominanceAC = tables.huffmanChrominanceAC;
+      const auto  codewords            = tables.codewords();
+
+      // the next two variables are frequently used when checking for image borders
+      const auto maxWidth  = width  - 1; // "last row"
+      const auto maxHeight = height - 1; // "bottom line"
+
+      // process MCUs (minimum codes units) => image is subdivided into a grid of 8x8 or 16x16 tiles
+      const auto sampling = downsample ? 2 : 1; // 1x1 or 2x2 sampling
+      const auto mcuSize  = 8 * sampling;
+
+      // average color of the previous MCU
+      int16_t lastYDC = 0, lastCbDC = 0, lastCrDC = 0;
+      Sample Y[8][8];          // grayscale
+      YCbCrMcu<Sample> mcu;    // RGB converted to YCbCr
+      BlockRowInt16 blockRow; // DctMethod::Int16 only
+
+      const int lastMcuY = std::min(int(height), lastMcuRow * mcuSize);
+      for (int mcuY = firstMcuRow * mcuSize; mcuY < lastMcuY; mcuY += mcuSize) // each step is either 8 or 16 (=mcuSize)
+      {
+        for (int mcuX = 0; mcuX < width; mcuX += mcuSize)
+        {
+          if constexpr (std::is_same_v<Writer, CachedBlocks>)
+            if (writer.cache.reuse(size_t(mcuY / mcuSize) * writer.cache.mcusPerRow() + mcuX / mcuSize))
+            {
+              if constexpr (std::is_same_v<Sample, int16_t>)
+                blockRow.encode(writer, tables, lastYDC, lastCbDC, lastCrDC); // pending blocks come first
+              writer.replay(tables, lastYDC, lastCbDC, lastCrDC);
+              continue;
+            }
+
+          if (isRGB)
+          {
+            // color conversion of the whole MCU (color_convert.hpp)
+            // YCbCr 4:4:4 format: each MCU is a 8x8 block
+            // YCbCr 4:2:0 format: each MCU represents a 16x16 block, stored as 4x 8x8 Y-blocks plus 1x 8x8 Cb and 1x 8x8 Cr block)
+            rgb_to_ycbcr_mcu(pixels, linesize, mcuX, mcuY, width, height, downsample, mcu);
+            for (int block = 0; block < sampling * sampling; block++)
+              if constexpr (std::is_same_v<Sample, float>)
+                lastYDC = encodeBlock(writer, mcu.Y[block], scaledLuminance, lastYDC, huffmanLuminanceDC, huffmanLuminanceAC, codewords);
+              else
+                blockRow.add(0, mcu.Y[block]);
+
+            if constexpr (std::is_same_v<Sample, float>)
+            {
+              lastCbDC = encodeBlock(writer, mcu.Cb, scaledChrominance, lastCbDC, huffmanChrominanceDC, huffmanChrominanceAC, codewords);
+              lastCrDC = encodeBlock(writer, mcu.Cr, scaledChrominance, lastCrDC, huffmanChrominanceDC, huffmanChrominanceAC, codewords);
+            }
+            else
+            {
+              blockRow.add(1, mcu.Cb);
+              blockRow.add(2, mcu.Cr);
+            }
+            continue;
+          }
+
+          // grayscale images have solely a Y channel which can be easily derived from the input pixel by shifting it by 128
+          // (one or four 8x8 blocks per MCU)
+          for (unsigned short blockY = 0; blockY < mcuSize; blockY += 8)
+            for (unsigned short blockX = 0; blockX < mcuSize; blockX += 8)
+            {
+              // now we finally have an 8x8 block ...
+              for (auto deltaY = 0; deltaY < 8; deltaY++)
+              {
+                unsigned short column = std::min(mcuX + blockX         , maxWidth); // must not exceed image borders, replicate last row/column if needed
+                unsigned short row    = std::min(mcuY + blockY + deltaY, maxHeight);
+                const uint8_t* line   = pixels + row * ptrdiff_t(linesize); // the cast ensures that we don't run into multiplication overflows
+                for (auto deltaX = 0; deltaX < 8; deltaX++)
+                {
+                  Y[deltaY][deltaX] = Sample(line[column] - 128);
+                  if (column < maxWidth)
+                    column++;
+                }
+              }
+
+            // encode Y channel
+            if constexpr (std::is_same_v<Sample, float>)
+              lastYDC = encodeBlock(writer, Y, scaledLuminance, lastYDC, huffmanLuminanceDC, huffmanLuminanceAC, codewords);
+            else
+              blockRow.add(0, Y);
+          }
+        }
+        if constexpr (std::is_same_v<Sample, int16_t>)
+          blockRow.encode(writer, tables, lastYDC, lastCbDC, lastCrDC);
+      }
+      }
+
+      // encode planar YCbCr (e.g. straight from the decoder) without going through RGB:
+      // Y is copied as is, Cb/Cr are taken from the source chroma planes and only resampled
+      // if the source subsampling differs from the requested one (4:2:0 if downsample, else 4:4:4)
+      bool writeJpegYCbCr(const PlanarYCbCr& image, unsigned short width, unsigned short height,
+        unsigned char quality_, bool downsample, const char* comment)
+      {
+      EncoderTables tables;
+      writeHeaders(tables, width, height, true, quality_, downsample, comment);
+      encodeImageYCbCr(tables, image, width, height, downsample);
+      return true;
+      }
+
+      // entropy coded data of a planar YCbCr image and the EOI marker, the headers are already written
+      void encodeImageYCbCr(const EncoderTables& tables, const PlanarYCbCr& image,
+        unsigned short width, unsigned short height, bool downsample)
+      {
+      encodeScanBlocks(tables, width, height, true, downsample, [&](auto& writer, int firstMcuRow, int lastMcuRow)
+      {
+        if (tables.dct == DctMethod::Int16)
+          encodeMcuRowsYCbCr<int16_t>(writer, tables, image, width, height, downsample, firstMcuRow, lastMcuRow);
+        else
+          encodeMcuRowsYCbCr<float>(writer, tables, image, width, height, downsample, firstMcuRow, lastMcuRow);
+      });
+
+      *this << 0xFF << 0xD9;
+      }
+
+      // DCT, quantization and Huffman coding of the MCU rows [firstMcuRow, lastMcuRow) of a planar YCbCr image
+      template<typename Sample, typename Writer>
+      static void encodeMcuRowsYCbCr(Writer& writer, const EncoderTables& tables, const PlanarYCbCr& image,
+        unsigned short width, unsigned short height, bool downsample, int firstMcuRow, int lastMcuRow)
+      {
+      const auto codewords = tables.codewords();
+
+      // video range is stretched to the full 0..255 range expected by JFIF
+      const float lumaScale   = image.fullRange ? 1.f : 255.f / 219.f;
+      const float lumaOffset  = image.fullRange ? 0.f : 16.f;
+      const float chromaScale = image.fullRange ? 1.f : 255.f / 224.f;
+      // level shifted sample for each 8 bit value
+      Sample lumaSamples[256], chromaSamples[256];
+      for (int value = 0; value < 256; value++)
+      {
+        lumaSamples  [value] = toSample<Sample>((value - lumaOffset) * lumaScale - 128.f);
+        chromaSamples[value] = toSample<Sample>((value - 128.f) * chromaScale);
+      }
+
+      const int maxWidth  = width  - 1;
+      const int maxHeight = height - 1;
+      // last valid sample of the source chroma planes
+      const int maxChromaX = maxWidth  >> image.chromaShiftX;
+      const int maxChromaY = maxHeight >> image.chromaShiftY;
+
+      const auto sampling = downsample ? 2 : 1; // 1x1 or 2x2 sampling
+      const auto mcuSize  = 8 * sampling;
+      // source chroma matches the output chroma => no resampling at all
+      const bool sameChroma = (1 << image.chromaShiftX) == sampling && (1 << image.chromaShiftY) == sampling;
+
+      int16_t lastYDC = 0, lastCbDC = 0, lastCrDC = 0;
+      Sample Y[8][8], Cb[8][8], Cr[8][8];
+      BlockRowInt16 blockRow; // DctMethod::Int16 only
+
+      // the Y plane (and Cb/Cr if they need no resampling) of an MCU row is converted to level shifted tiles in
+      // bulk, the MCUs then take their blocks front to back; the incremental encoder skips most of its MCUs and
+      // gathers the blocks of the others from the rows of the planes
+      constexpr bool bulk = !std::is_same_v<Writer, CachedBlocks>;
+      TiledImage<Sample> strip;
+      auto tile = [](Sample* samples) { return reinterpret_cast<Sample(*)[8]>(samples); };
+      auto toLuma   = [&](uint8_t value) { return lumaSamples  [value]; };
+      auto toChroma = [&](uint8_t value) { return chromaSamples[value]; };
+
+      const int lastMcuY = std::min(int(height), lastMcuRow * mcuSize);
+      for (int mcuY = firstMcuRow * mcuSize; mcuY < lastMcuY; mcuY += mcuSize)
+      {
+        if constexpr (bulk)
+        {
+          strip.planes[0].assign(image.planes[0] + mcuY * image.linesizes[0], image.linesizes[0], width,
+                                 std::min(mcuSize, height - mcuY), toLuma, sampling);
+          if (sameChroma)
+          {
+            const int chromaY = mcuY >> image.chromaShiftY;
+            for (int plane = 1; plane < 3; plane++)
+              strip.planes[plane].assign(image.planes[plane] + chromaY * image.linesizes[plane], image.linesizes[plane],
+                                         maxChromaX + 1, std::min(8, maxChromaY + 1 - chromaY), toChroma);
+          }
+        }
+
+        for (int mcuX = 0; mcuX < width; mcuX += mcuSize)
+        {
+          if constexpr (std::is_same_v<Writer, CachedBlocks>)
+            if (writer.cache.reuse(size_t(mcuY / mcuSize) * writer.cache.mcusPerRow() + mcuX / mcuSize))
+            {
+              if constexpr (std::is_same_v<Sample, int16_t>)
+                blockRow.encode(writer, tables, lastYDC, lastCbDC, lastCrDC); // pending blocks come first
+              writer.replay(tables, lastYDC, lastCbDC, lastCrDC);
+              continue;
+            }
+
+          for (int blockY = 0; blockY < mcuSize; blockY += 8)
+            for (int blockX = 0; blockX < mcuSize; blockX += 8)
+            {
+              Sample (*block)[8] = Y;
+              if constexpr (bulk)
+                block = tile(strip.planes[0].block((mcuX + blockX) / 8, blockY / 8));
+              else
+                for (auto deltaY = 0; deltaY < 8; deltaY++)
+                {
+                  // must not exceed image borders, replicate last row/column if needed
+                  auto row  = std::min(mcuY + blockY + deltaY, maxHeight);
+                  auto line = image.planes[0] + row * image.linesizes[0];
+                  for (auto deltaX = 0; deltaX < 8; deltaX++)
+                  {
+                    auto column = std::min(mcuX + blockX + deltaX, maxWidth);
+                    Y[deltaY][deltaX] = lumaSamples[line[column]];
+                  }
+                }
+              if constexpr (std::is_same_v<Sample, float>)
+                lastYDC = encodeBlock(writer, block, tables.scaledLuminance, lastYDC,
+                                      tables.huffmanLuminanceDC, tables.huffmanLuminanceAC, codewords);
+              else
+                blockRow.add(0, block);
+            }
+
+          // Cb/Cr from the strip, or resampled: one output chroma sample covers sampling x sampling luma pixels
+          // starting at the MCU's top left corner
+          Sample (*cb)[8] = Cb, (*cr)[8] = Cr;
+          if (bulk && sameChroma)
+          {
+            cb = tile(strip.planes[1].block(mcuX / mcuSize, 0));
+            cr = tile(strip.planes[2].block(mcuX / mcuSize, 0));
+          }
+          else
+          for (auto deltaY = 0; deltaY < 8; deltaY++)
+            for (auto deltaX = 0; deltaX < 8; deltaX++)
+            {
+              auto lumaX = std::min(mcuX + deltaX * sampling, maxWidth);
+              auto lumaY = std::min(mcuY + deltaY * sampling, maxHeight);
+              if (sameChroma)
+              {
+                auto x = lumaX >> image.chromaShiftX;
+                auto y = lumaY >> image.chromaShiftY;
+                Cb[deltaY][deltaX] = chromaSamples[image.planes[1][y * image.linesizes[1] + x]];
+                Cr[deltaY][deltaX] = chromaSamples[image.planes[2][y * image.linesizes[2] + x]];
+              }
+              else
+              {
+                // average (4:4:4 => 4:2:0) or replicate (4:2:0 => 4:4:4) the source chroma
+                int sumCb = 0, sumCr = 0;
+                for (auto subY = 0; subY < sampling; subY++)
+                  for (auto subX = 0; subX < sampling; subX++)
+                  {
+                    auto x = std::min(std::min(lumaX + subX, maxWidth ) >> image.chromaShiftX, maxChromaX);
+                    auto y = std::min(std::min(lumaY + subY, maxHeight) >> image.chromaShiftY, maxChromaY);
+                    sumCb += image.planes[1][y * image.linesizes[1] + x];
+                    sumCr += image.planes[2][y * image.linesizes[2] + x];
+                  }
+                const int count = sampling * sampling;
+                if constexpr (std::is_same_v<Sample, float>)
+                {
+                  Cb[deltaY][deltaX] = (sumCb / float(count) - 128.f) * chromaScale;
+                  Cr[deltaY][deltaX] = (sumCr / float(count) - 128.f) * chromaScale;
+                }
+                else
+                {
+                  Cb[deltaY][deltaX] = chromaSamples[(sumCb + count / 2) / count];
+                  Cr[deltaY][deltaX] = chromaSamples[(sumCr + count / 2) / count];
+                }
+              }
+            }
+
+          if constexpr (std::is_same_v<Sample, float>)
+          {
+            lastCbDC = encodeBlock(writer, cb, tables.scaledChrominance, lastCbDC,
+                                   tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+            lastCrDC = encodeBlock(writer, cr, tables.scaledChrominance, lastCrDC,
+                                   tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+          }
+          else
+          {
+            blockRow.add(1, cb);
+            blockRow.add(2, cr);
+          }
+        }
+        if constexpr (std::is_same_v<Sample, int16_t>)
+          blockRow.encode(writer, tables, lastYDC, lastCbDC, lastCrDC);
+      }
+      }
+
+      // write the entropy coded data of the scan, encodeRows(writer, firstMcuRow, lastMcuRow) encodes a range of MCU rows:
+      // - without restart interval all rows are encoded in one go straight into this stream
+      // - otherwise each restart interval is encoded into its own stream (possibly on a worker thread, DC prediction
+      //   restarts at every interval anyway) and the streams are concatenated, separated by RST0..RST7 markers
+      template<typename EncodeRows>
+      void encodeScan(const EncoderTables& tables, int numMcuRows, EncodeRows&& encodeRows)
+      {
+        if (tables.restartMcuRows == 0)
+        {
+          TRACE_SPAN("scan");
+          BitWriter writer(m_byte_stream);
+          encodeRows(writer, 0, numMcuRows);
+          writer.flush();
+          return;
+        }
 
+        const int rowsPerSegment = tables.restartMcuRows;
+        const int numSegments    = (numMcuRows + rowsPerSegment - 1) / rowsPerSegment;
+        auto& segments = m_segments; // kept by the writer, their buffers are reused by the next image
+        segments.resize(numSegments);
+        forEachInterval(numMcuRows, rowsPerSegment, [&](size_t segment, int firstMcuRow, int lastMcuRow)
+        {
+          TRACE_SPAN("restart_interval");
+          segments[segment].clear();
+          BitWriter writer(segments[segment]);
+          encodeRows(writer, firstMcuRow, lastMcuRow);
+          writer.flush(); // each interval ends byte aligned
+        });
+
+        for (int segment = 0; segment < numSegments; segment++)
+        {
+          const auto& bytes = segments[segment];
+          m_byte_stream.insert(m_byte_stream.end(), bytes.begin(), bytes.end());
+          if (segment + 1 < numSegments)
+          {
+            m_byte_stream.push_back(0xFF);
+            m_byte_stream.push_back(uint8_t(0xD0 + (segment & 7))); // RSTn, n counts modulo 8
+          }
+        }
+      }
+
+      // calls func(interval, firstMcuRow, lastMcuRow) for each group of rowsPerInterval MCU rows,
+      // on the thread pool if there is one
+      template<typename Func>
+      void forEachInterval(int numMcuRows, int rowsPerInterval, Func&& func)
+      {
+        const int numIntervals = (numMcuRows + rowsPerInterval - 1) / rowsPerInterval;
+        auto encodeInterval = [&](size_t interval)
+        {
+          const int firstMcuRow = int(interval) * rowsPerInterval;
+          func(interval, firstMcuRow, std::min(firstMcuRow + rowsPerInterval, numMcuRows));
+        };
+        if (m_pool)
+          m_pool->parallel_for(numIntervals, encodeInterval);
+        else
+          for (int interval = 0; interval < numIntervals; interval++)
+            encodeInterval(interval);
+      }
+
+      // two pass encoding of an image, encodeRows(writer, tables, firstMcuRow, lastMcuRow) as for encodeScan()
+      // (defined below JpegEncoderContext)
+      template<typename EncodeRows>
+      bool encodeOptimized(const JpegEncoderContext& context, HuffmanTables* reusable, EncodeRows&& encodeRows);
+
+      // single pass with reuse of the blocks in cache, encodeRows(writer, tables, firstMcuRow, lastMcuRow) as above
+      template<typename EncodeRows>
+      bool encodeIncremental(const JpegEncoderContext& context, BlockCache& cache, EncodeRows&& encodeRows);
+
+      // the three ways to encode RGB / grayscale pixels, rows linesize bytes apart
+      bool encodePixels(const JpegEncoderContext& context, const uint8_t* pixels, int linesize);
+      bool encodePixelsOptimized(const JpegEncoderContext& context, const uint8_t* pixels, int linesize,
+                                 HuffmanTables* reusable);
+      bool encodePixelsIncremental(const JpegEncoderContext& context, const uint8_t* pixels, int linesize,
+                                   BlockCache& cache);
+
+      // the view covers the image of the context
+      static bool covers(const JpegEncoderContext& context, size_t width, size_t height);
+
+      // write the JPEG header
+      // this is the first part of the JPEG file, it contains the JFIF header, quantization and Huffman tables
+      // and the start of scan; the tables needed to encode the MCUs are returned in "tables"
+      // huffman: the Huffman tables to use, nullptr = the standard ones from Annex K
+      void writeHeaders(EncoderTables& tables, unsigned short width, unsigned short height,
+        bool isRGB, unsigned char quality_, bool downsample, const char* comment, const HuffmanTables* huffman = nullptr)
+      {
         // number of components
         const u_int8_t numComponents = isRGB ? 3 : 1;
         writeJFIFHeader();
@@ -203,28 +750,15 @@ class JPEGWriter : public Bytestream
           size_t length = strlen(comment);
           // write COM marker
           addMarker(0xFE, 2+length); // block size is number of bytes (without zero terminator) + 2 bytes for this length field
-          for (int i = 0; i < length; i++)
+          for (size_t i = 0; i < length; i++)
             *this << comment[i];
         }
         // ////////////////////////////////////////
         // adjust quantization tables to desired quality
         // ////////////////////////////////////////
-        // quality level must be in 1 ... 100
-        auto quality = std::clamp<uint16_t>(quality_, 1, 100);
-        // convert to an internal JPEG quality factor, formula taken from libjpeg
-        quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
-
         uint8_t quantLuminance  [8*8];
         uint8_t quantChrominance[8*8];
-        for (auto i = 0; i < 8*8; i++)
-        {
-          int luminance   = (DefaultQuantLuminance  [ZigZagInv[i]] * quality + 50) / 100;
-          int chrominance = (DefaultQuantChrominance[ZigZagInv[i]] * quality + 50) / 100;
-
-          // clamp to 1..255
-          quantLuminance  [i] = std::clamp(luminance,   1, 255);
-          quantChrominance[i] = std::clamp(chrominance, 1, 255);
-        }
+        jpegQuantTables(quality_, quantLuminance, quantChrominance);
 
         // write quantization tables
         addMarker(0xDB, 2 + (isRGB ? 2 : 1) * (1 + 8*8)); // length: 65 bytes per table + 2 bytes for this length field
@@ -257,44 +791,43 @@ class JPEGWriter : public Bytestream
         // ////////////////////////////////////////
         // Huffman tables
         // DHT marker - define Huffman tables
-        addMarker(0xC4, isRGB ? (2+208+208) : (2+208));
-                                  // 2 bytes for the length field, store chrominance only if needed
-                                  //   1+16+12  for the DC luminance
-                                  //   1+16+162 for the AC luminance   (208 = 1+16+12 + 1+16+162)
-                                  //   1+16+12  for the DC chrominance
-                                  //   1+16+162 for the AC chrominance (208 = 1+16+12 + 1+16+162, same as above)
-
-        // store luminance's DC+AC Huffman table definitions
-        *this << 0x00 // highest 4 bits: 0 => DC, lowest 4 bits: 0 => Y (baseline)
-                  << DcLuminanceCodesPerBitsize
-                  << DcLuminanceValues;
-        *this << 0x10 // highest 4 bits: 1 => AC, lowest 4 bits: 0 => Y (baseline)
-                  << AcLuminanceCodesPerBitsize
-                  << AcLuminanceValues;
-
-        // compute actual Huffman code tables (see Jon's code for precalculated tables)
-        BitCode huffmanLuminanceDC[256];
-        BitCode huffmanLuminanceAC[256];
-        generateHuffmanTable(DcLuminanceCodesPerBitsize, DcLuminanceValues, huffmanLuminanceDC);
-        generateHuffmanTable(AcLuminanceCodesPerBitsize, AcLuminanceValues, huffmanLuminanceAC);
-
-        // chrominance is only relevant for color images
-        BitCode huffmanChrominanceDC[256];
-        BitCode huffmanChrominanceAC[256];
-        if (isRGB)
+        const HuffmanTables standard = huffman ? HuffmanTables() : standardHuffmanTables();
+        if (!huffman)
+          huffman = &standard;
+        // DC and AC luminance, then DC and AC chrominance (only relevant for color images)
+        const HuffmanSpec* specs[4] = { &huffman->dcLuminance, &huffman->acLuminance,
+                                        &huffman->dcChrominance, &huffman->acChrominance };
+        const uint8_t      ids  [4] = { 0x00, 0x10, 0x01, 0x11 }; // highest 4 bits: 0 => DC, 1 => AC, lowest 4 bits: 0 => Y, 1 => Cb,Cr
+        BitCode*           codes[4] = { tables.huffmanLuminanceDC,   tables.huffmanLuminanceAC,
+                                        tables.huffmanChrominanceDC, tables.huffmanChrominanceAC };
+        const int numTables = isRGB ? 4 : 2;
+        int length = 2; // 2 bytes for the length field, then ID, number of codes per bitsize and the values of each table
+        for (auto i = 0; i < numTables; i++)
+          length += 1 + 16 + specs[i]->numValues();
+        addMarker(0xC4, length);
+        for (auto i = 0; i < numTables; i++)
         {
-          // store luminance's DC+AC Huffman table definitions
-          *this << 0x01 // highest 4 bits: 0 => DC, lowest 4 bits: 1 => Cr,Cb (baseline)
-                    << DcChrominanceCodesPerBitsize
-                    << DcChrominanceValues;
-        *this << 0x11 // highest 4 bits: 1 => AC, lowest 4 bits: 1 => Cr,Cb (baseline)
-                    << AcChrominanceCodesPerBitsize
-                    << AcChrominanceValues;
-
+          *this << ids[i] << specs[i]->codesPerBitsize;
+          for (auto value = 0; value < specs[i]->numValues(); value++)
+            *this << specs[i]->values[value];
           // compute actual Huffman code tables (see Jon's code for precalculated tables)
-          generateHuffmanTable(DcChrominanceCodesPerBitsize, DcChrominanceValues, huffmanChrominanceDC);
-          generateHuffmanTable(AcChrominanceCodesPerBitsize, AcChrominanceValues, huffmanChrominanceAC);
+          generateHuffmanTable(specs[i]->codesPerBitsize, specs[i]->values, codes[i]);
+        }
+        // ////////////////////////////////////////
+        // restart interval (optional)
+        // DRI marker - number of MCUs between two RSTn markers, whole MCU rows so that intervals can be encoded independently
+        tables.dct = m_dct;
+        tables.restartMcuRows = 0;
+        if (m_restartMcuRows > 0)
+        {
+          const int mcuSize    = downsample ? 16 : 8;
+          const int mcusPerRow = (width + mcuSize - 1) / mcuSize;
+          tables.restartMcuRows = std::max(1, std::min(m_restartMcuRows, 65535 / mcusPerRow)); // interval is a 16 bit value
+          const uint16_t restartInterval = uint16_t(tables.restartMcuRows * mcusPerRow);
+          addMarker(0xDD, 4);
+          *this << (restartInterval >> 8) << (restartInterval & 0xFF);
         }
+
         //////////////////////////////////////////
         // start of scan (there is only a single scan for baseline JPEGs)
         //////////////////////////////////////////
@@ -313,18 +846,16 @@ class JPEGWriter : public Bytestream
       //////////////////////////////////////////
       // adjust quantization tables with AAN scaling factors to simplify DCT
       //////////////////////////////////////////
-      float scaledLuminance  [8*8];
-      float scaledChrominance[8*8];
+      const QuantizeTable scaledLuminance  (quantLuminance);
+      const QuantizeTable scaledChrominance(quantChrominance);
+      std::memcpy(tables.scaledLuminance,   scaledLuminance.multiplier,   sizeof(tables.scaledLuminance));
+      std::memcpy(tables.scaledChrominance, scaledChrominance.multiplier, sizeof(tables.scaledChrominance));
       for (auto i = 0; i < 8*8; i++)
       {
-        auto row    = ZigZagInv[i] / 8; // same as ZigZagInv[i] >> 3
-        auto column = ZigZagInv[i] % 8; // same as ZigZagInv[i] &  7
-
-        // scaling constants for AAN DCT algorithm: AanScaleFactors[0] = 1, AanScaleFactors[k=1..7] = cos(k*PI/16) * sqrt(2)
-        static const float AanScaleFactors[8] = { 1, 1.387039845f, 1.306562965f, 1.175875602f, 1, 0.785694958f, 0.541196100f, 0.275899379f };
-        auto factor = 1 / (AanScaleFactors[row] * AanScaleFactors[column] * 8);
-        scaledLuminance  [ZigZagInv[i]] = factor / quantLuminance  [i];
-        scaledChrominance[ZigZagInv[i]] = factor / quantChrominance[i];
+        auto factor = 1 / aan_scale(ZigZagInv[i]);
+        // same steps for the fixed point path, 1 / scaled... as reciprocal multiplier
+        tables.reciprocalLuminance  [ZigZagInv[i]] = QuantReciprocal::fromDivisor(quantLuminance  [i] / factor);
+        tables.reciprocalChrominance[ZigZagInv[i]] = QuantReciprocal::fromDivisor(quantChrominance[i] / factor);
         // if you really want JPEGs that are bitwise identical to Jon Olick's code then you need slightly different formulas (note: sqrt(8) = 2.828427125f)
         //static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f }; // line 240 of jo_jpeg.cpp
         //scaledLuminance  [ZigZagInv[i]] = 1 / (quantLuminance  [i] * aasf[row] * aasf[column]); // lines 266-267 of jo_jpeg.cpp
@@ -334,7 +865,7 @@ class JPEGWriter : public Bytestream
       // ////////////////////////////////////////
       // precompute JPEG codewords for quantized DCT
       // ////////////////////////////////////////
-      BitCode  codewordsArray[2 * CodeWordLimit];          // note: quantized[i] is found at codewordsArray[quantized[i] + CodeWordLimit]
+      auto&    codewordsArray = tables.codewordsArray;     // note: quantized[i] is found at codewordsArray[quantized[i] + CodeWordLimit]
       BitCode* codewords = &codewordsArray[CodeWordLimit]; // allow negative indices, so quantized[i] is at codewords[quantized[i]]
       uint8_t numBits = 1; // each codeword has at least one bit (value == 0 is undefined)
       int32_t mask    = 1; // mask is always 2^numBits - 1, initial value 2^1-1 = 2-1 = 1
@@ -351,124 +882,7 @@ class JPEGWriter : public Bytestream
         codewords[+value] = BitCode(       value, numBits);
       }
 
-      // just convert image data from void*
-      auto pixels = (const uint8_t*)pixels_;
-
-      // the next two variables are frequently used when checking for image borders
-      const auto maxWidth  = width  - 1; // "last row"
-      const auto maxHeight = height - 1; // "bottom line"
-
-      // process MCUs (minimum codes units) => image is subdivided into a grid of 8x8 or 16x16 tiles
-      const auto sampling = downsample ? 2 : 1; // 1x1 or 2x2 sampling
-      const auto mcuSize  = 8 * sampling;
-
-      // average color of the previous MCU
-      int16_t lastYDC = 0, lastCbDC = 0, lastCrDC = 0;
-      // convert from RGB to YCbCr
-      float Y[8][8], Cb[8][8], Cr[8][8];
-
-      for (unsigned short mcuY = 0; mcuY < height; mcuY += mcuSize) // each step is either 8 or 16 (=mcuSize)
-        for (unsigned short mcuX = 0; mcuX < width; mcuX += mcuSize)
-        {
-          // YCbCr 4:4:4 format: each MCU is a 8x8 block - the same applies to grayscale images, too
-          // YCbCr 4:2:0 format: each MCU represents a 16x16 block, stored as 4x 8x8 Y-blocks plus 1x 8x8 Cb and 1x 8x8 Cr block)
-          for (unsigned short blockY = 0; blockY < mcuSize; blockY += 8) // iterate once (YCbCr444 and grayscale) or twice (YCbCr420)
-            for (unsigned short blockX = 0; blockX < mcuSize; blockX += 8)
-            {
-              // now we finally have an 8x8 block ...
-              for (auto deltaY = 0; deltaY < 8; deltaY++)
-              {
-                unsigned short column = std::min(mcuX + blockX         , maxWidth); // must not exceed image borders, replicate last row/column if needed
-                unsigned short row    = std::min(mcuY + blockY + deltaY, maxHeight);
-                for (auto deltaX = 0; deltaX < 8; deltaX++)
-                {
-                  // find actual pixel position within the current image
-                  auto pixelPos = row * int(width) + column; // the cast ensures that we don't run into multiplication overflows
-                  if (column < maxWidth)
-                    column++;
-
-                  // grayscale images have solely a Y channel which can be easily derived from the input pixel by shifting it by 128
-                  if (!isRGB)
-                  {
-                    Y[deltaY][deltaX] = pixels[pixelPos] - 128.f;
-                    continue;
-                  }
-
-                  // RGB: 3 bytes per pixel (whereas grayscale images have only 1 byte per pixel)
-                  auto r = pixels[3 * pixelPos    ];
-                  auto g = pixels[3 * pixelPos + 1];
-                  auto b = pixels[3 * pixelPos + 2];
-
-                  Y   [deltaY][deltaX] = rgb2y (r, g, b) - 128; // again, the JPEG standard requires Y to be shifted by 128
-                  // YCbCr444 is easy - the more complex YCbCr420 has to be computed about 20 lines below in a second pass
-                  if (!downsample)
-                  {
-                    Cb[deltaY][deltaX] = rgb2cb(r, g, b); // standard RGB-to-YCbCr conversion
-                    Cr[deltaY][deltaX] = rgb2cr(r, g, b);
-                  }
-                }
-              }
-
-            // encode Y channel
-            lastYDC = encodeBlock(bitWriter, Y, scaledLuminance, lastYDC, huffmanLuminanceDC, huffmanLuminanceAC, codewords);
-            // Cb and Cr are encoded about 50 lines below
-          }
-
-          // grayscale images don't need any Cb and Cr information
-          if (!isRGB)
-            continue;
-
-          // ////////////////////////////////////////
-          // the following lines are only relevant for YCbCr420:
-          // average/downsample chrominance of four pixels while respecting the image borders
-          if (downsample)
-            for (short deltaY = 7; downsample && deltaY >= 0; deltaY--) // iterating loop in reverse increases cache read efficiency
-            {
-              auto row      = std::min(mcuY + 2*deltaY, maxHeight); // each deltaX/Y step covers a 2x2 area
-              auto column   =         mcuX;                        // column is updated inside next loop
-              auto pixelPos = (row * int(width) + column) * 3;     // numComponents = 3
-
-              // deltas (in bytes) to next row / column, must not exceed image borders
-              auto rowStep    = (row    < maxHeight) ? 3 * int(width) : 0; // always numComponents*width except for bottom    line
-              auto columnStep = (column < maxWidth ) ? 3              : 0; // always numComponents       except for rightmost pixel
-
-              for (short deltaX = 0; deltaX < 8; deltaX++)
-              {
-                // let's add all four samples (2x2 area)
-                auto right     = pixelPos + columnStep;
-                auto down      = pixelPos +              rowStep;
-                auto downRight = pixelPos + columnStep + rowStep;
-
-                // note: cast from 8 bits to >8 bits to avoid overflows when adding
-                auto r = short(pixels[pixelPos    ]) + pixels[right    ] + pixels[down    ] + pixels[downRight    ];
-                auto g = short(pixels[pixelPos + 1]) + pixels[right + 1] + pixels[down + 1] + pixels[downRight + 1];
-                auto b = short(pixels[pixelPos + 2]) + pixels[right + 2] + pixels[down + 2] + pixels[downRight + 2];
-
-                // convert to Cb and Cr
-                Cb[deltaY][deltaX] = rgb2cb(r, g, b) / 4; // I still have to divide r,g,b by 4 to get their average values
-                Cr[deltaY][deltaX] = rgb2cr(r, g, b) / 4; // it's a bit faster if done AFTER CbCr conversion
-
-                // step forward to next 2x2 area
-                pixelPos += 2*3; // 2 pixels => 6 bytes (2*numComponents)
-                column   += 2;
-
-                // reached right border ?
-                if (column >= maxWidth)
-                {
-                  columnStep = 0;
-                  pixelPos = ((row + 1) * int(width) - 1) * 3; // same as (row * width + maxWidth) * numComponents => current's row last pixel
-                }
-              }
-            } // end of YCbCr420 code for Cb and Cr
-
-          // encode Cb and Cr
-          lastCbDC = encodeBlock(bitWriter, Cb, scaledChrominance, lastCbDC, huffmanChrominanceDC, huffmanChrominanceAC, codewords);
-          lastCrDC = encodeBlock(bitWriter, Cr, scaledChrominance, lastCrDC, huffmanChrominanceDC, huffmanChrominanceAC, codewords);
-        }
-
-
-
-  } // WriteJPEG
+      }
 
 
       // JFIF headers
@@ -502,8 +916,693 @@ class JPEGWriter : public Bytestream
       // next Huffman code needs to be one bit wider
       huffmanCode <<= 1;
     }
-}
+  }
+
+  private:
+  int         m_restartMcuRows = 0;       // see setRestartInterval()
+  ThreadPool* m_pool           = nullptr; // optional, encodes restart intervals in parallel
+  DctMethod   m_dct            = DctMethod::Float;
+  std::vector<std::vector<uint8_t>> m_segments; // entropy coded restart intervals, see encodeScan()
+  std::pmr::vector<QuantizedBlocks> m_quantized;  // per restart interval, see encodeOptimized()
+  CoefficientFrame* m_coefficients     = nullptr;  // see setCoefficientOutput()
+  CoefficientOrder  m_coefficientOrder = CoefficientOrder::ZigZag;
+
+  public:
+  // DCT, quantization and Huffman coding of a single 8x8 block, returns the new DC value
+  // (the block is level-shifted by 128 and will be modified in place)
+  template<typename Writer>
+  static int16_t encodeBlock(Writer& writer, float block[8][8], const float scaled[8*8], int16_t lastDC,
+                      const BitCode huffmanDC[256], const BitCode huffmanAC[256], const BitCode* codewords)
+  {
+    // DCT: rows
+    for (auto row = 0; row < 8; row++)
+      _DCTImpl(block[row][0], block[row][1], block[row][2], block[row][3],
+               block[row][4], block[row][5], block[row][6], block[row][7]);
+    // DCT: columns
+    for (auto col = 0; col < 8; col++)
+      _DCTImpl(block[0][col], block[1][col], block[2][col], block[3][col],
+               block[4][col], block[5][col], block[6][col], block[7][col]);
+
+    // scale
+    auto block64 = &block[0][0];
+    for (auto i = 0; i < 8*8; i++)
+      block64[i] *= scaled[i];
+
+    // quantize and zigzag the coefficients
+    int16_t quantized[8*8];
+    for (auto i = 0; i < 8*8; i++)
+    {
+      auto value = block64[ZigZagInv[i]];
+      // round to nearest integer
+      quantized[i] = int(value + (value >= 0 ? +0.5f : -0.5f)); // C++11's nearbyint() achieves a similar effect
+    }
+    return encodeQuantized(writer, quantized, lastDC, huffmanDC, huffmanAC, codewords);
+  }
+
+  // DctMethod::Int16: the blocks of one MCU row are collected per component, transformed and quantized
+  // DCTBatchInt16Native::lanes blocks at a time and then Huffman coded in their original order
+  struct BlockRowInt16
+  {
+    std::vector<int16_t> blocks[3];  // Y, Cb, Cr: level shifted samples, 64 per block
+    std::vector<uint8_t> components; // component of each block in coding order
+
+    void add(int component, const int16_t block[8][8])
+    {
+      blocks[component].insert(blocks[component].end(), &block[0][0], &block[0][0] + 8*8);
+      components.push_back(uint8_t(component));
+    }
+
+    // encode and forget all blocks added so far
+    template<typename Writer>
+    void encode(Writer& writer, const EncoderTables& tables, int16_t& lastYDC, int16_t& lastCbDC, int16_t& lastCrDC)
+    {
+      {
+        TRACE_SPAN("dct_quantize"); // the fixed point DCT quantizes in the same pass
+        dct_forward_blocks_int16(blocks[0].data(), blocks[0].size() / 64, tables.reciprocalLuminance);
+        dct_forward_blocks_int16(blocks[1].data(), blocks[1].size() / 64, tables.reciprocalChrominance);
+        dct_forward_blocks_int16(blocks[2].data(), blocks[2].size() / 64, tables.reciprocalChrominance);
+      }
+      TRACE_SPAN("huffman");
+
+      const auto codewords = tables.codewords();
+      int16_t*   lastDC[3] = { &lastYDC, &lastCbDC, &lastCrDC };
+      size_t     next[3]   = { 0, 0, 0 };
+      int16_t    quantized[8*8];
+      for (auto component : components)
+      {
+        const int16_t* block = &blocks[component][64 * next[component]++];
+        for (auto i = 0; i < 8*8; i++)
+          quantized[i] = block[ZigZagInv[i]];
+        *lastDC[component] = component == 0
+          ? encodeQuantized(writer, quantized, *lastDC[component], tables.huffmanLuminanceDC, tables.huffmanLuminanceAC, codewords)
+          : encodeQuantized(writer, quantized, *lastDC[component], tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+      }
+
+      for (auto& component : blocks)
+        component.clear(); // keeps the capacity for the next MCU row
+      components.clear();
+    }
+  };
+
+  // same interface as the Huffman coder: just keep the block
+  static int16_t encodeQuantized(QuantizedBlocks& blocks, const int16_t quantized[8*8], int16_t lastDC,
+                      const BitCode huffmanDC[256], const BitCode huffmanAC[256], const BitCode* codewords)
+  {
+    blocks.coefficients.insert(blocks.coefficients.end(), quantized, quantized + 8*8);
+    return quantized[0];
+  }
+
+  // writeJpegIncremental(): the blocks are Huffman coded and copied to the cache, MCUs the cache marks
+  // for reuse are replayed from there (the blocks of a restart interval, starting at its first MCU)
+  struct CachedBlocks
+  {
+    BitWriter&  writer;
+    BlockCache& cache;
+    size_t      mcu;       // the next block belongs to this MCU ...
+    int         block = 0; // ... at this position in coding order
+
+    // Huffman coding of the stored blocks of the next MCU
+    void replay(const EncoderTables& tables, int16_t& lastYDC, int16_t& lastCbDC, int16_t& lastCrDC)
+    {
+      const auto     codewords = tables.codewords();
+      const int16_t* blocks    = cache.blocks(mcu++);
+      int16_t*       lastDC[3] = { &lastYDC, &lastCbDC, &lastCrDC };
+      for (int position = 0; position < cache.mcuBlocks(); position++)
+      {
+        const int      component = position < cache.lumaBlocks() ? 0 : position - cache.lumaBlocks() + 1;
+        const int16_t* quantized = blocks + 64 * position;
+        *lastDC[component] = component == 0
+          ? encodeQuantized(writer, quantized, *lastDC[component], tables.huffmanLuminanceDC, tables.huffmanLuminanceAC, codewords)
+          : encodeQuantized(writer, quantized, *lastDC[component], tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+      }
+    }
+  };
+
+  static int16_t encodeQuantized(CachedBlocks& cached, const int16_t quantized[8*8], int16_t lastDC,
+                      const BitCode huffmanDC[256], const BitCode huffmanAC[256], const BitCode* codewords)
+  {
+    std::memcpy(cached.cache.blocks(cached.mcu) + 64 * cached.block, quantized, 8*8 * sizeof(int16_t));
+    if (++cached.block == cached.cache.mcuBlocks())
+    {
+      cached.block = 0;
+      cached.mcu++;
+    }
+    return encodeQuantized(cached.writer, quantized, lastDC, huffmanDC, huffmanAC, codewords);
+  }
+
+  // where the blocks of an MCU (coding order: 1 or 4 Y blocks, then Cb and Cr) are in a CoefficientFrame
+  struct CoefficientLayout
+  {
+    int mcusPerRow;
+    int sampling;   // Y blocks per MCU and dimension
+    int lumaBlocks;
+    int mcuBlocks;
+
+    CoefficientLayout(unsigned short width, bool isRGB, bool downsample)
+    : mcusPerRow((width + (downsample ? 15 : 7)) / (downsample ? 16 : 8)), sampling(downsample ? 2 : 1),
+      lumaBlocks(sampling * sampling), mcuBlocks(lumaBlocks + (isRGB ? 2 : 0))
+    {}
+
+    // plane of the block at position of the MCU, its coordinates in blocks
+    int locate(size_t mcu, int position, int& blockX, int& blockY) const
+    {
+      const int mcuX = int(mcu % mcusPerRow);
+      const int mcuY = int(mcu / mcusPerRow);
+      if (position >= lumaBlocks)
+      {
+        blockX = mcuX;
+        blockY = mcuY;
+        return position - lumaBlocks + 1;
+      }
+      blockX = mcuX * sampling + position % sampling;
+      blockY = mcuY * sampling + position / sampling;
+      return 0;
+    }
+  };
+
+  // copy a quantized block (zigzag order) to the frame, blocks of a 4:2:0 MCU beyond the Y plane are dropped
+  static void storeBlock(CoefficientFrame& frame, const CoefficientLayout& layout, size_t mcu, int position,
+                         const int16_t quantized[8*8])
+  {
+    int   blockX, blockY;
+    auto& plane = frame.planes[layout.locate(mcu, position, blockX, blockY)];
+    if (blockX >= plane.blocks_x() || blockY >= plane.blocks_y())
+      return;
+    int16_t* block = plane.block(blockX, blockY);
+    if (plane.order == CoefficientOrder::ZigZag)
+      std::memcpy(block, quantized, 8*8 * sizeof(int16_t));
+    else
+      for (auto i = 0; i < 8*8; i++)
+        block[ZigZagInv[i]] = quantized[i];
+  }
+
+  // the other way round for writeJpegCoefficients(), the dropped blocks get the DC of the nearest block, no AC
+  static void loadBlock(const CoefficientFrame& frame, const CoefficientLayout& layout, size_t mcu, int position,
+                        int16_t quantized[8*8])
+  {
+    int         blockX, blockY;
+    const auto& plane = frame.planes[layout.locate(mcu, position, blockX, blockY)];
+    const bool  inside = blockX < plane.blocks_x() && blockY < plane.blocks_y();
+    const int16_t* block = plane.block(std::min(blockX, plane.blocks_x() - 1), std::min(blockY, plane.blocks_y() - 1));
+    if (!inside)
+    {
+      std::fill_n(quantized, 8*8, int16_t(0));
+      quantized[0] = block[0]; // the DC comes first in both orders
+    }
+    else if (plane.order == CoefficientOrder::ZigZag)
+      std::memcpy(quantized, block, 8*8 * sizeof(int16_t));
+    else
+      for (auto i = 0; i < 8*8; i++)
+        quantized[i] = block[ZigZagInv[i]];
+  }
+
+  // setCoefficientOutput() in a single pass: the blocks are Huffman coded and copied to the frame
+  struct CoefficientBlocks
+  {
+    BitWriter&               writer;
+    CoefficientFrame&        frame;
+    const CoefficientLayout& layout;
+    size_t                   mcu;       // the next block belongs to this MCU ...
+    int                      block = 0; // ... at this position in coding order
+  };
+
+  static int16_t encodeQuantized(CoefficientBlocks& blocks, const int16_t quantized[8*8], int16_t lastDC,
+                      const BitCode huffmanDC[256], const BitCode huffmanAC[256], const BitCode* codewords)
+  {
+    storeBlock(blocks.frame, blocks.layout, blocks.mcu, blocks.block, quantized);
+    if (++blocks.block == blocks.layout.mcuBlocks)
+    {
+      blocks.block = 0;
+      blocks.mcu++;
+    }
+    return encodeQuantized(blocks.writer, quantized, lastDC, huffmanDC, huffmanAC, codewords);
+  }
+
+  // sizes of the planes of setCoefficientOutput() for an image, before its blocks are stored (by several threads)
+  void prepareCoefficients(unsigned short width, unsigned short height, bool isRGB, bool downsample)
+  {
+    auto&     frame = *m_coefficients;
+    const int shift = isRGB && downsample ? 1 : 0;
+    frame.chromaShiftX = frame.chromaShiftY = shift;
+    frame.planes[0].resize(width, height, m_coefficientOrder);
+    for (int plane = 1; plane < 3; plane++)
+      frame.planes[plane].resize(isRGB ? (width  + shift) >> shift : 0,
+                                 isRGB ? (height + shift) >> shift : 0, m_coefficientOrder);
+  }
+
+  // encodeScan() of writeJpeg() / writeJpegYCbCr(), the blocks also go to the frame of setCoefficientOutput()
+  // if there is one: encodeRows(writer, firstMcuRow, lastMcuRow) gets a BitWriter or CoefficientBlocks
+  template<typename EncodeRows>
+  void encodeScanBlocks(const EncoderTables& tables, unsigned short width, unsigned short height, bool isRGB,
+                        bool downsample, EncodeRows&& encodeRows)
+  {
+    const int mcuSize    = downsample ? 16 : 8;
+    const int numMcuRows = (height + mcuSize - 1) / mcuSize;
+    if (!m_coefficients)
+    {
+      encodeScan(tables, numMcuRows, encodeRows);
+      return;
+    }
+    prepareCoefficients(width, height, isRGB, downsample);
+    const CoefficientLayout layout(width, isRGB, downsample);
+    encodeScan(tables, numMcuRows, [&](BitWriter& writer, int firstMcuRow, int lastMcuRow)
+    {
+      CoefficientBlocks blocks{ writer, *m_coefficients, layout, size_t(firstMcuRow) * layout.mcusPerRow };
+      encodeRows(blocks, firstMcuRow, lastMcuRow);
+    });
+  }
+
+  // count the Huffman symbols encodeQuantized() would write for a block
+  static void countSymbols(const int16_t quantized[8*8], int16_t lastDC, uint32_t countsDC[256], uint32_t countsAC[256])
+  {
+    auto diff = quantized[0] - lastDC;
+    countsDC[diff == 0 ? 0 : bitSize(diff)]++;
+
+    auto posNonZero = 0;
+    for (auto i = 1; i < 8*8; i++)
+      if (quantized[i] != 0)
+        posNonZero = i;
+
+    auto offset = 0;
+    for (auto i = 1; i <= posNonZero; i++)
+    {
+      while (quantized[i] == 0)
+      {
+        offset += 0x10;
+        if (offset > 0xF0)
+        {
+          countsAC[0xF0]++;
+          offset = 0;
+        }
+        i++;
+      }
+      countsAC[offset + bitSize(quantized[i])]++;
+      offset = 0;
+    }
+    if (posNonZero < 8*8 - 1)
+      countsAC[0x00]++;
+  }
+
+  // number of bits of |value|, the Huffman symbol's size category
+  static int bitSize(int value)
+  {
+    return 32 - __builtin_clz(unsigned(std::abs(value)));
+  }
+
+  // Huffman coding of a quantized block in zigzag order, returns the new DC value
+  static int16_t encodeQuantized(BitWriter& writer, const int16_t quantized[8*8], int16_t lastDC,
+                      const BitCode huffmanDC[256], const BitCode huffmanAC[256], const BitCode* codewords)
+  {
+    writer.reserve(BitWriter::max_block_bytes); // no capacity checks while writing the block
+
+    // DC is the first coefficient, the "average color" of the 8x8 block
+    auto DC = quantized[0];
+
+    // find last coefficient which is not zero (because trailing zeros are encoded differently)
+    auto posNonZero = 0;
+    for (auto i = 1; i < 8*8; i++)
+      if (quantized[i] != 0)
+        posNonZero = i;
+
+    // same "average color" as previous block ?
+    auto diff = DC - lastDC;
+    if (diff == 0)
+      writer << huffmanDC[0x00];   // yes, write a special short symbol
+    else
+    {
+      auto bits = codewords[diff]; // nope, encode the difference to previous block's average color
+      writer << huffmanDC[bits.numBits] << bits;
+    }
+
+    // encode ACs (quantized[1..63])
+    auto offset = 0; // upper 4 bits count the number of consecutive zeros
+    for (auto i = 1; i <= posNonZero; i++) // quantized[0] was already written, skip all trailing zeros, too
+    {
+      // zeros are encoded in a special way
+      while (quantized[i] == 0) // found another zero ?
+      {
+        offset    += 0x10; // add 1 to the upper 4 bits
+        // split into blocks of at most 16 consecutive zeros
+        if (offset > 0xF0) // remember, the counter is in the upper 4 bits, 0xF = 15
+        {
+          writer << huffmanAC[0xF0]; // 0xF0 is a special code for "16 zeros"
+          offset = 0;
+        }
+        i++;
+      }
+
+      auto encoded = codewords[quantized[i]];
+      // combine number of zeros with the number of bits of the next non-zero value
+      writer << huffmanAC[offset + encoded.numBits] << encoded; // and the value itself
+      offset = 0;
+    }
+
+    // send end-of-block code (0x00), only needed if there are trailing zeros
+    if (posNonZero < 8*8 - 1) // = 63
+      writer << huffmanAC[0x00];
+
+    return DC;
+  }
 };
 
+// Everything of a JPEG that only depends on its configuration, built once and shared by all frames
+// (and threads) with the same size, quality, sampling, restart interval and DCT method:
+// the quantization, Huffman and codeword tables and the serialized headers (SOI/APP0/COM/DQT/SOF0/DHT/DRI/SOS)
+class JpegEncoderContext
+{
+public:
+  // restartMcuRows as for JPEGWriter::setRestartInterval(), huffman = nullptr: Annex K tables
+  JpegEncoderContext(unsigned short width, unsigned short height, bool isRGB, unsigned char quality, bool downsample,
+                     int restartMcuRows = 0, DctMethod dct = DctMethod::Float, const char* comment = nullptr,
+                     const HuffmanTables* huffman = nullptr)
+  : m_width(width), m_height(height), m_isRGB(isRGB), m_quality(quality), m_downsample(downsample),
+    m_restartMcuRows(restartMcuRows), m_dct(dct), m_comment(comment ? comment : "")
+  {
+    JPEGWriter writer(1024);
+    writer.setRestartInterval(restartMcuRows);
+    writer.setDctMethod(dct);
+    writer.writeHeaders(m_tables, width, height, isRGB, quality, downsample, comment, huffman);
+    m_header = std::move(writer.m_byte_stream);
+  }
+
+  // the settings of another context with different Huffman tables (e.g. optimized ones)
+  JpegEncoderContext(const JpegEncoderContext& settings, const HuffmanTables& huffman)
+  : JpegEncoderContext(settings.m_width, settings.m_height, settings.m_isRGB, settings.m_quality, settings.m_downsample,
+                       settings.m_restartMcuRows, settings.m_dct,
+                       settings.m_comment.empty() ? nullptr : settings.m_comment.c_str(), &huffman)
+  {}
+
+  JpegEncoderContext(const JpegEncoderContext& other) = delete;
+  JpegEncoderContext& operator=(const JpegEncoderContext& other) = delete;
+
+  // true if a frame with these settings can be encoded with this context (the comment is not compared)
+  bool matches(unsigned short width, unsigned short height, bool isRGB, unsigned char quality, bool downsample,
+               int restartMcuRows, DctMethod dct) const
+  {
+    return width == m_width && height == m_height && isRGB == m_isRGB && quality == m_quality &&
+           downsample == m_downsample && restartMcuRows == m_restartMcuRows && dct == m_dct;
+  }
+
+  unsigned short width()      const { return m_width; }
+  unsigned short height()     const { return m_height; }
+  bool           isRGB()      const { return m_isRGB; }
+  bool           downsample() const { return m_downsample; }
+  unsigned char  quality()    const { return m_quality; }
+  DctMethod      dct()        const { return m_dct; }
+
+  const JPEGWriter::EncoderTables& tables() const { return m_tables; }
+  const std::vector<uint8_t>&      header() const { return m_header; }
+
+private:
+  unsigned short            m_width;
+  unsigned short            m_height;
+  bool                      m_isRGB;
+  unsigned char             m_quality;
+  bool                      m_downsample;
+  int                       m_restartMcuRows;
+  DctMethod                 m_dct;
+  std::string               m_comment;
+  JPEGWriter::EncoderTables m_tables;
+  std::vector<uint8_t>      m_header;
+};
+
+inline bool JPEGWriter::encodePixels(const JpegEncoderContext& context, const uint8_t* pixels, int linesize)
+{
+  m_byte_stream.assign(context.header().begin(), context.header().end());
+  encodeImage(context.tables(), pixels, linesize, context.width(), context.height(), context.isRGB(), context.downsample());
+  return true;
+}
+
+inline bool JPEGWriter::covers(const JpegEncoderContext& context, size_t width, size_t height)
+{
+  return width >= context.width() && height >= context.height();
+}
+
+inline bool JPEGWriter::writeJpeg(const JpegEncoderContext& context, const void* pixels)
+{
+  return encodePixels(context, (const uint8_t*)pixels, context.width() * (context.isRGB() ? 3 : 1));
+}
+
+inline bool JPEGWriter::writeJpeg(const JpegEncoderContext& context, const RGBView& pixels)
+{
+  if (!context.isRGB() || !covers(context, pixels.width(), pixels.height()))
+    return false;
+  return encodePixels(context, (const uint8_t*)pixels.data(), int(pixels.stride()));
+}
+
+inline bool JPEGWriter::writeJpeg(const JpegEncoderContext& context, const PlaneView& gray)
+{
+  if (context.isRGB() || !covers(context, gray.width(), gray.height()))
+    return false;
+  return encodePixels(context, gray.data(), int(gray.stride()));
+}
+
+inline bool JPEGWriter::writeJpegYCbCr(const JpegEncoderContext& context, const PlanarYCbCr& image)
+{
+  if (!context.isRGB())
+    return false; // always three components
+  m_byte_stream.assign(context.header().begin(), context.header().end());
+  encodeImageYCbCr(context.tables(), image, context.width(), context.height(), context.downsample());
+  return true;
+}
+
+inline bool JPEGWriter::writeJpegCoefficients(const JpegEncoderContext& context, const CoefficientFrame& coefficients)
+{
+  const bool isRGB  = context.isRGB();
+  const int  shift  = isRGB && context.downsample() ? 1 : 0;
+  const int  width  = isRGB ? (context.width()  + shift) >> shift : 0; // of the chroma planes
+  const int  height = isRGB ? (context.height() + shift) >> shift : 0;
+  auto fits = [](const CoefficientPlane& plane, int width, int height)
+  {
+    return plane.width == width && plane.height == height && plane.coefficients.size() == plane.block_count() * 64;
+  };
+  if (!fits(coefficients.planes[0], context.width(), context.height()) ||
+      !fits(coefficients.planes[1], width, height) || !fits(coefficients.planes[2], width, height))
+    return false;
+
+  const auto& tables     = context.tables();
+  const int   mcuSize    = context.downsample() ? 16 : 8;
+  const int   numMcuRows = (context.height() + mcuSize - 1) / mcuSize;
+  const CoefficientLayout layout(context.width(), isRGB, context.downsample());
+  m_byte_stream.assign(context.header().begin(), context.header().end());
+  encodeScan(tables, numMcuRows, [&](BitWriter& writer, int firstMcuRow, int lastMcuRow)
+  {
+    const auto codewords = tables.codewords();
+    int16_t    lastDC[3] = { 0, 0, 0 };
+    int16_t    quantized[8*8];
+    for (size_t mcu = size_t(firstMcuRow) * layout.mcusPerRow; mcu < size_t(lastMcuRow) * layout.mcusPerRow; mcu++)
+      for (int position = 0; position < layout.mcuBlocks; position++)
+      {
+        loadBlock(coefficients, layout, mcu, position, quantized);
+        const int component = position < layout.lumaBlocks ? 0 : position - layout.lumaBlocks + 1;
+        lastDC[component] = component == 0
+          ? encodeQuantized(writer, quantized, lastDC[0], tables.huffmanLuminanceDC, tables.huffmanLuminanceAC, codewords)
+          : encodeQuantized(writer, quantized, lastDC[component], tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+      }
+  });
+
+  // EOI marker (end of image)
+  *this << 0xFF << 0xD9;
+  return true;
+}
+
+inline bool JPEGWriter::writeJpegOptimized(const JpegEncoderContext& context, const void* pixels, HuffmanTables* reusable)
+{
+  return encodePixelsOptimized(context, (const uint8_t*)pixels, context.width() * (context.isRGB() ? 3 : 1), reusable);
+}
+
+inline bool JPEGWriter::writeJpegOptimized(const JpegEncoderContext& context, const RGBView& pixels, HuffmanTables* reusable)
+{
+  if (!context.isRGB() || !covers(context, pixels.width(), pixels.height()))
+    return false;
+  return encodePixelsOptimized(context, (const uint8_t*)pixels.data(), int(pixels.stride()), reusable);
+}
+
+inline bool JPEGWriter::encodePixelsOptimized(const JpegEncoderContext& context, const uint8_t* data, int linesize,
+                                              HuffmanTables* reusable)
+{
+  return encodeOptimized(context, reusable, [&](auto& writer, const EncoderTables& tables, int firstMcuRow, int lastMcuRow)
+  {
+    if (tables.dct == DctMethod::Int16)
+      encodeMcuRows<int16_t>(writer, tables, data, linesize, context.width(), context.height(), context.isRGB(), context.downsample(),
+                             firstMcuRow, lastMcuRow);
+    else
+      encodeMcuRows<float>(writer, tables, data, linesize, context.width(), context.height(), context.isRGB(), context.downsample(),
+                           firstMcuRow, lastMcuRow);
+  });
+}
+
+inline bool JPEGWriter::writeJpegYCbCrOptimized(const JpegEncoderContext& context, const PlanarYCbCr& image, HuffmanTables* reusable)
+{
+  if (!context.isRGB())
+    return false; // always three components
+  return encodeOptimized(context, reusable, [&](auto& writer, const EncoderTables& tables, int firstMcuRow, int lastMcuRow)
+  {
+    if (tables.dct == DctMethod::Int16)
+      encodeMcuRowsYCbCr<int16_t>(writer, tables, image, context.width(), context.height(), context.downsample(),
+                                  firstMcuRow, lastMcuRow);
+    else
+      encodeMcuRowsYCbCr<float>(writer, tables, image, context.width(), context.height(), context.downsample(),
+                                firstMcuRow, lastMcuRow);
+  });
+}
+
+inline bool JPEGWriter::writeJpegIncremental(const JpegEncoderContext& context, const void* pixels, BlockCache& cache)
+{
+  return encodePixelsIncremental(context, (const uint8_t*)pixels, context.width() * (context.isRGB() ? 3 : 1), cache);
+}
+
+inline bool JPEGWriter::writeJpegIncremental(const JpegEncoderContext& context, const RGBView& pixels, BlockCache& cache)
+{
+  if (!context.isRGB() || !covers(context, pixels.width(), pixels.height()))
+    return false;
+  return encodePixelsIncremental(context, (const uint8_t*)pixels.data(), int(pixels.stride()), cache);
+}
+
+inline bool JPEGWriter::encodePixelsIncremental(const JpegEncoderContext& context, const uint8_t* data, int linesize,
+                                                BlockCache& cache)
+{
+  return encodeIncremental(context, cache, [&](CachedBlocks& writer, const EncoderTables& tables, int firstMcuRow, int lastMcuRow)
+  {
+    if (tables.dct == DctMethod::Int16)
+      encodeMcuRows<int16_t>(writer, tables, data, linesize, context.width(), context.height(), context.isRGB(), context.downsample(),
+                             firstMcuRow, lastMcuRow);
+    else
+      encodeMcuRows<float>(writer, tables, data, linesize, context.width(), context.height(), context.isRGB(), context.downsample(),
+                           firstMcuRow, lastMcuRow);
+  });
+}
+
+inline bool JPEGWriter::writeJpegYCbCrIncremental(const JpegEncoderContext& context, const PlanarYCbCr& image, BlockCache& cache)
+{
+  if (!context.isRGB())
+    return false; // always three components
+  return encodeIncremental(context, cache, [&](CachedBlocks& writer, const EncoderTables& tables, int firstMcuRow, int lastMcuRow)
+  {
+    if (tables.dct == DctMethod::Int16)
+      encodeMcuRowsYCbCr<int16_t>(writer, tables, image, context.width(), context.height(), context.downsample(),
+                                  firstMcuRow, lastMcuRow);
+    else
+      encodeMcuRowsYCbCr<float>(writer, tables, image, context.width(), context.height(), context.downsample(),
+                                firstMcuRow, lastMcuRow);
+  });
+}
+
+template<typename EncodeRows>
+bool JPEGWriter::encodeIncremental(const JpegEncoderContext& context, BlockCache& cache, EncodeRows&& encodeRows)
+{
+  // the stored blocks only fit if the quantization is the same, the Huffman tables may differ
+  cache.prepare(context.width(), context.height(), context.isRGB(), context.downsample(),
+                context.quality() | int(context.dct()) << 8);
+
+  const auto& tables     = context.tables();
+  const int   mcuSize    = context.downsample() ? 16 : 8;
+  const int   numMcuRows = (context.height() + mcuSize - 1) / mcuSize;
+  const CoefficientLayout layout(context.width(), context.isRGB(), context.downsample());
+  if (m_coefficients)
+    prepareCoefficients(context.width(), context.height(), context.isRGB(), context.downsample());
+  m_byte_stream.assign(context.header().begin(), context.header().end());
+  encodeScan(tables, numMcuRows, [&](BitWriter& writer, int firstMcuRow, int lastMcuRow)
+  {
+    CachedBlocks cached{ writer, cache, size_t(firstMcuRow) * cache.mcusPerRow() };
+    encodeRows(cached, tables, firstMcuRow, lastMcuRow);
+    // encoded or reused, all blocks of the interval are in the cache now
+    if (m_coefficients)
+      for (size_t mcu = size_t(firstMcuRow) * layout.mcusPerRow; mcu < size_t(lastMcuRow) * layout.mcusPerRow; mcu++)
+        for (int position = 0; position < layout.mcuBlocks; position++)
+          storeBlock(*m_coefficients, layout, mcu, position, cache.blocks(mcu) + 64 * position);
+  });
+
+  // EOI marker (end of image)
+  *this << 0xFF << 0xD9;
+  return true;
+}
+
+template<typename EncodeRows>
+bool JPEGWriter::encodeOptimized(const JpegEncoderContext& context, HuffmanTables* reusable, EncodeRows&& encodeRows)
+{
+  const auto& quantization    = context.tables(); // only the quantization steps are used in the first pass
+  const int   mcuSize         = context.downsample() ? 16 : 8;
+  const int   numMcuRows      = (context.height() + mcuSize - 1) / mcuSize;
+  const int   rowsPerInterval = quantization.restartMcuRows > 0 ? quantization.restartMcuRows : numMcuRows;
+  const int   numIntervals    = (numMcuRows + rowsPerInterval - 1) / rowsPerInterval;
+  // blocks of an MCU in coding order: 1 or 4 Y blocks, then Cb and Cr
+  const int   lumaBlocks      = context.downsample() ? 4 : 1;
+  const int   mcuBlocks       = lumaBlocks + (context.isRGB() ? 2 : 0);
+  auto componentOf = [&](size_t block) { const int position = int(block % mcuBlocks);
+                                         return position < lumaBlocks ? 0 : position - lumaBlocks + 1; };
+
+  // pass 1: DCT and quantization, symbol statistics of each restart interval (DC prediction restarts there)
+  // all memory is taken here, before the intervals may run in parallel (the memory resource needn't be thread-safe),
+  // exactly the blocks of each interval: an arena wouldn't get the memory of a regrown vector back
+  m_quantized.resize(numIntervals);
+  std::pmr::vector<HuffmanStatistics> statistics(numIntervals, m_quantized.get_allocator());
+  const int mcusPerRow = (context.width() + mcuSize - 1) / mcuSize;
+  for (int interval = 0; interval < numIntervals; interval++)
+  {
+    const int mcuRows = std::min(rowsPerInterval, numMcuRows - interval * rowsPerInterval);
+    m_quantized[interval].coefficients.clear();
+    m_quantized[interval].coefficients.reserve(size_t(mcuRows) * mcusPerRow * mcuBlocks * 64);
+  }
+  forEachInterval(numMcuRows, rowsPerInterval, [&](size_t interval, int firstMcuRow, int lastMcuRow)
+  {
+    TRACE_SPAN("optimize_pass1");
+    auto& blocks = m_quantized[interval];
+    encodeRows(blocks, quantization, firstMcuRow, lastMcuRow);
+
+    auto&   counts    = statistics[interval];
+    int16_t lastDC[3] = { 0, 0, 0 };
+    for (size_t block = 0; block < blocks.coefficients.size() / 64; block++)
+    {
+      const int      component = componentOf(block);
+      const int16_t* quantized = &blocks.coefficients[64 * block];
+      if (component == 0)
+        countSymbols(quantized, lastDC[0], counts.dcLuminance, counts.acLuminance);
+      else
+        countSymbols(quantized, lastDC[component], counts.dcChrominance, counts.acChrominance);
+      lastDC[component] = quantized[0];
+    }
+  });
+
+  HuffmanStatistics total;
+  for (const auto& counts : statistics)
+    total.add(counts);
+  if (reusable)
+    total.coverAllSymbols();
+  const HuffmanTables huffman = HuffmanTables::fromStatistics(total);
+  if (reusable)
+    *reusable = huffman;
+
+  // pass 2: headers with the new tables, then Huffman coding of the stored blocks
+  const JpegEncoderContext optimized(context, huffman);
+  const auto& tables    = optimized.tables();
+  const auto  codewords = tables.codewords();
+  const CoefficientLayout layout(context.width(), context.isRGB(), context.downsample());
+  if (m_coefficients)
+    prepareCoefficients(context.width(), context.height(), context.isRGB(), context.downsample());
+  m_byte_stream.assign(optimized.header().begin(), optimized.header().end());
+  encodeScan(tables, numMcuRows, [&](BitWriter& writer, int firstMcuRow, int lastMcuRow)
+  {
+    TRACE_SPAN("optimize_pass2");
+    const auto& blocks    = m_quantized[firstMcuRow / rowsPerInterval];
+    const size_t firstMcu = size_t(firstMcuRow) * mcusPerRow;
+    int16_t     lastDC[3] = { 0, 0, 0 };
+    for (size_t block = 0; block < blocks.coefficients.size() / 64; block++)
+    {
+      const int      component = componentOf(block);
+      const int16_t* quantized = &blocks.coefficients[64 * block];
+      if (m_coefficients)
+        storeBlock(*m_coefficients, layout, firstMcu + block / mcuBlocks, int(block % mcuBlocks), quantized);
+      lastDC[component] = component == 0
+        ? encodeQuantized(writer, quantized, lastDC[0], tables.huffmanLuminanceDC, tables.huffmanLuminanceAC, codewords)
+        : encodeQuantized(writer, quantized, lastDC[component], tables.huffmanChrominanceDC, tables.huffmanChrominanceAC, codewords);
+    }
+  });
+
+  // EOI marker (end of image)
+  *this << 0xFF << 0xD9;
+  return true;
+}
+
 
 #endif// _WRITE_JPEG_HPP